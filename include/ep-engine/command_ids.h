@@ -314,4 +314,26 @@ typedef union {
 #define  CMD_GET_RANDOM_KEY 0xb6
 typedef protocol_binary_request_get protocol_binary_request_get_random;
 
+/**
+ * Flow control of a UPR producer connection. CMD_UPR_SET_BUFFER_SIZE
+ * advertises how many bytes of messages the consumer is able to buffer
+ * (0 turns flow control off), and CMD_UPR_BUFFER_ACK gives back the
+ * bytes of messages the consumer has processed since its last ack.
+ */
+#define CMD_UPR_SET_BUFFER_SIZE 0xb7
+#define CMD_UPR_BUFFER_ACK 0xb8
+
+/**
+ * The physical layout for CMD_UPR_SET_BUFFER_SIZE and CMD_UPR_BUFFER_ACK
+ */
+typedef union {
+    struct {
+        protocol_binary_request_header header;
+        struct {
+            uint32_t buffer_bytes;
+        } body;
+    } message;
+    uint8_t bytes[sizeof(protocol_binary_request_header) + 4];
+} protocol_binary_request_upr_buffer;
+
 #endif /* EP_ENGINE_COMMAND_IDS_H */
@@ -17,7 +17,12 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
 
 #include "access_scanner.h"
 #include "ep_engine.h"
@@ -37,7 +42,9 @@ public:
         prev = name + ".old";
         next = name + ".next";
 
-        log = new MutationLog(next, conf.getAlogBlockSize());
+        log = new MutationLog(next, conf.getAlogBlockSize(),
+                              conf.isAlogCompact() ? LOG_VERSION_COMPACT :
+                                                     LOG_VERSION);
         assert(log != NULL);
         log->open();
         if (!log->isOpen()) {
@@ -54,21 +61,39 @@ public:
                 LOG(EXTENSION_LOG_INFO,
                 "INFO: Skipping expired/deleted item: %s",v->getKey().c_str());
             } else {
-                log->newItem(currentBucket->getId(), v->getKey(),
-                             v->getBySeqno());
+                keys.push_back(std::make_pair(v->getKey(), v->getBySeqno()));
             }
         }
     }
 
     bool visitBucket(RCPtr<VBucket> &vb) {
+        logKeys();
         if (log == NULL) {
             return false;
         }
 
+        uint16_t vbid = vb->getId();
+        AccessLogSignature sig;
+        sig.valid = true;
+        sig.highSeqno = vb->getHighSeqno();
+        sig.numItems = vb->ht.getNumItems();
+        sig.numNonResident = vb->ht.getNumNonResidentItems();
+        sig.numEjects = vb->ht.getNumEjects();
+        if (vbid < as->signatures.size()) {
+            newSignatures[vbid] = sig;
+            if (as->signatures[vbid] == sig) {
+                unchanged.insert(vbid);
+                return false;
+            }
+        }
+
         return VBucketVisitor::visitBucket(vb);
     }
 
     virtual void complete() {
+        logKeys();
+        copyUnchanged();
+
         if (stateFinalizer) {
             if (++(as->completedCount) == store.getVBuckets().getNumShards()) {
                 *stateFinalizer = true;
@@ -105,11 +130,79 @@ public:
                 LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
                     next.c_str(), name.c_str(), strerror(errno));
                 remove(next.c_str());
+            } else {
+                // A vbucket of this shard that wasn't visited is gone, and
+                // must not match a new vbucket with the same id.
+                const VBucketMap &vbMap = store.getVBuckets();
+                for (size_t i = 0; i < as->signatures.size(); ++i) {
+                    if (vbMap.getShard(i)->getId() != shardID) {
+                        continue;
+                    }
+                    std::map<uint16_t, AccessLogSignature>::iterator it;
+                    it = newSignatures.find(i);
+                    if (it != newSignatures.end()) {
+                        as->signatures[i] = it->second;
+                    } else {
+                        as->signatures[i] = AccessLogSignature();
+                    }
+                }
             }
         }
     }
 
 private:
+
+    // Log the keys collected from the last vbucket sorted, so that the
+    // compact format only stores what differs from the previous key.
+    void logKeys() {
+        if (keys.empty()) {
+            return;
+        }
+        if (log != NULL) {
+            uint16_t vbid = currentBucket->getId();
+            std::sort(keys.begin(), keys.end());
+            std::vector<std::pair<std::string, uint64_t> >::iterator it;
+            for (it = keys.begin(); it != keys.end(); ++it) {
+                log->newItem(vbid, it->first, it->second);
+            }
+        }
+        keys.clear();
+    }
+
+    // Copy the entries of the unchanged vbuckets from the current access
+    // log. If it can't be read, visit those vbuckets after all.
+    void copyUnchanged() {
+        if (log == NULL || unchanged.empty()) {
+            return;
+        }
+
+        try {
+            MutationLog current(name);
+            current.open(true);
+            MutationLog::iterator it = current.begin();
+            for (; it != current.end(); ++it) {
+                const MutationLogEntry *e = *it;
+                if (e->type() == ML_NEW && unchanged.count(e->vbucket())) {
+                    log->newItem(e->vbucket(), e->key(), e->rowid());
+                }
+            }
+            stats.alogSkippedVBuckets.fetch_add(unchanged.size());
+        } catch (MutationLog::ReadException &e) {
+            LOG(EXTENSION_LOG_WARNING, "Failed to copy %ld vbuckets from "
+                "access log '%s': %s; visiting them instead",
+                unchanged.size(), name.c_str(), e.what());
+            std::set<uint16_t>::iterator it;
+            for (it = unchanged.begin(); it != unchanged.end(); ++it) {
+                RCPtr<VBucket> vb = store.getVBucket(*it);
+                if (vb && VBucketVisitor::visitBucket(vb)) {
+                    vb->ht.visit(*this);
+                    logKeys();
+                }
+            }
+        }
+        unchanged.clear();
+    }
+
     EventuallyPersistentStore &store;
     EPStats &stats;
     rel_time_t startTime;
@@ -121,6 +214,13 @@ private:
     MutationLog *log;
     bool *stateFinalizer;
     AccessScanner *as;
+
+    //! Resident keys of the vbucket being visited and their seqnos.
+    std::vector<std::pair<std::string, uint64_t> > keys;
+    //! Vbuckets to copy from the current access log.
+    std::set<uint16_t> unchanged;
+    //! Signatures to remember once the new access log is in place.
+    std::map<uint16_t, AccessLogSignature> newSignatures;
 };
 
 bool AccessScanner::run() {
@@ -128,6 +228,7 @@ bool AccessScanner::run() {
         available = false;
         store.resetAccessScannerTasktime();
         completedCount = 0;
+        stats.alogSkippedVBuckets.store(0);
         for (size_t i = 0; i < store.getVBuckets().getNumShards(); i++) {
             shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store,
                                              stats, i, &available, this));
@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include "ep_engine.h"
@@ -29,15 +30,40 @@
 // Forward declaration.
 class EventuallyPersistentStore;
 class AccessScannerValueChangeListener;
+class ItemAccessVisitor;
+
+/**
+ * What a vbucket looked like when its keys were last written to the
+ * access log. As long as none of these move, the vbucket holds the same
+ * resident keys and its entries can be copied from the previous log.
+ */
+struct AccessLogSignature {
+    AccessLogSignature() : valid(false), highSeqno(0), numItems(0),
+                           numNonResident(0), numEjects(0) { }
+
+    bool operator==(const AccessLogSignature &other) const {
+        return valid && other.valid && highSeqno == other.highSeqno &&
+            numItems == other.numItems &&
+            numNonResident == other.numNonResident &&
+            numEjects == other.numEjects;
+    }
+
+    bool valid;
+    int64_t highSeqno;
+    size_t numItems;
+    size_t numNonResident;
+    size_t numEjects;
+};
 
 class AccessScanner : public GlobalTask {
     friend class AccessScannerValueChangeListener;
+    friend class ItemAccessVisitor;
 public:
     AccessScanner(EventuallyPersistentStore &_store, EPStats &st,
                   const Priority &p, double sleeptime = 0)
         : GlobalTask(&_store.getEPEngine(), p, sleeptime),
           completedCount(0), store(_store), stats(st), sleepTime(sleeptime),
-          available(true) { }
+          available(true), signatures(_store.getVBuckets().getSize()) { }
 
     bool run();
     std::string getDescription();
@@ -49,6 +75,9 @@ private:
     EPStats &stats;
     double sleepTime;
     bool available;
+    // Indexed by vbucket id. Every vbucket belongs to a single shard, so
+    // the visitors of a run never touch the same entry.
+    std::vector<AccessLogSignature> signatures;
 };
 
 #endif  // SRC_ACCESS_SCANNER_H_
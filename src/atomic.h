@@ -521,6 +521,11 @@ public:
         return (bool)value;
     }
 
+    // true if this is the only reference to the value
+    bool isUnique() const {
+        return value && static_cast<RCValue *>(value)->_rc_refcount == 1;
+    }
+
 private:
     T *gimme() const {
         if (value) {
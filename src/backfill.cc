@@ -31,35 +31,93 @@ static bool isMemoryUsageTooHigh(EPStats &stats) {
     return memoryUsed > (maxSize * BACKFILL_MEM_THRESHOLD);
 }
 
+/**
+ * Collects the items loaded by a disk backfill and hands them to the
+ * producer in batches.
+ */
+class BackfillBatch {
+public:
+    BackfillBatch(const std::string &n, hrtime_t token, connection_t &c,
+                  ConnMap &cm, EPStats &st)
+        : name(n), connToken(token), producer(dynamic_cast<Producer*>(c.get())),
+          connMap(cm), stats(st) {
+        assert(producer);
+        items.reserve(BACKFILL_BATCH_SIZE);
+    }
+
+    ~BackfillBatch() {
+        flush();
+    }
+
+    void add(Item *itm) {
+        items.push_back(itm);
+        if (items.size() >= BACKFILL_BATCH_SIZE) {
+            flush();
+        }
+    }
+
+    void flush();
+
+private:
+    const std::string  name;
+    hrtime_t           connToken;
+    Producer          *producer;
+    ConnMap           &connMap;
+    EPStats           &stats;
+    std::vector<Item*> items;
+
+    DISALLOW_COPY_AND_ASSIGN(BackfillBatch);
+};
+
+void BackfillBatch::flush() {
+    if (items.empty()) {
+        return;
+    }
+    stats.numBackfillItems.fetch_add(items.size());
+    if (!producer->isRetired()) {
+        producer->completeBGFetchJobs(items, true);
+        connMap.notifyPausedConnection(producer, false);
+    } else {
+        // The producer is gone from the map; whoever holds its name now
+        // decides on the items.
+        std::vector<Item*>::iterator it = items.begin();
+        for (; it != items.end(); ++it) {
+            ++stats.numBackfillConnMapLookups;
+            CompletedBGFetchTapOperation tapop(connToken, (*it)->getVBucketId(),
+                                               true);
+            if (!connMap.performOp(name, tapop, *it)) {
+                delete *it;
+            }
+        }
+    }
+    items.clear();
+}
+
 class ItemResidentCallback : public Callback<CacheLookup> {
 public:
-    ItemResidentCallback(hrtime_t token, const std::string &n,
-                         ConnMap &cm, EventuallyPersistentEngine* e)
-    : connToken(token), tapConnName(n), connMap(cm), engine(e) {
+    ItemResidentCallback(BackfillBatch &b, EventuallyPersistentEngine* e)
+    : batch(b), engine(e) {
         assert(engine);
     }
 
     void callback(CacheLookup &lookup);
 
 private:
-    hrtime_t                    connToken;
-    const std::string           tapConnName;
-    ConnMap                    &connMap;
+    BackfillBatch              &batch;
     EventuallyPersistentEngine *engine;
 };
 
 void ItemResidentCallback::callback(CacheLookup &lookup) {
     RCPtr<VBucket> vb = engine->getEpStore()->getVBucket(lookup.getVBucketId());
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num);
+    uint64_t h = vb->ht.hash(lookup.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), h, bucket_num,
+                                          false, true);
     if (v && v->isResident() && v->getBySeqno() == lookup.getBySeqno()) {
         Item* it = v->toItem(false, lookup.getVBucketId());
         lh.unlock();
-        CompletedBGFetchTapOperation tapop(connToken, lookup.getVBucketId(), true);
-        if (!connMap.performOp(tapConnName, tapop, it)) {
-            delete it;
-        }
+        batch.add(it);
         setStatus(ENGINE_KEY_EEXISTS);
     } else {
         setStatus(ENGINE_SUCCESS);
@@ -72,25 +130,18 @@ void ItemResidentCallback::callback(CacheLookup &lookup) {
  */
 class BackfillDiskCallback : public Callback<GetValue> {
 public:
-    BackfillDiskCallback(hrtime_t token, const std::string &n, ConnMap &cm)
-        : connToken(token), tapConnName(n), connMap(cm) {}
+    BackfillDiskCallback(BackfillBatch &b) : batch(b) {}
 
     void callback(GetValue &val);
 
 private:
 
-    hrtime_t                    connToken;
-    const std::string           tapConnName;
-    ConnMap                    &connMap;
+    BackfillBatch &batch;
 };
 
 void BackfillDiskCallback::callback(GetValue &gv) {
     assert(gv.getValue());
-    CompletedBGFetchTapOperation tapop(connToken, gv.getValue()->getVBucketId(), true);
-    // if the tap connection is closed, then free an Item instance
-    if (!connMap.performOp(tapConnName, tapop, gv.getValue())) {
-        delete gv.getValue();
-    }
+    batch.add(gv.getValue());
 }
 
 bool BackfillDiskLoad::run() {
@@ -102,22 +153,43 @@ bool BackfillDiskLoad::run() {
         return true;
     }
 
+    Producer *producer = dynamic_cast<Producer*>(conn.get());
+    if (producer->isBackfillBlocked(vbucket)) {
+        // The producer wakes us up once it has sent enough of the backlog.
+        snooze(DEFAULT_BACKFILL_SNOOZE_TIME, false);
+        return true;
+    }
+
+    EPStats &stats = engine->getEpStats();
+    ++stats.numBackfillConnMapLookups;
     if (connMap.checkConnectivity(name) && !engine->getEpStore()->isFlushAllScheduled()) {
-        size_t num_items = store->getNumItems(vbucket);
-        size_t num_deleted = store->getNumPersistedDeletes(vbucket);
-        connMap.incrBackfillRemaining(name, num_items + num_deleted);
+        if (!started) {
+            size_t num_items = store->getNumItems(vbucket);
+            size_t num_deleted = store->getNumPersistedDeletes(vbucket);
+            ++stats.numBackfillConnMapLookups;
+            connMap.incrBackfillRemaining(name, num_items + num_deleted);
+            started = true;
+        }
 
+        BackfillBatch batch(name, connToken, conn, connMap, stats);
         shared_ptr<Callback<GetValue> >
-            cb(new BackfillDiskCallback(connToken, name, connMap));
+            cb(new BackfillDiskCallback(batch));
         shared_ptr<Callback<CacheLookup> >
-            cl(new ItemResidentCallback(connToken, name, connMap, engine));
-        store->dump(vbucket, startSeqno, endSeqno, cb, cl);
+            cl(new ItemResidentCallback(batch, engine));
+        size_t maxBytes = engine->getConfiguration().getBackfillDumpBatchBytes();
+        if (!store->dumpBatch(vbucket, startSeqno, endSeqno, maxBytes, cb, cl)) {
+            // Give the thread to other tasks before loading the next
+            // batch; the memory check above runs again first.
+            snooze(0, false);
+            return true;
+        }
     }
 
     LOG(EXTENSION_LOG_INFO,"VBucket %d backfill task from disk is completed",
         vbucket);
 
     // Should decr the disk backfill counter regardless of the connectivity status
+    ++stats.numBackfillConnMapLookups;
     CompleteDiskBackfillTapOperation op;
     connMap.performOp(name, op, static_cast<void*>(NULL));
 
@@ -145,7 +217,7 @@ bool BackFillVisitor::visitBucket(RCPtr<VBucket> &vb) {
         ExTask task = new BackfillDiskLoad(name, engine, connMap,
                                            underlying, vb->getId(), 0,
                                            std::numeric_limits<uint64_t>::max(),
-                                           connToken,
+                                           conn,
                                            Priority::TapBgFetcherPriority,
                                            0, false);
         ExecutorPool::get()->schedule(task, AUXIO_TASK_IDX);
@@ -35,6 +35,7 @@
 
 #define BACKFILL_MEM_THRESHOLD 0.95
 #define DEFAULT_BACKFILL_SNOOZE_TIME 1.0
+#define BACKFILL_BATCH_SIZE 64
 
 typedef enum {
     ALL_MUTATIONS = 1,
@@ -47,6 +48,12 @@ typedef enum {
  *
  * Note that this is only used if the KVStore reports that it has
  * efficient vbucket ops.
+ *
+ * The task holds a reference to its producer and hands it the loaded
+ * items in batches, without going through the connection map unless
+ * the producer was replaced in the meantime. The vbucket is loaded in
+ * runs of backfill_dump_batch_bytes, each resuming at the seqno where
+ * the previous one stopped.
  */
 class BackfillDiskLoad : public GlobalTask {
 public:
@@ -54,12 +61,15 @@ public:
     BackfillDiskLoad(const std::string &n, EventuallyPersistentEngine* e,
                      ConnMap &cm, KVStore *s, uint16_t vbid,
                      uint64_t start_seqno, uint64_t end_seqno,
-                     hrtime_t token, const Priority &p, double sleeptime = 0,
-                     bool shutdown = false)
+                     const connection_t &c, const Priority &p,
+                     double sleeptime = 0, bool shutdown = false)
         : GlobalTask(e, p, sleeptime, shutdown),
-          name(n), engine(e), connMap(cm), store(s), vbucket(vbid),
-          startSeqno(start_seqno), endSeqno(end_seqno), connToken(token) {
+          name(n), engine(e), connMap(cm), conn(c), store(s), vbucket(vbid),
+          startSeqno(start_seqno), endSeqno(end_seqno),
+          connToken(dynamic_cast<Producer*>(c.get())->getConnectionToken()),
+          started(false) {
         ScheduleDiskBackfillTapOperation tapop;
+        ++e->getEpStats().numBackfillConnMapLookups;
         cm.performOp(name, tapop, static_cast<void*>(NULL));
     }
 
@@ -71,11 +81,13 @@ private:
     const std::string           name;
     EventuallyPersistentEngine *engine;
     ConnMap                    &connMap;
+    connection_t                conn;
     KVStore                    *store;
     uint16_t                    vbucket;
     uint64_t                    startSeqno;
     uint64_t                    endSeqno;
     hrtime_t                    connToken;
+    bool                        started;
 };
 
 /**
@@ -87,8 +99,8 @@ class BackFillVisitor : public VBucketVisitor {
 public:
     BackFillVisitor(EventuallyPersistentEngine *e, ConnMap &cm, Producer *tc,
                     const VBucketFilter &backfillVBfilter):
-        VBucketVisitor(backfillVBfilter), engine(e), connMap(cm),
-        name(tc->getName()), connToken(tc->getConnectionToken()), valid(true) {}
+        VBucketVisitor(backfillVBfilter), engine(e), connMap(cm), conn(tc),
+        name(tc->getName()), valid(true) {}
 
     virtual ~BackFillVisitor() {}
 
@@ -110,8 +122,8 @@ private:
 
     EventuallyPersistentEngine *engine;
     ConnMap &connMap;
+    connection_t conn;
     const std::string name;
-    hrtime_t connToken;
     bool valid;
 };
 
@@ -30,10 +30,45 @@
 
 const uint16_t MAX_BGFETCH_RETRY=5;
 
+/**
+ * The background fetches queued for one cookie by a batched get. The
+ * cookie is notified once, when the last of them completes.
+ */
+class BGFetchGroup : public RCValue {
+public:
+    BGFetchGroup(size_t n) : pending(n), failure(ENGINE_SUCCESS) { }
+
+    /**
+     * Record the completion of one fetch of the group.
+     *
+     * @param status the status of the fetch; set to the status to notify
+     *               the cookie with if this was the last one
+     * @return true if this was the last fetch of the group
+     */
+    bool complete(ENGINE_ERROR_CODE &status) {
+        if (status != ENGINE_SUCCESS) {
+            int expected = ENGINE_SUCCESS;
+            failure.compare_exchange_strong(expected, status);
+        }
+        if (pending.fetch_sub(1) != 0) {
+            return false;
+        }
+        status = static_cast<ENGINE_ERROR_CODE>(failure.load());
+        return true;
+    }
+
+private:
+    Atomic<size_t> pending;
+    //! Status of the first fetch that failed.
+    Atomic<int>    failure;
+};
+
 class VBucketBGFetchItem {
 public:
-    VBucketBGFetchItem(const void *c, bool meta_only) :
-        cookie(c), initTime(gethrtime()), retryCount(0), metaDataOnly(meta_only)
+    VBucketBGFetchItem(const void *c, bool meta_only,
+                       BGFetchGroup *g = NULL) :
+        cookie(c), initTime(gethrtime()), retryCount(0),
+        metaDataOnly(meta_only), group(g)
     { }
     ~VBucketBGFetchItem() {}
 
@@ -56,6 +91,8 @@ public:
     hrtime_t initTime;
     uint16_t retryCount;
     bool metaDataOnly;
+    //! Set if the cookie waits for other fetches too.
+    RCPtr<BGFetchGroup> group;
 };
 
 typedef unordered_map<std::string, std::list<VBucketBGFetchItem *> > vb_bgfetch_queue_t;
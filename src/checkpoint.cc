@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -74,11 +75,23 @@ void Checkpoint::popBackCheckpointEndItem() {
     if (!toWrite.empty() && toWrite.back()->getOperation() == queue_op_checkpoint_end) {
         keyIndex.erase(toWrite.back()->getKey());
         toWrite.pop_back();
+        updateMemOverhead();
     }
 }
 
 bool Checkpoint::keyExists(const std::string &key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return keyIndex.find(key) != NULL;
+}
+
+void Checkpoint::updateMemOverhead() {
+    size_t newOverhead = toWrite.memorySize() + keyIndex.memorySize();
+    if (newOverhead > memOverhead) {
+        stats.memOverhead.fetch_add(newOverhead - memOverhead);
+    } else {
+        stats.memOverhead.fetch_sub(memOverhead - newOverhead);
+    }
+    assert(stats.memOverhead.load() < GIGANTOR);
+    memOverhead = newOverhead;
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
@@ -86,21 +99,21 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
     assert (checkpointState == CHECKPOINT_OPEN);
     queue_dirty_t rv;
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    CheckpointIndex::Entry *entry = keyIndex.find(qi->getKey());
     // Check if this checkpoint already had an item for the same key.
-    if (it != keyIndex.end()) {
+    if (entry) {
         rv = EXISTING_ITEM;
-        std::list<queued_item>::iterator currPos = it->second.position;
-        uint64_t currMutationId = it->second.mutation_id;
+        CheckpointQueue::iterator currPos = entry->position;
+        uint64_t currMutationId = entry->mutation_id;
         CheckpointCursor &pcursor = checkpointManager->persistenceCursor;
 
         if (*(pcursor.currentCheckpoint) == this) {
             // If the existing item is in the left-hand side of the item pointed by the
             // persistence cursor, decrease the persistence cursor's offset by 1.
             const std::string &key = (*(pcursor.currentPos))->getKey();
-            checkpoint_index::iterator ita = keyIndex.find(key);
-            if (ita != keyIndex.end()) {
-                uint64_t mutationId = ita->second.mutation_id;
+            CheckpointIndex::Entry *cursorEntry = keyIndex.find(key);
+            if (cursorEntry) {
+                uint64_t mutationId = cursorEntry->mutation_id;
                 if (currMutationId <= mutationId) {
                     checkpointManager->decrCursorOffset_UNLOCKED(pcursor, 1);
                     rv = PERSIST_AGAIN;
@@ -113,32 +126,34 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
             }
         }
 
-        cursor_index::iterator map_it = checkpointManager->tapCursors.begin();
-        for (; map_it != checkpointManager->tapCursors.end(); ++map_it) {
-
-            if (*(map_it->second.currentCheckpoint) == this) {
-                const std::string &key = (*(map_it->second.currentPos))->getKey();
-                checkpoint_index::iterator ita = keyIndex.find(key);
-                if (ita != keyIndex.end()) {
-                    uint64_t mutationId = ita->second.mutation_id;
+        std::vector<CheckpointCursor*> &cursors = checkpointManager->cursorSlots;
+        std::vector<CheckpointCursor*>::iterator cit = cursors.begin();
+        for (; cit != cursors.end(); ++cit) {
+            CheckpointCursor *cursor = *cit;
+            if (cursor && *(cursor->currentCheckpoint) == this) {
+                const std::string &key = (*(cursor->currentPos))->getKey();
+                CheckpointIndex::Entry *cursorEntry = keyIndex.find(key);
+                if (cursorEntry) {
+                    uint64_t mutationId = cursorEntry->mutation_id;
                     if (currMutationId <= mutationId) {
-                        checkpointManager->decrCursorOffset_UNLOCKED(map_it->second, 1);
+                        checkpointManager->decrCursorOffset_UNLOCKED(*cursor, 1);
                     }
                 }
                 // If an TAP cursor points to the existing item for the same key, shift it left by 1
-                if (map_it->second.currentPos == currPos) {
-                    checkpointManager->decrCursorPos_UNLOCKED(map_it->second);
+                if (cursor->currentPos == currPos) {
+                    checkpointManager->decrCursorPos_UNLOCKED(*cursor);
                 }
             }
         }
 
-        queued_item &existing_itm = *currPos;
+        queued_item existing_itm = *currPos;
         existing_itm->setOperation(qi->getOperation());
         existing_itm->setQueuedTime(qi->getQueuedTime());
         existing_itm->setRevSeqno(qi->getRevSeqno());
         existing_itm->setBySeqno(qi->getBySeqno());
-        toWrite.push_back(existing_itm);
-        // Remove the existing item for the same key from the list.
+        // Move the item to the tail, leaving a tombstone at its old position.
+        entry->position = toWrite.push_back(existing_itm);
+        entry->mutation_id = qi->getBySeqno();
         toWrite.erase(currPos);
     } else {
         if (qi->getOperation() == queue_op_set || qi->getOperation() == queue_op_del) {
@@ -146,74 +161,73 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         }
         rv = NEW_ITEM;
         // Push the new item into the list
-        toWrite.push_back(qi);
-    }
-
-    if (qi->getKey().size() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
-        // --last is okay as the list is not empty now.
-        index_entry entry = {--last, qi->getBySeqno()};
-        // Set the index of the key to the new item that is pushed back into the list.
-        keyIndex[qi->getKey()] = entry;
-        if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getKey().size() + sizeof(index_entry) + sizeof(queued_item);
-            memOverhead += newEntrySize;
-            stats.memOverhead.fetch_add(newEntrySize);
-            assert(stats.memOverhead.load() < GIGANTOR);
+        CheckpointQueue::iterator last = toWrite.push_back(qi);
+        if (qi->getKey().size() > 0) {
+            keyIndex.set(last, qi->getBySeqno());
+        }
+        if (qi->getOperation() == queue_op_checkpoint_start) {
+            // Keep the meta items at the head in a chunk of their own, so that items of
+            // collapsed checkpoints can be inserted right behind them.
+            toWrite.closeChunk();
         }
     }
+    updateMemOverhead();
     return rv;
 }
 
 size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
-    size_t numNewItems = 0;
-    size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
-
     LOG(EXTENSION_LOG_INFO,
         "Collapse the checkpoint %llu into the checkpoint %llu for vbucket %d",
         pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    keyIndex["dummy_key"].mutation_id =
-        pPrevCheckpoint->getMutationIdForKey("dummy_key");
-    keyIndex["checkpoint_start"].mutation_id =
-        pPrevCheckpoint->getMutationIdForKey("checkpoint_start");
-    for (; rit != pPrevCheckpoint->rend(); ++rit) {
-        const std::string &key = (*rit)->getKey();
-        if ((*rit)->getOperation() != queue_op_del &&
-            (*rit)->getOperation() != queue_op_set) {
+    const char *metaKeys[] = { "dummy_key", "checkpoint_start" };
+    for (size_t i = 0; i < sizeof(metaKeys) / sizeof(metaKeys[0]); ++i) {
+        CheckpointIndex::Entry *entry = keyIndex.find(metaKeys[i]);
+        if (entry) {
+            entry->mutation_id = pPrevCheckpoint->getMutationIdForKey(metaKeys[i]);
+        }
+    }
+
+    std::vector<queued_item> newItems;
+    CheckpointQueue::iterator it = pPrevCheckpoint->begin();
+    for (; it != pPrevCheckpoint->end(); ++it) {
+        if ((*it)->getOperation() != queue_op_del &&
+            (*it)->getOperation() != queue_op_set) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
-            // Skip the first two meta items
-            ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, static_cast<int64_t>(pPrevCheckpoint->getMutationIdForKey(key))};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
-            ++numItems;
-            ++numNewItems;
+        if (!keyExists((*it)->getKey())) {
+            newItems.push_back(*it);
         }
     }
-    memOverhead += newEntryMemOverhead;
-    stats.memOverhead.fetch_add(newEntryMemOverhead);
-    assert(stats.memOverhead.load() < GIGANTOR);
-    return numNewItems;
+    if (newItems.empty()) {
+        return 0;
+    }
+
+    // Insert the items behind the meta items of this checkpoint, keeping
+    // their order.
+    CheckpointQueue::iterator pos = toWrite.insertAfterHead(newItems);
+    for (size_t i = 0; i < newItems.size(); ++i, ++pos) {
+        const std::string &key = newItems[i]->getKey();
+        keyIndex.set(pos, pPrevCheckpoint->getMutationIdForKey(key));
+    }
+    numItems.fetch_add(newItems.size());
+    updateMemOverhead();
+    return newItems.size();
 }
 
 uint64_t Checkpoint::getMutationIdForKey(const std::string &key) {
     uint64_t mid = 0;
-    checkpoint_index::iterator it = keyIndex.find(key);
-    if (it != keyIndex.end()) {
-        mid = it->second.mutation_id;
+    CheckpointIndex::Entry *entry = keyIndex.find(key);
+    if (entry) {
+        mid = entry->mutation_id;
     }
     return mid;
 }
 
+Atomic<uint64_t> CheckpointManager::lastCursorId(0);
+
 CheckpointManager::~CheckpointManager() {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     while(it != checkpointList.end()) {
         delete *it;
@@ -231,7 +245,7 @@ uint64_t CheckpointManager::getOpenCheckpointId_UNLOCKED() {
 }
 
 uint64_t CheckpointManager::getOpenCheckpointId() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     return getOpenCheckpointId_UNLOCKED();
 }
 
@@ -244,7 +258,7 @@ uint64_t CheckpointManager::getLastClosedCheckpointId_UNLOCKED() {
 }
 
 uint64_t CheckpointManager::getLastClosedCheckpointId() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     return getLastClosedCheckpointId_UNLOCKED();
 }
 
@@ -257,7 +271,7 @@ void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
         int64_t bySeqno = nextBySeqno();
         queued_item qi = createCheckpointItem(id, vbucketId, queue_op_checkpoint_start,
                                               bySeqno);
-        std::list<queued_item>::iterator it = ++(checkpointList.back()->begin());
+        CheckpointQueue::iterator it = ++(checkpointList.back()->begin());
         *it = qi;
     }
 }
@@ -291,7 +305,7 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id) {
 }
 
 bool CheckpointManager::addNewCheckpoint(uint64_t id) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     return addNewCheckpoint_UNLOCKED(id);
 }
 
@@ -317,22 +331,22 @@ bool CheckpointManager::closeOpenCheckpoint_UNLOCKED(uint64_t id) {
 }
 
 bool CheckpointManager::closeOpenCheckpoint(uint64_t id) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     return closeOpenCheckpoint_UNLOCKED(id);
 }
 
 void CheckpointManager::registerPersistenceCursor() {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     assert(!checkpointList.empty());
     persistenceCursor.currentCheckpoint = checkpointList.begin();
     persistenceCursor.currentPos = checkpointList.front()->begin();
-    checkpointList.front()->registerCursorName(persistenceCursor.name);
+    checkpointList.front()->registerCursor();
 }
 
 bool CheckpointManager::registerTAPCursor(const std::string &name,
                                           uint64_t checkpointId,
                                           bool alwaysFromBeginning) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     return registerTAPCursor_UNLOCKED(name,
                                       checkpointId,
                                       alwaysFromBeginning);
@@ -356,13 +370,16 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
         "Register the tap cursor with the name \"%s\" for vbucket %d",
         name.c_str(), vbucketId);
 
-    // If the tap cursor exists, remove its name from the checkpoint that is
+    // If the tap cursor exists, remove it from the checkpoint that is
     // currently referenced by the tap cursor.
     cursor_index::iterator map_it = tapCursors.find(name);
     if (map_it != tapCursors.end()) {
-        (*(map_it->second.currentCheckpoint))->removeCursorName(name);
+        (*(map_it->second.currentCheckpoint))->removeCursor();
     }
 
+    CheckpointQueue::iterator curr;
+    size_t offset = 0;
+
     if (!found) {
         for (it = checkpointList.begin(); it != checkpointList.end(); ++it) {
             if (pCursorPreCheckpointId < (*it)->getId() ||
@@ -378,14 +395,9 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
 
         assert(it != checkpointList.end());
 
-        CheckpointCursor cursor(name, it, (*it)->begin(),
-                            numItems - ((*it)->getNumItems() + 1)); // 1 is for checkpoint start item
-        tapCursors.insert(std::pair<std::string, CheckpointCursor>(name, cursor));
-        (*it)->registerCursorName(name);
+        curr = (*it)->begin();
+        offset = numItems - ((*it)->getNumItems() + 1); // 1 is for checkpoint start item
     } else {
-        size_t offset = 0;
-        std::list<queued_item>::iterator curr;
-
         LOG(EXTENSION_LOG_DEBUG,
             "Checkpoint %llu for vbucket %d exists in memory. "
             "Set the cursor with the name \"%s\" to the checkpoint %llu\n",
@@ -406,18 +418,36 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
                 offset += (*pos)->getNumItems() + 2; // 2 is for checkpoint start and end items.
             }
         }
+    }
 
+    if (map_it == tapCursors.end()) {
         CheckpointCursor cursor(name, it, curr, offset);
-        tapCursors.insert(std::pair<std::string, CheckpointCursor>(name, cursor));
-        // Register the tap cursor's name to the checkpoint.
-        (*it)->registerCursorName(name);
+        map_it = tapCursors.insert(std::make_pair(name, cursor)).first;
+
+        // Give the new cursor a slot, so that it can be addressed by handles.
+        CheckpointCursor &newCursor = map_it->second;
+        newCursor.id = ++lastCursorId;
+        newCursor.slot = std::find(cursorSlots.begin(), cursorSlots.end(),
+                                   static_cast<CheckpointCursor*>(NULL)) -
+                         cursorSlots.begin();
+        if (newCursor.slot == cursorSlots.size()) {
+            cursorSlots.push_back(&newCursor);
+        } else {
+            cursorSlots[newCursor.slot] = &newCursor;
+        }
+    } else {
+        map_it->second.currentCheckpoint = it;
+        map_it->second.currentPos = curr;
+        map_it->second.offset = offset;
     }
+    // Count the tap cursor in the checkpoint.
+    (*it)->registerCursor();
 
     return found;
 }
 
 bool CheckpointManager::removeTAPCursor(const std::string &name) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
 
     cursor_index::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
@@ -428,22 +458,14 @@ bool CheckpointManager::removeTAPCursor(const std::string &name) {
         "Remove the checkpoint cursor with the name \"%s\" from vbucket %d",
         name.c_str(), vbucketId);
 
-    // We can simply remove the cursor's name from the checkpoint to which it currently belongs,
-    // by calling
-    // (*(it->second.currentCheckpoint))->removeCursorName(name);
-    // However, we just want to do more sanity checks by looking at each checkpoint. This won't
-    // cause much overhead because the max number of checkpoints allowed per vbucket is small.
-    std::list<Checkpoint*>::iterator cit = checkpointList.begin();
-    for (; cit != checkpointList.end(); ++cit) {
-        (*cit)->removeCursorName(name);
-    }
-
+    (*(it->second.currentCheckpoint))->removeCursor();
+    cursorSlots[it->second.slot] = NULL;
     tapCursors.erase(it);
     return true;
 }
 
 uint64_t CheckpointManager::getCheckpointIdForTAPCursor(const std::string &name) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     cursor_index::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
         return 0;
@@ -453,17 +475,17 @@ uint64_t CheckpointManager::getCheckpointIdForTAPCursor(const std::string &name)
 }
 
 size_t CheckpointManager::getNumOfTAPCursors() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     return tapCursors.size();
 }
 
 size_t CheckpointManager::getNumCheckpoints() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     return checkpointList.size();
 }
 
 std::list<std::string> CheckpointManager::getTAPCursorNames() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     std::list<std::string> cursor_names;
     cursor_index::iterator tap_it = tapCursors.begin();
         for (; tap_it != tapCursors.end(); ++tap_it) {
@@ -492,7 +514,7 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
                                                        bool &newOpenCheckpointCreated) {
 
     // This function is executed periodically by the non-IO dispatcher.
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     assert(vbucket);
     uint64_t oldCheckpointId = 0;
     bool canCreateNewCheckpoint = false;
@@ -523,7 +545,6 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
     std::list<Checkpoint*> unrefCheckpointList;
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     for (; it != checkpointList.end(); ++it) {
-        removeInvalidCursorsOnCheckpoint(*it);
         if ((*it)->getNumberOfCursors() > 0 ||
             (*it)->getId() > pCursorPreCheckpointId) {
             break;
@@ -543,9 +564,11 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
     if (numUnrefItems > 0) {
         numItems.fetch_sub(numUnrefItems);
         decrCursorOffset_UNLOCKED(persistenceCursor, numUnrefItems);
-        cursor_index::iterator map_it = tapCursors.begin();
-        for (; map_it != tapCursors.end(); ++map_it) {
-            decrCursorOffset_UNLOCKED(map_it->second, numUnrefItems);
+        std::vector<CheckpointCursor*>::iterator cit = cursorSlots.begin();
+        for (; cit != cursorSlots.end(); ++cit) {
+            if (*cit) {
+                decrCursorOffset_UNLOCKED(**cit, numUnrefItems);
+            }
         }
     }
     unrefCheckpointList.splice(unrefCheckpointList.begin(), checkpointList,
@@ -571,7 +594,7 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
             vbucket->dirtyQueueSize.fetch_add(diff);
         }
     }
-    lh.unlock();
+    wlh.unlock();
 
     std::list<Checkpoint*>::iterator chkpoint_it = unrefCheckpointList.begin();
     for (; chkpoint_it != unrefCheckpointList.end(); ++chkpoint_it) {
@@ -581,40 +604,34 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
     return numUnrefItems;
 }
 
-void CheckpointManager::removeInvalidCursorsOnCheckpoint(Checkpoint *pCheckpoint) {
-    std::list<std::string> invalidCursorNames;
-    const std::set<std::string> &cursors = pCheckpoint->getCursorNameList();
-    std::set<std::string>::const_iterator cit = cursors.begin();
-    for (; cit != cursors.end(); ++cit) {
-        // Check it with persistence cursor
-        if ((*cit).compare(persistenceCursor.name) == 0) {
-            if (pCheckpoint != *(persistenceCursor.currentCheckpoint)) {
-                invalidCursorNames.push_back(*cit);
-            }
-        } else { // Check it with tap cursors
-            cursor_index::iterator mit = tapCursors.find(*cit);
-            if (mit == tapCursors.end() || pCheckpoint != *(mit->second.currentCheckpoint)) {
-                invalidCursorNames.push_back(*cit);
-            }
-        }
-    }
-
-    std::list<std::string>::iterator it = invalidCursorNames.begin();
-    for (; it != invalidCursorNames.end(); ++it) {
-        pCheckpoint->removeCursorName(*it);
-    }
-}
-
 void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collapsedChks) {
     // If there are one open checkpoint and more than one closed checkpoint, collapse those
     // closed checkpoints into one checkpoint to reduce the memory overhead.
     if (checkpointList.size() > 2) {
-        std::map<std::string, uint64_t> slowCursors;
-        std::set<std::string> fastCursors;
         std::list<Checkpoint*>::iterator lastClosedChk = checkpointList.end();
         --lastClosedChk; --lastClosedChk; // Move to the lastest closed checkpoint.
-        fastCursors.insert((*lastClosedChk)->getCursorNameList().begin(),
-                           (*lastClosedChk)->getCursorNameList().end());
+
+        // Cursors in the checkpoints merged into the latest closed one are slow cursors
+        // and get repositioned; the others only need their offsets adjusted.
+        std::vector<CheckpointCursor*> cursors(cursorSlots);
+        cursors.push_back(&persistenceCursor);
+        std::map<CheckpointCursor*, uint64_t> slowCursors;
+        std::vector<CheckpointCursor*> fastCursors;
+        std::vector<CheckpointCursor*>::iterator cit = cursors.begin();
+        for (; cit != cursors.end(); ++cit) {
+            CheckpointCursor *cursor = *cit;
+            if (!cursor) {
+                continue;
+            }
+            Checkpoint *chk = *(cursor->currentCheckpoint);
+            if (chk == *lastClosedChk || chk == checkpointList.back()) {
+                fastCursors.push_back(cursor);
+            } else {
+                const std::string& key = (*(cursor->currentPos))->getKey();
+                slowCursors[cursor] = chk->getMutationIdForKey(key);
+            }
+        }
+
         std::list<Checkpoint*>::reverse_iterator rit = checkpointList.rbegin();
         ++rit; ++rit;// Move to the second lastest closed checkpoint.
         size_t numDuplicatedItems = 0, numMetaItems = 0;
@@ -622,61 +639,53 @@ void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collap
             size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit);
             numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
             numMetaItems += 2; // checkpoint start and end meta items
-
-            std::set<std::string>::iterator nameItr =
-                (*rit)->getCursorNameList().begin();
-            for (; nameItr != (*rit)->getCursorNameList().end(); ++nameItr) {
-                if (nameItr->compare(persistenceCursor.name) == 0) {
-                    const std::string& key = (*(persistenceCursor.currentPos))->getKey();
-                    slowCursors[*nameItr] = (*rit)->getMutationIdForKey(key);
-                } else {
-                    cursor_index::iterator cc =
-                        tapCursors.find(*nameItr);
-                    const std::string& key = (*(cc->second.currentPos))->getKey();
-                    slowCursors[*nameItr] = (*rit)->getMutationIdForKey(key);
-                }
-            }
         }
         putCursorsInChk(slowCursors, lastClosedChk);
 
         numItems.fetch_sub(numDuplicatedItems + numMetaItems);
-        Checkpoint *pOpenCheckpoint = checkpointList.back();
-        const std::set<std::string> &openCheckpointCursors = pOpenCheckpoint->getCursorNameList();
-        fastCursors.insert(openCheckpointCursors.begin(), openCheckpointCursors.end());
-        std::set<std::string>::const_iterator cit = fastCursors.begin();
         // Update the offset of each fast cursor.
-        for (; cit != fastCursors.end(); ++cit) {
-            if ((*cit).compare(persistenceCursor.name) == 0) {
-                decrCursorOffset_UNLOCKED(persistenceCursor, numDuplicatedItems + numMetaItems);
-            } else {
-                cursor_index::iterator mit = tapCursors.find(*cit);
-                if (mit != tapCursors.end()) {
-                    decrCursorOffset_UNLOCKED(mit->second, numDuplicatedItems + numMetaItems);
-                }
-            }
+        for (cit = fastCursors.begin(); cit != fastCursors.end(); ++cit) {
+            decrCursorOffset_UNLOCKED(**cit, numDuplicatedItems + numMetaItems);
         }
         collapsedChks.splice(collapsedChks.end(), checkpointList,
                              checkpointList.begin(),  lastClosedChk);
     }
 }
 
-bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb,
+bool CheckpointManager::queueDirty(VBucket &vb,
                                    const std::string &key,
                                    enum queue_operation op,
                                    uint64_t revSeqno,
                                    int64_t* bySeqno) {
-    LockHolder lh(queueLock);
+    {
+        // Appending a new key to the open checkpoint neither moves cursors
+        // nor changes the list of checkpoints.
+        ReaderLockHolder rlh(queueLock);
+        LockHolder alh(appendLock);
+        if (canAppendToOpenCheckpoint_UNLOCKED(vb, key)) {
+            *bySeqno = nextBySeqno();
+            queued_item qi(new QueuedItem(key, vb.getId(), op, revSeqno, *bySeqno));
+            queue_dirty_t result = checkpointList.back()->queueDirty(qi, this);
+            assert(result == NEW_ITEM);
+            ++numItems;
+            ++stats.totalEnqueued;
+            ++stats.diskQueueSize;
+            vb.doStatsForQueueing(*qi, qi->size());
+            return true;
+        }
+    }
+
+    WriterLockHolder wlh(queueLock);
     *bySeqno = nextBySeqno();
-    queued_item qi(new QueuedItem(key, vb->getId(), op, revSeqno, *bySeqno));
+    queued_item qi(new QueuedItem(key, vb.getId(), op, revSeqno, *bySeqno));
 
-    assert(vb);
     bool canCreateNewCheckpoint = false;
     if (checkpointList.size() < checkpointConfig.getMaxCheckpoints() ||
         (checkpointList.size() == checkpointConfig.getMaxCheckpoints() &&
          checkpointList.front()->getNumberOfCursors() == 0)) {
         canCreateNewCheckpoint = true;
     }
-    if (vb->getState() == vbucket_state_active && canCreateNewCheckpoint) {
+    if (vb.getState() == vbucket_state_active && canCreateNewCheckpoint) {
         // Only the master active vbucket can create a next open checkpoint.
         checkOpenCheckpoint_UNLOCKED(false, true);
     }
@@ -692,36 +701,75 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb,
     if (result != EXISTING_ITEM) {
         ++stats.totalEnqueued;
         ++stats.diskQueueSize;
-        vb->doStatsForQueueing(*qi, qi->size());
+        vb.doStatsForQueueing(*qi, qi->size());
     }
 
     return result != EXISTING_ITEM;
 }
 
+bool CheckpointManager::canAppendToOpenCheckpoint_UNLOCKED(VBucket &vb,
+                                                           const std::string &key) {
+    Checkpoint *openCheckpoint = checkpointList.back();
+    if (openCheckpoint->getState() != CHECKPOINT_OPEN ||
+        openCheckpoint->keyExists(key)) {
+        return false;
+    }
+    // The same check as in queueDirty for whether to start a new checkpoint.
+    if (vb.getState() == vbucket_state_active &&
+        (checkpointList.size() < checkpointConfig.getMaxCheckpoints() ||
+         (checkpointList.size() == checkpointConfig.getMaxCheckpoints() &&
+          checkpointList.front()->getNumberOfCursors() == 0))) {
+        return !needsNewCheckpoint_UNLOCKED(false, true);
+    }
+    return true;
+}
+
 void CheckpointManager::itemsPersisted() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     std::list<Checkpoint*>::iterator itr = persistenceCursor.currentCheckpoint;
     pCursorPreCheckpointId = ((*itr)->getId() > 0) ? (*itr)->getId() - 1 : 0;
 }
 
 void CheckpointManager::getAllItemsForPersistence(std::vector<queued_item> &items) {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
+    // Items appended while the cursor moves are left for the next call.
+    size_t numItemsBefore = numItems;
     // Get all the items up to the end of the current open checkpoint.
     while (incrCursor(persistenceCursor)) {
         items.push_back(*(persistenceCursor.currentPos));
     }
 
-    persistenceCursor.offset = numItems;
+    persistenceCursor.offset = numItemsBefore;
 
     LOG(EXTENSION_LOG_DEBUG,
         "Grab %ld items through the persistence cursor from vbucket %d",
         items.size(), vbucketId);
 }
 
-queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMutationItem) {
-    LockHolder lh(queueLock);
+CheckpointCursor *CheckpointManager::getTAPCursor_UNLOCKED(const std::string &name,
+                                                           CursorHandle &handle) {
+    if (handle.slot < cursorSlots.size()) {
+        CheckpointCursor *cursor = cursorSlots[handle.slot];
+        if (cursor && cursor->id == handle.id) {
+            return cursor;
+        }
+    }
+
     cursor_index::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
+        return NULL;
+    }
+    handle.slot = it->second.slot;
+    handle.id = it->second.id;
+    return &it->second;
+}
+
+queued_item CheckpointManager::nextItem(const std::string &name,
+                                        CursorHandle &handle,
+                                        bool &isLastMutationItem) {
+    ReaderLockHolder rlh(queueLock);
+    CheckpointCursor *cursor = getTAPCursor_UNLOCKED(name, handle);
+    if (!cursor) {
         LOG(EXTENSION_LOG_WARNING, "The cursor with name \"%s\" is not found in"
             " the checkpoint of vbucket %d.\n", name.c_str(), vbucketId);
         queued_item qi(new QueuedItem("", 0xffff, queue_op_empty, 0, 0));
@@ -736,10 +784,9 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
         return qi;
     }
 
-    CheckpointCursor &cursor = it->second;
-    if (incrCursor(cursor)) {
-        isLastMutationItem = isLastMutationItemInCheckpoint(cursor);
-        return *(cursor.currentPos);
+    if (incrCursor(*cursor)) {
+        isLastMutationItem = isLastMutationItemInCheckpoint(*cursor);
+        return *(cursor->currentPos);
     } else {
         isLastMutationItem = false;
         queued_item qi(new QueuedItem("", 0xffff, queue_op_empty, 0, 0));
@@ -747,6 +794,54 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
     }
 }
 
+size_t CheckpointManager::nextItems(const std::string &name,
+                                    CursorHandle &handle,
+                                    std::vector<queued_item> &items,
+                                    size_t maxItems, size_t maxBytes,
+                                    bool &isLastMutationItem) {
+    ReaderLockHolder rlh(queueLock);
+    isLastMutationItem = false;
+    CheckpointCursor *cursor = getTAPCursor_UNLOCKED(name, handle);
+    if (!cursor) {
+        LOG(EXTENSION_LOG_WARNING, "The cursor with name \"%s\" is not found in"
+            " the checkpoint of vbucket %d.\n", name.c_str(), vbucketId);
+        return 0;
+    }
+    if (checkpointList.back()->getId() == 0) {
+        LOG(EXTENSION_LOG_INFO,
+            "VBucket %d is still in backfill phase that doesn't allow "
+            " the tap cursor to fetch an item from it's current checkpoint",
+            vbucketId);
+        return 0;
+    }
+
+    size_t numItems = 0;
+    size_t numBytes = 0;
+    while (numItems < maxItems && numBytes < maxBytes && incrCursor(*cursor)) {
+        const queued_item &qi = *(cursor->currentPos);
+        bool isLast = isLastMutationItemInCheckpoint(*cursor);
+        bool isMutation = qi->getOperation() == queue_op_set ||
+                          qi->getOperation() == queue_op_del;
+        bool alone = qi->getOperation() == queue_op_checkpoint_end ||
+                     (isMutation && isLast);
+        if (alone && numItems > 0) {
+            // Leave the item for the next batch. Neither of these items
+            // starts a checkpoint, so the cursor stays in this checkpoint.
+            decrCursorOffset_UNLOCKED(*cursor, 1);
+            decrCursorPos_UNLOCKED(*cursor);
+            break;
+        }
+        items.push_back(qi);
+        ++numItems;
+        numBytes += qi->size();
+        if (alone) {
+            isLastMutationItem = isMutation;
+            break;
+        }
+    }
+    return numItems;
+}
+
 bool CheckpointManager::incrCursor(CheckpointCursor &cursor) {
     if (++(cursor.currentPos) != (*(cursor.currentCheckpoint))->end()) {
         ++(cursor.offset);
@@ -759,7 +854,7 @@ bool CheckpointManager::incrCursor(CheckpointCursor &cursor) {
 }
 
 void CheckpointManager::clear(vbucket_state_t vbState) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     // Remove all the checkpoints.
     while(it != checkpointList.end()) {
@@ -781,21 +876,24 @@ void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
         persistenceCursor.currentCheckpoint = checkpointList.begin();
         persistenceCursor.currentPos = checkpointList.front()->begin();
         persistenceCursor.offset = 0;
-        checkpointList.front()->registerCursorName(persistenceCursor.name);
+        checkpointList.front()->registerCursor();
     }
 
     // Reset all the TAP cursors.
-    cursor_index::iterator cit = tapCursors.begin();
-    for (; cit != tapCursors.end(); ++cit) {
-        cit->second.currentCheckpoint = checkpointList.begin();
-        cit->second.currentPos = checkpointList.front()->begin();
-        cit->second.offset = 0;
-        checkpointList.front()->registerCursorName(cit->second.name);
+    std::vector<CheckpointCursor*>::iterator cit = cursorSlots.begin();
+    for (; cit != cursorSlots.end(); ++cit) {
+        CheckpointCursor *cursor = *cit;
+        if (cursor) {
+            cursor->currentCheckpoint = checkpointList.begin();
+            cursor->currentPos = checkpointList.front()->begin();
+            cursor->offset = 0;
+            checkpointList.front()->registerCursor();
+        }
     }
 }
 
 void CheckpointManager::resetTAPCursors(const std::list<std::string> &cursors) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     std::list<std::string>::const_iterator it = cursors.begin();
     for (; it != cursors.end(); ++it) {
         registerTAPCursor_UNLOCKED(*it, getOpenCheckpointId_UNLOCKED(), true);
@@ -812,39 +910,47 @@ bool CheckpointManager::moveCursorToNextCheckpoint(CheckpointCursor &cursor) {
         }
     }
 
-    // Remove the cursor's name from its current checkpoint.
-    (*(cursor.currentCheckpoint))->removeCursorName(cursor.name);
+    // Remove the cursor from its current checkpoint.
+    (*(cursor.currentCheckpoint))->removeCursor();
     // Move the cursor to the next checkpoint.
     ++(cursor.currentCheckpoint);
     cursor.currentPos = (*(cursor.currentCheckpoint))->begin();
-    // Register the cursor's name to its new current checkpoint.
-    (*(cursor.currentCheckpoint))->registerCursorName(cursor.name);
+    // Count the cursor in its new current checkpoint.
+    (*(cursor.currentCheckpoint))->registerCursor();
     return true;
 }
 
 size_t CheckpointManager::getNumOpenChkItems() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     if (checkpointList.empty()) {
         return 0;
     }
     return checkpointList.back()->getNumItems() + 1;
 }
 
-uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation, bool timeBound) {
-    int checkpoint_id = 0;
-
+bool CheckpointManager::needsNewCheckpoint_UNLOCKED(bool forceCreation, bool timeBound) {
     timeBound = timeBound &&
                 (ep_real_time() - checkpointList.back()->getCreationTime()) >=
                 checkpointConfig.getCheckpointPeriod();
     // Create the new open checkpoint if any of the following conditions is satisfied:
     // (1) force creation due to online update or high memory usage
-    // (2) current checkpoint is reached to the max number of items allowed.
+    // (2) current checkpoint is reached to the max number of items allowed. The tombstones
+    //     of deduplicated items count as well, as they hold memory and slow down the
+    //     cursors just as items do, so updates to a hot key can't grow the checkpoint
+    //     until it times out.
     // (3) time elapsed since the creation of the current checkpoint is greater than the threshold
-    if (forceCreation ||
-        (checkpointConfig.isItemNumBasedNewCheckpoint() &&
-         checkpointList.back()->getNumItems() >= checkpointConfig.getCheckpointMaxItems()) ||
-        (checkpointList.back()->getNumItems() > 0 && timeBound)) {
+    Checkpoint *openCheckpoint = checkpointList.back();
+    return forceCreation ||
+           (checkpointConfig.isItemNumBasedNewCheckpoint() &&
+            openCheckpoint->getNumItems() + openCheckpoint->getNumTombstones() >=
+            checkpointConfig.getCheckpointMaxItems()) ||
+           (openCheckpoint->getNumItems() > 0 && timeBound);
+}
 
+uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation, bool timeBound) {
+    int checkpoint_id = 0;
+
+    if (needsNewCheckpoint_UNLOCKED(forceCreation, timeBound)) {
         checkpoint_id = checkpointList.back()->getId();
         closeOpenCheckpoint_UNLOCKED(checkpoint_id);
         addNewCheckpoint_UNLOCKED(checkpoint_id + 1);
@@ -853,7 +959,7 @@ uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation, boo
 }
 
 bool CheckpointManager::eligibleForEviction(const std::string &key) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     uint64_t smallest_mid;
 
     // Get the mutation id of the item pointed by the slowest cursor.
@@ -861,10 +967,14 @@ bool CheckpointManager::eligibleForEviction(const std::string &key) {
     // usually bounded to 3 (persistence cursor + 2 replicas).
     const std::string &pkey = (*(persistenceCursor.currentPos))->getKey();
     smallest_mid = (*(persistenceCursor.currentCheckpoint))->getMutationIdForKey(pkey);
-    cursor_index::iterator mit = tapCursors.begin();
-    for (; mit != tapCursors.end(); ++mit) {
-        const std::string &tkey = (*(mit->second.currentPos))->getKey();
-        uint64_t mid = (*(mit->second.currentCheckpoint))->getMutationIdForKey(tkey);
+    std::vector<CheckpointCursor*>::iterator cit = cursorSlots.begin();
+    for (; cit != cursorSlots.end(); ++cit) {
+        CheckpointCursor *cursor = *cit;
+        if (!cursor) {
+            continue;
+        }
+        const std::string &tkey = (*(cursor->currentPos))->getKey();
+        uint64_t mid = (*(cursor->currentCheckpoint))->getMutationIdForKey(tkey);
         if (mid < smallest_mid) {
             smallest_mid = mid;
         }
@@ -886,12 +996,13 @@ bool CheckpointManager::eligibleForEviction(const std::string &key) {
     return can_evict;
 }
 
-size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name) {
-    LockHolder lh(queueLock);
+size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name,
+                                                      CursorHandle &handle) {
+    ReaderLockHolder rlh(queueLock);
     size_t remains = 0;
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it != tapCursors.end()) {
-        remains = (numItems >= it->second.offset) ? numItems - it->second.offset : 0;
+    CheckpointCursor *cursor = getTAPCursor_UNLOCKED(name, handle);
+    if (cursor) {
+        remains = (numItems >= cursor->offset) ? numItems - cursor->offset : 0;
     }
     return remains;
 }
@@ -905,7 +1016,7 @@ size_t CheckpointManager::getNumItemsForPersistence_UNLOCKED() {
     std::list<Checkpoint*>::iterator curr_chk = persistenceCursor.currentCheckpoint;
     for (; curr_chk != checkpointList.end(); ++curr_chk) {
         if (curr_chk == persistenceCursor.currentCheckpoint) {
-            std::list<queued_item>::iterator curr_pos = persistenceCursor.currentPos;
+            CheckpointQueue::iterator curr_pos = persistenceCursor.currentPos;
             ++curr_pos;
             if (curr_pos == (*curr_chk)->end()) {
                 continue;
@@ -934,13 +1045,14 @@ size_t CheckpointManager::getNumItemsForPersistence_UNLOCKED() {
     return num_items > offset ? num_items - offset : 0;
 }
 
-void CheckpointManager::decrTapCursorFromCheckpointEnd(const std::string &name) {
-    LockHolder lh(queueLock);
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it != tapCursors.end() &&
-        (*(it->second.currentPos))->getOperation() == queue_op_checkpoint_end) {
-        decrCursorOffset_UNLOCKED(it->second, 1);
-        decrCursorPos_UNLOCKED(it->second);
+void CheckpointManager::decrTapCursorFromCheckpointEnd(const std::string &name,
+                                                       CursorHandle &handle) {
+    ReaderLockHolder rlh(queueLock);
+    CheckpointCursor *cursor = getTAPCursor_UNLOCKED(name, handle);
+    if (cursor &&
+        (*(cursor->currentPos))->getOperation() == queue_op_checkpoint_end) {
+        decrCursorOffset_UNLOCKED(*cursor, 1);
+        decrCursorPos_UNLOCKED(*cursor);
     }
 }
 
@@ -955,7 +1067,7 @@ uint64_t CheckpointManager::getMutationIdForKey(uint64_t chk_id, std::string key
 }
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
+    CheckpointQueue::iterator it = cursor.currentPos;
     ++it;
     if (it == (*(cursor.currentCheckpoint))->end() ||
         (*it)->getOperation() == queue_op_checkpoint_end) {
@@ -966,7 +1078,7 @@ bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor)
 
 void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
                                                  const RCPtr<VBucket> &vbucket) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
 
     // Ignore CHECKPOINT_START message with ID 0 as 0 is reserved for representing backfill.
     if (id == 0) {
@@ -976,6 +1088,12 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
     // simply set the current open checkpoint id to the one received from the active vbucket.
     if (checkpointList.back()->getId() == 0) {
         setOpenCheckpointId_UNLOCKED(id);
+        std::vector<CheckpointCursor*>::iterator cit = cursorSlots.begin();
+        for (; cit != cursorSlots.end(); ++cit) {
+            if (*cit) {
+                (*((*cit)->currentCheckpoint))->removeCursor();
+            }
+        }
         resetCursors(false);
         return;
     }
@@ -1002,16 +1120,13 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
             // If the current open checkpoint doesn't have any items, simply set its id to
             // the one from the master node.
             setOpenCheckpointId_UNLOCKED(id);
-            // Reposition all the cursors in the open checkpoint to the begining position
+            // Reposition all the TAP cursors in the open checkpoint to the begining position
             // so that a checkpoint_start message can be sent again with the correct id.
-            const std::set<std::string> &cursors = checkpointList.back()->getCursorNameList();
-            std::set<std::string>::const_iterator cit = cursors.begin();
-            for (; cit != cursors.end(); ++cit) {
-                if ((*cit).compare(persistenceCursor.name) == 0) { // Persistence cursor
-                    continue;
-                } else { // TAP cursors
-                    cursor_index::iterator mit = tapCursors.find(*cit);
-                    mit->second.currentPos = checkpointList.back()->begin();
+            std::vector<CheckpointCursor*>::iterator cit = cursorSlots.begin();
+            for (; cit != cursorSlots.end(); ++cit) {
+                CheckpointCursor *cursor = *cit;
+                if (cursor && *(cursor->currentCheckpoint) == checkpointList.back()) {
+                    cursor->currentPos = checkpointList.back()->begin();
                 }
             }
         } else {
@@ -1037,18 +1152,22 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
 void CheckpointManager::collapseCheckpoints(uint64_t id) {
     assert(!checkpointList.empty());
 
-    std::map<std::string, uint64_t> cursorMap;
-    cursor_index::iterator itr;
-    for (itr = tapCursors.begin(); itr != tapCursors.end(); itr++) {
-        Checkpoint* chk = *(itr->second.currentCheckpoint);
-        const std::string& key = (*(itr->second.currentPos))->getKey();
-        cursorMap[itr->first.c_str()] = chk->getMutationIdForKey(key);
+    // Every cursor is put back into the remaining checkpoint below.
+    std::map<CheckpointCursor*, uint64_t> cursorMap;
+    std::vector<CheckpointCursor*> cursors(cursorSlots);
+    cursors.push_back(&persistenceCursor);
+    std::vector<CheckpointCursor*>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        CheckpointCursor *cursor = *cit;
+        if (!cursor) {
+            continue;
+        }
+        Checkpoint* chk = *(cursor->currentCheckpoint);
+        const std::string& key = (*(cursor->currentPos))->getKey();
+        cursorMap[cursor] = chk->getMutationIdForKey(key);
+        chk->removeCursor();
     }
 
-    Checkpoint* chk = *(persistenceCursor.currentCheckpoint);
-    std::string key = (*(persistenceCursor.currentPos))->getKey();
-    cursorMap[persistenceCursor.name.c_str()] = chk->getMutationIdForKey(key);
-
     std::list<Checkpoint*>::reverse_iterator rit = checkpointList.rbegin();
     ++rit; // Move to the last closed checkpoint.
     size_t numDuplicatedItems = 0, numMetaItems = 0;
@@ -1075,29 +1194,22 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
     putCursorsInChk(cursorMap, checkpointList.begin());
 }
 
-void CheckpointManager::putCursorsInChk(std::map<std::string, uint64_t> &cursors,
+void CheckpointManager::putCursorsInChk(std::map<CheckpointCursor*, uint64_t> &cursors,
                                         std::list<Checkpoint*>::iterator chkItr) {
     int i;
     Checkpoint *chk = *chkItr;
-    std::list<queued_item>::iterator cit = chk->begin();
-    std::list<queued_item>::iterator last = chk->begin();
+    CheckpointQueue::iterator cit = chk->begin();
+    CheckpointQueue::iterator last = chk->begin();
     for (i = 0; cit != chk->end(); ++i, ++cit) {
         uint64_t id = chk->getMutationIdForKey((*cit)->getKey());
-        std::map<std::string, uint64_t>::iterator mit = cursors.begin();
+        std::map<CheckpointCursor*, uint64_t>::iterator mit = cursors.begin();
         while (mit != cursors.end()) {
             if (mit->second < id) {
-                if (mit->first.compare(persistenceCursor.name) == 0) {
-                    persistenceCursor.currentCheckpoint = chkItr;
-                    persistenceCursor.currentPos = last;
-                    persistenceCursor.offset = (i > 0) ? i - 1 : 0;
-                    chk->registerCursorName(persistenceCursor.name);
-                } else {
-                    cursor_index::iterator cc = tapCursors.find(mit->first);
-                    cc->second.currentCheckpoint = chkItr;
-                    cc->second.currentPos = last;
-                    cc->second.offset = (i > 0) ? i - 1 : 0;
-                    chk->registerCursorName(cc->second.name);
-                }
+                CheckpointCursor *cursor = mit->first;
+                cursor->currentCheckpoint = chkItr;
+                cursor->currentPos = last;
+                cursor->offset = (i > 0) ? i - 1 : 0;
+                chk->registerCursor();
                 cursors.erase(mit);
                 break;
             }
@@ -1106,35 +1218,28 @@ void CheckpointManager::putCursorsInChk(std::map<std::string, uint64_t> &cursors
         last = cit;
     }
 
-    std::map<std::string, uint64_t>::iterator mit = cursors.begin();
+    std::map<CheckpointCursor*, uint64_t>::iterator mit = cursors.begin();
     for (; mit != cursors.end(); ++mit) {
-        if (mit->first.compare(persistenceCursor.name) == 0) {
-            persistenceCursor.currentCheckpoint = chkItr;
-            persistenceCursor.currentPos = last;
-            persistenceCursor.offset = (i > 0) ? i - 1 : 0;
-            chk->registerCursorName(persistenceCursor.name);
-        } else {
-            cursor_index::iterator cc = tapCursors.find(mit->first);
-            cc->second.currentCheckpoint = chkItr;
-            cc->second.currentPos = last;
-            cc->second.offset = (i > 0) ? i - 1 : 0;
-            chk->registerCursorName(cc->second.name);
-        }
+        CheckpointCursor *cursor = mit->first;
+        cursor->currentCheckpoint = chkItr;
+        cursor->currentPos = last;
+        cursor->offset = (i > 0) ? i - 1 : 0;
+        chk->registerCursor();
     }
 }
 
-bool CheckpointManager::hasNext(const std::string &name) {
-    LockHolder lh(queueLock);
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it == tapCursors.end() || getOpenCheckpointId_UNLOCKED() == 0) {
+bool CheckpointManager::hasNext(const std::string &name, CursorHandle &handle) {
+    ReaderLockHolder rlh(queueLock);
+    CheckpointCursor *cursor = getTAPCursor_UNLOCKED(name, handle);
+    if (!cursor || getOpenCheckpointId_UNLOCKED() == 0) {
         return false;
     }
 
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
+    CheckpointQueue::iterator curr = cursor->currentPos;
     ++curr;
-    if (curr == (*(it->second.currentCheckpoint))->end() &&
-        (*(it->second.currentCheckpoint)) == checkpointList.back()) {
+    if (curr == (*(cursor->currentCheckpoint))->end() &&
+        (*(cursor->currentCheckpoint)) == checkpointList.back()) {
         hasMore = false;
     }
     return hasMore;
@@ -1155,9 +1260,9 @@ queued_item CheckpointManager::createCheckpointItem(uint64_t id, uint16_t vbid,
 }
 
 bool CheckpointManager::hasNextForPersistence() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = persistenceCursor.currentPos;
+    CheckpointQueue::iterator curr = persistenceCursor.currentPos;
     ++curr;
     if (curr == (*(persistenceCursor.currentCheckpoint))->end() &&
         (*(persistenceCursor.currentCheckpoint)) == checkpointList.back()) {
@@ -1167,7 +1272,7 @@ bool CheckpointManager::hasNextForPersistence() {
 }
 
 uint64_t CheckpointManager::createNewCheckpoint() {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     if (checkpointList.back()->getNumItems() > 0) {
         uint64_t chk_id = checkpointList.back()->getId();
         closeOpenCheckpoint_UNLOCKED(chk_id);
@@ -1194,7 +1299,7 @@ void CheckpointManager::decrCursorPos_UNLOCKED(CheckpointCursor &cursor) {
 }
 
 uint64_t CheckpointManager::getPersistenceCursorPreChkId() {
-    LockHolder lh(queueLock);
+    ReaderLockHolder rlh(queueLock);
     return pCursorPreCheckpointId;
 }
 
@@ -1284,7 +1389,7 @@ void CheckpointConfig::setMaxCheckpoints(size_t value) {
 }
 
 void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
-    LockHolder lh(queueLock);
+    WriterLockHolder wlh(queueLock);
     char buf[256];
 
     snprintf(buf, sizeof(buf), "vb_%d:open_checkpoint_id", vbucketId);
@@ -24,14 +24,15 @@
 
 #include <list>
 #include <map>
-#include <set>
 #include <string>
 #include <vector>
 
 #include "atomic.h"
+#include "checkpoint_queue.h"
 #include "common.h"
 #include "locks.h"
 #include "queueditem.h"
+#include "rwlock.h"
 #include "stats.h"
 
 #define MIN_CHECKPOINT_ITEMS 100
@@ -53,19 +54,6 @@ typedef enum {
     CHECKPOINT_CLOSED  //!< The checkpoint is not open.
 } checkpoint_state;
 
-/**
- * A checkpoint index entry.
- */
-struct index_entry {
-    std::list<queued_item>::iterator position;
-    int64_t mutation_id;
-};
-
-/**
- * The checkpoint index maps a key to a checkpoint index_entry.
- */
-typedef unordered_map<std::string, index_entry> checkpoint_index;
-
 class Checkpoint;
 class CheckpointManager;
 class CheckpointConfig;
@@ -83,19 +71,26 @@ public:
         : name(n),
           currentCheckpoint(),
           currentPos(),
-          offset(0) { }
+          offset(0),
+          slot(0),
+          id(0) { }
 
     CheckpointCursor(const std::string &n,
                      std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
+                     CheckpointQueue::iterator pos,
                      size_t os = 0) :
-        name(n), currentCheckpoint(checkpoint), currentPos(pos), offset(os) { }
+        name(n), currentCheckpoint(checkpoint), currentPos(pos), offset(os),
+        slot(0), id(0) { }
 
 private:
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
+    CheckpointQueue::iterator currentPos;
     Atomic<size_t>                   offset;
+    // Position in the manager's cursor slots and the id handed out in
+    // handles to this cursor.
+    size_t                           slot;
+    uint64_t                         id;
 };
 
 /**
@@ -103,6 +98,23 @@ private:
  */
 typedef std::map<const std::string, CheckpointCursor> cursor_index;
 
+/**
+ * A handle to a TAP cursor of a checkpoint manager, so that the cursor can
+ * be addressed without looking its name up. A default constructed handle,
+ * or one whose cursor was removed in the meantime, makes the manager look
+ * the cursor up by name once and refresh the handle.
+ */
+class CursorHandle {
+public:
+    CursorHandle() : slot(0), id(0) { }
+
+private:
+    friend class CheckpointManager;
+
+    size_t   slot;
+    uint64_t id;
+};
+
 /**
  * Result from invoking queueDirty in the current open checkpoint.
  */
@@ -135,7 +147,8 @@ public:
     Checkpoint(EPStats &st, uint64_t id, uint16_t vbid,
                checkpoint_state state = CHECKPOINT_OPEN) :
         stats(st), checkpointId(id), vbucketId(vbid), creationTime(ep_real_time()),
-        checkpointState(state), numItems(0), memOverhead(0) {
+        checkpointState(state), numItems(0), numCursors(0),
+        memOverhead(toWrite.memorySize() + keyIndex.memorySize()) {
         stats.memOverhead.fetch_add(memorySize());
         assert(stats.memOverhead.load() < GIGANTOR);
     }
@@ -171,6 +184,13 @@ public:
         return numItems;
     }
 
+    /**
+     * Return the number of tombstones left behind by deduplicated items.
+     */
+    size_t getNumTombstones() const {
+        return toWrite.tombstones();
+    }
+
     /**
      * Return the current state of this checkpoint.
      */
@@ -190,35 +210,22 @@ public:
      * Return the number of cursors that are currently walking through this checkpoint.
      */
     size_t getNumberOfCursors() const {
-        return cursors.size();
-    }
-
-    /**
-     * Register a cursor's name to this checkpoint
-     */
-    void registerCursorName(const std::string &name) {
-        cursors.insert(name);
+        return numCursors;
     }
 
     /**
-     * Remove a cursor's name from this checkpoint
+     * Count a cursor that moved into this checkpoint
      */
-    void removeCursorName(const std::string &name) {
-        cursors.erase(name);
+    void registerCursor() {
+        ++numCursors;
     }
 
     /**
-     * Return true if the cursor with a given name exists in this checkpoint
+     * Stop counting a cursor that left this checkpoint
      */
-    bool hasCursorName(const std::string &name) const {
-        return cursors.find(name) != cursors.end();
-    }
-
-    /**
-     * Return the list of all cursor names in this checkpoint
-     */
-    const std::set<std::string> &getCursorNameList() const {
-        return cursors;
+    void removeCursor() {
+        assert(numCursors > 0);
+        --numCursors;
     }
 
     /**
@@ -232,28 +239,20 @@ public:
                              CheckpointManager *checkpointManager);
 
 
-    std::list<queued_item>::iterator begin() {
+    CheckpointQueue::iterator begin() {
         return toWrite.begin();
     }
 
-    std::list<queued_item>::iterator end() {
+    CheckpointQueue::iterator end() {
         return toWrite.end();
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
-        return toWrite.rbegin();
-    }
-
-    std::list<queued_item>::reverse_iterator rend() {
-        return toWrite.rend();
-    }
-
     bool keyExists(const std::string &key);
 
     /**
-     * Return the memory overhead of this checkpoint instance, except for the memory used by
-     * all the items belonging to this checkpoint. The memory overhead of those items is
-     * accounted separately in "ep_kv_size" stat.
+     * Return the memory overhead of this checkpoint instance, i.e. the chunks of its queue
+     * and its key index, except for the memory used by all the items belonging to this
+     * checkpoint. The memory overhead of those items is accounted separately.
      * @return memory overhead of this checkpoint instance.
      */
     size_t memorySize() {
@@ -276,22 +275,30 @@ public:
     uint64_t getMutationIdForKey(const std::string &key);
 
 private:
+    // Bring memOverhead and the overhead stat in line with the queue and the index.
+    void updateMemOverhead();
+
     EPStats                       &stats;
     uint64_t                       checkpointId;
     uint16_t                       vbucketId;
     rel_time_t                     creationTime;
     checkpoint_state               checkpointState;
-    size_t                         numItems;
-    std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
-    checkpoint_index               keyIndex;
+    Atomic<size_t>                 numItems;
+    Atomic<size_t>                 numCursors; // Number of cursors in this checkpoint.
+    // Deduplicated items leave a tombstone behind, so queued items never move.
+    CheckpointQueue                toWrite;
+    CheckpointIndex                keyIndex;
     size_t                         memOverhead;
 };
 
 /**
  * Representation of a checkpoint manager that maintains the list of checkpoints
  * for each vbucket.
+ *
+ * Appending a new key to the open checkpoint and advancing cursors only share
+ * queueLock, so the front end doesn't wait for the persistence and TAP cursors
+ * (and the cursors don't wait for each other). A cursor must only be advanced
+ * by one thread at a time.
  */
 class CheckpointManager {
     friend class Checkpoint;
@@ -322,7 +329,7 @@ public:
     void setOpenCheckpointId_UNLOCKED(uint64_t id);
 
     void setOpenCheckpointId(uint64_t id) {
-        LockHolder lh(queueLock);
+        WriterLockHolder wlh(queueLock);
         setOpenCheckpointId_UNLOCKED(id);
     }
 
@@ -373,10 +380,17 @@ public:
      * @param bySeqno the sequence number assigned to this mutation
      * @return true if an item queued increases the size of persistence queue by 1.
      */
-    bool queueDirty(const RCPtr<VBucket> &vb, const std::string &key,
+    bool queueDirty(VBucket &vb, const std::string &key,
                     enum queue_operation op, uint64_t revSeqno,
                     int64_t* bySeqno);
 
+    bool queueDirty(const RCPtr<VBucket> &vb, const std::string &key,
+                    enum queue_operation op, uint64_t revSeqno,
+                    int64_t* bySeqno) {
+        assert(vb);
+        return queueDirty(*vb, key, op, revSeqno, bySeqno);
+    }
+
     /**
      * Return the next item to be sent to a given TAP connection
      * @param name the name of a given TAP connection
@@ -384,7 +398,44 @@ public:
      * in the closed checkpoint.
      * @return the next item to be sent to a given TAP connection.
      */
-    queued_item nextItem(const std::string &name, bool &isLastMutationItem);
+    queued_item nextItem(const std::string &name, bool &isLastMutationItem) {
+        CursorHandle handle;
+        return nextItem(name, handle, isLastMutationItem);
+    }
+
+    /**
+     * Return the next item to be sent to a given TAP connection, addressing
+     * its cursor through a handle kept by the caller.
+     * @param name the name of a given TAP connection
+     * @param handle the handle to the connection's cursor, refreshed if needed
+     * @param isLastMutationItem flag indicating if the item to be returned is the last mutation one
+     * in the closed checkpoint.
+     * @return the next item to be sent to a given TAP connection.
+     */
+    queued_item nextItem(const std::string &name, CursorHandle &handle,
+                         bool &isLastMutationItem);
+
+    /**
+     * Move a TAP connection's cursor over a batch of items in one go.
+     *
+     * The batch stops at the end of the open checkpoint, after maxItems
+     * items or once the items reach maxBytes. A checkpoint end item and the
+     * last mutation of a checkpoint are only returned as a batch of their
+     * own, so that the connection has sent everything before them when it
+     * gets to see them.
+     *
+     * @param name the name of a given TAP connection
+     * @param handle the handle to the connection's cursor, refreshed if needed
+     * @param items the vector the items are appended to
+     * @param maxItems the maximum number of items to return
+     * @param maxBytes the size of the items after which the batch stops
+     * @param isLastMutationItem set if the batch is the last mutation item in
+     * the closed checkpoint.
+     * @return the number of items appended to the vector.
+     */
+    size_t nextItems(const std::string &name, CursorHandle &handle,
+                     std::vector<queued_item> &items, size_t maxItems,
+                     size_t maxBytes, bool &isLastMutationItem);
 
     /**
      * Return the list of items, which needs to be persisted, to the flusher.
@@ -410,11 +461,17 @@ public:
     size_t getNumItemsForPersistence_UNLOCKED();
 
     size_t getNumItemsForPersistence() {
-        LockHolder lh(queueLock);
+        WriterLockHolder wlh(queueLock);
         return getNumItemsForPersistence_UNLOCKED();
     }
 
-    size_t getNumItemsForTAPConnection(const std::string &name);
+    size_t getNumItemsForTAPConnection(const std::string &name) {
+        CursorHandle handle;
+        return getNumItemsForTAPConnection(name, handle);
+    }
+
+    size_t getNumItemsForTAPConnection(const std::string &name,
+                                       CursorHandle &handle);
 
     /**
      * Return true if a given key was already visited by all the cursors
@@ -433,9 +490,20 @@ public:
      * synchronization between the master and slave nodes.
      * @param name the name of a given TAP connection
      */
-    void decrTapCursorFromCheckpointEnd(const std::string &name);
+    void decrTapCursorFromCheckpointEnd(const std::string &name) {
+        CursorHandle handle;
+        decrTapCursorFromCheckpointEnd(name, handle);
+    }
 
-    bool hasNext(const std::string &name);
+    void decrTapCursorFromCheckpointEnd(const std::string &name,
+                                        CursorHandle &handle);
+
+    bool hasNext(const std::string &name) {
+        CursorHandle handle;
+        return hasNext(name, handle);
+    }
+
+    bool hasNext(const std::string &name, CursorHandle &handle);
 
     bool hasNextForPersistence();
 
@@ -498,6 +566,14 @@ private:
 
     void registerPersistenceCursor();
 
+    /**
+     * Find the TAP cursor addressed by a handle, falling back to a lookup
+     * by name (and refreshing the handle) if the handle is stale.
+     * @return the cursor or NULL if no cursor with that name exists
+     */
+    CheckpointCursor *getTAPCursor_UNLOCKED(const std::string &name,
+                                            CursorHandle &handle);
+
     /**
      * Create a new open checkpoint and add it to the checkpoint list.
      * The lock should be acquired before calling this function.
@@ -505,8 +581,6 @@ private:
      */
     bool addNewCheckpoint_UNLOCKED(uint64_t id);
 
-    void removeInvalidCursorsOnCheckpoint(Checkpoint *pCheckpoint);
-
     /**
      * Create a new open checkpoint and add it to the checkpoint list.
      * @param id the id of a checkpoint to be created.
@@ -527,7 +601,7 @@ private:
     uint64_t checkOpenCheckpoint_UNLOCKED(bool forceCreation, bool timeBound);
 
     uint64_t checkOpenCheckpoint(bool forceCreation, bool timeBound) {
-        LockHolder lh(queueLock);
+        WriterLockHolder wlh(queueLock);
         return checkOpenCheckpoint_UNLOCKED(forceCreation, timeBound);
     }
 
@@ -548,16 +622,26 @@ private:
 
     void resetCursors(bool resetPersistenceCursor = true);
 
-    void putCursorsInChk(std::map<std::string, uint64_t> &cursors,
+    void putCursorsInChk(std::map<CheckpointCursor*, uint64_t> &cursors,
                          std::list<Checkpoint*>::iterator chkItr);
 
     static queued_item createCheckpointItem(uint64_t id, uint16_t vbid,
                                             enum queue_operation checkpoint_op,
                                             int64_t bySeqno);
 
+    bool needsNewCheckpoint_UNLOCKED(bool forceCreation, bool timeBound);
+
+    bool canAppendToOpenCheckpoint_UNLOCKED(VBucket &vb,
+                                            const std::string &key);
+
     EPStats                 &stats;
     CheckpointConfig        &checkpointConfig;
-    Mutex                    queueLock;
+    // Held shared by queueDirty appending a new key to the open checkpoint
+    // and by cursors advancing over the checkpoints; held exclusively by
+    // anything else that changes checkpoints or cursors.
+    RWLock                   queueLock;
+    // Serializes the appends made under the shared queueLock.
+    Mutex                    appendLock;
     uint16_t                 vbucketId;
     Atomic<size_t>           numItems;
     int64_t                  lastBySeqNo;
@@ -565,8 +649,13 @@ private:
     CheckpointCursor         persistenceCursor;
     bool                     isCollapsedCheckpoint;
     uint64_t                 lastClosedCheckpointId;
-    uint64_t                 pCursorPreCheckpointId;
+    Atomic<uint64_t>         pCursorPreCheckpointId;
     cursor_index             tapCursors;
+    // TAP cursors by slot; NULL for free slots.
+    std::vector<CheckpointCursor*> cursorSlots;
+    // Cursor ids are unique across managers, so that a handle kept for a
+    // vbucket that was since recreated can't match a cursor of the new one.
+    static Atomic<uint64_t>  lastCursorId;
 };
 
 /**
@@ -0,0 +1,203 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+
+#include "checkpoint_queue.h"
+#include "keyhash.h"
+
+const size_t CheckpointQueue::MIN_CHUNK_ITEMS;
+const size_t CheckpointQueue::MAX_CHUNK_ITEMS;
+
+CheckpointQueue::CheckpointQueue() : head(NULL), tail(NULL), numItems(0),
+                                     numTombstones(0), memory(0) {
+    head = addChunk(MIN_CHUNK_ITEMS);
+    tail = head;
+}
+
+CheckpointQueue::~CheckpointQueue() {
+    while (head) {
+        Chunk *next = head->next;
+        delete head;
+        head = next;
+    }
+}
+
+CheckpointQueue::Chunk *CheckpointQueue::addChunk(size_t capacity) {
+    Chunk *chunk = new Chunk(capacity);
+    memory += sizeof(Chunk) + capacity * sizeof(queued_item);
+    return chunk;
+}
+
+void CheckpointQueue::extend(size_t capacity) {
+    Chunk *last = tail;
+    Chunk *chunk = addChunk(capacity);
+    chunk->prev = last;
+    // Readers may follow the link right away.
+    ep_sync_synchronize();
+    last->next = chunk;
+    tail = chunk;
+}
+
+CheckpointQueue::iterator CheckpointQueue::push_back(const queued_item &qi) {
+    Chunk *last = tail;
+    size_t n = last->count;
+    last->items[n] = qi;
+    if (n + 1 == last->limit) {
+        // Link the next chunk before the last slot is published.
+        extend(std::min(last->capacity * 2, MAX_CHUNK_ITEMS));
+    }
+    // The item must be visible before the count that publishes it.
+    ep_sync_synchronize();
+    last->count = n + 1;
+    ++numItems;
+    return iterator(last, n);
+}
+
+void CheckpointQueue::pop_back() {
+    iterator last = --end();
+    last->reset();
+    --numItems;
+    ++numTombstones;
+    // Drop the trailing tombstones, so that their slots are reused by the
+    // next items. An empty tail chunk stays behind a full chunk, as full
+    // chunks must have a successor.
+    for (;;) {
+        Chunk *chunk = tail;
+        if (chunk->count > 0) {
+            if (chunk->items[chunk->count - 1]) {
+                break;
+            }
+            --chunk->count;
+            --numTombstones;
+        } else if (chunk != head &&
+                   !chunk->prev->items[chunk->prev->count - 1]) {
+            tail = chunk->prev;
+            chunk->prev->next = static_cast<Chunk*>(NULL);
+            memory -= sizeof(Chunk) + chunk->capacity * sizeof(queued_item);
+            delete chunk;
+        } else {
+            break;
+        }
+    }
+}
+
+void CheckpointQueue::erase(iterator pos) {
+    assert(*pos);
+    pos->reset();
+    --numItems;
+    ++numTombstones;
+}
+
+void CheckpointQueue::closeChunk() {
+    Chunk *last = tail;
+    if (last->count > 0) {
+        extend(std::min(last->capacity * 2, MAX_CHUNK_ITEMS));
+        last->limit = last->count;
+    }
+}
+
+CheckpointQueue::iterator
+CheckpointQueue::insertAfterHead(const std::vector<queued_item> &items) {
+    assert(!items.empty());
+    assert(head->count == head->limit && head->next);
+
+    Chunk *chunk = addChunk(items.size());
+    std::copy(items.begin(), items.end(), chunk->items);
+    chunk->count = items.size();
+    chunk->prev = head;
+    chunk->next = head->next.load();
+    head->next.load()->prev = chunk;
+    head->next = chunk;
+    numItems.fetch_add(items.size());
+    return iterator(chunk, 0);
+}
+
+CheckpointIndex::CheckpointIndex() : slots(16), mask(15), used(0) {
+}
+
+size_t CheckpointIndex::lookup(const std::string &key, uint32_t hash) const {
+    size_t i = hash & mask;
+    while (!isFree(slots[i]) &&
+           (slots[i].hash != hash || keyOf(slots[i]) != key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+CheckpointIndex::Entry *CheckpointIndex::find(const std::string &key) {
+    uint32_t hash = static_cast<uint32_t>(keyhash(key.data(), key.length()));
+    Slot &slot = slots[lookup(key, hash)];
+    return isFree(slot) ? NULL : &slot.entry;
+}
+
+void CheckpointIndex::set(CheckpointQueue::iterator pos, int64_t mutationId) {
+    const std::string &key = (*pos)->getKey();
+    uint32_t hash = static_cast<uint32_t>(keyhash(key.data(), key.length()));
+    Slot &slot = slots[lookup(key, hash)];
+    if (isFree(slot)) {
+        slot.hash = hash;
+        ++used;
+    }
+    slot.entry.position = pos;
+    slot.entry.mutation_id = mutationId;
+    if (used * 2 > slots.size()) {
+        grow();
+    }
+}
+
+void CheckpointIndex::erase(const std::string &key) {
+    uint32_t hash = static_cast<uint32_t>(keyhash(key.data(), key.length()));
+    size_t i = lookup(key, hash);
+    if (isFree(slots[i])) {
+        return;
+    }
+    --used;
+    // Shift the following entries of the probe sequence back, so that no
+    // lookup runs into the freed slot before reaching its entry.
+    size_t j = i;
+    for (;;) {
+        slots[i].entry.position = CheckpointQueue::iterator();
+        do {
+            j = (j + 1) & mask;
+            if (isFree(slots[j])) {
+                return;
+            }
+        } while (((j - (slots[j].hash & mask)) & mask) <
+                 ((j - i) & mask));
+        slots[i] = slots[j];
+        i = j;
+    }
+}
+
+void CheckpointIndex::grow() {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    mask = slots.size() - 1;
+    std::vector<Slot>::iterator it = old.begin();
+    for (; it != old.end(); ++it) {
+        if (!isFree(*it)) {
+            size_t i = it->hash & mask;
+            while (!isFree(slots[i])) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = *it;
+        }
+    }
+}
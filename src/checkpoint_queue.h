@@ -0,0 +1,317 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_CHECKPOINT_QUEUE_H_
+#define SRC_CHECKPOINT_QUEUE_H_ 1
+
+#include "config.h"
+
+#include <assert.h>
+
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "queueditem.h"
+
+/**
+ * The items of a checkpoint, kept in an append-only list of chunks.
+ *
+ * Items are never moved once queued, so iterators (and the checkpoint
+ * cursors holding them) stay valid while items are appended. Removing an
+ * item in the middle only leaves a tombstone that iteration skips; the
+ * memory is given back in whole chunks when the queue is destroyed.
+ *
+ * push_back() publishes an item only after it is written, so a single
+ * appender may run concurrently with readers iterating over the queue.
+ * All other modifications need exclusive access.
+ */
+class CheckpointQueue {
+    struct Chunk {
+        Chunk(size_t cap) : items(new queued_item[cap]), capacity(cap),
+                            limit(cap), count(0), prev(NULL), next(NULL) { }
+
+        ~Chunk() {
+            delete []items;
+        }
+
+        queued_item         *items;
+        size_t               capacity;
+        // The number of slots in use once the chunk is full.
+        size_t               limit;
+        // The number of published slots.
+        Atomic<size_t>       count;
+        Chunk               *prev;
+        // Set before the chunk gets full, so a reader never finds a full
+        // chunk without a successor.
+        Atomic<Chunk*>       next;
+
+        DISALLOW_COPY_AND_ASSIGN(Chunk);
+    };
+
+public:
+
+    //! Capacity of the first chunk; each following chunk doubles it.
+    static const size_t MIN_CHUNK_ITEMS = 8;
+    static const size_t MAX_CHUNK_ITEMS = 512;
+
+    /**
+     * A bidirectional iterator over the live items of the queue.
+     */
+    class iterator {
+    public:
+        iterator() : chunk(NULL), index(0) { }
+
+        queued_item &operator *() const {
+            return chunk->items[index];
+        }
+
+        queued_item *operator ->() const {
+            return &chunk->items[index];
+        }
+
+        iterator &operator ++() {
+            ++index;
+            settle();
+            return *this;
+        }
+
+        iterator &operator --() {
+            do {
+                while (index == 0) {
+                    chunk = chunk->prev;
+                    assert(chunk);
+                    index = chunk->count;
+                }
+                --index;
+            } while (!chunk->items[index]);
+            return *this;
+        }
+
+        bool operator ==(const iterator &other) const {
+            return chunk == other.chunk && index == other.index;
+        }
+
+        bool operator !=(const iterator &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class CheckpointQueue;
+        friend class CheckpointIndex;
+
+        iterator(Chunk *c, size_t i) : chunk(c), index(i) { }
+
+        // Move forward to the next live item, or to the end of the queue.
+        void settle() {
+            for (;;) {
+                skipFullChunks();
+                if (index == chunk->count || chunk->items[index]) {
+                    return;
+                }
+                ++index;
+            }
+        }
+
+        // Never stay past the last slot of a full chunk, which is the
+        // same position as the start of the next one. A full chunk always
+        // has its successor linked before its last slot is published.
+        void skipFullChunks() {
+            while (index == chunk->limit) {
+                chunk = chunk->next;
+                index = 0;
+            }
+        }
+
+        Chunk  *chunk;
+        size_t  index;
+    };
+
+    CheckpointQueue();
+
+    ~CheckpointQueue();
+
+    iterator begin() const {
+        iterator it(head, 0);
+        it.settle();
+        return it;
+    }
+
+    iterator end() const {
+        Chunk *last = tail;
+        iterator it(last, last->count);
+        // An appender may have filled the chunk since the tail was read.
+        // The end then is the start of the next chunk, as it is for an
+        // iterator moving past the last item, so the two compare equal.
+        it.skipFullChunks();
+        return it;
+    }
+
+    bool empty() const {
+        return numItems == 0;
+    }
+
+    /**
+     * Return the number of live items in the queue.
+     */
+    size_t size() const {
+        return numItems;
+    }
+
+    /**
+     * Return the number of tombstones in the queue.
+     */
+    size_t tombstones() const {
+        return numTombstones;
+    }
+
+    /**
+     * Return the last live item. The queue must not be empty.
+     */
+    queued_item &back() {
+        return *(--end());
+    }
+
+    /**
+     * Append an item and return its position. Readers see the item once
+     * it is completely queued.
+     */
+    iterator push_back(const queued_item &qi);
+
+    /**
+     * Remove the last live item. The queue must not be empty.
+     */
+    void pop_back();
+
+    /**
+     * Leave a tombstone in place of the item at the given position.
+     */
+    void erase(iterator pos);
+
+    /**
+     * Let the next item start a new chunk, so the items queued so far
+     * form the head of the queue that insertAfterHead() inserts behind.
+     * Only called before any item follows the head.
+     */
+    void closeChunk();
+
+    /**
+     * Insert items between the head chunk (see closeChunk()) and the rest
+     * of the queue, keeping their order. No queued item moves.
+     *
+     * @return the position of the first inserted item
+     */
+    iterator insertAfterHead(const std::vector<queued_item> &items);
+
+    /**
+     * Return the number of bytes held by the queue itself, not counting
+     * the items it refers to.
+     */
+    size_t memorySize() const {
+        return memory;
+    }
+
+private:
+
+    Chunk *addChunk(size_t capacity);
+
+    // Link a new empty chunk behind the tail.
+    void extend(size_t capacity);
+
+    Chunk          *head;
+    Atomic<Chunk*>  tail;
+    Atomic<size_t>  numItems;
+    size_t          numTombstones;
+    size_t          memory;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointQueue);
+};
+
+/**
+ * Maps the keys of a checkpoint to the position of their item in the
+ * checkpoint queue and the mutation id they were queued with.
+ *
+ * This is an open addressing hash table that doesn't store keys: a slot
+ * only holds the position and part of the hash, and the key is compared
+ * against the item it points to. An entry must therefore be moved or
+ * erased before its item is removed from the queue.
+ */
+class CheckpointIndex {
+public:
+
+    /**
+     * A key's entry in the index.
+     */
+    struct Entry {
+        CheckpointQueue::iterator position;
+        int64_t                   mutation_id;
+    };
+
+    CheckpointIndex();
+
+    /**
+     * Find the entry for a key.
+     *
+     * @return the entry, or NULL if the key is not in the index
+     */
+    Entry *find(const std::string &key);
+
+    /**
+     * Set the entry for the key of the item at the given position.
+     */
+    void set(CheckpointQueue::iterator pos, int64_t mutationId);
+
+    /**
+     * Remove the entry for a key, if there is one.
+     */
+    void erase(const std::string &key);
+
+    /**
+     * Return the number of bytes held by the index.
+     */
+    size_t memorySize() const {
+        return slots.capacity() * sizeof(Slot);
+    }
+
+private:
+
+    struct Slot {
+        Entry    entry;
+        uint32_t hash;
+    };
+
+    static bool isFree(const Slot &slot) {
+        return slot.entry.position.chunk == NULL;
+    }
+
+    static const std::string &keyOf(const Slot &slot) {
+        return (*slot.entry.position)->getKey();
+    }
+
+    size_t lookup(const std::string &key, uint32_t hash) const;
+
+    void grow();
+
+    std::vector<Slot> slots;
+    size_t            mask;
+    size_t            used;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointIndex);
+};
+
+#endif  // SRC_CHECKPOINT_QUEUE_H_
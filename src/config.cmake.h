@@ -27,6 +27,8 @@
 #cmakedefine HAVE_MACH_ABSOLUTE_TIME ${HAVE_MACH_ABSOLUTE_TIME}
 #cmakedefine HAVE_GETTIMEOFDAY ${GETTIMEOFDAY}
 #cmakedefine HAVE_GETOPT_LONG ${HAVE_GETOPT_LONG}
+#cmakedefine HAVE_SYNCFS ${HAVE_SYNCFS}
+#cmakedefine HAVE_POSIX_FADVISE ${HAVE_POSIX_FADVISE}
 
 /* various */
 #define VERSION "${EP_ENGINE_VERSION}"
@@ -104,4 +104,11 @@
 #include <sched.h>
 #endif
 
+/* Hint the CPU to start loading the cache line at addr */
+#if defined(__GNUC__)
+#define ep_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define ep_prefetch(addr)
+#endif
+
 #endif /* SRC_CONFIG_STATIC_H */
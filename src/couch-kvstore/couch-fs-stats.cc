@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include "atomic.h"
 #include "common.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "histo.h"
@@ -32,6 +33,8 @@ static ssize_t cfs_pwrite(couchstore_error_info_t*, couch_file_handle,
                           const void *, size_t, cs_off_t);
 static cs_off_t cfs_goto_eof(couchstore_error_info_t*, couch_file_handle);
 static couchstore_error_t cfs_sync(couchstore_error_info_t*, couch_file_handle);
+static couchstore_error_t cfs_deferred_sync(couchstore_error_info_t*,
+                                            couch_file_handle);
 static couchstore_error_t cfs_advise(couchstore_error_info_t*,
                                      couch_file_handle,
                                      cs_off_t, cs_off_t,
@@ -39,7 +42,7 @@ static couchstore_error_t cfs_advise(couchstore_error_info_t*,
 static void cfs_destroy(couchstore_error_info_t*,couch_file_handle);
 }
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
+couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats, bool deferSync) {
     couch_file_ops ops = {
         5,
         cfs_construct,
@@ -48,7 +51,7 @@ couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
         cfs_pread,
         cfs_pwrite,
         cfs_goto_eof,
-        cfs_sync,
+        deferSync ? cfs_deferred_sync : cfs_sync,
         cfs_advise,
         cfs_destroy,
         stats
@@ -63,6 +66,21 @@ struct StatFile {
     cs_off_t last_offs;
 };
 
+// The file opened last on each thread, for takeLastOpenedStatFile().
+static ThreadLocalPtr<StatFile> lastOpened;
+
+StatFile *takeLastOpenedStatFile() {
+    StatFile *sf = lastOpened.get();
+    lastOpened = NULL;
+    return sf;
+}
+
+couchstore_error_t adviseStatFile(StatFile *sf, cs_off_t offs, cs_off_t len,
+                                  couchstore_file_advice_t advice) {
+    couchstore_error_info_t errinfo;
+    return sf->orig_ops->advise(&errinfo, sf->orig_handle, offs, len, advice);
+}
+
 extern "C" {
     static couch_file_handle cfs_construct(couchstore_error_info_t *errinfo,
                                            void* cookie) {
@@ -80,7 +98,12 @@ extern "C" {
                                        const char* path,
                                        int flags) {
         StatFile* sf = reinterpret_cast<StatFile*>(*h);
-        return sf->orig_ops->open(errinfo, &sf->orig_handle, path, flags);
+        couchstore_error_t err = sf->orig_ops->open(errinfo, &sf->orig_handle,
+                                                    path, flags);
+        if (err == COUCHSTORE_SUCCESS) {
+            lastOpened = sf;
+        }
+        return err;
     }
 
     static void cfs_close(couchstore_error_info_t *errinfo,
@@ -128,6 +151,11 @@ extern "C" {
         return sf->orig_ops->sync(errinfo, sf->orig_handle);
     }
 
+    static couchstore_error_t cfs_deferred_sync(couchstore_error_info_t *,
+                                                couch_file_handle) {
+        return COUCHSTORE_SUCCESS;
+    }
+
     static couchstore_error_t cfs_advise(couchstore_error_info_t *errinfo,
                                          couch_file_handle h,
                                          cs_off_t offs,
@@ -140,6 +168,9 @@ extern "C" {
     static void cfs_destroy(couchstore_error_info_t *errinfo,
                             couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (lastOpened.get() == sf) {
+            lastOpened = NULL;
+        }
         sf->orig_ops->destructor(errinfo, sf->orig_handle);
         delete sf;
     }
@@ -54,6 +54,28 @@ public:
     }
 };
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats);
+/**
+ * Get file ops that collect stats and pass everything on to couchstore's
+ * default file ops. With deferSync, couchstore's sync calls return at
+ * once and it is up to the caller to get the data onto disk.
+ */
+couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats,
+                                     bool deferSync = false);
+
+struct StatFile;
+
+/**
+ * Take the file the stats file ops opened last on this thread. couchstore
+ * doesn't hand out the file under a Db, so call this right after opening
+ * the Db to get at it. NULL if no file was opened since the last call.
+ */
+StatFile *takeLastOpenedStatFile();
+
+/**
+ * Give the kernel advice about a range of a file opened through the stats
+ * file ops, e.g. to start reading it ahead.
+ */
+couchstore_error_t adviseStatFile(StatFile *sf, cs_off_t offs, cs_off_t len,
+                                  couchstore_file_advice_t advice);
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_FS_STATS_H_
@@ -184,21 +184,119 @@ static bool allDigit(std::string &input)
     return true;
 }
 
+static std::string getDBFileName(const std::string &dbname,
+                                 uint16_t vbid,
+                                 uint64_t rev)
+{
+    std::stringstream ss;
+    ss << dbname << "/" << vbid << ".couch." << rev;
+    return ss.str();
+}
+
 static std::string couchkvstore_strerrno(Db *db, couchstore_error_t err) {
     return (err == COUCHSTORE_ERROR_OPEN_FILE ||
             err == COUCHSTORE_ERROR_READ ||
             err == COUCHSTORE_ERROR_WRITE) ? getStrError(db) : "none";
 }
 
+/**
+ * A document body read that waits for the lookup of its batch to finish.
+ */
+struct PendingBodyRead {
+    PendingBodyRead(DocInfo *d, std::list<VBucketBGFetchItem *> *f) :
+        docinfo(d), fetches(f) {}
+
+    bool operator<(const PendingBodyRead &other) const {
+        return docinfo->bp < other.docinfo->bp;
+    }
+
+    DocInfo *docinfo;
+    std::list<VBucketBGFetchItem *> *fetches;
+};
+
 struct GetMultiCbCtx {
-    GetMultiCbCtx(CouchKVStore &c, uint16_t v, vb_bgfetch_queue_t &f) :
-        cks(c), vbId(v), fetches(f) {}
+    GetMultiCbCtx(CouchKVStore &c, uint16_t v, vb_bgfetch_queue_t &f,
+                  bool defer) :
+        cks(c), vbId(v), fetches(f), deferBodies(defer) {}
 
     CouchKVStore &cks;
     uint16_t vbId;
     vb_bgfetch_queue_t &fetches;
+    bool deferBodies;
+    std::vector<PendingBodyRead> bodies;
 };
 
+/**
+ * Copy a DocInfo into memory owned by the caller, to be released with
+ * freeDocInfoCopy().
+ */
+static DocInfo *copyDocInfo(const DocInfo *src) {
+    char *buf = new char[sizeof(DocInfo) + src->id.size + src->rev_meta.size];
+    DocInfo *docinfo = reinterpret_cast<DocInfo *>(buf);
+    *docinfo = *src;
+    docinfo->id.buf = buf + sizeof(DocInfo);
+    memcpy(docinfo->id.buf, src->id.buf, src->id.size);
+    docinfo->rev_meta.buf = docinfo->id.buf + src->id.size;
+    memcpy(docinfo->rev_meta.buf, src->rev_meta.buf, src->rev_meta.size);
+    return docinfo;
+}
+
+static void freeDocInfoCopy(DocInfo *docinfo) {
+    delete [] reinterpret_cast<char *>(docinfo);
+}
+
+/**
+ * Ask the kernel to read ahead the bodies of all documents in the batch,
+ * which must be sorted by file offset. Documents that are close together
+ * are coalesced into one range.
+ */
+static void readAheadBodies(StatFile *file,
+                            const std::vector<PendingBodyRead> &bodies) {
+    cs_off_t start = 0;
+    cs_off_t end = 0;
+    std::vector<PendingBodyRead>::const_iterator it;
+    for (it = bodies.begin(); it != bodies.end(); ++it) {
+        // chunk header and block prefixes add a few bytes to the body
+        cs_off_t bp = static_cast<cs_off_t>(it->docinfo->bp);
+        cs_off_t len = static_cast<cs_off_t>(it->docinfo->size) + 8 +
+                       it->docinfo->size / 4096 + 1;
+        if (it != bodies.begin() && bp <= end) {
+            end = std::max(end, bp + len);
+            continue;
+        }
+        if (it != bodies.begin()) {
+            adviseStatFile(file, start, end - start,
+                           COUCHSTORE_FILE_ADVICE_WILLNEED);
+        }
+        start = bp;
+        end = bp + len;
+    }
+    if (!bodies.empty()) {
+        adviseStatFile(file, start, end - start,
+                       COUCHSTORE_FILE_ADVICE_WILLNEED);
+    }
+}
+
+/**
+ * Ask the kernel to read a range of a database file ahead, for a scan
+ * that is going to continue there.
+ */
+static void readAhead(const std::string &fname, uint64_t offset, size_t len) {
+#ifdef HAVE_POSIX_FADVISE
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(len),
+                  POSIX_FADV_WILLNEED);
+    ::close(fd);
+#else
+    (void)fname;
+    (void)offset;
+    (void)len;
+#endif
+}
+
 struct StatResponseCtx {
 public:
     StatResponseCtx(std::map<std::pair<uint16_t, uint16_t>, vbucket_state> &sm,
@@ -217,6 +315,12 @@ struct LoadResponseCtx {
     uint64_t endSeqno;
     bool keysonly;
     EPStats *stats;
+    // Size limit of the items to load, or 0 for no limit
+    size_t maxBytes;
+    size_t numBytes;
+    // Where the load stopped because of maxBytes
+    uint64_t resumeSeqno;
+    uint64_t resumeOffset;
 };
 
 CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &cb, bool del) :
@@ -273,10 +377,20 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &c
 CouchKVStore::CouchKVStore(EPStats &stats, Configuration &config, bool read_only) :
     KVStore(read_only), epStats(stats), configuration(config),
     dbname(configuration.getDbname()), couchNotifier(NULL), pendingCommitCnt(0),
-    intransaction(false), dbFileRevMapPopulated(false)
+    intransaction(false), groupTransaction(false),
+    dbFileRevMapPopulated(false),
+    dbCacheSize(configuration.getCouchFileCacheSize())
 {
+    coalesceReads = configuration.isCouchCoalesceReads();
     open();
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+#ifdef HAVE_SYNCFS
+    deferredSyncFileOps = getCouchstoreStatsOps(&st.fsStats, true);
+#else
+    // Without syncfs() no single call syncs all files of a group, so
+    // group commits keep couchstore's own per file syncs.
+    deferredSyncFileOps = statCollectingFileOps;
+#endif
 
     // init db file map with default revision number, 1
     numDbFiles = static_cast<uint16_t>(configuration.getMaxVbuckets());
@@ -291,10 +405,17 @@ CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     dbname(copyFrom.dbname),
     couchNotifier(NULL), dbFileRevMap(copyFrom.dbFileRevMap),
     numDbFiles(copyFrom.numDbFiles), pendingCommitCnt(0),
-    intransaction(false), dbFileRevMapPopulated(true)
+    intransaction(false), groupTransaction(false),
+    dbFileRevMapPopulated(true), dbCacheSize(copyFrom.dbCacheSize),
+    coalesceReads(copyFrom.coalesceReads)
 {
     open();
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+#ifdef HAVE_SYNCFS
+    deferredSyncFileOps = getCouchstoreStatsOps(&st.fsStats, true);
+#else
+    deferredSyncFileOps = statCollectingFileOps;
+#endif
 }
 
 void CouchKVStore::reset()
@@ -335,13 +456,14 @@ void CouchKVStore::get(const std::string &key, uint64_t, uint16_t vb,
                        Callback<GetValue> &cb)
 {
     hrtime_t start = gethrtime();
-    Db *db = NULL;
+    CouchDbHandle handle;
     std::string dbFile;
     GetValue rv;
     uint64_t fileRev = dbFileRevMap[vb];
 
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = acquireDB(vb, fileRev, handle,
+                                           COUCHSTORE_OPEN_FLAG_RDONLY);
+    Db *db = handle.db;
     if (errCode != COUCHSTORE_SUCCESS) {
         ++st.numGetFailure;
         LOG(EXTENSION_LOG_WARNING,
@@ -395,7 +517,7 @@ void CouchKVStore::get(const std::string &key, uint64_t, uint16_t vb,
     }
 
     couchstore_free_docinfo(docInfo);
-    closeDatabaseHandle(db);
+    releaseDB(handle);
     rv.setStatus(couchErr2EngineErr(errCode));
     cb.callback(rv);
 }
@@ -406,9 +528,10 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
     int numItems = itms.size();
     uint64_t fileRev = dbFileRevMap[vb];
 
-    Db *db = NULL;
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    CouchDbHandle handle;
+    couchstore_error_t errCode = acquireDB(vb, fileRev, handle,
+                                           COUCHSTORE_OPEN_FLAG_RDONLY);
+    Db *db = handle.db;
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Warning: failed to open database for data fetch, "
@@ -435,9 +558,27 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
         ++idx;
     }
 
-    GetMultiCbCtx ctx(*this, vb, itms);
+    GetMultiCbCtx ctx(*this, vb, itms,
+                      coalesceReads && handle.file && itms.size() > 1);
     errCode = couchstore_docinfos_by_id(db, ids, itms.size(),
                                         0, getMultiCbC, &ctx);
+    if (errCode == COUCHSTORE_SUCCESS && !ctx.bodies.empty()) {
+        // Ask for the whole batch at once, then read it in file order.
+        // The reads are still one pread at a time, but they find the
+        // data on its way into the page cache.
+        std::sort(ctx.bodies.begin(), ctx.bodies.end());
+        readAheadBodies(handle.file, ctx.bodies);
+        st.readQueueDepth.add(ctx.bodies.size());
+        std::vector<PendingBodyRead>::iterator bitr;
+        for (bitr = ctx.bodies.begin(); bitr != ctx.bodies.end(); ++bitr) {
+            completeFetch(db, bitr->docinfo, vb, false, *bitr->fetches);
+        }
+    }
+    std::vector<PendingBodyRead>::iterator bitr;
+    for (bitr = ctx.bodies.begin(); bitr != ctx.bodies.end(); ++bitr) {
+        freeDocInfoCopy(bitr->docinfo);
+    }
+
     if (errCode != COUCHSTORE_SUCCESS) {
         st.numGetFailure.fetch_add(numItems);
         for (itr = itms.begin(); itr != itms.end(); ++itr) {
@@ -453,7 +594,7 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
             }
         }
     }
-    closeDatabaseHandle(db);
+    releaseDB(handle);
     delete []ids;
 }
 
@@ -595,15 +736,6 @@ void CouchKVStore::getPersistedStats(std::map<std::string, std::string> &stats)
     delete[] buffer;
 }
 
-static std::string getDBFileName(const std::string &dbname,
-                                 uint16_t vbid,
-                                 uint64_t rev)
-{
-    std::stringstream ss;
-    ss << dbname << "/" << vbid << ".couch." << rev;
-    return ss.str();
-}
-
 typedef struct {
     uint64_t cas;
     uint32_t expiry;
@@ -964,6 +1096,20 @@ void CouchKVStore::dump(uint16_t vb, uint64_t stSeqno, uint64_t enSeqno,
     loadDB(cb, cl, false, vb, stSeqno, enSeqno);
 }
 
+bool CouchKVStore::dumpBatch(uint16_t vb, uint64_t &stSeqno, uint64_t enSeqno,
+                             size_t maxBytes,
+                             shared_ptr<Callback<GetValue> > cb,
+                             shared_ptr<Callback<CacheLookup> > cl)
+{
+    uint64_t resumeSeqno = loadDB(cb, cl, false, vb, stSeqno, enSeqno,
+                                  COUCHSTORE_NO_OPTIONS, maxBytes);
+    if (resumeSeqno == 0) {
+        return true;
+    }
+    stSeqno = resumeSeqno;
+    return false;
+}
+
 void CouchKVStore::dumpKeys(std::vector<uint16_t> &vbids,  shared_ptr<Callback<GetValue> > cb)
 {
     shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
@@ -993,7 +1139,10 @@ bool CouchKVStore::commit(void)
 {
     assert(!isReadOnly());
     if (intransaction) {
-        intransaction = commit2couchstore() ? false : true;
+        bool success = groupTransaction ? commitGroup2couchstore() :
+                                          commit2couchstore();
+        intransaction = !success;
+        groupTransaction = false;
     }
     return !intransaction;
 
@@ -1009,8 +1158,12 @@ void CouchKVStore::addStats(const std::string &prefix,
     addStat(prefix_str, "backend_type",   "couchstore",       add_stat, c);
     addStat(prefix_str, "open",           st.numOpen,         add_stat, c);
     addStat(prefix_str, "close",          st.numClose,        add_stat, c);
+    addStat(prefix_str, "openTime",       st.openTimeHisto,   add_stat, c);
+    addStat(prefix_str, "fileCacheHits",  st.fileCacheHits,   add_stat, c);
+    addStat(prefix_str, "fileCacheMisses", st.fileCacheMisses, add_stat, c);
     addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
     addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
+    addStat(prefix_str, "readQueueDepth", st.readQueueDepth,  add_stat, c);
     addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
 
     // failure stats
@@ -1042,6 +1195,8 @@ void CouchKVStore::addTimingStats(const std::string &prefix,
     addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
     addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
     addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+    addStat(prefix_str, "itemsPerSync", st.itemsPerSync,    add_stat, c);
+    addStat(prefix_str, "groupCommitSize", st.groupCommitSize, add_stat, c);
 
     // Couchstore file ops stats
     addStat(prefix_str, "fsReadTime",  st.fsStats.readTimeHisto,  add_stat, c);
@@ -1071,11 +1226,16 @@ void CouchKVStore::optimizeWrites(std::vector<queued_item> &items)
     std::sort(items.begin(), items.end(), cq);
 }
 
-void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
-                          shared_ptr<Callback<CacheLookup> > cl,
-                          bool keysOnly, uint16_t vbid,
-                          uint64_t startSeqno, uint64_t endSeqno,
-                          couchstore_docinfos_options options)
+/**
+ * @return the seqno to resume at if the load stopped after maxBytes,
+ *         0 otherwise
+ */
+uint64_t CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
+                              shared_ptr<Callback<CacheLookup> > cl,
+                              bool keysOnly, uint16_t vbid,
+                              uint64_t startSeqno, uint64_t endSeqno,
+                              couchstore_docinfos_options options,
+                              size_t maxBytes)
 {
     if (!dbFileRevMapPopulated) {
         // warmup, first discover db files from local directory
@@ -1084,10 +1244,12 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
         populateFileNameMap(files);
     }
 
-    Db *db = NULL;
+    CouchDbHandle handle;
     uint64_t rev = dbFileRevMap[vbid];
-    couchstore_error_t errorCode = openDB(vbid, rev, &db,
-                                          COUCHSTORE_OPEN_FLAG_RDONLY);
+    uint64_t resumeSeqno = 0;
+    couchstore_error_t errorCode = acquireDB(vbid, rev, handle,
+                                             COUCHSTORE_OPEN_FLAG_RDONLY);
+    Db *db = handle.db;
     if (errorCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Failed to open database, name=%s/%d.couch.%lu",
@@ -1101,10 +1263,20 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
         ctx.callback = cb;
         ctx.lookup = cl;
         ctx.stats = &epStats;
+        ctx.maxBytes = maxBytes;
+        ctx.numBytes = 0;
+        ctx.resumeSeqno = 0;
+        ctx.resumeOffset = 0;
         errorCode = couchstore_changes_since(db, startSeqno, options,
                                              recordDbDumpC,
                                              static_cast<void *>(&ctx));
-        if (errorCode != COUCHSTORE_SUCCESS) {
+        if (errorCode == COUCHSTORE_ERROR_CANCEL && ctx.resumeSeqno != 0) {
+            // Documents are appended in seqno order, so the next batch
+            // mostly lives right behind the last document loaded.
+            resumeSeqno = ctx.resumeSeqno;
+            readAhead(getDBFileName(dbname, vbid, handle.fileRev),
+                      ctx.resumeOffset, maxBytes);
+        } else if (errorCode != COUCHSTORE_SUCCESS) {
             if (errorCode == COUCHSTORE_ERROR_CANCEL) {
                 LOG(EXTENSION_LOG_WARNING,
                     "Canceling loading database, warmup has completed\n");
@@ -1114,16 +1286,19 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb,
                     couchstore_strerror(errorCode),
                     couchkvstore_strerrno(db, errorCode).c_str());
                 remVBucketFromDbFileMap(vbid);
+                handle.cacheable = false;
             }
         }
-        closeDatabaseHandle(db);
+        releaseDB(handle);
     }
+    return resumeSeqno;
 }
 
 void CouchKVStore::open()
 {
     // TODO intransaction, is it needed?
     intransaction = false;
+    groupTransaction = false;
     if (!isReadOnly()) {
         couchNotifier = CouchNotifier::create(epStats, configuration);
     }
@@ -1147,7 +1322,9 @@ void CouchKVStore::open()
 
 void CouchKVStore::close()
 {
+    clearDBCache();
     intransaction = false;
+    groupTransaction = false;
     if (!isReadOnly()) {
         CouchNotifier::deleteNotifier();
     }
@@ -1199,19 +1376,24 @@ void CouchKVStore::updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev)
     }
 
     dbFileRevMap[vbucketId] = newFileRev;
+    evictCachedDB(vbucketId);
 }
 
 couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
                                         uint64_t fileRev,
                                         Db **db,
                                         uint64_t options,
-                                        uint64_t *newFileRev)
+                                        uint64_t *newFileRev,
+                                        const couch_file_ops *ops)
 {
     std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
-    couch_file_ops* ops = &statCollectingFileOps;
+    if (ops == NULL) {
+        ops = &statCollectingFileOps;
+    }
 
     uint64_t newRevNum = fileRev;
     couchstore_error_t errorCode = COUCHSTORE_SUCCESS;
+    hrtime_t start = gethrtime();
 
     if (options == COUCHSTORE_OPEN_FLAG_CREATE) {
         // first try to open the requested file without the create option
@@ -1242,6 +1424,7 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
 
     /* update command statistics */
     st.numOpen++;
+    st.openTimeHisto.add((gethrtime() - start) / 1000);
     if (errorCode) {
         st.numOpenFailure++;
         LOG(EXTENSION_LOG_WARNING, "Warning: couchstore_open_db failed, name=%s"
@@ -1375,6 +1558,21 @@ couchstore_error_t CouchKVStore::fetchDoc(Db *db, DocInfo *docinfo,
     return errCode;
 }
 
+/**
+ * Account for an item passed on by a load, and tell if the load has
+ * reached its size limit.
+ */
+static bool loadIsFull(LoadResponseCtx *ctx, const DocInfo *docinfo,
+                       size_t bytes) {
+    ctx->numBytes += bytes;
+    if (ctx->maxBytes == 0 || ctx->numBytes < ctx->maxBytes) {
+        return false;
+    }
+    ctx->resumeSeqno = docinfo->db_seq + 1;
+    ctx->resumeOffset = docinfo->bp + docinfo->size;
+    return true;
+}
+
 int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
 {
     LoadResponseCtx *loadCtx = (LoadResponseCtx *)ctx;
@@ -1403,6 +1601,10 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
     CacheLookup lookup(docKey, byseqno, vbucketId);
     cl->callback(lookup);
     if (cl->getStatus() == ENGINE_KEY_EEXISTS) {
+        // The resident item shares its value with the hash table.
+        if (loadIsFull(loadCtx, docinfo, sizeof(Item) + key.size)) {
+            return COUCHSTORE_ERROR_CANCEL;
+        }
         return COUCHSTORE_SUCCESS;
     }
 
@@ -1444,12 +1646,14 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
         it->setDeleted();
     }
 
+    size_t itemSize = it->size();
     GetValue rv(it, ENGINE_SUCCESS, -1, loadCtx->keysonly);
     cb->callback(rv);
 
     couchstore_free_document(doc);
 
-    if (cb->getStatus() == ENGINE_ENOMEM) {
+    if (cb->getStatus() == ENGINE_ENOMEM ||
+        loadIsFull(loadCtx, docinfo, itemSize)) {
         return COUCHSTORE_ERROR_CANCEL;
     }
     return COUCHSTORE_SUCCESS;
@@ -1487,6 +1691,8 @@ bool CouchKVStore::commit2couchstore(void)
             "Warning: commit failed, cannot save CouchDB docs "
             "for vbucket = %d rev = %llu\n", vbucket2flush, fileRev);
         ++epStats.commitFailed;
+    } else {
+        st.itemsPerSync.add(reqIndex);
     }
     commitCallback(committedReqs, reqIndex, errCode);
 
@@ -1501,6 +1707,222 @@ bool CouchKVStore::commit2couchstore(void)
     return success;
 }
 
+/**
+ * The part of a group commit that goes to one vbucket file.
+ */
+struct VBucketCommit {
+    VBucketCommit(uint16_t vb, uint64_t rev, size_t idx) :
+        vbid(vb), fileRev(rev), newFileRev(rev), first(idx), count(0),
+        db(NULL), errCode(COUCHSTORE_SUCCESS) { }
+
+    uint16_t vbid;
+    uint64_t fileRev;
+    uint64_t newFileRev;
+    size_t first;
+    size_t count;
+    Db *db;
+    couchstore_error_t errCode;
+};
+
+bool CouchKVStore::commitGroup2couchstore(void)
+{
+    if (pendingCommitCnt == 0) {
+        return true;
+    }
+
+    size_t numReqs = pendingReqsQ.size();
+    CouchRequest **committedReqs = new CouchRequest *[numReqs];
+    Doc **docs = new Doc *[numReqs];
+    DocInfo **docinfos = new DocInfo *[numReqs];
+
+    // The flusher queues one vbucket after the other, so each vbucket's
+    // requests are next to each other.
+    std::vector<VBucketCommit> vbs;
+    for (size_t i = 0; i < numReqs; ++i) {
+        CouchRequest *req = pendingReqsQ[i];
+        assert(req);
+        committedReqs[i] = req;
+        docs[i] = req->getDbDoc();
+        docinfos[i] = req->getDbDocInfo();
+        if (vbs.empty() || vbs.back().vbid != req->getVBucketId()) {
+            vbs.push_back(VBucketCommit(req->getVBucketId(),
+                                        req->getRevNum(), i));
+        }
+        ++vbs.back().count;
+    }
+
+    std::vector<VBucketCommit>::iterator it;
+    uint64_t flags = COMPRESS_DOC_BODIES | COUCHSTORE_SEQUENCE_AS_IS;
+
+    // Write the documents of all vbuckets, then sync them all at once.
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        it->errCode = openDB(it->vbid, it->fileRev, &it->db, 0,
+                             &it->newFileRev, &deferredSyncFileOps);
+        if (it->errCode != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to open database, vbucketId = %d "
+                "fileRev = %llu numDocs = %d", it->vbid, it->fileRev,
+                static_cast<int>(it->count));
+            it->db = NULL;
+            continue;
+        }
+
+        int count = static_cast<int>(it->count);
+        it->errCode = updateMaxDeletedSeqno(it->db, it->vbid,
+                                            docinfos + it->first, count);
+        if (it->errCode == COUCHSTORE_SUCCESS) {
+            hrtime_t cs_begin = gethrtime();
+            it->errCode = couchstore_save_documents(it->db, docs + it->first,
+                                                    docinfos + it->first,
+                                                    count, flags);
+            st.saveDocsHisto.add((gethrtime() - cs_begin) / 1000);
+            if (it->errCode != COUCHSTORE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to save docs to database, numDocs = %d "
+                    "error=%s [%s]\n", count,
+                    couchstore_strerror(it->errCode),
+                    couchkvstore_strerrno(it->db, it->errCode).c_str());
+            }
+        }
+        if (it->errCode != COUCHSTORE_SUCCESS) {
+            closeDatabaseHandle(it->db);
+            it->db = NULL;
+        }
+    }
+    bool synced = syncDataDir();
+
+    // The headers only go out once the data they point to is on disk.
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        if (!it->db) {
+            continue;
+        }
+        if (synced) {
+            hrtime_t cs_begin = gethrtime();
+            it->errCode = couchstore_commit(it->db);
+            st.commitHisto.add((gethrtime() - cs_begin) / 1000);
+            if (it->errCode) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: couchstore_commit failed, error=%s [%s]",
+                    couchstore_strerror(it->errCode),
+                    couchkvstore_strerrno(it->db, it->errCode).c_str());
+            }
+        } else {
+            it->errCode = COUCHSTORE_ERROR_WRITE;
+        }
+        if (it->errCode != COUCHSTORE_SUCCESS) {
+            closeDatabaseHandle(it->db);
+            it->db = NULL;
+        }
+    }
+    synced = syncDataDir();
+
+    size_t docsCommitted = 0;
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        if (!it->db) {
+            continue;
+        }
+        if (!synced) {
+            it->errCode = COUCHSTORE_ERROR_WRITE;
+            closeDatabaseHandle(it->db);
+            continue;
+        }
+        if (epStats.isShutdown) {
+            closeDatabaseHandle(it->db);
+            docsCommitted += it->count;
+            continue;
+        }
+
+        RememberingCallback<uint16_t> cb;
+        uint64_t newHeaderPos = couchstore_get_header_position(it->db);
+        couchNotifier->notify_headerpos_update(it->vbid, it->newFileRev,
+                                               newHeaderPos, cb);
+        if (cb.val == PROTOCOL_BINARY_RESPONSE_ETMPFAIL) {
+            // The file was compacted under us; write the docs again to
+            // the new file the way a single vbucket commit does.
+            closeDatabaseHandle(it->db);
+            LOG(EXTENSION_LOG_WARNING,
+                "Retry notify CouchDB of update, vbucket=%d rev=%llu\n",
+                it->vbid, it->newFileRev);
+            std::string dbFileName = getDBFileName(dbname, it->vbid,
+                                                   it->newFileRev);
+            ++st.numCommitRetry;
+            hrtime_t retry_begin = gethrtime();
+            it->errCode = saveDocs(it->vbid, checkNewRevNum(dbFileName),
+                                   docs + it->first, docinfos + it->first,
+                                   static_cast<int>(it->count));
+            st.commitRetryHisto.add((gethrtime() - retry_begin) / 1000);
+        } else {
+            if (cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify "
+                    "CouchDB of update for vbucket=%d, error=0x%x\n",
+                    it->vbid, cb.val);
+            }
+            st.batchSize.add(it->count);
+            DbInfo info;
+            couchstore_db_info(it->db, &info);
+            cachedDeleteCount[it->vbid] = info.deleted_count;
+            cachedDocCount[it->vbid] = info.doc_count;
+            closeDatabaseHandle(it->db);
+        }
+        if (it->errCode == COUCHSTORE_SUCCESS) {
+            docsCommitted += it->count;
+        }
+    }
+    st.docsCommitted = docsCommitted;
+    st.itemsPerSync.add(docsCommitted);
+    st.groupCommitSize.add(vbs.size());
+
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        if (it->errCode) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: commit failed, cannot save CouchDB docs "
+                "for vbucket = %d rev = %llu\n", it->vbid, it->fileRev);
+            ++epStats.commitFailed;
+        }
+        commitCallback(committedReqs + it->first,
+                       static_cast<int>(it->count), it->errCode);
+    }
+
+    // clean up
+    pendingReqsQ.clear();
+    pendingCommitCnt = 0;
+    for (size_t i = 0; i < numReqs; ++i) {
+        delete committedReqs[i];
+    }
+    delete [] committedReqs;
+    delete [] docs;
+    delete [] docinfos;
+    return true;
+}
+
+bool CouchKVStore::syncDataDir(void)
+{
+#ifdef HAVE_SYNCFS
+    // One syncfs() covers the files of every vbucket in the group. It
+    // syncs the whole filesystem holding the data directory, so anything
+    // else written to that filesystem (other buckets, logs) is flushed
+    // and waited for as well. Keep the data directory on a filesystem of
+    // its own when enabling group commits.
+    int fd = ::open(dbname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to open data directory "
+            "%s to sync it: %s", dbname.c_str(), strerror(errno));
+        return false;
+    }
+    hrtime_t begin = gethrtime();
+    int rv = syncfs(fd);
+    st.fsStats.syncTimeHisto.add((gethrtime() - begin) / 1000);
+    if (rv == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to sync data directory "
+            "%s: %s", dbname.c_str(), strerror(errno));
+    }
+    ::close(fd);
+    return rv == 0;
+#else
+    return true;
+#endif
+}
+
 couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
                                           DocInfo **docinfos, int docCount)
 {
@@ -1512,34 +1934,22 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
     assert(fileRev);
 
     do {
-        Db *db = NULL;
+        CouchDbHandle handle;
         uint64_t newFileRev;
         retry_save_docs = false;
-        errCode = openDB(vbid, fileRev, &db, 0, &newFileRev);
+        errCode = acquireDB(vbid, fileRev, handle, 0, &newFileRev);
+        Db *db = handle.db;
         if (errCode != COUCHSTORE_SUCCESS) {
             LOG(EXTENSION_LOG_WARNING,
                 "Warning: failed to open database, vbucketId = %d "
                 "fileRev = %llu numDocs = %d", vbid, fileRev, docCount);
             return errCode;
         } else {
-            uint64_t max = computeMaxDeletedSeqNum(docinfos, docCount);
-
-            // update max_deleted_seq in the local doc (vbstate)
-            // before save docs for the given vBucket
-            if (max > 0) {
-                vbucket_map_t::iterator it =
-                    cachedVBStates.find(vbid);
-                if (it != cachedVBStates.end() && it->second.maxDeletedSeqno < max) {
-                    it->second.maxDeletedSeqno = max;
-                    errCode = saveVBState(db, it->second);
-                    if (errCode != COUCHSTORE_SUCCESS) {
-                        LOG(EXTENSION_LOG_WARNING,
-                            "Warning: failed to save local doc for, "
-                            "vBucket = %d numDocs = %d\n", vbid, docCount);
-                        closeDatabaseHandle(db);
-                        return errCode;
-                    }
-                }
+            errCode = updateMaxDeletedSeqno(db, vbid, docinfos, docCount);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                handle.cacheable = false;
+                releaseDB(handle);
+                return errCode;
             }
 
             hrtime_t cs_begin = gethrtime();
@@ -1552,7 +1962,8 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
                     "Warning: failed to save docs to database, numDocs = %d "
                     "error=%s [%s]\n", docCount, couchstore_strerror(errCode),
                     couchkvstore_strerrno(db, errCode).c_str());
-                closeDatabaseHandle(db);
+                handle.cacheable = false;
+                releaseDB(handle);
                 return errCode;
             }
 
@@ -1564,14 +1975,15 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
                     "Warning: couchstore_commit failed, error=%s [%s]",
                     couchstore_strerror(errCode),
                     couchkvstore_strerrno(db, errCode).c_str());
-                closeDatabaseHandle(db);
+                handle.cacheable = false;
+                releaseDB(handle);
                 return errCode;
             }
 
             if (epStats.isShutdown) {
                 // shutdown is in progress, no need to notify mccouch
                 // the compactor must have already exited!
-                closeDatabaseHandle(db);
+                releaseDB(handle, true);
                 break;
             }
 
@@ -1586,6 +1998,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
                     std::string dbFileName = getDBFileName(dbname, vbid, newFileRev);
                     fileRev = checkNewRevNum(dbFileName);
                     retry_save_docs = true;
+                    handle.cacheable = false;
                     ++st.numCommitRetry;
                     if (!retried) {
                         retry_begin = gethrtime();
@@ -1605,7 +2018,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
                 cachedDeleteCount[vbid] = info.deleted_count;
                 cachedDocCount[vbid] = info.doc_count;
             }
-            closeDatabaseHandle(db);
+            releaseDB(handle, true);
         }
     } while (retry_save_docs);
 
@@ -1622,7 +2035,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
 
 void CouchKVStore::queueItem(CouchRequest *req)
 {
-    if (pendingCommitCnt &&
+    if (!groupTransaction && pendingCommitCnt &&
         pendingReqsQ.front()->getVBucketId() != req->getVBucketId()) {
         // got new request for a different vb, commit pending
         // pending requests of the current vb firt
@@ -1643,6 +2056,7 @@ void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId)
 
     // just reset revision number of the requested vbucket
     dbFileRevMap[vbucketId] = 1;
+    evictCachedDB(vbucketId);
 }
 
 void CouchKVStore::commitCallback(CouchRequest **committedReqs, int numReqs,
@@ -1758,14 +2172,36 @@ couchstore_error_t CouchKVStore::saveVBState(Db *db, vbucket_state &vbState)
     return errCode;
 }
 
+couchstore_error_t CouchKVStore::updateMaxDeletedSeqno(Db *db, uint16_t vbid,
+                                                       DocInfo **docinfos,
+                                                       int docCount)
+{
+    uint64_t max = computeMaxDeletedSeqNum(docinfos, docCount);
+
+    // update max_deleted_seq in the local doc (vbstate)
+    // before save docs for the given vBucket
+    if (max > 0) {
+        vbucket_map_t::iterator it = cachedVBStates.find(vbid);
+        if (it != cachedVBStates.end() && it->second.maxDeletedSeqno < max) {
+            it->second.maxDeletedSeqno = max;
+            couchstore_error_t errCode = saveVBState(db, it->second);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to save local doc for, "
+                    "vBucket = %d numDocs = %d\n", vbid, docCount);
+                return errCode;
+            }
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
 {
     assert(docinfo);
     std::string keyStr(docinfo->id.buf, docinfo->id.size);
     assert(ctx);
     GetMultiCbCtx *cbCtx = static_cast<GetMultiCbCtx *>(ctx);
-    CouchKVStoreStats &st = cbCtx->cks.getCKVStoreStat();
-
 
     vb_bgfetch_queue_t::iterator qitr = cbCtx->fetches.find(keyStr);
     if (qitr == cbCtx->fetches.end()) {
@@ -1788,18 +2224,35 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
         }
     }
 
+    if (cbCtx->deferBodies && !meta_only) {
+        // read the body with the rest of the batch once the lookup is done
+        cbCtx->bodies.push_back(PendingBodyRead(copyDocInfo(docinfo),
+                                                &fetches));
+        return 0;
+    }
+
+    cbCtx->cks.completeFetch(db, docinfo, cbCtx->vbId, meta_only, fetches);
+    return 0;
+}
+
+void CouchKVStore::completeFetch(Db *db, DocInfo *docinfo, uint16_t vbId,
+                                 bool metaOnly,
+                                 std::list<VBucketBGFetchItem *> &fetches)
+{
     GetValue returnVal;
-    couchstore_error_t errCode = cbCtx->cks.fetchDoc(db, docinfo, returnVal,
-                                                     cbCtx->vbId, meta_only);
+    couchstore_error_t errCode = fetchDoc(db, docinfo, returnVal, vbId,
+                                          metaOnly);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING, "Warning: failed to fetch data from database, "
-            "vBucket=%d key=%s error=%s [%s]", cbCtx->vbId,
-            keyStr.c_str(), couchstore_strerror(errCode),
+            "vBucket=%d key=%.*s error=%s [%s]", vbId,
+            (int)docinfo->id.size, docinfo->id.buf,
+            couchstore_strerror(errCode),
             couchkvstore_strerrno(db, errCode).c_str());
         st.numGetFailure++;
     }
 
-    returnVal.setStatus(cbCtx->cks.couchErr2EngineErr(errCode));
+    returnVal.setStatus(couchErr2EngineErr(errCode));
+    std::list<VBucketBGFetchItem *>::iterator itr;
     for (itr = fetches.begin(); itr != fetches.end(); ++itr) {
         // populate return value for remaining fetch items with the
         // same seqid
@@ -1810,7 +2263,6 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx)
                                  returnVal.getValue()->getNBytes());
         }
     }
-    return 0;
 }
 
 
@@ -1824,6 +2276,146 @@ void CouchKVStore::closeDatabaseHandle(Db *db) {
     st.numClose++;
 }
 
+static bool statDbFile(const std::string &fname, uint64_t &inode,
+                       uint64_t &size) {
+    struct stat fst;
+    if (stat(fname.c_str(), &fst) != 0) {
+        return false;
+    }
+    inode = static_cast<uint64_t>(fst.st_ino);
+    size = static_cast<uint64_t>(fst.st_size);
+    return true;
+}
+
+couchstore_error_t CouchKVStore::acquireDB(uint16_t vbid, uint64_t fileRev,
+                                           CouchDbHandle &handle,
+                                           uint64_t options,
+                                           uint64_t *newFileRev)
+{
+    bool writable = !(options & COUCHSTORE_OPEN_FLAG_RDONLY);
+    // Every commit appends a new header, and compaction or vbucket
+    // deletion replace the file, so a handle is current as long as the
+    // file has the same inode and size it had when the handle was opened.
+    // The stat is taken before the open: a commit racing with it only
+    // makes the next lookup miss.
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    bool exists = statDbFile(getDBFileName(dbname, vbid, fileRev),
+                             inode, size);
+
+    CouchDbHandle cached;
+    if (dbCacheSize > 0) {
+        LockHolder lh(dbCacheMutex);
+        std::map<uint16_t, db_handle_list_t::iterator>::iterator it =
+            dbCacheIndex.find(vbid);
+        if (it != dbCacheIndex.end()) {
+            cached = *it->second;
+            dbCacheLru.erase(it->second);
+            dbCacheIndex.erase(it);
+        }
+    }
+
+    if (cached.db) {
+        if (exists && cached.fileRev == fileRev && cached.inode == inode &&
+            cached.size == size && (cached.writable || !writable)) {
+            ++st.fileCacheHits;
+            handle = cached;
+            if (newFileRev != NULL) {
+                *newFileRev = fileRev;
+            }
+            return COUCHSTORE_SUCCESS;
+        }
+        closeDatabaseHandle(cached.db);
+    }
+    if (dbCacheSize > 0) {
+        ++st.fileCacheMisses;
+    }
+
+    uint64_t openedRev = fileRev;
+    takeLastOpenedStatFile();
+    couchstore_error_t errCode = openDB(vbid, fileRev, &handle.db, options,
+                                        &openedRev);
+    if (errCode == COUCHSTORE_SUCCESS) {
+        handle.file = takeLastOpenedStatFile();
+        handle.vbid = vbid;
+        handle.fileRev = openedRev;
+        handle.inode = inode;
+        handle.size = size;
+        handle.writable = writable;
+        // a handle to a file we did not stat can't be validated later
+        handle.cacheable = dbCacheSize > 0 && exists && openedRev == fileRev;
+    }
+    if (newFileRev != NULL) {
+        *newFileRev = openedRev;
+    }
+    return errCode;
+}
+
+void CouchKVStore::releaseDB(CouchDbHandle &handle, bool wrote)
+{
+    if (handle.db == NULL) {
+        return;
+    }
+
+    bool keep = handle.cacheable &&
+                handle.fileRev == dbFileRevMap[handle.vbid];
+    if (keep && wrote) {
+        // the handle now holds the header it just wrote
+        keep = statDbFile(getDBFileName(dbname, handle.vbid, handle.fileRev),
+                          handle.inode, handle.size);
+    }
+
+    Db *toClose = handle.db;
+    if (keep) {
+        LockHolder lh(dbCacheMutex);
+        if (dbCacheIndex.find(handle.vbid) == dbCacheIndex.end()) {
+            dbCacheLru.push_front(handle);
+            dbCacheIndex[handle.vbid] = dbCacheLru.begin();
+            toClose = NULL;
+            if (dbCacheLru.size() > dbCacheSize) {
+                toClose = dbCacheLru.back().db;
+                dbCacheIndex.erase(dbCacheLru.back().vbid);
+                dbCacheLru.pop_back();
+            }
+        }
+    }
+    if (toClose) {
+        closeDatabaseHandle(toClose);
+    }
+    handle.db = NULL;
+}
+
+void CouchKVStore::evictCachedDB(uint16_t vbid)
+{
+    Db *toClose = NULL;
+    {
+        LockHolder lh(dbCacheMutex);
+        std::map<uint16_t, db_handle_list_t::iterator>::iterator it =
+            dbCacheIndex.find(vbid);
+        if (it == dbCacheIndex.end()) {
+            return;
+        }
+        toClose = it->second->db;
+        dbCacheLru.erase(it->second);
+        dbCacheIndex.erase(it);
+    }
+    closeDatabaseHandle(toClose);
+}
+
+void CouchKVStore::clearDBCache(void)
+{
+    db_handle_list_t handles;
+    {
+        LockHolder lh(dbCacheMutex);
+        handles.swap(dbCacheLru);
+        dbCacheIndex.clear();
+    }
+    db_handle_list_t::iterator it;
+    for (it = handles.begin(); it != handles.end(); ++it) {
+        closeDatabaseHandle(it->db);
+    }
+}
+
 ENGINE_ERROR_CODE CouchKVStore::couchErr2EngineErr(couchstore_error_t errCode)
 {
     switch (errCode) {
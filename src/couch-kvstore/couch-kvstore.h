@@ -21,6 +21,7 @@
 #include "config.h"
 #include "libcouchstore/couch_db.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
@@ -31,6 +32,7 @@
 #include "histo.h"
 #include "item.h"
 #include "kvstore.h"
+#include "mutex.h"
 #include "stats.h"
 #include "tasks.h"
 
@@ -49,6 +51,7 @@ public:
       docsCommitted(0), numOpen(0), numClose(0),
       numLoadedVb(0), numGetFailure(0), numSetFailure(0),
       numDelFailure(0), numOpenFailure(0), numVbSetFailure(0),
+      fileCacheHits(0), fileCacheMisses(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
       writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
     }
@@ -64,9 +67,13 @@ public:
         numOpenFailure.store(0);
         numVbSetFailure.store(0);
         numCommitRetry.store(0);
+        fileCacheHits.store(0);
+        fileCacheMisses.store(0);
 
+        openTimeHisto.reset();
         readTimeHisto.reset();
         readSizeHisto.reset();
+        readQueueDepth.reset();
         writeTimeHisto.reset();
         writeSizeHisto.reset();
         delTimeHisto.reset();
@@ -75,6 +82,8 @@ public:
         commitRetryHisto.reset();
         saveDocsHisto.reset();
         batchSize.reset();
+        itemsPerSync.reset();
+        groupCommitSize.reset();
         fsStats.reset();
     }
 
@@ -95,13 +104,21 @@ public:
     Atomic<size_t> numVbSetFailure;
     Atomic<size_t> numCommitRetry;
 
+    // the number of database handles served from / missing in the cache
+    Atomic<size_t> fileCacheHits;
+    Atomic<size_t> fileCacheMisses;
+
     /* for flush and vb delete, no error handling in CouchKVStore, such
      * failure should be tracked in MC-engine  */
 
+    // How long it takes us to open a database file
+    Histogram<hrtime_t> openTimeHisto;
     // How long it takes us to complete a read
     Histogram<hrtime_t> readTimeHisto;
     // How big are our reads?
     Histogram<size_t> readSizeHisto;
+    // Document reads of a batch requested from the disk at once
+    Histogram<size_t> readQueueDepth;
     // How long it takes us to complete a write
     Histogram<hrtime_t> writeTimeHisto;
     // How big are our writes?
@@ -118,6 +135,10 @@ public:
     Histogram<hrtime_t> saveDocsHisto;
     // Batch size of saveDocs calls
     Histogram<size_t> batchSize;
+    // Docs made durable by one commit, across all its vbuckets
+    Histogram<size_t> itemsPerSync;
+    // Vbuckets written by one group commit
+    Histogram<size_t> groupCommitSize;
 
     // Stats from the underlying OS file operations done by couchstore.
     CouchstoreStats fsStats;
@@ -258,6 +279,27 @@ private :
     hrtime_t start;
 };
 
+/**
+ * An open vbucket database file, either taken from the open file cache or
+ * freshly opened. The inode and size of the file when its header was read
+ * tell whether the handle still sees the latest commit.
+ */
+struct CouchDbHandle {
+    CouchDbHandle() :
+        db(NULL), file(NULL), vbid(0), fileRev(0), inode(0), size(0),
+        writable(false), cacheable(false) { }
+
+    Db *db;
+    //! The file under db, if it was opened through the stats file ops.
+    StatFile *file;
+    uint16_t vbid;
+    uint64_t fileRev;
+    uint64_t inode;
+    uint64_t size;
+    bool writable;
+    bool cacheable;
+};
+
 /**
  * KVStore with couchstore as the underlying storage system
  */
@@ -302,6 +344,19 @@ public:
         return intransaction;
     }
 
+    /**
+     * Begin a transaction that keeps the writes to several vbuckets
+     * until commit(), which syncs them all at once.
+     *
+     * @return true if the transaction is started successfully
+     */
+    bool beginGroup(void) {
+        assert(!isReadOnly());
+        intransaction = true;
+        groupTransaction = true;
+        return intransaction;
+    }
+
     /**
      * Commit a transaction (unless not currently in one).
      *
@@ -317,6 +372,7 @@ public:
         if (intransaction) {
             intransaction = false;
         }
+        groupTransaction = false;
     }
 
     /**
@@ -435,6 +491,23 @@ public:
               shared_ptr<Callback<GetValue> > cb,
               shared_ptr<Callback<CacheLookup> > cl);
 
+    /**
+     * Retrieve the documents of a vbucket in seqno order, stopping after
+     * about maxBytes of items. The file is read ahead from where the
+     * batch stopped, so the next batch finds its documents cached.
+     *
+     * @param vb vbucket id
+     * @param stSeqno seqno to start at; set to the seqno to resume at
+     * @param maxBytes the size of the items to load in this batch
+     * @param cb callback instance to process each document retrieved
+     * @param cl callback to see if we need to read the value from disk
+     * @return true if all documents up to enSeqno were retrieved
+     */
+    bool dumpBatch(uint16_t vb, uint64_t &stSeqno, uint64_t enSeqno,
+                   size_t maxBytes,
+                   shared_ptr<Callback<GetValue> > cb,
+                   shared_ptr<Callback<CacheLookup> > cl);
+
     /**
      * Retrieve all the keys from the underlying storage system.
      *
@@ -528,11 +601,12 @@ public:
     CouchKVStoreStats &getCKVStoreStat(void) { return st; }
 
 protected:
-    void loadDB(shared_ptr<Callback<GetValue> > cb,
-                shared_ptr<Callback<CacheLookup> > cl,
-                bool keysOnly, uint16_t vbid,
-                uint64_t startSeqno, uint64_t endSeqno,
-                couchstore_docinfos_options options=COUCHSTORE_NO_OPTIONS);
+    uint64_t loadDB(shared_ptr<Callback<GetValue> > cb,
+                    shared_ptr<Callback<CacheLookup> > cl,
+                    bool keysOnly, uint16_t vbid,
+                    uint64_t startSeqno, uint64_t endSeqno,
+                    couchstore_docinfos_options options=COUCHSTORE_NO_OPTIONS,
+                    size_t maxBytes=0);
     bool setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
                          uint32_t vb_change_type, bool notify = true);
     bool resetVBucket(uint16_t vbucketId, vbucket_state &vbstate) {
@@ -562,6 +636,8 @@ private:
     void open();
     void close();
     bool commit2couchstore(void);
+    bool commitGroup2couchstore(void);
+    bool syncDataDir(void);
     void queueItem(CouchRequest *req);
 
     uint64_t checkNewRevNum(std::string &dbname, bool newFile = false);
@@ -569,7 +645,8 @@ private:
     void remVBucketFromDbFileMap(uint16_t vbucketId);
     void updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev);
     couchstore_error_t openDB(uint16_t vbucketId, uint64_t fileRev, Db **db,
-                              uint64_t options, uint64_t *newFileRev = NULL);
+                              uint64_t options, uint64_t *newFileRev = NULL,
+                              const couch_file_ops *ops = NULL);
     couchstore_error_t openDB_retry(std::string &dbfile, uint64_t options,
                                     const couch_file_ops *ops,
                                     Db **db, uint64_t *newFileRev);
@@ -578,9 +655,53 @@ private:
     void commitCallback(CouchRequest **committedReqs, int numReqs,
                         couchstore_error_t errCode);
     couchstore_error_t saveVBState(Db *db, vbucket_state &vbState);
+    couchstore_error_t updateMaxDeletedSeqno(Db *db, uint16_t vbid,
+                                             DocInfo **docinfos, int docCount);
     void setDocsCommitted(uint16_t docs);
     void closeDatabaseHandle(Db *db);
 
+    /**
+     * Read one document of a getMulti batch and hand the result to all
+     * fetches waiting for it.
+     */
+    void completeFetch(Db *db, DocInfo *docinfo, uint16_t vbId,
+                       bool metaOnly,
+                       std::list<VBucketBGFetchItem *> &fetches);
+
+    /**
+     * Get an open handle to a vbucket database file, reusing a cached one
+     * if the file has not changed since it was opened.
+     *
+     * @param vbid the vbucket to open
+     * @param fileRev the file revision to open
+     * @param handle filled in with the open database
+     * @param options COUCHSTORE_OPEN_FLAG_RDONLY or 0 for a writable handle
+     * @param newFileRev set to the revision actually opened
+     * @return the couchstore error of the open
+     */
+    couchstore_error_t acquireDB(uint16_t vbid, uint64_t fileRev,
+                                 CouchDbHandle &handle, uint64_t options,
+                                 uint64_t *newFileRev = NULL);
+
+    /**
+     * Give back a handle from acquireDB. It is kept in the open file cache
+     * if possible and closed otherwise.
+     *
+     * @param handle the handle to release
+     * @param wrote true if a commit was written through the handle
+     */
+    void releaseDB(CouchDbHandle &handle, bool wrote = false);
+
+    /**
+     * Close the cached handle of the given vbucket, if any.
+     */
+    void evictCachedDB(uint16_t vbid);
+
+    /**
+     * Close all cached handles.
+     */
+    void clearDBCache(void);
+
     EPStats &epStats;
     Configuration &configuration;
     const std::string dbname;
@@ -590,17 +711,29 @@ private:
     std::vector<CouchRequest *> pendingReqsQ;
     size_t pendingCommitCnt;
     bool intransaction;
+    bool groupTransaction;
     bool dbFileRevMapPopulated;
 
     /* all stats */
     CouchKVStoreStats   st;
     couch_file_ops statCollectingFileOps;
+    /* file ops for group commits, which sync the data dir themselves */
+    couch_file_ops deferredSyncFileOps;
     /* vbucket state cache*/
     vbucket_map_t cachedVBStates;
     /* deleted docs in each file*/
     std::map<uint16_t, size_t> cachedDeleteCount;
     /* non-deleted docs in each file */
     unordered_map<uint16_t, size_t> cachedDocCount;
+
+    /* open file cache, most recently used first */
+    typedef std::list<CouchDbHandle> db_handle_list_t;
+    Mutex dbCacheMutex;
+    db_handle_list_t dbCacheLru;
+    std::map<uint16_t, db_handle_list_t::iterator> dbCacheIndex;
+    size_t dbCacheSize;
+    /* read ahead the documents of a getMulti batch together */
+    bool coalesceReads;
 };
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_KVSTORE_H_
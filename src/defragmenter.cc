@@ -0,0 +1,60 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "defragmenter.h"
+#include "ep.h"
+#include "ep_engine.h"
+#include "slab_allocator.h"
+#include "stored-value.h"
+
+DefragmenterTask::DefragmenterTask(EventuallyPersistentStore *s,
+                                   double sleepTime) :
+    GlobalTask(&s->getEPEngine(), Priority::DefragmenterPriority, sleepTime,
+               false),
+    store(s) {}
+
+bool DefragmenterTask::run(void) {
+    EventuallyPersistentEngine &engine = store->getEPEngine();
+    Configuration &config = engine.getConfiguration();
+    SlabAllocator *allocator = engine.getSlabAllocator();
+
+    // Warmup and the access log harvesting that follows it look at
+    // StoredValues without holding their bucket lock.
+    if (store->isWarmingUp()) {
+        snooze(static_cast<double>(config.getDefragmenterStime()), false);
+        return true;
+    }
+
+    EPStats &stats = engine.getEpStats();
+    double maxUsage = config.getDefragmenterSlabPcnt() / 100.0;
+    if (allocator->startDefragment(maxUsage) > 0) {
+        const VBucketMap &vbMap = store->getVBuckets();
+        for (size_t i = 0; i < vbMap.getSize(); ++i) {
+            RCPtr<VBucket> vb = vbMap.getBucket(static_cast<uint16_t>(i));
+            if (vb) {
+                stats.defragNumMoved.fetch_add(vb->ht.defragment());
+            }
+        }
+    }
+    // Also picks up slabs that emptied out on their own since last time.
+    stats.defragNumSlabsFreed.fetch_add(allocator->finishDefragment());
+
+    snooze(static_cast<double>(config.getDefragmenterStime()), false);
+    return true;
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_DEFRAGMENTER_H_
+#define SRC_DEFRAGMENTER_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "scheduler.h"
+
+class EventuallyPersistentStore;
+
+/**
+ * Periodically move items out of sparsely used slabs so the slab
+ * allocator can give those slabs back.
+ */
+class DefragmenterTask : public GlobalTask {
+public:
+
+    DefragmenterTask(EventuallyPersistentStore *s, double sleepTime);
+
+    bool run(void);
+
+    std::string getDescription() {
+        return std::string("Defragmenting slab memory.");
+    }
+
+private:
+    EventuallyPersistentStore *store;
+};
+
+#endif  // SRC_DEFRAGMENTER_H_
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -31,6 +32,7 @@
 
 #include "access_scanner.h"
 #include "checkpoint_remover.h"
+#include "defragmenter.h"
 #include "ep.h"
 #include "ep_engine.h"
 #include "flusher.h"
@@ -104,6 +106,20 @@ public:
             store.getEPEngine().getTapThrottle().setQueueCap(value);
         } else if (key.compare("tap_throttle_cap_pcnt") == 0) {
             store.getEPEngine().getTapThrottle().setCapPercent(value);
+        } else if (key.compare("flusher_group_commit_max_items") == 0) {
+            store.setGroupCommitMaxItems(value);
+        } else if (key.compare("flusher_group_commit_max_latency") == 0) {
+            store.setGroupCommitMaxLatency(value);
+        } else {
+            LOG(EXTENSION_LOG_WARNING,
+                "Failed to change value for unknown variable, %s\n",
+                key.c_str());
+        }
+    }
+
+    virtual void booleanValueChanged(const std::string &key, bool value) {
+        if (key.compare("flusher_group_commit") == 0) {
+            store.setGroupCommit(value);
         } else {
             LOG(EXTENSION_LOG_WARNING,
                 "Failed to change value for unknown variable, %s\n",
@@ -180,12 +196,12 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
         accessLog.push_back(shardlog);
     }
 
-    storageProperties = new StorageProperties(true, true, true, true);
-
     ExecutorPool::get()->registerBucket(ObjectRegistry::getCurrentEngine());
 
     auxUnderlying = KVStoreFactory::create(stats, config, true);
     assert(auxUnderlying);
+    storageProperties =
+        new StorageProperties(auxUnderlying->getStorageProperties());
 
     stats.memOverhead = sizeof(EventuallyPersistentStore);
 
@@ -201,6 +217,16 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
     config.addValueChangedListener("max_txn_size",
                                    new EPStoreValueChangeListener(*this));
 
+    setGroupCommit(config.isFlusherGroupCommit());
+    config.addValueChangedListener("flusher_group_commit",
+                                   new EPStoreValueChangeListener(*this));
+    setGroupCommitMaxItems(config.getFlusherGroupCommitMaxItems());
+    config.addValueChangedListener("flusher_group_commit_max_items",
+                                   new EPStoreValueChangeListener(*this));
+    setGroupCommitMaxLatency(config.getFlusherGroupCommitMaxLatency());
+    config.addValueChangedListener("flusher_group_commit_max_latency",
+                                   new EPStoreValueChangeListener(*this));
+
     stats.setMaxDataSize(config.getMaxSize());
     config.addValueChangedListener("max_size",
                                    new StatsValueChangeListener(stats));
@@ -342,6 +368,12 @@ bool EventuallyPersistentStore::initialize() {
     ExTask htrTask = new HashtableResizerTask(this, 10);
     ExecutorPool::get()->schedule(htrTask, NONIO_TASK_IDX);
 
+    if (engine.getSlabAllocator()) {
+        ExTask defragTask = new DefragmenterTask(this,
+                                          config.getDefragmenterStime());
+        ExecutorPool::get()->schedule(defragTask, NONIO_TASK_IDX);
+    }
+
     size_t checkpointRemoverInterval = config.getChkRemoverStime();
     ExTask chkTask = new ClosedUnrefCheckpointRemoverTask(&engine, stats,
                                                     checkpointRemoverInterval);
@@ -479,14 +511,15 @@ EventuallyPersistentStore::deleteExpiredItem(uint16_t vbid, std::string &key,
     RCPtr<VBucket> vb = getVBucket(vbid);
     if (vb) {
         int bucket_num(0);
-        incExpirationStat(vb);
-        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+        incExpirationStat(*vb);
+        uint64_t h = vb->ht.hash(key);
+        LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, h, bucket_num, true, false);
         if (v) {
             if (v->isTempItem()) {
                 // This is a temporary item whose background fetch for metadata
                 // has completed.
-                bool deleted = vb->ht.unlocked_del(key, bucket_num);
+                bool deleted = vb->ht.unlocked_del(key, h, bucket_num);
                 assert(deleted);
             } else if (v->isExpired(startTime) && !v->isDeleted()) {
                 vb->ht.unlocked_softDelete(v, 0, getItemEvictionPolicy());
@@ -504,7 +537,7 @@ EventuallyPersistentStore::deleteExpiredItem(uint16_t vbid, std::string &key,
                 if (rv == ADD_NOMEM) {
                     return;
                 }
-                v = vb->ht.unlocked_find(key, bucket_num, true, false);
+                v = vb->ht.unlocked_find(key, h, bucket_num, true, false);
                 v->setStoredValueState(StoredValue::state_deleted_key);
                 v->setRevSeqno(revSeqno);
                 vb->ht.unlocked_softDelete(v, 0, eviction_policy);
@@ -527,21 +560,23 @@ EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t,
     }
 }
 
-StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
+StoredValue *EventuallyPersistentStore::fetchValidValue(VBucket &vb,
                                                         const std::string &key,
+                                                        uint64_t h,
                                                         int bucket_num,
                                                         bool wantDeleted,
                                                         bool trackReference,
                                                         bool queueExpired) {
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, wantDeleted, trackReference);
+    StoredValue *v = vb.ht.unlocked_find(key, h, bucket_num, wantDeleted,
+                                         trackReference);
     if (v && !v->isDeleted()) { // In the deleted case, we ignore expiration time.
         if (v->isExpired(ep_real_time())) {
-            if (vb->getState() != vbucket_state_active) {
+            if (vb.getState() != vbucket_state_active) {
                 return wantDeleted ? v : NULL;
             }
             if (queueExpired) {
                 incExpirationStat(vb, false);
-                vb->ht.unlocked_softDelete(v, 0, eviction_policy);
+                vb.ht.unlocked_softDelete(v, 0, eviction_policy);
                 int64_t bySeqno = queueDirty(vb, key, queue_op_del,
                                              v->getRevSeqno(), false, false);
                 v->setBySeqno(bySeqno);
@@ -563,8 +598,9 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, force, false);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, force, false);
 
     protocol_binary_response_status rv(PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
@@ -624,7 +660,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
                                                  bool force,
                                                  uint8_t nru) {
 
-    RCPtr<VBucket> vb = getVBucket(itm.getVBucketId());
+    // The epoch keeps the vbucket alive without touching its refcount.
+    EpochGuard guard(vbMap.getEpochs());
+    VBucket *vb = vbMap.peekBucket(itm.getVBucketId());
     if (!vb || vb->getState() == vbucket_state_dead) {
         ++stats.numNotMyVBuckets;
         return ENGINE_NOT_MY_VBUCKET;
@@ -639,8 +677,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
 
     bool cas_op = (itm.getCas() != 0);
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true, false);
+    uint64_t h = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), h, bucket_num, true,
+                                          false);
     mutation_type_t mtype = vb->ht.unlocked_set(v, itm, itm.getCas(),
                                                 true, false,
                                                 eviction_policy, nru);
@@ -664,7 +704,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
     case WAS_DIRTY:
         // Even if the item was dirty, push it into the vbucket's open checkpoint.
     case WAS_CLEAN:
-        bySeqno = queueDirty(vb, itm.getKey(), queue_op_set, itm.getRevSeqno());
+        bySeqno = queueDirty(*vb, itm.getKey(), queue_op_set, itm.getRevSeqno());
         v->setBySeqno(bySeqno);
         break;
     case NEED_BG_FETCH: // CAS operation with non-resident item + full eviction.
@@ -674,7 +714,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
                 bgFetch(itm.getKey(), vb->getId(), -1, cookie, true);
                 return ENGINE_EWOULDBLOCK;
             }
-            ret = addTempItemForBgFetch(lh, bucket_num, itm.getKey(), vb,
+            RCPtr<VBucket> ref(vb);
+            ret = addTempItemForBgFetch(lh, bucket_num, itm.getKey(), ref,
                                         cookie, true);
             break;
         }
@@ -705,8 +746,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &itm,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true, false);
+    uint64_t h = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), h, bucket_num, true,
+                                          false);
     add_type_t atype = vb->ht.unlocked_add(bucket_num, v, itm, eviction_policy);
 
     int64_t bySeqno;
@@ -1167,8 +1210,9 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     RCPtr<VBucket> vb = getVBucket(vbucket);
     if (vb && vb->getState() != vbucket_state_dead) {
         int bucket_num(0);
-        LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+        uint64_t h = vb->ht.hash(key);
+        LockHolder hlh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
         if (isMeta) {
             if (v && v->isTempInitialItem()) {
                 if (v->unlocked_restoreMeta(gcb.val.getValue(),
@@ -1256,8 +1300,9 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
 
         if (vb->getState() != vbucket_state_dead) {
             int bucket = 0;
-            LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
-            StoredValue *v = fetchValidValue(vb, key, bucket, true);
+            uint64_t h = vb->ht.hash(key);
+            LockHolder blh = vb->ht.getLockedBucket(h, &bucket);
+            StoredValue *v = fetchValidValue(vb, key, h, bucket, true);
             if (bgitem->metaDataOnly) {
                 if (v && v->isTempInitialItem()) {
                     if (v->unlocked_restoreMeta(fetchedValue, status, vb->ht)) {
@@ -1319,7 +1364,9 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
 
         hrtime_t endTime = gethrtime();
         updateBGStats(bgitem->initTime, startTime, endTime);
-        engine.notifyIOComplete(bgitem->cookie, status);
+        if (!bgitem->group || bgitem->group->complete(status)) {
+            engine.notifyIOComplete(bgitem->cookie, status);
+        }
     }
 
     LOG(EXTENSION_LOG_DEBUG,
@@ -1369,11 +1416,14 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
                                                 bool queueBG,
                                                 bool honorStates,
                                                 vbucket_state_t allowedState,
-                                                bool trackReference) {
+                                                bool trackReference,
+                                                Item *reuse) {
 
     vbucket_state_t disallowedState = (allowedState == vbucket_state_active) ?
         vbucket_state_replica : vbucket_state_active;
-    RCPtr<VBucket> vb = getVBucket(vbucket);
+    // The epoch keeps the vbucket alive without touching its refcount.
+    EpochGuard guard(vbMap.getEpochs());
+    VBucket *vb = vbMap.peekBucket(vbucket);
     if (!vb) {
         ++stats.numNotMyVBuckets;
         return GetValue(NULL, ENGINE_NOT_MY_VBUCKET);
@@ -1390,8 +1440,10 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true, trackReference);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(*vb, key, h, bucket_num, true,
+                                     trackReference);
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
             v->isTempNonExistentItem()) {
@@ -1407,7 +1459,7 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
                             true, v->getNRUValue());
         }
 
-        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
+        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket, reuse),
                     ENGINE_SUCCESS, v->getBySeqno(), false, v->getNRUValue());
         return rv;
     } else {
@@ -1417,13 +1469,181 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         }
         ENGINE_ERROR_CODE ec = ENGINE_EWOULDBLOCK;
         if (queueBG) { // Full eviction and need a bg fetch.
-            ec = addTempItemForBgFetch(lh, bucket_num, key, vb,
+            RCPtr<VBucket> ref(vb);
+            ec = addTempItemForBgFetch(lh, bucket_num, key, ref,
                                        cookie, false);
         }
         return GetValue(NULL, ec, -1, true);
     }
 }
 
+/// @cond DETAILS
+/**
+ * A background fetch EventuallyPersistentStore::getMulti has to queue.
+ */
+struct MultiGetFetch {
+    MultiGetFetch(RCPtr<VBucket> &v, size_t i, uint64_t r) :
+        vb(v), index(i), rowid(r) { }
+
+    RCPtr<VBucket> vb;
+    size_t index;
+    uint64_t rowid;
+};
+
+/**
+ * Gets the keys of a batched get, the same way getInternal gets a single
+ * key, but collects the background fetches instead of queueing them.
+ */
+class MultiGetLookup {
+public:
+    MultiGetLookup(EventuallyPersistentStore &s, std::vector<MultiGetItem> &i,
+                   bool q, std::vector<MultiGetFetch> &f) :
+        store(s), items(i), queueBG(q), fetches(f) { }
+
+    void lookup(RCPtr<VBucket> &vb, size_t i, uint64_t h) {
+        MultiGetItem &item = items[i];
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = store.fetchValidValue(vb, item.key, h, bucket_num,
+                                               true);
+        if (v) {
+            if (v->isDeleted() || v->isTempDeletedItem() ||
+                v->isTempNonExistentItem()) {
+                item.value = GetValue();
+            } else if (!v->isResident()) {
+                if (queueBG) {
+                    fetches.push_back(MultiGetFetch(vb, i, v->getBySeqno()));
+                }
+                item.value = GetValue(NULL, ENGINE_EWOULDBLOCK,
+                                      v->getBySeqno(), true,
+                                      v->getNRUValue());
+            } else {
+                item.value = GetValue(v->toItem(v->isLocked(ep_current_time()),
+                                                vb->getId()),
+                                      ENGINE_SUCCESS, v->getBySeqno(), false,
+                                      v->getNRUValue());
+            }
+        } else if (store.eviction_policy == VALUE_ONLY || store.diskFlushAll) {
+            item.value = GetValue();
+        } else {
+            ENGINE_ERROR_CODE ec = ENGINE_EWOULDBLOCK;
+            if (queueBG) { // Full eviction and need a bg fetch.
+                switch (vb->ht.unlocked_addTempItem(bucket_num, item.key,
+                                                    store.eviction_policy)) {
+                case ADD_NOMEM:
+                    ec = ENGINE_ENOMEM;
+                    break;
+                case ADD_BG_FETCH:
+                    fetches.push_back(MultiGetFetch(vb, i, -1));
+                    break;
+                default:
+                    // Since the hashtable bucket is locked, we shouldn't
+                    // get here
+                    abort();
+                }
+            }
+            item.value = GetValue(NULL, ec, -1, true);
+        }
+    }
+
+private:
+    EventuallyPersistentStore &store;
+    std::vector<MultiGetItem> &items;
+    bool queueBG;
+    std::vector<MultiGetFetch> &fetches;
+};
+/// @endcond
+
+/**
+ * Number of keys of a batched get whose buckets are prefetched before
+ * any of them is searched. Enough misses to keep the memory system busy,
+ * few enough that the first bucket is still cached when it's searched.
+ */
+static const size_t MULTI_GET_WINDOW = 16;
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::getMulti(
+                                            std::vector<MultiGetItem> &items,
+                                            const void *cookie,
+                                            bool queueBG) {
+    // Check the vbuckets of all keys first. Once a pending vbucket holds
+    // on to the cookie nothing else may notify it, so then no key may
+    // queue a background fetch, nor add a temp item for one.
+    std::vector<RCPtr<VBucket> > vbs(items.size());
+    bool pending = false;
+    for (size_t i = 0; i < items.size(); ++i) {
+        MultiGetItem &item = items[i];
+        ENGINE_ERROR_CODE ec = ENGINE_SUCCESS;
+        RCPtr<VBucket> vb = getVBucket(item.vbucket);
+        if (!vb || vb->getState() == vbucket_state_dead ||
+            vb->getState() == vbucket_state_replica) {
+            ++stats.numNotMyVBuckets;
+            ec = ENGINE_NOT_MY_VBUCKET;
+        } else if (vb->getState() == vbucket_state_pending) {
+            if (pending || vb->addPendingOp(cookie)) {
+                pending = true;
+                ec = ENGINE_EWOULDBLOCK;
+            }
+        }
+        if (ec != ENGINE_SUCCESS) {
+            item.value = GetValue(NULL, ec);
+        } else {
+            vbs[i] = vb;
+        }
+    }
+
+    std::vector<MultiGetFetch> fetches;
+    MultiGetLookup lookup(*this, items, queueBG && !pending, fetches);
+    for (size_t start = 0; start < items.size(); start += MULTI_GET_WINDOW) {
+        size_t end = std::min(items.size(), start + MULTI_GET_WINDOW);
+        uint64_t hashes[MULTI_GET_WINDOW];
+
+        // Start loading the buckets of all keys of the window before
+        // searching any of them.
+        for (size_t i = start; i < end; ++i) {
+            if (vbs[i]) {
+                hashes[i - start] = vbs[i]->ht.hash(items[i].key);
+                vbs[i]->ht.prefetchBucket(hashes[i - start]);
+            }
+        }
+
+        for (size_t i = start; i < end; ++i) {
+            if (vbs[i]) {
+                lookup.lookup(vbs[i], i, hashes[i - start]);
+            }
+        }
+    }
+
+    if (!fetches.empty()) {
+        std::vector<MultiGetFetch>::iterator it;
+        if (multiBGFetchEnabled()) {
+            // Queue all fetches before the BgFetchers get to them, so the
+            // keys of a vbucket mostly end up in the same getMulti.
+            RCPtr<BGFetchGroup> group(new BGFetchGroup(fetches.size()));
+            for (it = fetches.begin(); it != fetches.end(); ++it) {
+                KVShard *myShard = vbMap.getShard(it->vb->getId());
+                VBucketBGFetchItem *fetchThis =
+                    new VBucketBGFetchItem(cookie, false, group.get());
+                it->vb->queueBGFetchItem(items[it->index].key, fetchThis,
+                                         myShard->getBgFetcher());
+                myShard->getBgFetcher()->notifyBGEvent();
+            }
+        } else {
+            // Every fetch notifies the cookie on its own, so fetch one key
+            // at a time, as gets of the single keys would.
+            it = fetches.begin();
+            bgFetch(items[it->index].key, it->vb->getId(), it->rowid, cookie);
+        }
+    }
+
+    std::vector<MultiGetItem>::iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        if (it->value.getStatus() == ENGINE_EWOULDBLOCK) {
+            return ENGINE_EWOULDBLOCK;
+        }
+    }
+    return ENGINE_SUCCESS;
+}
+
 GetValue EventuallyPersistentStore::getRandomKey() {
     long max = vbMap.getSize();
 
@@ -1480,8 +1700,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
 
     int bucket_num(0);
     deleted = 0;
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, trackReferenced);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, h, bucket_num, true,
+                                          trackReferenced);
 
     if (v) {
         stats.numOpsGetMeta++;
@@ -1534,8 +1756,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(const Item &itm,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true, false);
+    uint64_t h = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), h, bucket_num, true,
+                                          false);
 
     if (!force) {
         if (v)  {
@@ -1614,8 +1838,9 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
@@ -1673,8 +1898,9 @@ EventuallyPersistentStore::statsVKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
@@ -1736,8 +1962,9 @@ void EventuallyPersistentStore::completeStatsVKey(const void* cookie,
         RCPtr<VBucket> vb = getVBucket(vbid);
         if (vb) {
             int bucket_num(0);
-            LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-            StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+            uint64_t h = vb->ht.hash(key);
+            LockHolder hlh = vb->ht.getLockedBucket(h, &bucket_num);
+            StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
             if (v && v->isTempInitialItem()) {
                 if (gcb.val.getStatus() == ENGINE_SUCCESS) {
                     v->unlocked_restoreValue(gcb.val.getValue(), vb->ht);
@@ -1780,8 +2007,9 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempNonExistentItem() ||
@@ -1847,8 +2075,9 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempNonExistentItem() ||
@@ -1891,8 +2120,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
 
     if (v) {
         if ((v->isDeleted() && !wantsDeleted) ||
@@ -1931,8 +2161,9 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
                                                    Item &diskItem) {
     int bucket_num(0);
     RCPtr<VBucket> vb = getVBucket(vbucket);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true,
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true,
                                      false, true);
 
     if (v) {
@@ -1978,8 +2209,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, h, bucket_num, true, false);
     if (!v || v->isDeleted() || v->isTempItem()) {
         if (eviction_policy == VALUE_ONLY) {
             return ENGINE_KEY_ENOENT;
@@ -2003,7 +2235,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
                     if (rv == ADD_NOMEM) {
                         return ENGINE_ENOMEM;
                     }
-                    v = vb->ht.unlocked_find(key, bucket_num, true, false);
+                    v = vb->ht.unlocked_find(key, h, bucket_num, true, false);
                     v->setStoredValueState(StoredValue::state_deleted_key);
                 } else if (v->isTempInitialItem()) {
                     v->setStoredValueState(StoredValue::state_deleted_key);
@@ -2080,8 +2312,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(const std::string &k
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    uint64_t h = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, h, bucket_num, true, false);
     if (!force) { // Need conflict resolution.
         if (v)  {
             if (v->isTempInitialItem()) {
@@ -2106,7 +2339,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(const std::string &k
             if (rv == ADD_NOMEM) {
                 return ENGINE_ENOMEM;
             }
-            v = vb->ht.unlocked_find(key, bucket_num, true, false);
+            v = vb->ht.unlocked_find(key, h, bucket_num, true, false);
             v->setStoredValueState(StoredValue::state_deleted_key);
         } else if (v->isTempInitialItem()) {
             v->setStoredValueState(StoredValue::state_deleted_key);
@@ -2194,9 +2427,10 @@ public:
     void callback(mutation_result &value) {
         if (value.first == 1) {
             int bucket_num(0);
-            LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
+            uint64_t h = vbucket->ht.hash(queuedItem->getKey());
+            LockHolder lh = vbucket->ht.getLockedBucket(h, &bucket_num);
             StoredValue *v = store->fetchValidValue(vbucket, queuedItem->getKey(),
-                                                    bucket_num, true, false);
+                                                    h, bucket_num, true, false);
             if (v && v->getCas() == cas) {
                 // mark this item clean only if current and stored cas
                 // value match
@@ -2211,9 +2445,11 @@ public:
             // we do not know the rowid of this object.
             if (value.first == 0) {
                 int bucket_num(0);
-                LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
+                uint64_t h = vbucket->ht.hash(queuedItem->getKey());
+                LockHolder lh = vbucket->ht.getLockedBucket(h, &bucket_num);
                 StoredValue *v = store->fetchValidValue(vbucket, queuedItem->getKey(),
-                                                        bucket_num, true, false);
+                                                        h, bucket_num, true,
+                                                        false);
                 if (v) {
                     std::stringstream ss;
                     ss << "Persisting ``" << queuedItem->getKey() << "'' on vb"
@@ -2252,12 +2488,13 @@ public:
             // We have succesfully removed an item from the disk, we
             // may now remove it from the hash table.
             int bucket_num(0);
-            LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
+            uint64_t h = vbucket->ht.hash(queuedItem->getKey());
+            LockHolder lh = vbucket->ht.getLockedBucket(h, &bucket_num);
             StoredValue *v = store->fetchValidValue(vbucket, queuedItem->getKey(),
-                                                    bucket_num, true, false);
+                                                    h, bucket_num, true, false);
             if (v && v->isDeleted()) {
                 bool deleted = vbucket->ht.unlocked_del(queuedItem->getKey(),
-                                                        bucket_num);
+                                                        h, bucket_num);
                 assert(deleted);
             }
 
@@ -2335,13 +2572,7 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
         std::vector<queued_item> items;
         KVStore *rwUnderlying = getRWUnderlying(vbid);
 
-        while (!vb->rejectQueue.empty()) {
-            items.push_back(vb->rejectQueue.front());
-            vb->rejectQueue.pop();
-        }
-
-        vb->getBackfillItems(items);
-        vb->checkpointManager.getAllItemsForPersistence(items);
+        getItemsToPersist(vb, items);
 
         if (!items.empty()) {
             while (!rwUnderlying->begin()) {
@@ -2350,83 +2581,197 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
                     "Retry in 1 sec ...");
                 sleep(1);
             }
-            rwUnderlying->optimizeWrites(items);
 
-            QueuedItem *prev = NULL;
             std::list<PersistenceCallback*> pcbs;
-            std::vector<queued_item>::iterator it = items.begin();
-            for(; it != items.end(); ++it) {
-                if ((*it)->getOperation() != queue_op_set &&
-                    (*it)->getOperation() != queue_op_del) {
-                    continue;
-                } else if (!prev || prev->getKey() != (*it)->getKey()) {
-                    prev = (*it).get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
-                    }
-                    ++stats.flusher_todo;
-                } else {
-                    stats.decrDiskQueueSize(1);
-                    vb->doStatsForFlushing(*(*it), (*it)->size());
-                }
-            }
+            items_flushed = queueItemsToPersist(vb, items, pcbs);
+            commitPersistedItems(rwUnderlying, pcbs, items_flushed,
+                                 flush_start);
+        }
 
-            BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
-                             stats.timingLog);
-            hrtime_t start = gethrtime();
+        schedule_vb_snapshot = completeVBucketFlush(vb);
+    }
 
-            while (!rwUnderlying->commit()) {
-                ++stats.commitFailed;
-                LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
-                    "1 sec...\n");
-                sleep(1);
-            }
+    if (schedule_vb_snapshot || snapshotVBState) {
+        scheduleVBSnapshot(Priority::VBucketPersistHighPriority,
+                           shard->getId());
+    }
 
-            while (!pcbs.empty()) {
-                delete pcbs.front();
-                pcbs.pop_front();
-            }
+    return items_flushed;
+}
 
-            ++stats.flusherCommits;
-            hrtime_t end = gethrtime();
-            uint64_t commit_time = (end - start) / 1000000;
-            uint64_t trans_time = (end - flush_start) / 1000000;
+size_t EventuallyPersistentStore::flushVBuckets(std::queue<uint16_t> &vbids) {
+    assert(!vbids.empty());
+    KVShard *shard = vbMap.getShard(vbids.front());
+    if (diskFlushAll) {
+        if (shard->getId() == EP_PRIMARY_SHARD) {
+            flushOneDeleteAll();
+        } else {
+            // disk flush is pending: leave the vbuckets queued, the
+            // flusher snoozes until the primary shard is done with it.
+            return 0;
+        }
+    }
 
-            lastTransTimePerItem = (items_flushed == 0) ? 0 :
-                static_cast<double>(trans_time) /
-                static_cast<double>(items_flushed);
-            stats.commit_time.store(commit_time);
-            stats.cumulativeCommitTime.fetch_add(commit_time);
-            stats.cumulativeFlushTime.fetch_add(ep_current_time() - flush_start);
-            stats.flusher_todo.store(0);
+    size_t maxItems = groupCommitMaxItems.load();
+    hrtime_t maxLatency = groupCommitMaxLatency.load() * 1000000;
+    size_t candidates = vbids.size();
+    size_t taken = 0;
+    std::vector<uint16_t> retry;
+    std::list<RCPtr<VBucket> > flushed;
+    std::list<PersistenceCallback*> pcbs;
+    int items_flushed = 0;
+    bool began = false;
+    bool schedule_vb_snapshot = false;
+    rel_time_t flush_start = ep_current_time();
+    hrtime_t group_start = gethrtime();
+    KVStore *rwUnderlying = getRWUnderlying(vbids.front());
 
+    LockHolder lh(shard->getWriteLock());
+    while (taken < candidates &&
+           (taken == 0 || (static_cast<size_t>(items_flushed) < maxItems &&
+                           gethrtime() - group_start < maxLatency))) {
+        uint16_t vbid = vbids.front();
+        vbids.pop();
+        ++taken;
+        if (vbMap.isBucketCreation(vbid)) {
+            retry.push_back(vbid);
+            continue;
         }
 
-        if (vb->rejectQueue.empty()) {
-            vb->checkpointManager.itemsPersisted();
+        RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+        if (!vb) {
+            continue;
         }
 
-        uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
-        if (vb->rejectQueue.empty()) {
-            vb->notifyCheckpointPersisted(engine, chkid);
+        std::vector<queued_item> items;
+        getItemsToPersist(vb, items);
+        if (!items.empty()) {
+            while (!began && !(began = rwUnderlying->beginGroup())) {
+                ++stats.beginFailed;
+                LOG(EXTENSION_LOG_WARNING, "Failed to start a "
+                    "transaction!!! Retry in 1 sec ...");
+                sleep(1);
+            }
+            items_flushed += queueItemsToPersist(vb, items, pcbs);
         }
+        flushed.push_back(vb);
+    }
 
-        if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
-            vbMap.setPersistenceCheckpointId(vbid, chkid);
+    if (began) {
+        commitPersistedItems(rwUnderlying, pcbs, items_flushed, flush_start);
+    }
+
+    std::list<RCPtr<VBucket> >::iterator it = flushed.begin();
+    for (; it != flushed.end(); ++it) {
+        if (completeVBucketFlush(*it)) {
             schedule_vb_snapshot = true;
         }
     }
+    lh.unlock();
+
+    for (size_t i = 0; i < retry.size(); ++i) {
+        vbids.push(retry[i]);
+    }
 
     if (schedule_vb_snapshot || snapshotVBState) {
         scheduleVBSnapshot(Priority::VBucketPersistHighPriority,
                            shard->getId());
     }
 
+    return taken;
+}
+
+void EventuallyPersistentStore::getItemsToPersist(RCPtr<VBucket> &vb,
+                                                std::vector<queued_item> &items) {
+    while (!vb->rejectQueue.empty()) {
+        items.push_back(vb->rejectQueue.front());
+        vb->rejectQueue.pop();
+    }
+
+    vb->getBackfillItems(items);
+    vb->checkpointManager.getAllItemsForPersistence(items);
+}
+
+int EventuallyPersistentStore::queueItemsToPersist(RCPtr<VBucket> &vb,
+                                         std::vector<queued_item> &items,
+                                         std::list<PersistenceCallback*> &pcbs) {
+    int items_flushed = 0;
+    getRWUnderlying(vb->getId())->optimizeWrites(items);
+
+    QueuedItem *prev = NULL;
+    std::vector<queued_item>::iterator it = items.begin();
+    for(; it != items.end(); ++it) {
+        if ((*it)->getOperation() != queue_op_set &&
+            (*it)->getOperation() != queue_op_del) {
+            continue;
+        } else if (!prev || prev->getKey() != (*it)->getKey()) {
+            prev = (*it).get();
+            ++items_flushed;
+            PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
+            if (cb) {
+                pcbs.push_back(cb);
+            }
+            ++stats.flusher_todo;
+        } else {
+            stats.decrDiskQueueSize(1);
+            vb->doStatsForFlushing(*(*it), (*it)->size());
+        }
+    }
     return items_flushed;
 }
 
+void EventuallyPersistentStore::commitPersistedItems(KVStore *rwUnderlying,
+                                         std::list<PersistenceCallback*> &pcbs,
+                                         int items_flushed,
+                                         rel_time_t flush_start) {
+    BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
+                     stats.timingLog);
+    hrtime_t start = gethrtime();
+
+    while (!rwUnderlying->commit()) {
+        ++stats.commitFailed;
+        LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
+            "1 sec...\n");
+        sleep(1);
+    }
+
+    while (!pcbs.empty()) {
+        delete pcbs.front();
+        pcbs.pop_front();
+    }
+
+    ++stats.flusherCommits;
+    hrtime_t end = gethrtime();
+    uint64_t commit_time = (end - start) / 1000000;
+    uint64_t trans_time = (end - flush_start) / 1000000;
+
+    lastTransTimePerItem = (items_flushed == 0) ? 0 :
+        static_cast<double>(trans_time) /
+        static_cast<double>(items_flushed);
+    stats.commit_time.store(commit_time);
+    stats.cumulativeCommitTime.fetch_add(commit_time);
+    stats.cumulativeFlushTime.fetch_add(ep_current_time() - flush_start);
+    stats.flusher_todo.store(0);
+}
+
+bool EventuallyPersistentStore::completeVBucketFlush(RCPtr<VBucket> &vb) {
+    if (vb->rejectQueue.empty()) {
+        vb->checkpointManager.itemsPersisted();
+    }
+
+    uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
+    if (vb->rejectQueue.empty()) {
+        vb->notifyCheckpointPersisted(engine, chkid);
+    }
+
+    uint16_t vbid = vb->getId();
+    if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
+        vbMap.setPersistenceCheckpointId(vbid, chkid);
+        return true;
+    }
+    return false;
+}
+
 // While I actually know whether a delete or set was intended, I'm
 // still a bit better off running the older code that figures it out
 // based on what's in memory.
@@ -2440,8 +2785,10 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(qi->getKey(), &bucket_num);
-    StoredValue *v = fetchValidValue(vb, qi->getKey(), bucket_num, true, false, false);
+    uint64_t h = vb->ht.hash(qi->getKey());
+    LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, qi->getKey(), h, bucket_num, true,
+                                     false, false);
 
     size_t itemBytes = qi->size();
 
@@ -2538,21 +2885,31 @@ int64_t EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
                                            uint64_t revSeqno,
                                            bool tapBackfill,
                                            bool notifyReplicator) {
+    if (!vb) {
+        return -1;
+    }
+    return queueDirty(*vb, key, op, revSeqno, tapBackfill, notifyReplicator);
+}
+
+int64_t EventuallyPersistentStore::queueDirty(VBucket &vb,
+                                           const std::string &key,
+                                           enum queue_operation op,
+                                           uint64_t revSeqno,
+                                           bool tapBackfill,
+                                           bool notifyReplicator) {
     int64_t bySeqno = -1;
-    if (vb) {
-        bool rv = tapBackfill ?
-                  vb->queueBackfillItem(key, op, revSeqno, &bySeqno) :
-                  vb->checkpointManager.queueDirty(vb, key, op, revSeqno,
-                                                   &bySeqno);
+    bool rv = tapBackfill ?
+              vb.queueBackfillItem(key, op, revSeqno, &bySeqno) :
+              vb.checkpointManager.queueDirty(vb, key, op, revSeqno,
+                                              &bySeqno);
 
-        if (rv) {
-            KVShard* shard = vbMap.getShard(vb->getId());
-            shard->getFlusher()->notifyFlushEvent();
+    if (rv) {
+        KVShard* shard = vbMap.getShard(vb.getId());
+        shard->getFlusher()->notifyFlushEvent();
 
-        }
-        if (!tapBackfill && notifyReplicator) {
-            engine.getTapConnMap().notifyVBConnections(vb->getId());
-        }
+    }
+    if (!tapBackfill && notifyReplicator) {
+        engine.getTapConnMap().notifyVBConnections(vb.getId());
     }
     return bySeqno;
 }
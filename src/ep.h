@@ -171,6 +171,17 @@ private:
     uint16_t                     shardID;
 };
 
+/**
+ * A key of a batched get, and the result of getting it.
+ */
+struct MultiGetItem {
+    MultiGetItem(const std::string &k, uint16_t vb) : key(k), vbucket(vb) { }
+
+    std::string key;
+    uint16_t vbucket;
+    GetValue value;
+};
+
 const uint16_t EP_PRIMARY_SHARD = 0;
 class KVShard;
 
@@ -220,16 +231,40 @@ public:
      * @param queueBG if true, automatically queue a background fetch if necessary
      * @param honorStates if false, fetch a result regardless of state
      * @param trackReference true if we want to set the nru bit for the item
+     * @param reuse if not NULL, an item to fill in rather than allocating
+     *              one; it stays with the caller if the get fails
      *
      * @return a GetValue representing the result of the request
      */
     GetValue get(const std::string &key, uint16_t vbucket,
                  const void *cookie, bool queueBG=true,
-                 bool honorStates=true, bool trackReference=true) {
+                 bool honorStates=true, bool trackReference=true,
+                 Item *reuse=NULL) {
         return getInternal(key, vbucket, cookie, queueBG, honorStates,
-                           vbucket_state_active, trackReference);
+                           vbucket_state_active, trackReference, reuse);
     }
 
+    /**
+     * Retrieve a batch of values from vbuckets in active state.
+     *
+     * The keys are looked up in order, a few at a time: the buckets of
+     * the keys are all prefetched before any of them is searched, so
+     * their cache misses overlap. The background fetches of all non
+     * resident keys are queued together, and the cookie is notified once
+     * when they have all completed.
+     *
+     * @param items the keys to fetch; the result of each key is stored
+     *              in its value
+     * @param cookie the connection cookie
+     * @param queueBG if true, automatically queue background fetches if
+     *                necessary
+     *
+     * @return ENGINE_EWOULDBLOCK if any key has to wait for a background
+     *         fetch or vbucket state change, ENGINE_SUCCESS otherwise
+     */
+    ENGINE_ERROR_CODE getMulti(std::vector<MultiGetItem> &items,
+                               const void *cookie, bool queueBG=true);
+
     GetValue getRandomKey(void);
 
     /**
@@ -604,13 +639,13 @@ public:
         accessScanner.lastTaskRuntime = gethrtime();
     }
 
-    void incExpirationStat(RCPtr<VBucket> &vb, bool byPager = true) {
+    void incExpirationStat(VBucket &vb, bool byPager = true) {
         if (byPager) {
             ++stats.expired_pager;
         } else {
             ++stats.expired_access;
         }
-        ++vb->numExpiredItems;
+        ++vb.numExpiredItems;
     }
 
     bool multiBGFetchEnabled() {
@@ -633,6 +668,34 @@ public:
      */
     int flushVBucket(uint16_t vbid);
 
+    /**
+     * Flushes the items waiting for persistence in vbuckets taken from the
+     * front of the given queue, all committed together. Vbuckets are
+     * added to the group until it holds flusher_group_commit_max_items
+     * items or has been writing for flusher_group_commit_max_latency ms.
+     * Vbuckets that can't be flushed yet go to the back of the queue.
+     *
+     * @param vbids vbuckets of one shard waiting to be flushed
+     * @return The number of vbuckets taken from the queue
+     */
+    size_t flushVBuckets(std::queue<uint16_t> &vbids);
+
+    bool isGroupCommitEnabled(void) {
+        return groupCommit.load();
+    }
+
+    void setGroupCommit(bool to) {
+        groupCommit.store(to);
+    }
+
+    void setGroupCommitMaxItems(size_t to) {
+        groupCommitMaxItems.store(to);
+    }
+
+    void setGroupCommitMaxLatency(size_t to) {
+        groupCommitMaxLatency.store(to);
+    }
+
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
 
     void addKVStoreTimingStats(ADD_STAT add_stat, const void* cookie);
@@ -675,6 +738,13 @@ private:
                     bool tapBackfill = false,
                     bool notifyReplicator = true);
 
+    int64_t queueDirty(VBucket &vb,
+                    const std::string &key,
+                    enum queue_operation op,
+                    uint64_t seqno,
+                    bool tapBackfill = false,
+                    bool notifyReplicator = true);
+
     /**
      * Retrieve a StoredValue and invoke a method on it.
      *
@@ -697,8 +767,9 @@ private:
         }
 
         int bucket_num(0);
-        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true);
+        uint64_t h = vb->ht.hash(key);
+        LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, h, bucket_num, true, true);
 
         if (v) {
             std::mem_fun(f)(v);
@@ -710,15 +781,36 @@ private:
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
                                           RCPtr<VBucket> &vb);
 
+    void getItemsToPersist(RCPtr<VBucket> &vb,
+                           std::vector<queued_item> &items);
+    int queueItemsToPersist(RCPtr<VBucket> &vb,
+                            std::vector<queued_item> &items,
+                            std::list<PersistenceCallback*> &pcbs);
+    void commitPersistedItems(KVStore *rwUnderlying,
+                              std::list<PersistenceCallback*> &pcbs,
+                              int items_flushed, rel_time_t flush_start);
+    bool completeVBucketFlush(RCPtr<VBucket> &vb);
+
+    StoredValue *fetchValidValue(VBucket &vb, const std::string &key,
+                                 uint64_t h, int bucket_num,
+                                 bool wantsDeleted=false,
+                                 bool trackReference=true,
+                                 bool queueExpired=true);
+
     StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
-                                 int bucket_num, bool wantsDeleted=false,
-                                 bool trackReference=true, bool queueExpired=true);
+                                 uint64_t h, int bucket_num,
+                                 bool wantsDeleted=false,
+                                 bool trackReference=true,
+                                 bool queueExpired=true) {
+        return fetchValidValue(*vb, key, h, bucket_num, wantsDeleted,
+                               trackReference, queueExpired);
+    }
 
     GetValue getInternal(const std::string &key, uint16_t vbucket,
                          const void *cookie, bool queueBG,
                          bool honorStates,
                          vbucket_state_t allowedState,
-                         bool trackReference=true);
+                         bool trackReference=true, Item *reuse=NULL);
 
     ENGINE_ERROR_CODE addTempItemForBgFetch(LockHolder &lock, int bucket_num,
                                             const std::string &key, RCPtr<VBucket> &vb,
@@ -731,6 +823,7 @@ private:
     friend class PersistenceCallback;
     friend class Deleter;
     friend class VBCBAdaptor;
+    friend class MultiGetLookup;
     friend class VBucketVisitorTask;
     friend class ItemPager;
     friend class PagingVisitor;
@@ -771,6 +864,9 @@ private:
     size_t transactionSize;
     size_t lastTransTimePerItem;
     size_t itemExpiryWindow;
+    Atomic<bool> groupCommit;
+    Atomic<size_t> groupCommitMaxItems;
+    Atomic<size_t> groupCommitMaxLatency;
     Atomic<bool> snapshotVBState;
     item_eviction_policy_t eviction_policy;
 
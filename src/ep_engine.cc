@@ -131,9 +131,13 @@ extern "C" {
 
     static void EvpDestroy(ENGINE_HANDLE* handle, const bool force)
     {
-        getHandle(handle)->destroy(force);
-        delete getHandle(handle);
-        releaseHandle(NULL);
+        EventuallyPersistentEngine *engine = getHandle(handle);
+        engine->destroy(force);
+        // The stats of the engine go away with it, so the memory freed
+        // while deleting it must not be batched up for them.
+        ObjectRegistry::onDeleteEngine();
+        delete engine;
+        ObjectRegistry::onEngineDeleted();
     }
 
     static ENGINE_ERROR_CODE EvpItemAllocate(ENGINE_HANDLE* handle,
@@ -348,6 +352,20 @@ extern "C" {
             } else if (strcmp(keyz, "bg_fetch_delay") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setBgFetchDelay(v);
+            } else if (strcmp(keyz, "flusher_group_commit") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setFlusherGroupCommit(true);
+                } else if(strcmp(valz, "false") == 0) {
+                    e->getConfiguration().setFlusherGroupCommit(false);
+                } else {
+                    throw std::runtime_error("value out of range.");
+                }
+            } else if (strcmp(keyz, "flusher_group_commit_max_items") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setFlusherGroupCommitMaxItems(v);
+            } else if (strcmp(keyz, "flusher_group_commit_max_latency") == 0) {
+                checkNumeric(valz);
+                e->getConfiguration().setFlusherGroupCommitMaxLatency(v);
             } else if (strcmp(keyz, "flushall_enabled") == 0) {
                 if (strcmp(valz, "true") == 0) {
                     e->getConfiguration().setFlushallEnabled(true);
@@ -1047,6 +1065,11 @@ extern "C" {
             }
 
             return h->getRandomKey(cookie, response);
+        case CMD_UPR_SET_BUFFER_SIZE:
+        case CMD_UPR_BUFFER_ACK:
+            return h->uprFlowControl(cookie,
+                    reinterpret_cast<protocol_binary_request_upr_buffer*>(request),
+                    response);
         }
 
         // Send a special response for getl since we don't want to send the key
@@ -1501,7 +1524,7 @@ EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server
     clusterConfig(), epstore(NULL), workload(NULL), workloadPriority(NO_BUCKET_PRIORITY),
     tapThrottle(NULL), getServerApiFunc(get_server_api),
     tapConnMap(NULL), tapConfig(NULL), checkpointConfig(NULL),
-    flushAllEnabled(false), startupTime(0)
+    slabAllocator(NULL), flushAllEnabled(false), startupTime(0)
 {
     interface.interface = 1;
     ENGINE_HANDLE_V1::get_info = EvpGetInfo;
@@ -1619,6 +1642,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    if (configuration.getHtIndex().compare("bucketed") == 0) {
+        HashTable::setDefaultIndexType(HT_INDEX_BUCKETED);
+    } else {
+        HashTable::setDefaultIndexType(HT_INDEX_CHAINED);
+    }
     StoredValue::setMutationMemoryThreshold(configuration.getMutationMemThreshold());
 
     if (configuration.getMaxSize() == 0) {
@@ -1665,6 +1693,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     checkpointConfig = new CheckpointConfig(*this);
     CheckpointConfig::addConfigChangeListener(*this);
 
+    if (configuration.isSlabAllocatorEnabled()) {
+        slabAllocator = new SlabAllocator(stats);
+    }
+
     epstore = new EventuallyPersistentStore(*this);
     if (epstore == NULL) {
         return ENGINE_ENOMEM;
@@ -2910,6 +2942,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_mem_tracker_enabled",
                     stats.memoryTrackerEnabled ? "true" : "false",
                     add_stat, cookie);
+    add_casted_stat("ep_slab_memory", stats.slabMemory, add_stat, cookie);
+    add_casted_stat("ep_defrag_num_moved", stats.defragNumMoved,
+                    add_stat, cookie);
+    add_casted_stat("ep_defrag_num_slabs_freed", stats.defragNumSlabsFreed,
+                    add_stat, cookie);
     add_casted_stat("ep_bg_fetched", epstats.bg_fetched, add_stat,
                     cookie);
     add_casted_stat("ep_bg_meta_fetched", epstats.bg_meta_fetched, add_stat,
@@ -2921,6 +2958,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_tap_bg_fetched", stats.numTapBGFetched, add_stat, cookie);
     add_casted_stat("ep_tap_bg_fetch_requeued", stats.numTapBGFetchRequeued,
                     add_stat, cookie);
+    add_casted_stat("ep_backfill_items", stats.numBackfillItems,
+                    add_stat, cookie);
+    add_casted_stat("ep_backfill_map_lookups",
+                    stats.numBackfillConnMapLookups, add_stat, cookie);
+    if (stats.numBackfillItems > 0) {
+        add_casted_stat("ep_backfill_map_lookups_per_item",
+                        static_cast<double>(stats.numBackfillConnMapLookups.load()) /
+                        stats.numBackfillItems.load(), add_stat, cookie);
+    }
     add_casted_stat("ep_num_pager_runs", epstats.pagerRuns, add_stat,
                     cookie);
     add_casted_stat("ep_num_expiry_pager_runs", epstats.expiryPagerRuns, add_stat,
@@ -3006,6 +3052,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_access_scanner_num_items", epstats.alogNumItems,
                     add_stat, cookie);
+    add_casted_stat("ep_access_scanner_skipped_vbuckets",
+                    epstats.alogSkippedVBuckets, add_stat, cookie);
 
     char timestr[20];
     struct tm alogTim = *gmtime((time_t *)&epstats.alogTime);
@@ -3072,6 +3120,19 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
                     stats.memoryTrackerEnabled ? "true" : "false",
                     add_stat, cookie);
 
+    size_t slabMemory = stats.slabMemory;
+    size_t slabUsed = stats.slabUsedMemory;
+    add_casted_stat("ep_slab_memory", slabMemory, add_stat, cookie);
+    add_casted_stat("ep_slab_used_memory", slabUsed, add_stat, cookie);
+    add_casted_stat("ep_slab_fragmentation",
+                    slabMemory > slabUsed ?
+                    (slabMemory - slabUsed) * 100 / slabMemory : 0,
+                    add_stat, cookie);
+    add_casted_stat("ep_defrag_num_moved", stats.defragNumMoved,
+                    add_stat, cookie);
+    add_casted_stat("ep_defrag_num_slabs_freed", stats.defragNumSlabsFreed,
+                    add_stat, cookie);
+
     std::map<std::string, size_t> alloc_stats;
     MemoryTracker::getInstance()->getAllocatorStats(alloc_stats);
     std::map<std::string, size_t>::iterator it = alloc_stats.begin();
@@ -3120,54 +3181,165 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doVBucketStats(const void *cookie,
     return ENGINE_SUCCESS;
 }
 
-ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
-                                                          ADD_STAT add_stat) {
+/// @cond DETAILS
+/**
+ * Walks the hash tables of all vbuckets for the "hash" stats, a few
+ * vbuckets per run so it doesn't hold on to a NONIO thread, and hands
+ * the stats to the engine when it is done.
+ */
+class HashStatsTask : public GlobalTask {
+public:
+    HashStatsTask(EventuallyPersistentEngine *e) :
+        GlobalTask(e, Priority::CheckpointStatsPriority, 0, false), ep(e),
+        vbuckets(e->getEpStore()->getVBuckets().getBuckets()), next(0),
+        completed(false) { }
+
+    ~HashStatsTask() {
+        if (!completed) {
+            // Cancelled at shutdown before the walk was done.
+            ep->abortHashStats();
+        }
+    }
 
-    class StatVBucketVisitor : public VBucketVisitor {
-    public:
-        StatVBucketVisitor(const void *c, ADD_STAT a) : cookie(c), add_stat(a) {}
+    bool run(void) {
+        hrtime_t start = gethrtime();
+        while (next < vbuckets.size()) {
+            RCPtr<VBucket> vb = ep->getVBucket(vbuckets[next++]);
+            if (vb) {
+                addVBucketStats(vb);
+            }
+            if (gethrtime() - start > MAX_RUN_TIME) {
+                return true;
+            }
+        }
+        completed = true;
+        ep->setHashStats(stats);
+        return false;
+    }
 
-        bool visitBucket(RCPtr<VBucket> &vb) {
-            uint16_t vbid = vb->getId();
-            char buf[32];
-            snprintf(buf, sizeof(buf), "vb_%d:state", vbid);
-            add_casted_stat(buf, VBucket::toString(vb->getState()), add_stat, cookie);
-
-            HashTableDepthStatVisitor depthVisitor;
-            vb->ht.visitDepth(depthVisitor);
-
-            snprintf(buf, sizeof(buf), "vb_%d:size", vbid);
-            add_casted_stat(buf, vb->ht.getSize(), add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:locks", vbid);
-            add_casted_stat(buf, vb->ht.getNumLocks(), add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:min_depth", vbid);
-            add_casted_stat(buf, depthVisitor.min == -1 ? 0 : depthVisitor.min,
-                            add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:max_depth", vbid);
-            add_casted_stat(buf, depthVisitor.max, add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:histo", vbid);
-            add_casted_stat(buf, depthVisitor.depthHisto, add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:reported", vbid);
-            add_casted_stat(buf, vb->ht.getNumItems(), add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:counted", vbid);
-            add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
-            add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
-            add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
-            snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted", vbid);
-            add_casted_stat(buf, depthVisitor.memUsed, add_stat, cookie);
+    std::string getDescription() {
+        return "hash stats for all vbuckets";
+    }
 
-            return false;
+private:
+    // Yield the thread after walking hash tables for this long (ns).
+    static const hrtime_t MAX_RUN_TIME = 20000000;
+
+    template <typename T>
+    void add(uint16_t vbid, const char *name, const T &value) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "vb_%d:%s", vbid, name);
+        std::stringstream ss;
+        ss << value;
+        stats.push_back(std::make_pair(std::string(buf), ss.str()));
+    }
+
+    void addVBucketStats(RCPtr<VBucket> &vb) {
+        uint16_t vbid = vb->getId();
+        add(vbid, "state", VBucket::toString(vb->getState()));
+
+        HashTableDepthStatVisitor depthVisitor;
+        vb->ht.visitDepth(depthVisitor);
+
+        add(vbid, "size", vb->ht.getSize());
+        add(vbid, "locks", vb->ht.getNumLocks());
+        add(vbid, "min_depth", depthVisitor.min == -1 ? 0 : depthVisitor.min);
+        add(vbid, "max_depth", depthVisitor.max);
+        for (Histogram<unsigned int>::iterator it =
+                 depthVisitor.depthHisto.begin();
+             it != depthVisitor.depthHisto.end(); ++it) {
+            if ((*it)->count()) {
+                std::stringstream ss;
+                ss << "histo_" << (*it)->start() << "," << (*it)->end();
+                add(vbid, ss.str().c_str(), (*it)->count());
+            }
+        }
+        add(vbid, "reported", vb->ht.getNumItems());
+        add(vbid, "counted", depthVisitor.size);
+        add(vbid, "resized", vb->ht.getNumResizes());
+        add(vbid, "resize_stripes_pending",
+            vb->ht.getNumResizeStripesPending());
+        add(vbid, "resize_stripes_moved", vb->ht.getNumResizeStripesMoved());
+        add(vbid, "resize_max_pause", vb->ht.getMaxResizePause());
+        add(vbid, "mem_size", vb->ht.memSize.load());
+        add(vbid, "mem_size_counted", depthVisitor.memUsed);
+    }
+
+    EventuallyPersistentEngine *ep;
+    std::vector<int> vbuckets;
+    size_t next;
+    bool completed;
+    std::vector<std::pair<std::string, std::string> > stats;
+};
+/// @endcond
+
+void EventuallyPersistentEngine::setHashStats(
+                    std::vector<std::pair<std::string, std::string> > &hs) {
+    std::list<const void*> waiting;
+    {
+        LockHolder lh(hashStats.mutex);
+        hashStats.stats.swap(hs);
+        hashStats.time = ep_current_time();
+        // A zero time means there are no stats.
+        if (hashStats.time == 0) {
+            hashStats.time = 1;
         }
+        hashStats.updating = false;
+        waiting.swap(hashStats.waiting);
+    }
+    notifyIOComplete(waiting, ENGINE_SUCCESS);
+}
 
-        const void *cookie;
-        ADD_STAT add_stat;
-    };
+void EventuallyPersistentEngine::abortHashStats() {
+    std::list<const void*> waiting;
+    {
+        LockHolder lh(hashStats.mutex);
+        hashStats.updating = false;
+        waiting.swap(hashStats.waiting);
+    }
+    notifyIOComplete(waiting, ENGINE_TMPFAIL);
+}
 
-    StatVBucketVisitor svbv(cookie, add_stat);
-    epstore->visit(svbv);
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
+                                                          ADD_STAT add_stat) {
+    // Walking every hash table takes seconds on a large node, so it is
+    // done by a HashStatsTask. Requests are answered from the result of
+    // the last walk, and only the very first one waits for a walk.
+    std::vector<std::pair<std::string, std::string> > hs;
+    rel_time_t now = ep_current_time();
+    rel_time_t age = 0;
+    {
+        LockHolder lh(hashStats.mutex);
+        bool waited = getEngineSpecific(cookie) != NULL;
+        if (waited) {
+            storeEngineSpecific(cookie, NULL);
+        }
+        if (!hashStats.updating && !waited &&
+            (hashStats.time == 0 ||
+             now - hashStats.time >= configuration.getHashStatsMaxAge())) {
+            ExTask task = new HashStatsTask(this);
+            ExecutorPool::get()->schedule(task, NONIO_TASK_IDX);
+            hashStats.updating = true;
+        }
+        if (hashStats.time == 0) {
+            if (waited) {
+                // The walk we waited for was cancelled.
+                return ENGINE_TMPFAIL;
+            }
+            hashStats.waiting.push_back(cookie);
+            storeEngineSpecific(cookie, this);
+            return ENGINE_EWOULDBLOCK;
+        }
+        hs = hashStats.stats;
+        age = now > hashStats.time ? now - hashStats.time : 0;
+    }
 
+    add_casted_stat("hash_stats_age", age, add_stat, cookie);
+    std::vector<std::pair<std::string, std::string> >::iterator it;
+    for (it = hs.begin(); it != hs.end(); ++it) {
+        add_casted_stat(it->first.c_str(), it->second.c_str(), add_stat,
+                        cookie);
+    }
     return ENGINE_SUCCESS;
 }
 
@@ -4477,6 +4649,36 @@ EventuallyPersistentEngine::changeTapVBFilter(const void *cookie,
                         0, cookie);
 }
 
+ENGINE_ERROR_CODE
+EventuallyPersistentEngine::uprFlowControl(const void *cookie,
+                                           protocol_binary_request_upr_buffer *request,
+                                           ADD_RESPONSE response)
+{
+    if (request->message.header.request.extlen != sizeof(uint32_t) ||
+        request->message.header.request.keylen != 0 ||
+        ntohl(request->message.header.request.bodylen) != sizeof(uint32_t)) {
+        return ENGINE_EINVAL;
+    }
+
+    UprProducer *producer = getUprProducer(cookie);
+    if (!producer) {
+        LOG(EXTENSION_LOG_WARNING, "Flow control message on a connection "
+            "that is not a UPR producer, disconnecting");
+        return ENGINE_DISCONNECT;
+    }
+
+    uint32_t bytes = ntohl(request->message.body.buffer_bytes);
+    if (request->message.header.request.opcode == CMD_UPR_SET_BUFFER_SIZE) {
+        producer->setBufferSize(bytes);
+    } else {
+        producer->bufferAcknowledgement(bytes);
+    }
+
+    return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
 ENGINE_ERROR_CODE
 EventuallyPersistentEngine::handleTrafficControlCmd(const void *cookie,
                                                     protocol_binary_request_header *request,
@@ -37,6 +37,7 @@
 #include "item_pager.h"
 #include "kvstore.h"
 #include "locks.h"
+#include "slab_allocator.h"
 #include "tapconnection.h"
 #include "tapconnmap.h"
 #include "tapthrottle.h"
@@ -223,7 +224,12 @@ public:
     void itemRelease(const void* cookie, item *itm)
     {
         (void)cookie;
-        delete (Item*)itm;
+        Item *it = reinterpret_cast<Item*>(itm);
+        if (it->isPooled()) {
+            tapConnMap->getItemPool().release(it);
+        } else {
+            delete it;
+        }
     }
 
     ENGINE_ERROR_CODE get(const void* cookie,
@@ -249,6 +255,37 @@ public:
         return ret;
     }
 
+    /**
+     * Get a batch of keys, e.g. for a multi-get, with the hash table
+     * locks and background fetches shared between keys. The caller gets
+     * the keys that would block again once the cookie is notified.
+     */
+    ENGINE_ERROR_CODE getMulti(const void* cookie,
+                               std::vector<MultiGetItem> &items)
+    {
+        if (items.empty()) {
+            return ENGINE_SUCCESS;
+        }
+        hrtime_t start = gethrtime();
+        ENGINE_ERROR_CODE ret = epstore->getMulti(items, cookie,
+                                                  serverApi->core);
+
+        if (isDegradedMode()) {
+            std::vector<MultiGetItem>::iterator it;
+            for (it = items.begin(); it != items.end(); ++it) {
+                ENGINE_ERROR_CODE st = it->value.getStatus();
+                if (st == ENGINE_KEY_ENOENT || st == ENGINE_NOT_MY_VBUCKET) {
+                    it->value.setStatus(ENGINE_TMPFAIL);
+                }
+            }
+        }
+
+        // Account for the time spent per key, as for single gets.
+        hrtime_t spent = (gethrtime() - start) / 1000;
+        stats.getCmdHisto.add(spent / items.size(), items.size());
+        return ret;
+    }
+
     const char* getName() {
         return name.c_str();
     }
@@ -423,6 +460,10 @@ public:
                                         uint16_t vbucket,
                                         upr_add_failover_log callback);
 
+    ENGINE_ERROR_CODE uprFlowControl(const void* cookie,
+                                     protocol_binary_request_upr_buffer *request,
+                                     ADD_RESPONSE response);
+
 
     // UPR consumer interface
     ENGINE_ERROR_CODE uprStreamEnd(const void* cookie,
@@ -563,6 +604,18 @@ public:
     ENGINE_ERROR_CODE reserveCookie(const void *cookie);
     ENGINE_ERROR_CODE releaseCookie(const void *cookie);
 
+    /**
+     * Replace the cached hash stats with the result of a walk over the
+     * hash tables, and wake up the connections waiting for it.
+     */
+    void setHashStats(std::vector<std::pair<std::string, std::string> > &hs);
+
+    /**
+     * Forget about a hash stats walk that was cancelled before it was
+     * done, and fail the connections waiting for it with TMPFAIL.
+     */
+    void abortHashStats();
+
     void storeEngineSpecific(const void *cookie, void *engine_data) {
         EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
         serverApi->cookie->store_engine_specific(cookie, engine_data);
@@ -680,6 +733,8 @@ public:
         delete checkpointConfig;
         delete tapThrottle;
         delete uprConnMap_;
+        // Last, as everything above may still hand memory back to it.
+        delete slabAllocator;
     }
 
     engine_info *getInfo() {
@@ -702,6 +757,12 @@ public:
 
     CheckpointConfig &getCheckpointConfig() { return *checkpointConfig; }
 
+    /**
+     * Get the allocator for items and values, or NULL if this engine
+     * uses the system allocator.
+     */
+    SlabAllocator *getSlabAllocator() { return slabAllocator; }
+
     SERVER_HANDLE_V1* getServerApi() { return serverApi; }
 
     Configuration &getConfiguration() {
@@ -895,6 +956,18 @@ private:
     TapThrottle *tapThrottle;
     std::map<const void*, Item*> lookups;
     Mutex lookupMutex;
+
+    //! Hash stats of all vbuckets, as of the last HashStatsTask.
+    struct HashStatsCache {
+        HashStatsCache() : time(0), updating(false) { }
+
+        Mutex mutex;
+        std::vector<std::pair<std::string, std::string> > stats;
+        //! When the walk finished, 0 if there wasn't any yet.
+        rel_time_t time;
+        bool updating;
+        std::list<const void*> waiting;
+    } hashStats;
     GET_SERVER_API getServerApiFunc;
     union {
         engine_info info;
@@ -905,6 +978,7 @@ private:
     TapConnMap *tapConnMap;
     TapConfig *tapConfig;
     CheckpointConfig *checkpointConfig;
+    SlabAllocator *slabAllocator;
     std::string name;
     size_t maxItemSize;
     size_t getlDefaultTimeout;
@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "epoch.h"
+#include "locks.h"
+
+const size_t EpochManager::MAX_READERS;
+
+EpochManager::EpochManager() : epoch(1), slots(new Slot[MAX_READERS]),
+                               numSlots(0), tls(releaseSlot) {
+}
+
+EpochManager::~EpochManager() {
+    std::vector<Retired>::iterator it;
+    for (it = retired.begin(); it != retired.end(); ++it) {
+        it->destroy(it->obj);
+    }
+    delete []slots;
+}
+
+EpochManager::Slot *EpochManager::claimSlot() {
+    for (size_t i = 0; i < MAX_READERS; ++i) {
+        bool inUse = false;
+        if (!slots[i].inUse && slots[i].inUse.compare_exchange_strong(inUse,
+                                                                      true)) {
+            // Make the slot visible to reclaim() before it gets an epoch.
+            atomic_setIfBigger(numSlots, i + 1);
+            tls = &slots[i];
+            return &slots[i];
+        }
+    }
+    LOG(EXTENSION_LOG_WARNING, "More than %lu threads entered an epoch",
+        static_cast<unsigned long>(MAX_READERS));
+    abort();
+    return NULL;
+}
+
+void EpochManager::releaseSlot(void *arg) {
+    Slot *slot = static_cast<Slot*>(arg);
+    slot->depth = 0;
+    slot->epoch.store(0);
+    slot->inUse.store(false);
+}
+
+void EpochManager::retire(destructor_t destroy, void *obj) {
+    LockHolder lh(retiredMutex);
+    retired.push_back(Retired(destroy, obj, epoch.load()));
+}
+
+bool EpochManager::reclaim() {
+    uint64_t oldest = ++epoch;
+    size_t n = numSlots.load();
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t e = slots[i].epoch.load();
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+
+    // Any reader that could have seen an object retired in an earlier
+    // epoch than the oldest active one has left.
+    std::vector<Retired> expired;
+    LockHolder lh(retiredMutex);
+    std::vector<Retired>::iterator it = retired.begin();
+    while (it != retired.end()) {
+        if (it->epoch < oldest) {
+            expired.push_back(*it);
+            it = retired.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    bool empty = retired.empty();
+    lh.unlock();
+
+    for (it = expired.begin(); it != expired.end(); ++it) {
+        it->destroy(it->obj);
+    }
+    return empty;
+}
+
+size_t EpochManager::getNumRetired() {
+    LockHolder lh(retiredMutex);
+    return retired.size();
+}
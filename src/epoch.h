@@ -0,0 +1,157 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EPOCH_H_
+#define SRC_EPOCH_H_ 1
+
+#include "config.h"
+
+#include <assert.h>
+
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+/**
+ * Epoch based reclamation of objects shared with lock-free readers.
+ *
+ * A reader brackets its accesses with enter() and exit() (see
+ * EpochGuard), which only publish the current epoch in a slot owned by
+ * the calling thread. A writer unlinks an object first and then hands it
+ * to retire(); reclaim() destroys it once every reader that was active
+ * when it got retired has left.
+ *
+ * Guards may nest. A thread claims its slot on first use and gives it
+ * back when it exits.
+ */
+class EpochManager {
+public:
+
+    //! Most threads that may be inside a guard at the same time.
+    static const size_t MAX_READERS = 1024;
+
+    typedef void (*destructor_t)(void *);
+
+    EpochManager();
+
+    /**
+     * Destroy all objects still retired. No reader may be active.
+     */
+    ~EpochManager();
+
+    void enter() {
+        Slot *slot = current();
+        if (slot->depth++ == 0) {
+            // The store is followed by a full barrier, so the epoch is
+            // visible before the reader loads any shared pointer.
+            slot->epoch.store(epoch.load());
+        }
+    }
+
+    void exit() {
+        Slot *slot = tls.get();
+        assert(slot && slot->depth > 0);
+        if (--slot->depth == 0) {
+            uint64_t e = slot->epoch.load();
+            // A full barrier, so the reader's loads complete first.
+            slot->epoch.compare_exchange_strong(e, 0);
+        }
+    }
+
+    /**
+     * Have an unlinked object destroyed once no reader can reach it.
+     */
+    void retire(destructor_t destroy, void *obj);
+
+    /**
+     * Advance the epoch and destroy the retired objects no active reader
+     * may still refer to.
+     *
+     * @return true if no retired object is left
+     */
+    bool reclaim();
+
+    /**
+     * Get the number of objects waiting to be destroyed.
+     */
+    size_t getNumRetired();
+
+private:
+
+    struct Slot {
+        Slot() : epoch(0), inUse(false), depth(0) { }
+
+        //! The epoch the reader entered in, 0 when not inside a guard.
+        Atomic<uint64_t> epoch;
+        Atomic<bool>     inUse;
+        int              depth;
+        // Keep the slots of different threads off each other's cache line.
+        char             pad[64];
+    };
+
+    struct Retired {
+        Retired(destructor_t d, void *o, uint64_t e) :
+            destroy(d), obj(o), epoch(e) { }
+
+        destructor_t destroy;
+        void        *obj;
+        uint64_t     epoch;
+    };
+
+    Slot *current() {
+        Slot *slot = tls.get();
+        return slot ? slot : claimSlot();
+    }
+
+    Slot *claimSlot();
+
+    static void releaseSlot(void *arg);
+
+    Atomic<uint64_t>      epoch;
+    Slot                 *slots;
+    //! Number of slots ever claimed; the rest never need to be scanned.
+    Atomic<size_t>        numSlots;
+    ThreadLocalPtr<Slot>  tls;
+
+    Mutex                 retiredMutex;
+    std::vector<Retired>  retired;
+
+    DISALLOW_COPY_AND_ASSIGN(EpochManager);
+};
+
+/**
+ * Keeps the calling thread inside an epoch for its lifetime.
+ */
+class EpochGuard {
+public:
+    EpochGuard(EpochManager &m) : manager(m) {
+        manager.enter();
+    }
+
+    ~EpochGuard() {
+        manager.exit();
+    }
+
+private:
+    EpochManager &manager;
+
+    DISALLOW_COPY_AND_ASSIGN(EpochGuard);
+};
+
+#endif  // SRC_EPOCH_H_
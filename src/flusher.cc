@@ -220,6 +220,12 @@ void Flusher::completeFlush() {
 }
 
 double Flusher::computeMinSleepTime() {
+    if (waitingForFlushAll()) {
+        // Nothing gets flushed until the primary shard has deleted all
+        // data, so check back shortly instead of spinning on it.
+        minSleepTime = DEFAULT_MIN_SLEEP_TIME;
+        return FLUSH_ALL_POLL_TIME;
+    }
     if (!canSnooze() || shard->highPriorityCount.load() > 0) {
         minSleepTime = DEFAULT_MIN_SLEEP_TIME;
         return 0;
@@ -228,8 +234,12 @@ double Flusher::computeMinSleepTime() {
     return std::min(minSleepTime, 1.0);
 }
 
+bool Flusher::waitingForFlushAll() {
+    return store->diskFlushAll && shard->getId() != EP_PRIMARY_SHARD;
+}
+
 void Flusher::flushVB(void) {
-    if (store->diskFlushAll && shard->getId() != EP_PRIMARY_SHARD) {
+    if (waitingForFlushAll()) {
         // another shard is doing disk flush
         bool inverse = false;
         pendingMutation.compare_exchange_strong(inverse, true);
@@ -267,6 +277,18 @@ void Flusher::flushVB(void) {
     if (hpVbs.empty() && lpVbs.empty()) {
         LOG(EXTENSION_LOG_INFO, "Trying to flush but no vbucket exist");
         return;
+    } else if (store->isGroupCommitEnabled()) {
+        if (!hpVbs.empty()) {
+            store->flushVBuckets(hpVbs);
+        } else {
+            size_t taken = store->flushVBuckets(lpVbs);
+            if (doHighPriority) {
+                numHighPriority -= std::min(taken, numHighPriority);
+                if (numHighPriority == 0) {
+                    doHighPriority = false;
+                }
+            }
+        }
     } else if (!hpVbs.empty()) {
         uint16_t vbid = hpVbs.front();
         hpVbs.pop();
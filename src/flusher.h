@@ -45,6 +45,8 @@ enum flusher_state {
 class Flusher;
 
 const double DEFAULT_MIN_SLEEP_TIME = MIN_SLEEP_TIME;
+//! How often a flusher checks whether a pending flush all is done (sec).
+const double FLUSH_ALL_POLL_TIME = 0.1;
 
 class KVShard;
 /**
@@ -95,6 +97,7 @@ private:
     void completeFlush();
     void schedule_UNLOCKED();
     double computeMinSleepTime();
+    bool waitingForFlushAll();
 
     const char * stateName(enum flusher_state st) const;
 
@@ -52,3 +52,39 @@ bool Item::prepend(const Item &i) {
     value.reset(newData);
     return true;
 }
+
+const size_t ItemPool::MAX_FREE_ITEMS;
+
+ItemPool::~ItemPool() {
+    std::vector<Item*>::iterator it = freeItems.begin();
+    for (; it != freeItems.end(); ++it) {
+        delete *it;
+    }
+}
+
+Item *ItemPool::acquire() {
+    {
+        LockHolder lh(lock);
+        if (!freeItems.empty()) {
+            Item *itm = freeItems.back();
+            freeItems.pop_back();
+            return itm;
+        }
+    }
+    Item *itm = new Item(std::string(), 0, 0, value_t());
+    itm->pooled = true;
+    return itm;
+}
+
+void ItemPool::release(Item *itm) {
+    assert(itm->isPooled());
+    // Don't keep the value alive while the item sits in the pool.
+    itm->reset(std::string(), 0, 0, value_t());
+    LockHolder lh(lock);
+    if (freeItems.size() < MAX_FREE_ITEMS) {
+        freeItems.push_back(itm);
+        return;
+    }
+    lh.unlock();
+    delete itm;
+}
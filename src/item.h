@@ -26,6 +26,7 @@
 
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include "atomic.h"
 #include "locks.h"
@@ -51,7 +52,7 @@ public:
      */
     static Blob* New(const char *start, const size_t len) {
         size_t total_len = len + sizeof(Blob);
-        Blob *t = new (::operator new(total_len)) Blob(start, len);
+        Blob *t = new (ObjectRegistry::allocate(total_len)) Blob(start, len);
         assert(t->length() == len);
         return t;
     }
@@ -76,7 +77,7 @@ public:
      */
     static Blob* New(const size_t len) {
         size_t total_len = len + sizeof(Blob);
-        Blob *t = new (::operator new(total_len)) Blob(len);
+        Blob *t = new (ObjectRegistry::allocate(total_len)) Blob(len);
         assert(t->length() == len);
         return t;
     }
@@ -114,7 +115,7 @@ public:
     // This is necessary for making C++ happy when I'm doing a
     // placement new on fairly "normal" c++ heap allocations, just
     // with variable-sized objects.
-    void operator delete(void* p) { ::operator delete(p); }
+    void operator delete(void* p) { ObjectRegistry::deallocate(p); }
 
     ~Blob() {
         ObjectRegistry::onDeleteBlob(this);
@@ -179,7 +180,8 @@ public:
     Item(const void* k, const size_t nk, const size_t nb,
          const uint32_t fl, const time_t exp, uint64_t theCas = 0,
          int64_t i = -1, uint16_t vbid = 0) :
-        metaData(theCas, 1, fl, exp), bySeqno(i), vbucketId(vbid), deleted(false)
+        metaData(theCas, 1, fl, exp), bySeqno(i), vbucketId(vbid), deleted(false),
+        pooled(false)
     {
         key.assign(static_cast<const char*>(k), nk);
         assert(bySeqno != 0);
@@ -190,7 +192,8 @@ public:
     Item(const std::string &k, const uint32_t fl, const time_t exp,
          const void *dta, const size_t nb, uint64_t theCas = 0,
          int64_t i = -1, uint16_t vbid = 0) :
-        metaData(theCas, 1, fl, exp), bySeqno(i), vbucketId(vbid), deleted(false)
+        metaData(theCas, 1, fl, exp), bySeqno(i), vbucketId(vbid), deleted(false),
+        pooled(false)
     {
         key.assign(k);
         assert(bySeqno != 0);
@@ -202,7 +205,7 @@ public:
          const value_t &val, uint64_t theCas = 0,  int64_t i = -1,
          uint16_t vbid = 0, uint64_t sno = 1) :
         metaData(theCas, sno, fl, exp), value(val), bySeqno(i), vbucketId(vbid),
-        deleted(false)
+        deleted(false), pooled(false)
     {
         assert(bySeqno != 0);
         key.assign(k);
@@ -213,7 +216,7 @@ public:
          const void *dta, const size_t nb, uint64_t theCas = 0,
          int64_t i = -1, uint16_t vbid = 0, uint64_t sno = 1) :
         metaData(theCas, sno, fl, exp), bySeqno(i), vbucketId(vbid),
-        deleted(false)
+        deleted(false), pooled(false)
     {
         assert(bySeqno != 0);
         key.assign(static_cast<const char*>(k), nk);
@@ -357,6 +360,30 @@ public:
         deleted = true;
     }
 
+    /**
+     * Make this item refer to another key, value and metadata. The value
+     * is shared, not copied, and the key reuses the item's memory.
+     */
+    void reset(const std::string &k, const uint32_t fl, const time_t exp,
+               const value_t &val, uint64_t theCas = 0, int64_t i = -1,
+               uint16_t vbid = 0, uint64_t sno = 1) {
+        ObjectRegistry::onDeleteItem(this);
+        metaData = ItemMetaData(theCas, sno, fl, exp);
+        value.reset(val);
+        key.assign(k);
+        bySeqno = i;
+        vbucketId = vbid;
+        deleted = false;
+        ObjectRegistry::onCreateItem(this);
+    }
+
+    /**
+     * True if this item belongs to an ItemPool.
+     */
+    bool isPooled() const {
+        return pooled;
+    }
+
     static uint64_t nextCas(void) {
         uint64_t ret = gethrtime();
         if ((ret & 1000) == 0) {
@@ -393,10 +420,45 @@ private:
     int64_t bySeqno;
     uint16_t vbucketId;
     bool deleted;
+    bool pooled;
+
+    friend class ItemPool;
 
     static Atomic<uint64_t> casCounter;
     static const uint32_t metaDataSize;
     DISALLOW_COPY_AND_ASSIGN(Item);
 };
 
+/**
+ * A free list of items for connections that hand out an item per
+ * message and get it back once the message is sent, so that shipping a
+ * resident value costs neither an allocation nor a copy of the value.
+ */
+class ItemPool {
+public:
+
+    //! The number of released items kept for reuse.
+    static const size_t MAX_FREE_ITEMS = 1024;
+
+    ItemPool() { }
+
+    ~ItemPool();
+
+    /**
+     * Get an item to reset() and hand out.
+     */
+    Item *acquire();
+
+    /**
+     * Take back an item handed out by acquire(), dropping its value.
+     */
+    void release(Item *itm);
+
+private:
+    Mutex              lock;
+    std::vector<Item*> freeItems;
+
+    DISALLOW_COPY_AND_ASSIGN(ItemPool);
+};
+
 #endif  // SRC_ITEM_H_
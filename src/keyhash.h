@@ -0,0 +1,85 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_KEYHASH_H_
+#define SRC_KEYHASH_H_ 1
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Compute the 64-bit hash of a key.
+ *
+ * This is MurmurHash64A (public domain, Austin Appleby). The key is
+ * consumed eight bytes per round instead of one, which keeps the
+ * dependency chain short for the long document ids we usually see.
+ * Loads go through memcpy, so the key does not need to be aligned.
+ *
+ * @param key the beginning of the key
+ * @param len the number of bytes in the key
+ * @return the hash value
+ */
+inline uint64_t keyhash(const char *key, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x9747b28cULL ^ (static_cast<uint64_t>(len) * m);
+
+    const char *end = key + (len & ~static_cast<size_t>(7));
+    for (; key != end; key += 8) {
+        uint64_t k;
+        memcpy(&k, key, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char *tail = reinterpret_cast<const unsigned char*>(key);
+    switch (len & 7) {
+    case 7:
+        h ^= static_cast<uint64_t>(tail[6]) << 48;
+        // FALLTHROUGH
+    case 6:
+        h ^= static_cast<uint64_t>(tail[5]) << 40;
+        // FALLTHROUGH
+    case 5:
+        h ^= static_cast<uint64_t>(tail[4]) << 32;
+        // FALLTHROUGH
+    case 4:
+        h ^= static_cast<uint64_t>(tail[3]) << 24;
+        // FALLTHROUGH
+    case 3:
+        h ^= static_cast<uint64_t>(tail[2]) << 16;
+        // FALLTHROUGH
+    case 2:
+        h ^= static_cast<uint64_t>(tail[1]) << 8;
+        // FALLTHROUGH
+    case 1:
+        h ^= static_cast<uint64_t>(tail[0]);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+#endif  // SRC_KEYHASH_H_
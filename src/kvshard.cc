@@ -23,8 +23,13 @@
 #include "flusher.h"
 #include "kvshard.h"
 
-KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
-    shardId(id), highPrioritySnapshot(false), lowPrioritySnapshot(false),
+static void releaseBucket(void *arg) {
+    delete static_cast<RCPtr<VBucket>*>(arg);
+}
+
+KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store,
+                 EpochManager &em) :
+    epochs(em), shardId(id), highPrioritySnapshot(false), lowPrioritySnapshot(false),
     highPriorityCount(0)
 {
     EPStats &stats = store.getEPEngine().getEpStats();
@@ -75,12 +80,25 @@ RCPtr<VBucket> KVShard::getBucket(uint16_t id) const {
     return vbuckets[id];
 }
 
+void KVShard::replaceBucket(uint16_t id, const RCPtr<VBucket> &vb) {
+    RCPtr<VBucket> *old = new RCPtr<VBucket>(vbuckets[id]);
+    vbuckets[id].reset(vb);
+    // Only retire once unlinked: a reader entering after the retirement
+    // must not find the old vbucket in the slot any more.
+    if (*old) {
+        epochs.retire(releaseBucket, old);
+    } else {
+        delete old;
+    }
+    epochs.reclaim();
+}
+
 void KVShard::setBucket(const RCPtr<VBucket> &vb) {
-    vbuckets[vb->getId()].reset(vb);
+    replaceBucket(vb->getId(), vb);
 }
 
 void KVShard::resetBucket(uint16_t id) {
-    vbuckets[id].reset();
+    replaceBucket(id, RCPtr<VBucket>());
 }
 
 std::vector<int> KVShard::getVBucketsSortedByState() {
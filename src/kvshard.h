@@ -30,6 +30,7 @@
 #include <vector>
 
 #include "bgfetcher.h"
+#include "epoch.h"
 #include "kvstore.h"
 
 
@@ -52,6 +53,7 @@
  *   | lowPrioritySnapshot: bool       |
  *   |                                 |
  *   | vbuckets: VBucket[] (partitions)|----> [(VBucket),(VBucket)..]
+ *   | epochs: EpochManager (shared)   |
  *   |                                 |
  *   | flusher: Flusher                |
  *   | BGFetcher: bgFetcher            |
@@ -65,7 +67,8 @@ class Flusher;
 class KVShard {
     friend class VBucketMap;
 public:
-    KVShard(uint16_t id, EventuallyPersistentStore &store);
+    KVShard(uint16_t id, EventuallyPersistentStore &store,
+            EpochManager &em);
     ~KVShard();
 
     KVStore *getRWUnderlying();
@@ -74,10 +77,43 @@ public:
     Flusher *getFlusher();
     BgFetcher *getBgFetcher();
 
+    /**
+     * Get a reference to a vbucket.
+     */
     RCPtr<VBucket> getBucket(uint16_t id) const;
+
+    /**
+     * Get a vbucket without taking a reference or any lock. The caller
+     * must be inside an epoch of getEpochs() for as long as it uses the
+     * vbucket; a vbucket replaced concurrently is only released once the
+     * epoch is left. The front end get and set look up their vbucket
+     * this way, as they don't keep it past the call.
+     */
+    VBucket *peekBucket(uint16_t id) const {
+        return vbuckets[id].get();
+    }
+
+    /**
+     * Replace the vbucket in a slot. The previous vbucket is released
+     * once no concurrent lookup may still be using it; changes to a slot
+     * must be serialized by the caller.
+     */
     void setBucket(const RCPtr<VBucket> &b);
     void resetBucket(uint16_t id);
 
+    /**
+     * Release the replaced vbuckets no lookup is using any more.
+     *
+     * @return true if no replaced vbucket is left to release
+     */
+    bool reclaimBuckets() {
+        return epochs.reclaim();
+    }
+
+    EpochManager &getEpochs() {
+        return epochs;
+    }
+
     uint16_t getId() { return shardId; }
     std::vector<int> getVBucketsSortedByState();
     std::vector<int> getVBuckets();
@@ -154,7 +190,12 @@ public:
     }
 
 private:
+    // Point the slot to another vbucket, and drop the reference the slot
+    // held once readers can't see it any more.
+    void replaceBucket(uint16_t id, const RCPtr<VBucket> &vb);
+
     RCPtr<VBucket> *vbuckets;
+    EpochManager &epochs;
 
     KVStore    *rwUnderlying;
     KVStore    *roUnderlying;
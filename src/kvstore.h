@@ -165,6 +165,17 @@ public:
      */
     virtual bool begin() = 0;
 
+    /**
+     * Begin a transaction that may hold writes to several vbuckets, all
+     * made durable together by commit(). Stores that can't do this
+     * commit each vbucket as they go.
+     *
+     * @return false if we cannot begin a transaction
+     */
+    virtual bool beginGroup() {
+        return begin();
+    }
+
     /**
      * Commit a transaction (unless not currently in one).
      *
@@ -262,6 +273,24 @@ public:
                       shared_ptr<Callback<GetValue> > cb,
                       shared_ptr<Callback<CacheLookup> > cl) = 0;
 
+    /**
+     * Pass the stored data of the given vbucket through the given
+     * callbacks in seqno order, like dump(), but stop once about maxBytes
+     * of items were passed, so that the dump can be resumed later.
+     *
+     * @param stSeqno the seqno to start at; set to the seqno to resume at
+     *                if the dump stopped early
+     * @return true if the dump went through to enSeqno
+     */
+    virtual bool dumpBatch(uint16_t vbid, uint64_t &stSeqno, uint64_t enSeqno,
+                           size_t maxBytes,
+                           shared_ptr<Callback<GetValue> > cb,
+                           shared_ptr<Callback<CacheLookup> > cl) {
+        (void)maxBytes;
+        dump(vbid, stSeqno, enSeqno, cb, cl);
+        return true;
+    }
+
     /**
      * Check if the kv-store supports a dumping all of the keys
      * @return true you may call dumpKeys() to do a prefetch
@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_MEMORY_BATCH_H_
+#define SRC_MEMORY_BATCH_H_ 1
+
+#include "config.h"
+
+#include "common.h"
+#include "stats.h"
+
+/**
+ * Memory accounting of one thread not yet added to the engine's stats.
+ *
+ * Keeping it per thread spares the allocator hooks an atomic update of a
+ * counter shared with every other thread. A counter is added to the
+ * stats as soon as it is off by more than BATCH_SIZE in either direction,
+ * so each thread skews the stats by at most that much.
+ *
+ * A batch may take away memory that another thread's batch has yet to
+ * add, so the stats may briefly be below what is really in use.
+ */
+class MemoryBatch {
+public:
+
+    static const int64_t BATCH_SIZE = 65536;
+
+    MemoryBatch() : totalMemory(0), currentSize(0), totalValueSize(0),
+                    memOverhead(0), discarding(false) { }
+
+    void addTotalMemory(EPStats &stats, int64_t delta) {
+        add(stats, totalMemory, delta);
+    }
+
+    void addValueSize(EPStats &stats, int64_t delta) {
+        if (!discarding) {
+            currentSize += delta;
+        }
+        add(stats, totalValueSize, delta);
+    }
+
+    void addOverhead(EPStats &stats, int64_t delta) {
+        add(stats, memOverhead, delta);
+    }
+
+    /**
+     * Drop what is batched, and everything added from now on until
+     * setDiscard(false), instead of adding it to any stats. For the
+     * memory freed while an engine gets deleted, whose stats may go away
+     * before the batch would be flushed.
+     */
+    void setDiscard(bool discard) {
+        discarding = discard;
+        totalMemory = currentSize = totalValueSize = memOverhead = 0;
+    }
+
+    /**
+     * Add everything batched to the stats.
+     */
+    void flush(EPStats &stats) {
+        if (totalMemory != 0) {
+            stats.totalMemory.fetch_add(static_cast<size_t>(totalMemory));
+            totalMemory = 0;
+            if (stats.memoryTrackerEnabled &&
+                stats.totalMemory.load() >= GIGANTOR) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Total memory in MemoryBatch::flush() >= GIGANTOR !!! "
+                    "Disable the memory tracker...\n");
+                stats.memoryTrackerEnabled.store(false);
+            }
+        }
+        if (currentSize != 0) {
+            stats.currentSize.fetch_add(static_cast<size_t>(currentSize));
+            currentSize = 0;
+        }
+        if (totalValueSize != 0) {
+            stats.totalValueSize.fetch_add(static_cast<size_t>(totalValueSize));
+            totalValueSize = 0;
+        }
+        if (memOverhead != 0) {
+            stats.memOverhead.fetch_add(static_cast<size_t>(memOverhead));
+            memOverhead = 0;
+        }
+    }
+
+private:
+
+    void add(EPStats &stats, int64_t &counter, int64_t delta) {
+        if (discarding) {
+            return;
+        }
+        counter += delta;
+        if (counter > BATCH_SIZE || counter < -BATCH_SIZE) {
+            flush(stats);
+        }
+    }
+
+    int64_t totalMemory;
+    // Moves with totalValueSize; blobs update both.
+    int64_t currentSize;
+    int64_t totalValueSize;
+    int64_t memOverhead;
+    bool    discarding;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryBatch);
+};
+
+#endif  // SRC_MEMORY_BATCH_H_
@@ -67,13 +67,27 @@ static void writeFully(int fd, const uint8_t *buf, size_t nbytes) {
     }
 }
 
+static size_t encodeVarint(uint64_t v, uint8_t *out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = static_cast<uint8_t>(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(v);
+    return n;
+}
+
+//! Set in the type byte of a compact entry that is followed by a vbucket.
+static const uint8_t COMPACT_VBUCKET_FLAG(0x80);
+
 uint64_t MutationLogEntry::rowid() const {
     return ntohll(_rowid);
 }
 
 MutationLog::MutationLog(const std::string &path,
-                         const size_t bs)
+                         const size_t bs, uint32_t version)
     : paddingHisto(GrowingWidthGenerator<uint32_t>(0, 8, 1.5), 32),
+    headerBlock(version),
     logPath(path),
     blockSize(bs),
     blockPos(HEADER_RESERVED),
@@ -82,8 +96,10 @@ MutationLog::MutationLog(const std::string &path,
     entryBuffer(static_cast<uint8_t*>(calloc(MutationLogEntry::len(256), 1))),
     blockBuffer(static_cast<uint8_t*>(calloc(bs, 1))),
     syncConfig(DEFAULT_SYNC_CONF),
-    readOnly(false)
+    readOnly(false),
+    prevVBucket(-1)
 {
+    assert(version == LOG_VERSION || version == LOG_VERSION_COMPACT);
     assert(entryBuffer);
     assert(blockBuffer);
     if (logPath == "") {
@@ -196,8 +212,13 @@ void MutationLog::readInitialBlock() {
 
     headerBlock.set(buf, sizeof(buf));
 
-    // These are reserved for future use.
-    assert(headerBlock.version() == LOG_VERSION);
+    if (headerBlock.version() != LOG_VERSION &&
+        headerBlock.version() != LOG_VERSION_COMPACT) {
+        std::stringstream ss;
+        ss << "Unsupported log version " << headerBlock.version();
+        throw ReadException(ss.str());
+    }
+    // This is reserved for future use.
     assert(headerBlock.blockCount() == 1);
 
     blockSize = headerBlock.blockSize();
@@ -305,10 +326,10 @@ void MutationLog::open(bool _readOnly) {
     } else {
         try {
             readInitialBlock();
-        } catch (ShortReadException &e) {
+        } catch (ReadException &e) {
             close();
             file = DISABLED_FD;
-            throw ShortReadException();
+            throw;
         }
 
         if (!readOnly) {
@@ -415,7 +436,44 @@ void MutationLog::flush() {
 
         blockPos = HEADER_RESERVED;
         entries = 0;
+        prevKey.clear();
+        prevVBucket = -1;
+    }
+}
+
+size_t MutationLog::encodeCompactEntry(const MutationLogEntry *mle,
+                                       uint8_t *out) {
+    size_t n = 0;
+    uint8_t type = mle->type();
+    if (type == ML_COMMIT1 || type == ML_COMMIT2) {
+        out[n++] = type;
+        return n;
     }
+
+    if (type == ML_DEL_ALL || mle->vbucket() != prevVBucket) {
+        out[n++] = type | COMPACT_VBUCKET_FLAG;
+        uint16_t vb = htons(mle->vbucket());
+        memcpy(out + n, &vb, sizeof(vb));
+        n += sizeof(vb);
+    } else {
+        out[n++] = type;
+    }
+    if (type == ML_DEL_ALL) {
+        return n;
+    }
+
+    const std::string key(mle->key());
+    size_t shared = 0;
+    size_t maxShared = std::min(key.length(), prevKey.length());
+    while (shared < maxShared && key[shared] == prevKey[shared]) {
+        ++shared;
+    }
+    out[n++] = static_cast<uint8_t>(shared);
+    out[n++] = static_cast<uint8_t>(key.length() - shared);
+    memcpy(out + n, key.data() + shared, key.length() - shared);
+    n += key.length() - shared;
+    n += encodeVarint(mle->rowid(), out + n);
+    return n;
 }
 
 void MutationLog::writeEntry(MutationLogEntry *mle) {
@@ -423,14 +481,35 @@ void MutationLog::writeEntry(MutationLogEntry *mle) {
     assert(isOpen());
     needWriteAccess();
 
-    size_t len(mle->len());
-    if (blockPos + len > blockSize) {
-        flush();
-    }
-    assert(len < blockSize);
+    if (headerBlock.version() == LOG_VERSION_COMPACT) {
+        uint8_t buf[LOG_ENTRY_BUF_SIZE];
+        size_t len(encodeCompactEntry(mle, buf));
+        if (blockPos + len > blockSize) {
+            flush();
+            // The new block starts without a previous entry.
+            len = encodeCompactEntry(mle, buf);
+        }
+        assert(len < blockSize);
+
+        memcpy(blockBuffer + blockPos, buf, len);
+        blockPos += len;
+        uint8_t type = mle->type();
+        if (type == ML_NEW || type == ML_DEL || type == ML_DEL_ALL) {
+            prevVBucket = mle->vbucket();
+        }
+        if (type == ML_NEW || type == ML_DEL) {
+            prevKey = mle->key();
+        }
+    } else {
+        size_t len(mle->len());
+        if (blockPos + len > blockSize) {
+            flush();
+        }
+        assert(len < blockSize);
 
-    memcpy(blockBuffer + blockPos, mle, len);
-    blockPos += len;
+        memcpy(blockBuffer + blockPos, mle, len);
+        blockPos += len;
+    }
     ++entries;
 
     ++itemsLogged[mle->type()];
@@ -470,7 +549,9 @@ MutationLog::iterator::iterator(const MutationLog *l, bool e)
     p(buf),
     offset(l->header().blockSize() * l->header().blockCount()),
     items(0),
-    isEnd(e)
+    isEnd(e),
+    entryLen(0),
+    prevVBucket(-1)
 {
     assert(log);
 }
@@ -482,7 +563,10 @@ MutationLog::iterator::iterator(const MutationLog::iterator& mit)
     p(NULL),
     offset(mit.offset),
     items(mit.items),
-    isEnd(mit.isEnd)
+    isEnd(mit.isEnd),
+    entryLen(mit.entryLen),
+    prevKey(mit.prevKey),
+    prevVBucket(mit.prevVBucket)
 {
     assert(log);
     if (mit.buf != NULL) {
@@ -505,20 +589,87 @@ MutationLog::iterator::~iterator() {
 }
 
 void MutationLog::iterator::prepItem() {
-    MutationLogEntry *e = MutationLogEntry::newEntry(p, bufferBytesRemaining());
     if (entryBuf == NULL) {
         entryBuf = static_cast<uint8_t*>(calloc(1, LOG_ENTRY_BUF_SIZE));
         assert(entryBuf);
     }
-    memcpy(entryBuf, p, e->len());
+    if (log->header().version() == LOG_VERSION_COMPACT) {
+        decodeCompactItem();
+        return;
+    }
+    MutationLogEntry *e = MutationLogEntry::newEntry(p, bufferBytesRemaining());
+    entryLen = e->len();
+    memcpy(entryBuf, p, entryLen);
+}
+
+void MutationLog::iterator::decodeCompactItem() {
+    const uint8_t *q = p;
+    const uint8_t *limit = p + bufferBytesRemaining();
+    uint8_t type = *q++;
+    bool hasVBucket = (type & COMPACT_VBUCKET_FLAG) != 0;
+    type &= ~COMPACT_VBUCKET_FLAG;
+    if (type > ML_COMMIT2) {
+        throw ReadException("Invalid compact log entry type");
+    }
+
+    uint16_t vb = 0;
+    uint64_t rowid = 0;
+    if (type == ML_NEW || type == ML_DEL || type == ML_DEL_ALL) {
+        if (hasVBucket) {
+            if (q + sizeof(vb) > limit) {
+                throw ShortReadException();
+            }
+            memcpy(&vb, q, sizeof(vb));
+            q += sizeof(vb);
+            prevVBucket = ntohs(vb);
+        } else if (prevVBucket < 0) {
+            throw ReadException("Compact log entry without a vbucket");
+        }
+        vb = static_cast<uint16_t>(prevVBucket);
+    }
+
+    if (type == ML_NEW || type == ML_DEL) {
+        if (q + 2 > limit) {
+            throw ShortReadException();
+        }
+        size_t shared = *q++;
+        size_t suffix = *q++;
+        if (shared > prevKey.length() || shared + suffix > 255 ||
+            q + suffix > limit) {
+            throw ReadException("Invalid compact log entry key");
+        }
+        prevKey.resize(shared);
+        prevKey.append(reinterpret_cast<const char*>(q), suffix);
+        q += suffix;
+
+        int shift = 0;
+        for (;;) {
+            if (q >= limit || shift > 63) {
+                throw ReadException("Invalid compact log entry rowid");
+            }
+            uint8_t byte = *q++;
+            rowid |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+            shift += 7;
+        }
+        MutationLogEntry::newEntry(entryBuf, rowid,
+                                   static_cast<mutation_log_type_t>(type),
+                                   vb, prevKey);
+    } else {
+        MutationLogEntry::newEntry(entryBuf, 0,
+                                   static_cast<mutation_log_type_t>(type),
+                                   vb, "");
+    }
+    entryLen = q - p;
 }
 
 MutationLog::iterator& MutationLog::iterator::operator++() {
     if (--items == 0) {
         nextBlock();
     } else {
-        size_t l(operator*()->len());
-        p += l;
+        p += entryLen;
 
         prepItem();
     }
@@ -582,6 +733,8 @@ void MutationLog::iterator::nextBlock() {
     items = ntohs(items);
 
     p = p + 4;
+    prevKey.clear();
+    prevVBucket = -1;
 
     prepItem();
 }
@@ -688,10 +841,16 @@ void MutationLogHarvester::apply(void *arg, mlCallbackWithQueue mlc) {
         unordered_map<std::string, uint64_t>::iterator it2 = committed[vb].begin();
         for (; it2 != committed[vb].end(); ++it2) {
             // cannot use rowid from access log, so must read from hashtable
-            std::string key = it2->first;
-            StoredValue *v = NULL;
-            if ((v = vbucket->ht.find(key, false))) {
-                fetches.push_back(std::make_pair(it2->first, v->getBySeqno()));
+            // and copy the seqno out before the bucket lock is dropped, as
+            // the defragmenter may relocate the StoredValue right after.
+            const std::string &key = it2->first;
+            int bucket_num(0);
+            uint64_t h = vbucket->ht.hash(key);
+            LockHolder lh = vbucket->ht.getLockedBucket(h, &bucket_num);
+            StoredValue *v = vbucket->ht.unlocked_find(key, h, bucket_num,
+                                                       false, false);
+            if (v) {
+                fetches.push_back(std::make_pair(key, v->getBySeqno()));
             }
         }
         mlc(vb, fetches, arg);
@@ -49,6 +49,8 @@ const size_t MIN_LOG_HEADER_SIZE(4096);
 const uint8_t MUTATION_LOG_MAGIC(0x45);
 const size_t HEADER_RESERVED(4);
 const uint32_t LOG_VERSION(1);
+//! Entries are prefix compressed against the previous entry of the block.
+const uint32_t LOG_VERSION_COMPACT(2);
 const size_t LOG_ENTRY_BUF_SIZE(512);
 const int DISABLED_FD(-3);
 
@@ -67,7 +69,8 @@ const uint8_t DEFAULT_SYNC_CONF(FLUSH_COMMIT_2 | SYNC_COMMIT_2);
  */
 class LogHeaderBlock {
 public:
-    LogHeaderBlock() : _version(htonl(LOG_VERSION)), _blockSize(0), _blockCount(0), _rdwr(1) {
+    LogHeaderBlock(uint32_t v = LOG_VERSION)
+        : _version(htonl(v)), _blockSize(0), _blockCount(0), _rdwr(1) {
     }
 
     void set(uint32_t bs, uint32_t bc=1) {
@@ -293,11 +296,22 @@ std::ostream& operator <<(std::ostream &out, const MutationLogEntry &mle);
 /**
  * The MutationLog records major key events to allow ep-engine to more
  * quickly restore the server to its previous state upon restart.
+ *
+ * Entries are written in the format of the version in the header of the
+ * file: new files get the version the log was created with, existing
+ * files keep theirs. Both versions read back as MutationLogEntry.
+ *
+ * In LOG_VERSION_COMPACT blocks each entry is a type byte (with 0x80
+ * set if a vbucket id follows), the number of leading key bytes shared
+ * with the previous entry of the block, the remaining key bytes and the
+ * rowid as a varint. Keys logged in order within a vbucket therefore
+ * cost little more than their distinct suffix.
  */
 class MutationLog {
 public:
 
-    MutationLog(const std::string &path, const size_t bs=4096);
+    MutationLog(const std::string &path, const size_t bs=4096,
+                uint32_t version=LOG_VERSION);
 
     ~MutationLog();
 
@@ -450,6 +464,7 @@ public:
         void nextBlock();
         size_t bufferBytesRemaining();
         void prepItem();
+        void decodeCompactItem();
 
         const MutationLog *log;
         uint8_t           *entryBuf;
@@ -458,6 +473,11 @@ public:
         off_t              offset;
         uint16_t           items;
         bool               isEnd;
+        //! Bytes the current entry takes in the block.
+        size_t             entryLen;
+        //! Key and vbucket of the previous compact entry of the block.
+        std::string        prevKey;
+        int                prevVBucket;
     };
 
     /**
@@ -494,6 +514,7 @@ private:
         }
     }
     void writeEntry(MutationLogEntry *mle);
+    size_t encodeCompactEntry(const MutationLogEntry *mle, uint8_t *out);
 
     bool writeInitialBlock();
     void readInitialBlock();
@@ -513,6 +534,9 @@ private:
     uint8_t           *blockBuffer;
     uint8_t            syncConfig;
     bool               readOnly;
+    //! Key and vbucket of the previous compact entry of the block.
+    std::string        prevKey;
+    int                prevVBucket;
 
     DISALLOW_COPY_AND_ASSIGN(MutationLog);
 };
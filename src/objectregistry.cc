@@ -18,10 +18,22 @@
 #include "config.h"
 
 #include "ep_engine.h"
+#include "memory_batch.h"
 #include "objectregistry.h"
+#include "slab_allocator.h"
 
 static ThreadLocal<EventuallyPersistentEngine*> *th;
 static ThreadLocal<Atomic<size_t>*> *initial_track;
+static ThreadLocal<MemoryBatch*> *batches;
+
+extern "C" {
+    static void releaseBatch(void *arg) {
+        // The engine may be gone by the time its thread exits, so what is
+        // left of the batch is dropped, and so is the batch's own memory.
+        th->set(NULL);
+        delete static_cast<MemoryBatch*>(arg);
+    }
+}
 
 /**
  * Object registry link hook for getting the registry thread local
@@ -33,6 +45,7 @@ public:
       if (th == NULL) {
          th = new ThreadLocal<EventuallyPersistentEngine*>();
          initial_track = new ThreadLocal<Atomic<size_t>*>();
+         batches = new ThreadLocal<MemoryBatch*>(releaseBatch);
       }
    }
 } install;
@@ -49,15 +62,18 @@ static bool verifyEngine(EventuallyPersistentEngine *engine)
    return true;
 }
 
+// A thread gets its batch before it runs for any engine.
+static MemoryBatch *getBatch() {
+    MemoryBatch *batch = batches->get();
+    assert(batch);
+    return batch;
+}
 
 void ObjectRegistry::onCreateBlob(Blob *blob)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.currentSize.fetch_add(blob->getSize());
-       stats.totalValueSize.fetch_add(blob->getSize());
-       assert(stats.currentSize.load() < GIGANTOR);
+       getBatch()->addValueSize(engine->getEpStats(), blob->getSize());
    }
 }
 
@@ -65,10 +81,8 @@ void ObjectRegistry::onDeleteBlob(Blob *blob)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.currentSize.fetch_sub(blob->getSize());
-       stats.totalValueSize.fetch_sub(blob->getSize());
-       assert(stats.currentSize.load() < GIGANTOR);
+       getBatch()->addValueSize(engine->getEpStats(),
+                                -static_cast<int64_t>(blob->getSize()));
    }
 }
 
@@ -76,9 +90,7 @@ void ObjectRegistry::onCreateQueuedItem(QueuedItem *qi)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.fetch_add(qi->size());
-       assert(stats.memOverhead.load() < GIGANTOR);
+       getBatch()->addOverhead(engine->getEpStats(), qi->size());
    }
 }
 
@@ -86,9 +98,8 @@ void ObjectRegistry::onDeleteQueuedItem(QueuedItem *qi)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.fetch_sub(qi->size());
-       assert(stats.memOverhead.load() < GIGANTOR);
+       getBatch()->addOverhead(engine->getEpStats(),
+                               -static_cast<int64_t>(qi->size()));
    }
 }
 
@@ -96,9 +107,8 @@ void ObjectRegistry::onCreateItem(Item *pItem)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.fetch_add(pItem->size() - pItem->getValMemSize());
-       assert(stats.memOverhead.load() < GIGANTOR);
+       getBatch()->addOverhead(engine->getEpStats(),
+                               pItem->size() - pItem->getValMemSize());
    }
 }
 
@@ -106,9 +116,9 @@ void ObjectRegistry::onDeleteItem(Item *pItem)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
-       EPStats &stats = engine->getEpStats();
-       stats.memOverhead.fetch_sub(pItem->size() - pItem->getValMemSize());
-       assert(stats.memOverhead.load() < GIGANTOR);
+       getBatch()->addOverhead(engine->getEpStats(),
+                               -static_cast<int64_t>(pItem->size() -
+                                                     pItem->getValMemSize()));
    }
 }
 
@@ -119,12 +129,44 @@ EventuallyPersistentEngine *ObjectRegistry::getCurrentEngine() {
 EventuallyPersistentEngine *ObjectRegistry::onSwitchThread(EventuallyPersistentEngine *engine,
                                                            bool want_old_thread_local)
 {
-    EventuallyPersistentEngine *old_engine = NULL;
-    if (want_old_thread_local) {
-        old_engine = th->get();
+    EventuallyPersistentEngine *old_engine = th->get();
+    MemoryBatch *batch = batches->get();
+    if (batch == NULL) {
+        // The thread didn't run for any engine yet, so this allocation
+        // isn't accounted anywhere.
+        batch = new MemoryBatch;
+        batches->set(batch);
+    } else if (old_engine != NULL && old_engine != engine) {
+        batch->flush(old_engine->getEpStats());
     }
     th->set(engine);
-    return old_engine;
+    return want_old_thread_local ? old_engine : NULL;
+}
+
+void ObjectRegistry::onDeleteEngine() {
+    EventuallyPersistentEngine *engine = th->get();
+    MemoryBatch *batch = getBatch();
+    assert(engine);
+    batch->flush(engine->getEpStats());
+    batch->setDiscard(true);
+}
+
+void ObjectRegistry::onEngineDeleted() {
+    getBatch()->setDiscard(false);
+    th->set(NULL);
+}
+
+void *ObjectRegistry::allocate(size_t len) {
+    EventuallyPersistentEngine *engine = th->get();
+    SlabAllocator *slabs = engine ? engine->getSlabAllocator() : NULL;
+    void *p = slabs ? slabs->allocate(len) : NULL;
+    return p ? p : ::operator new(len);
+}
+
+void ObjectRegistry::deallocate(void *p) {
+    if (p != NULL && !SlabAllocator::release(p)) {
+        ::operator delete(p);
+    }
 }
 
 void ObjectRegistry::setStats(Atomic<size_t>* init_track) {
@@ -139,14 +181,7 @@ bool ObjectRegistry::memoryAllocated(size_t mem) {
     if (!engine) {
         return false;
     }
-    EPStats &stats = engine->getEpStats();
-    stats.totalMemory.fetch_add(mem);
-    if (stats.memoryTrackerEnabled && stats.totalMemory.load() >= GIGANTOR) {
-        LOG(EXTENSION_LOG_WARNING,
-            "Total memory in memoryAllocated() >= GIGANTOR !!! "
-            "Disable the memory tracker...\n");
-        stats.memoryTrackerEnabled.store(false);
-    }
+    getBatch()->addTotalMemory(engine->getEpStats(), mem);
     return true;
 }
 
@@ -158,13 +193,7 @@ bool ObjectRegistry::memoryDeallocated(size_t mem) {
     if (!engine) {
         return false;
     }
-    EPStats &stats = engine->getEpStats();
-    stats.totalMemory.fetch_sub(mem);
-    if (stats.memoryTrackerEnabled && stats.totalMemory.load() >= GIGANTOR) {
-        LOG(EXTENSION_LOG_WARNING,
-            "Total memory in memoryDeallocated() >= GIGANTOR !!! "
-            "Disable the memory tracker...\n");
-        stats.memoryTrackerEnabled.store(false);
-    }
+    getBatch()->addTotalMemory(engine->getEpStats(),
+                               -static_cast<int64_t>(mem));
     return true;
 }
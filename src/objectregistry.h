@@ -36,9 +36,37 @@ public:
 
     static EventuallyPersistentEngine *getCurrentEngine();
 
+    /**
+     * Make the calling thread run for the given engine. Memory accounting
+     * batched for the previous engine is added to its stats first.
+     */
     static EventuallyPersistentEngine *onSwitchThread(EventuallyPersistentEngine *engine,
                                                       bool want_old_thread_local = false);
 
+    /**
+     * Add the memory accounting batched by the calling thread to the
+     * stats of the engine it runs for, and stop accounting for that
+     * engine because it is about to be deleted.
+     */
+    static void onDeleteEngine();
+
+    /**
+     * Make the calling thread run for no engine after deleting the one
+     * it ran for, dropping what was accounted during the delete.
+     */
+    static void onEngineDeleted();
+
+    /**
+     * Allocate memory for a stored value or blob from the slab allocator
+     * of the current engine, or the system allocator if it has none.
+     */
+    static void *allocate(size_t len);
+
+    /**
+     * Free memory obtained from allocate().
+     */
+    static void deallocate(void *p);
+
     static void setStats(Atomic<size_t>* init_track);
     static bool memoryAllocated(size_t mem);
     static bool memoryDeallocated(size_t mem);
@@ -50,4 +50,5 @@ const Priority Priority::ItemPagerPriority("item_pager_priority", 7);
 const Priority Priority::TapConnMgrPriority("tap_conn_manager_priority", 8);
 const Priority Priority::BackfillTaskPriority("backfill_task_priority", 8);
 const Priority Priority::HTResizePriority("hashtable_resize_priority", 211);
+const Priority Priority::DefragmenterPriority("defragmenter_priority", 212);
 const Priority Priority::TapResumePriority("tap_resume_priority", 316);
@@ -59,6 +59,7 @@ public:
     static const Priority HTResizePriority;
     static const Priority PendingOpsPriority;
     static const Priority TapConnMgrPriority;
+    static const Priority DefragmenterPriority;
 
     bool operator==(const Priority &other) const {
         return other.getPriorityValue() == this->priority;
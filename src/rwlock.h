@@ -0,0 +1,143 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_RWLOCK_H_
+#define SRC_RWLOCK_H_ 1
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+/**
+ * Abstraction built on top of pthread read/write locks.
+ *
+ * Waiting writers are preferred where the platform allows it, so that a
+ * steady stream of readers can't starve them. Read locks must therefore
+ * not be taken recursively.
+ */
+class RWLock {
+public:
+    RWLock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr,
+                                      PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        if (pthread_rwlock_init(&lock, &attr) != 0) {
+            abort();
+        }
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    ~RWLock() {
+        pthread_rwlock_destroy(&lock);
+    }
+
+private:
+    friend class ReaderLockHolder;
+    friend class WriterLockHolder;
+
+    void readerLock() {
+        if (pthread_rwlock_rdlock(&lock) != 0) {
+            abort();
+        }
+    }
+
+    void writerLock() {
+        if (pthread_rwlock_wrlock(&lock) != 0) {
+            abort();
+        }
+    }
+
+    void unlock() {
+        pthread_rwlock_unlock(&lock);
+    }
+
+    pthread_rwlock_t lock;
+
+    DISALLOW_COPY_AND_ASSIGN(RWLock);
+};
+
+/**
+ * RAII holder of the shared side of a RWLock.
+ */
+class ReaderLockHolder {
+public:
+    ReaderLockHolder(RWLock &l) : rwlock(l), locked(false) {
+        lock();
+    }
+
+    ~ReaderLockHolder() {
+        unlock();
+    }
+
+    void lock() {
+        rwlock.readerLock();
+        locked = true;
+    }
+
+    void unlock() {
+        if (locked) {
+            locked = false;
+            rwlock.unlock();
+        }
+    }
+
+private:
+    RWLock &rwlock;
+    bool locked;
+
+    DISALLOW_COPY_AND_ASSIGN(ReaderLockHolder);
+};
+
+/**
+ * RAII holder of the exclusive side of a RWLock.
+ */
+class WriterLockHolder {
+public:
+    WriterLockHolder(RWLock &l) : rwlock(l), locked(false) {
+        lock();
+    }
+
+    ~WriterLockHolder() {
+        unlock();
+    }
+
+    void lock() {
+        rwlock.writerLock();
+        locked = true;
+    }
+
+    void unlock() {
+        if (locked) {
+            locked = false;
+            rwlock.unlock();
+        }
+    }
+
+private:
+    RWLock &rwlock;
+    bool locked;
+
+    DISALLOW_COPY_AND_ASSIGN(WriterLockHolder);
+};
+
+#endif  // SRC_RWLOCK_H_
@@ -17,7 +17,8 @@
 
 #include "config.h"
 
-#include <queue>
+#include <algorithm>
+#include <vector>
 
 #include "common.h"
 #include "ep_engine.h"
@@ -30,6 +31,14 @@ Atomic<size_t> GlobalTask::task_id_counter = 1;
 Mutex ExecutorPool::initGuard;
 ExecutorPool *ExecutorPool::instance = NULL;
 
+// Most ready tasks a thread claims from a TaskQueue on top of the one it
+// runs; it never takes more than half of what is left.
+#define MAX_TASK_BATCH 4
+
+// A task running longer than this (usec) hands the tasks its thread had
+// claimed back to their TaskQueues, instead of keeping them waiting.
+#define TASK_BATCH_SLICE 10000
+
 extern "C" {
     static void launch_executor_thread(void *arg) {
         ExecutorThread *executor = (ExecutorThread*) arg;
@@ -83,8 +92,12 @@ void ExecutorThread::run() {
             ObjectRegistry::onSwitchThread(engine);
             if (currentTask->isdead()) {
                 manager->cancel(currentTask->taskId, true);
+                // The engine may go away once its task is done.
+                currentTask.reset();
+                ObjectRegistry::onSwitchThread(NULL);
                 continue;
             }
+            manager->recordSchedulingLatency(q, currentTask);
             taskStart = gethrtime();
             rel_time_t startReltime = ep_current_time();
             try {
@@ -124,12 +137,21 @@ void ExecutorThread::run() {
             }
 
             hrtime_t runtime((gethrtime() - taskStart) / 1000);
+            // After a long task, give back what we claimed and don't claim
+            // more on the next fetch, other threads are likely idle.
+            overran = runtime > TASK_BATCH_SLICE;
+            if (overran) {
+                manager->returnLocalTasks(*this);
+            }
             TaskLogEntry tle(currentTask->getDescription(), runtime,
                              startReltime);
             tasklog.add(tle);
             if (runtime > (hrtime_t)currentTask->maxExpectedDuration()) {
                 slowjobs.add(tle);
             }
+            // The engine may go away once its task is done.
+            currentTask.reset();
+            ObjectRegistry::onSwitchThread(NULL);
         }
     }
     state = EXECUTOR_DEAD;
@@ -140,6 +162,12 @@ void TaskQueue::pushReadyTask(ExTask &tid) {
     manager->moreWork();
 }
 
+void TaskQueue::returnReadyTask(ExTask &task) {
+    // Still counted as ready since it was claimed.
+    LockHolder lh(mutex);
+    readyQueue.push(task);
+}
+
 ExTask TaskQueue::popReadyTask(void) {
     ExTask t = readyQueue.top();
     readyQueue.pop();
@@ -147,8 +175,8 @@ ExTask TaskQueue::popReadyTask(void) {
     return t;
 }
 
-bool TaskQueue::fetchNextTask(ExTask &task, struct timeval &waketime,
-                              int &taskType, struct timeval now) {
+bool TaskQueue::fetchNextTask(ExecutorThread &thread, struct timeval now,
+                              bool batch) {
     bool inverse = false;
     if (!isLock.compare_exchange_strong(inverse, true)) {
         return false;
@@ -164,22 +192,36 @@ bool TaskQueue::fetchNextTask(ExTask &task, struct timeval &waketime,
 
     moveReadyTasks(now);
 
-    if (!futureQueue.empty() &&
-        less_tv(futureQueue.top()->waketime, waketime)) {
-        waketime = futureQueue.top()->waketime; // record earliest waketime
+    if (!futureQueue.empty()) {
+        // record earliest waketime
+        struct timeval due = futureQueue.nextDue();
+        if (less_tv(due, thread.waketime)) {
+            thread.waketime = due;
+        }
     }
 
-    manager->doneWork(taskType);
+    manager->doneWork(thread.curTaskType);
 
     if (!readyQueue.empty()) {
         if (readyQueue.top()->isdead()) {
-            task = popReadyTask();
+            thread.currentTask = popReadyTask();
             isLock.compare_exchange_strong(inverse, false);
             return true;
         }
-        taskType = manager->tryNewWork(queueType);
-        if (taskType != NO_TASK_TYPE) {
-            task = popReadyTask();
+        thread.curTaskType = manager->tryNewWork(queueType);
+        if (thread.curTaskType != NO_TASK_TYPE) {
+            thread.currentTask = popReadyTask();
+            if (batch && !thread.overran) {
+                // The claimed tasks stay counted as ready, so idle
+                // threads keep looking and steal them.
+                size_t n = std::min(readyQueue.size() / 2,
+                                    static_cast<size_t>(MAX_TASK_BATCH));
+                LockHolder tlh(thread.readyMutex);
+                for (; n > 0; --n) {
+                    thread.readyQ.push_back(TaskQpair(readyQueue.top(), this));
+                    readyQueue.pop();
+                }
+            }
             isLock.compare_exchange_strong(inverse, false);
             return true;
         }
@@ -194,39 +236,18 @@ void TaskQueue::moveReadyTasks(struct timeval tv) {
         return;
     }
 
-    std::queue<ExTask> notReady;
-    while (!futureQueue.empty()) {
-        ExTask tid = futureQueue.top();
-        if (less_tv(tid->waketime, tv)) {
-            pushReadyTask(tid);
-        } else {
-            // If we have woken a task recently the future queue might be out
-            // of order so we need to check each job.
-            if (hasWokenTask) {
-                notReady.push(tid);
-            } else {
-                return;
-            }
-        }
-        futureQueue.pop();
-    }
-    hasWokenTask = false;
-
-    while (!notReady.empty()) {
-        ExTask tid = notReady.front();
-        if (less_tv(tid->waketime, tv)) {
-            pushReadyTask(tid);
-        } else {
-            futureQueue.push(tid);
-        }
-        notReady.pop();
+    std::vector<ExTask> due;
+    futureQueue.expire(tv, due);
+    for (std::vector<ExTask>::iterator it = due.begin(); it != due.end();
+         ++it) {
+        pushReadyTask(*it);
     }
 }
 
 void TaskQueue::schedule(ExTask &task) {
     LockHolder lh(mutex);
 
-    futureQueue.push(task);
+    futureQueue.insert(task);
     manager->notifyAll();
 
     LOG(EXTENSION_LOG_DEBUG, "%s: Schedule a task \"%s\" id %d",
@@ -235,8 +256,8 @@ void TaskQueue::schedule(ExTask &task) {
 
 struct timeval TaskQueue::reschedule(ExTask &task) {
     LockHolder lh(mutex);
-    futureQueue.push(task);
-    return futureQueue.top()->waketime;
+    futureQueue.insert(task);
+    return futureQueue.nextDue();
 }
 
 void TaskQueue::wake(ExTask &task) {
@@ -244,10 +265,27 @@ void TaskQueue::wake(ExTask &task) {
     LOG(EXTENSION_LOG_DEBUG, "%s: Wake a task \"%s\" id %d", name.c_str(),
             task->getDescription().c_str(), task->getId());
     task->snooze(0, false);
-    hasWokenTask = true;
+    // A running task goes back to the wheel with its new waketime once
+    // it is done.
+    if (futureQueue.remove(task)) {
+        pushReadyTask(task);
+    }
     manager->notifyAll();
 }
 
+void TaskQueue::snooze(ExTask &task, double secs) {
+    LockHolder lh(mutex);
+    struct timeval due = futureQueue.nextDue();
+    task->snooze(secs, false);
+    if (futureQueue.remove(task)) {
+        futureQueue.insert(task);
+        if (less_tv(task->waketime, due)) {
+            // Sleeping threads may be waiting for a later waketime.
+            manager->notifyAll();
+        }
+    }
+}
+
 size_t ExecutorPool::getNumCPU(void) {
     size_t numCPU;
 #ifdef WIN32
@@ -300,18 +338,21 @@ ExecutorPool *ExecutorPool::get(void) {
 
 ExecutorPool::ExecutorPool(size_t maxThreads, size_t nTaskSets) :
                   numTaskSets(nTaskSets), numReadyTasks(0), highWaterMark(0),
-                  isHiPrioQset(false), isLowPrioQset(false), numBuckets(0) {
+                  numSleepers(0), isHiPrioQset(false), isLowPrioQset(false),
+                  numBuckets(0) {
     maxGlobalThreads = maxThreads ? maxThreads : 2 * getNumCPU();
-    curWorkers = (uint16_t *)calloc(nTaskSets, sizeof(uint16_t));
+    curWorkers = new Atomic<size_t>[nTaskSets];
     maxWorkers = (uint16_t *)malloc(nTaskSets*sizeof(uint16_t));
+    schedLatency = new Histogram<hrtime_t>[nTaskSets];
     for (size_t i = 0; i < nTaskSets; i++) {
         maxWorkers[i] = maxGlobalThreads;
     }
 }
 
 ExecutorPool::~ExecutorPool(void) {
-    free(curWorkers);
+    delete []curWorkers;
     free(maxWorkers);
+    delete []schedLatency;
     if (isHiPrioQset) {
         for (size_t i = 0; i < numTaskSets; i++) {
             delete hpTaskQ[i];
@@ -333,20 +374,27 @@ TaskQueue *ExecutorPool::nextTask(ExecutorThread &t, uint8_t tick) {
         return NULL;
     }
 
+    if (TaskQueue *q = popLocalTask(t)) {
+        return q;
+    }
+
     struct  timeval    now;
     gettimeofday(&now, NULL);
     size_t idx = t.startIndex;
 
+    // Only high priority bucket queues are drained in batches, so tasks of
+    // low priority buckets never wait in a thread's deque ahead of them.
     for (; !(tick % LOW_PRIORITY_FREQ); idx = (idx + 1) % numTaskSets) {
         if (isLowPrioQset &&
-             lpTaskQ[idx]->fetchNextTask(t.currentTask, t.waketime,
-                                         t.curTaskType, now)) {
+             lpTaskQ[idx]->fetchNextTask(t, now, false)) {
             return lpTaskQ[idx];
         } else if (isHiPrioQset &&
-             hpTaskQ[idx]->fetchNextTask(t.currentTask, t.waketime,
-                                         t.curTaskType, now)) {
+             hpTaskQ[idx]->fetchNextTask(t, now, true)) {
             return hpTaskQ[idx];
         } else if ((idx + 1) % numTaskSets == t.startIndex) {
+            if (TaskQueue *q = stealTask(t)) {
+                return q;
+            }
             if (!trySleep(t, now)) { // as all queues checked & got no task
                 return NULL; // executor is shutting down..
             }
@@ -355,14 +403,15 @@ TaskQueue *ExecutorPool::nextTask(ExecutorThread &t, uint8_t tick) {
 
     for (;; idx = (idx + 1) % numTaskSets) {
         if (isHiPrioQset &&
-             hpTaskQ[idx]->fetchNextTask(t.currentTask, t.waketime,
-                                         t.curTaskType, now)) {
+             hpTaskQ[idx]->fetchNextTask(t, now, true)) {
             return hpTaskQ[idx];
         } else if (isLowPrioQset &&
-             lpTaskQ[idx]->fetchNextTask(t.currentTask, t.waketime,
-                                         t.curTaskType, now)) {
+             lpTaskQ[idx]->fetchNextTask(t, now, false)) {
             return lpTaskQ[idx];
         } else if ((idx + 1) % numTaskSets == t.startIndex) {
+            if (TaskQueue *q = stealTask(t)) {
+                return q;
+            }
             if (!trySleep(t, now)) { // as all queues checked & got no task
                 return NULL; // executor is shutting down..
             }
@@ -371,39 +420,122 @@ TaskQueue *ExecutorPool::nextTask(ExecutorThread &t, uint8_t tick) {
     return NULL;
 }
 
+TaskQueue *ExecutorPool::popLocalTask(ExecutorThread &t) {
+    LockHolder lh(t.readyMutex);
+    if (t.readyQ.empty()) {
+        return NULL;
+    }
+    // Same task type as the last task, so t still holds a worker slot.
+    TaskQpair tqp = t.readyQ.front();
+    t.readyQ.pop_front();
+    lh.unlock();
+
+    t.currentTask = tqp.first;
+    lessWork();
+    return tqp.second;
+}
+
+void ExecutorPool::returnLocalTasks(ExecutorThread &t) {
+    std::deque<TaskQpair> tasks;
+    {
+        LockHolder lh(t.readyMutex);
+        tasks.swap(t.readyQ);
+    }
+    for (std::deque<TaskQpair>::iterator it = tasks.begin();
+         it != tasks.end(); ++it) {
+        it->second->returnReadyTask(it->first);
+    }
+    if (!tasks.empty()) {
+        notifyAll();
+    }
+}
+
+TaskQueue *ExecutorPool::stealTask(ExecutorThread &t) {
+    for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
+        ExecutorThread *victim = threadQ[tidx];
+        if (victim == &t) {
+            continue;
+        }
+        LockHolder lh(victim->readyMutex);
+        if (victim->readyQ.empty()) {
+            continue;
+        }
+        TaskQpair tqp = victim->readyQ.back();
+        if (!tqp.first->isdead()) {
+            doneWork(t.curTaskType);
+            t.curTaskType = tryNewWork(tqp.second->queueType);
+            if (t.curTaskType == NO_TASK_TYPE) {
+                continue;
+            }
+        }
+        victim->readyQ.pop_back();
+        lh.unlock();
+
+        t.currentTask = tqp.first;
+        lessWork();
+        return tqp.second;
+    }
+    return NULL;
+}
+
+void ExecutorPool::recordSchedulingLatency(TaskQueue *q, ExTask &task) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timeval due = task->waketime;
+    if (less_tv(due, now)) {
+        hrtime_t usec = (now.tv_sec - due.tv_sec) * 1000000 +
+                        (now.tv_usec - due.tv_usec);
+        schedLatency[q->queueType].add(usec);
+    } else {
+        schedLatency[q->queueType].add(0);
+    }
+}
+
 bool ExecutorPool::trySleep(ExecutorThread &t, struct timeval &now) {
-    LockHolder lh(mutex);
     if (!numReadyTasks && less_tv(now, t.waketime)) {
-        if (t.state == EXECUTOR_RUNNING) {
-            t.state = EXECUTOR_SLEEPING;
-        } else {
-            LOG(EXTENSION_LOG_DEBUG, "%s: shutting down %d tasks ready",
-                    t.getName().c_str(), numReadyTasks);
-            return false;
-        }
+        // moreWork() only takes the mutex to signal when it sees a
+        // sleeper, so announce ourselves before checking again under it.
+        ++numSleepers;
+        LockHolder lh(mutex);
+        if (!numReadyTasks) {
+            if (t.state == EXECUTOR_RUNNING) {
+                t.state = EXECUTOR_SLEEPING;
+            } else {
+                --numSleepers;
+                LOG(EXTENSION_LOG_DEBUG, "%s: shutting down %d tasks ready",
+                        t.getName().c_str(),
+                        static_cast<int>(numReadyTasks.load()));
+                return false;
+            }
 
-        LOG(EXTENSION_LOG_DEBUG, "%s: to sleep for %d s", t.getName().c_str(),
-                (t.waketime.tv_sec - now.tv_sec));
-        // zzz ....
-        if (is_max_tv(t.waketime)) { // in absence of reliable posting
-            advance_tv(now, MIN_SLEEP_TIME); // don't miss posts,
-            mutex.wait(now); // timed sleeps are the safe way to go
-        } else {
-            mutex.wait(t.waketime);
-        }
+            LOG(EXTENSION_LOG_DEBUG, "%s: to sleep for %d s",
+                    t.getName().c_str(), (t.waketime.tv_sec - now.tv_sec));
+            // zzz ....
+            if (is_max_tv(t.waketime)) { // in absence of reliable posting
+                advance_tv(now, MIN_SLEEP_TIME); // don't miss posts,
+                mutex.wait(now); // timed sleeps are the safe way to go
+            } else {
+                mutex.wait(t.waketime);
+            }
+
+            // got up ..
+            --numSleepers;
+            if (t.state == EXECUTOR_SLEEPING) {
+                t.state = EXECUTOR_RUNNING;
+            } else {
+                LOG(EXTENSION_LOG_DEBUG, "%s: shutting down %d tasks ready",
+                        t.getName().c_str(),
+                        static_cast<int>(numReadyTasks.load()));
+                return false;
+            }
 
-        // got up ..
-        if (t.state == EXECUTOR_SLEEPING) {
-            t.state = EXECUTOR_RUNNING;
+            gettimeofday(&now, NULL);
+            LOG(EXTENSION_LOG_DEBUG, "%s: woke up %d tasks ready",
+                    t.getName().c_str(),
+                    static_cast<int>(numReadyTasks.load()));
         } else {
-            LOG(EXTENSION_LOG_DEBUG, "%s: shutting down %d tasks ready",
-                    t.getName().c_str(), numReadyTasks);
-            return false;
+            --numSleepers;
         }
-
-        gettimeofday(&now, NULL);
-        LOG(EXTENSION_LOG_DEBUG, "%s: woke up %d tasks ready",
-        t.getName().c_str(), numReadyTasks);
     }
     set_max_tv(t.waketime);
     return true;
@@ -421,39 +553,41 @@ void ExecutorPool::notifyAll(void) {
 }
 
 void ExecutorPool::moreWork(void) {
-    LockHolder lh(mutex);
-    numReadyTasks++;
-    highWaterMark = (numReadyTasks > highWaterMark) ?
-                     numReadyTasks : highWaterMark;
+    size_t ready = numReadyTasks.fetch_add(1) + 1;
+    atomic_setIfBigger(highWaterMark, ready);
 
-    mutex.notifyOne();
+    if (numSleepers) {
+        LockHolder lh(mutex);
+        mutex.notifyOne();
+    }
 }
 
 void ExecutorPool::lessWork(void) {
     assert(numReadyTasks);
-    LockHolder lh(mutex);
-    numReadyTasks--;
+    --numReadyTasks;
 }
 
 void ExecutorPool::doneWork(int &curTaskType) {
-    LockHolder lh(mutex);
     // First record that a thread is done working on a particular queue type
     if (curTaskType != NO_TASK_TYPE) {
       LOG(EXTENSION_LOG_DEBUG, "Done with Task Type %d capacity = %d",
-              curTaskType, curWorkers[curTaskType]);
-      curWorkers[curTaskType]--;
+              curTaskType, static_cast<int>(curWorkers[curTaskType].load()));
+      --curWorkers[curTaskType];
     }
     curTaskType = NO_TASK_TYPE;
 }
 
 int ExecutorPool::tryNewWork(int newTaskType) {
-    LockHolder lh(mutex);
     // Test if a thread can take up task from the target Queue type
-    if (curWorkers[newTaskType] + 1 <= maxWorkers[newTaskType]) {
-        curWorkers[newTaskType]++;
-        LOG(EXTENSION_LOG_DEBUG, "Taking up work in task type %d capacity = %d",
-                newTaskType, curWorkers[newTaskType]);
-        return newTaskType;
+    size_t cur = curWorkers[newTaskType].load();
+    while (cur + 1 <= maxWorkers[newTaskType]) {
+        if (curWorkers[newTaskType].compare_exchange_strong(cur, cur + 1)) {
+            LOG(EXTENSION_LOG_DEBUG,
+                "Taking up work in task type %d capacity = %d",
+                newTaskType, static_cast<int>(cur + 1));
+            return newTaskType;
+        }
+        cur = curWorkers[newTaskType].load();
     }
 
     LOG(EXTENSION_LOG_DEBUG, "Limiting from taking up work in task "
@@ -462,14 +596,17 @@ int ExecutorPool::tryNewWork(int newTaskType) {
 }
 
 bool ExecutorPool::cancel(size_t taskId, bool eraseTask) {
-    LockHolder lh(tMutex);
-    std::map<size_t, TaskQpair>::iterator itr = taskLocator.find(taskId);
-    if (itr == taskLocator.end()) {
-        LOG(EXTENSION_LOG_DEBUG, "Task id %d not found");
+    size_t shard = taskId % TASK_LOCATOR_SHARDS;
+    LockHolder lh(locatorMutex[shard]);
+    std::map<size_t, TaskQpair>::iterator itr = taskLocator[shard].find(taskId);
+    if (itr == taskLocator[shard].end()) {
+        LOG(EXTENSION_LOG_DEBUG, "Task id %d not found",
+            static_cast<int>(taskId));
         return false;
     }
 
     ExTask task = itr->second.first;
+    TaskQueue *q = itr->second.second;
     LOG(EXTENSION_LOG_DEBUG, "Cancel task %s id %d on bucket %s %s",
             task->getDescription().c_str(), task->getId(),
             task->getEngine()->getName(), eraseTask ? "final erase" : "!");
@@ -478,31 +615,40 @@ bool ExecutorPool::cancel(size_t taskId, bool eraseTask) {
 
     if (eraseTask) { // only internal threads can erase tasks
         assert(task->isdead());
-        taskLocator.erase(itr);
+        taskLocator[shard].erase(itr);
+        lh.unlock();
+        LockHolder tlh(tMutex);
         tMutex.notify();
     } else { // wake up the task from the TaskQ so a thread can safely erase it
              // otherwise we may race with unregisterBucket where a unlocated
              // task runs in spite of its bucket getting unregistered
-        itr->second.second->wake(task);
+        lh.unlock();
+        q->wake(task);
     }
     return true;
 }
 
 bool ExecutorPool::wake(size_t taskId) {
-    LockHolder lh(tMutex);
-    std::map<size_t, TaskQpair>::iterator itr = taskLocator.find(taskId);
-    if (itr != taskLocator.end()) {
-        itr->second.second->wake(itr->second.first);
+    size_t shard = taskId % TASK_LOCATOR_SHARDS;
+    LockHolder lh(locatorMutex[shard]);
+    std::map<size_t, TaskQpair>::iterator itr = taskLocator[shard].find(taskId);
+    if (itr != taskLocator[shard].end()) {
+        TaskQpair tqp = itr->second;
+        lh.unlock();
+        tqp.second->wake(tqp.first);
         return true;
     }
     return false;
 }
 
 bool ExecutorPool::snooze(size_t taskId, double tosleep) {
-    LockHolder lh(tMutex);
-    std::map<size_t, TaskQpair>::iterator itr = taskLocator.find(taskId);
-    if (itr != taskLocator.end()) {
-        itr->second.first->snooze(tosleep, false);
+    size_t shard = taskId % TASK_LOCATOR_SHARDS;
+    LockHolder lh(locatorMutex[shard]);
+    std::map<size_t, TaskQpair>::iterator itr = taskLocator[shard].find(taskId);
+    if (itr != taskLocator[shard].end()) {
+        TaskQpair tqp = itr->second;
+        lh.unlock();
+        tqp.second->snooze(tqp.first, tosleep);
         return true;
     }
     return false;
@@ -546,7 +692,10 @@ size_t ExecutorPool::schedule(ExTask task, task_type_t qidx) {
     LockHolder lh(tMutex);
     TaskQueue *q = getTaskQueue(task->getEngine(), qidx);
     TaskQpair tqp(task, q);
-    taskLocator[task->getId()] = tqp;
+    size_t shard = task->getId() % TASK_LOCATOR_SHARDS;
+    LockHolder slh(locatorMutex[shard]);
+    taskLocator[shard][task->getId()] = tqp;
+    slh.unlock();
 
     q->schedule(task);
 
@@ -610,33 +759,36 @@ bool ExecutorPool::startWorkers(void) {
         ss << "reader_worker_" << tidx;
 
         threadQ.push_back(new ExecutorThread(this, READER_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
     for (size_t tidx = 0; tidx < numWriters; ++tidx) {
         std::stringstream ss;
         ss << "writer_worker_" << numReaders + tidx;
 
         threadQ.push_back(new ExecutorThread(this, WRITER_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
     for (size_t tidx = 0; tidx < numAuxIO; ++tidx) {
         std::stringstream ss;
         ss << "auxio_worker_" << numReaders + numWriters + tidx;
 
         threadQ.push_back(new ExecutorThread(this, AUXIO_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
     for (size_t tidx = 0; tidx < numNonIO; ++tidx) {
         std::stringstream ss;
         ss << "nonio_worker_" << numReaders + numWriters + numAuxIO + tidx;
 
         threadQ.push_back(new ExecutorThread(this, NONIO_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
 
     LockHolder lh(mutex);
     maxWorkers[AUXIO_TASK_IDX]  = numAuxIO;
     maxWorkers[NONIO_TASK_IDX]  = numNonIO;
+    lh.unlock();
+
+    // Threads steal from each other, so threadQ must be complete before
+    // the first one runs.
+    for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
+        threadQ[tidx]->start();
+    }
 
     return true;
 }
@@ -651,23 +803,30 @@ bool ExecutorPool::stopTaskGroup(EventuallyPersistentEngine *e,
     LOG(EXTENSION_LOG_DEBUG, "Stopping %d type tasks in bucket %s", taskType,
             e->getName());
     do {
-        ExTask task;
-        unfinishedTask = false;
-        for (itr = taskLocator.begin(); itr != taskLocator.end(); itr++) {
-            task = itr->second.first;
-            TaskQueue *q = itr->second.second;
-            if (task->getEngine() == e &&
-                (taskType == NO_TASK_TYPE || q->queueType == taskType)) {
-                LOG(EXTENSION_LOG_DEBUG, "Stopping Task id %d %s ",
-                        task->getId(), task->getDescription().c_str());
-                if (!task->blockShutdown) {
-                    task->cancel(); // Must be idempotent
+        std::vector<TaskQpair> found;
+        for (size_t shard = 0; shard < TASK_LOCATOR_SHARDS; ++shard) {
+            LockHolder slh(locatorMutex[shard]);
+            for (itr = taskLocator[shard].begin();
+                 itr != taskLocator[shard].end(); itr++) {
+                TaskQueue *q = itr->second.second;
+                if (itr->second.first->getEngine() == e &&
+                    (taskType == NO_TASK_TYPE || q->queueType == taskType)) {
+                    found.push_back(itr->second);
                 }
-                q->wake(task);
-                unfinishedTask = true;
-                retVal = true;
             }
         }
+
+        unfinishedTask = !found.empty();
+        for (size_t i = 0; i < found.size(); ++i) {
+            ExTask &task = found[i].first;
+            LOG(EXTENSION_LOG_DEBUG, "Stopping Task id %d %s ",
+                    task->getId(), task->getDescription().c_str());
+            if (!task->blockShutdown) {
+                task->cancel(); // Must be idempotent
+            }
+            found[i].second->wake(task);
+            retVal = true;
+        }
         if (unfinishedTask) {
             struct timeval waktime;
             gettimeofday(&waktime, NULL);
@@ -688,7 +847,10 @@ void ExecutorPool::unregisterBucket(EventuallyPersistentEngine *engine) {
     LockHolder lh(tMutex);
 
     if (!(--numBuckets)) {
-        assert (!taskLocator.size());
+        for (size_t shard = 0; shard < TASK_LOCATOR_SHARDS; ++shard) {
+            LockHolder slh(locatorMutex[shard]);
+            assert(taskLocator[shard].empty());
+        }
         LockHolder lm(mutex);
         for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
             threadQ[tidx]->stop(false); // only set state to DEAD
@@ -697,8 +859,12 @@ void ExecutorPool::unregisterBucket(EventuallyPersistentEngine *engine) {
         mutex.notify();
         lm.unlock();
 
+        // Join them all before deleting any, as a thread may still be
+        // looking into another's ready deque.
         for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
             threadQ[tidx]->stop(/*wait for threads */);
+        }
+        for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
             delete threadQ[tidx];
         }
         threadQ.clear();
@@ -731,6 +897,8 @@ const std::string TaskQueue::taskType2Str(task_type_t type) {
         return std::string("Reader");
     case AUXIO_TASK_IDX:
         return std::string("AuxIO");
+    case NONIO_TASK_IDX:
+        return std::string("NonIO");
     default:
         return std::string("None");
     }
@@ -785,4 +953,10 @@ void ExecutorPool::doWorkerStat(EventuallyPersistentEngine *engine,
         addWorkerStats(threadQ[tidx]->getName().c_str(), threadQ[tidx],
                      cookie, add_stat);
     }
+
+    for (size_t i = 0; i < numTaskSets; ++i) {
+        std::string name("sched_latency:" +
+                         TaskQueue::taskType2Str(static_cast<task_type_t>(i)));
+        add_casted_stat(name.c_str(), schedLatency[i], add_stat, cookie);
+    }
 }
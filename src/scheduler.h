@@ -29,13 +29,16 @@
 
 #include "atomic.h"
 #include "common.h"
+#include "histo.h"
 #include "mutex.h"
 #include "objectregistry.h"
 #include "ringbuffer.h"
 #include "tasks.h"
+#include "timer_wheel.h"
 
 #define TASK_LOG_SIZE 20
 #define MIN_SLEEP_TIME 2.0
+#define TASK_LOCATOR_SHARDS 16
 
 class ExecutorPool;
 class ExecutorThread;
@@ -91,11 +94,15 @@ private:
     hrtime_t duration;
 };
 
+class TaskQueue;
+
+typedef std::pair<ExTask, TaskQueue *> TaskQpair;
+
 class TaskQueue {
     friend class ExecutorPool;
 public:
     TaskQueue(ExecutorPool *m, task_type_t t, const char *nm) :
-    isLock(false), name(nm), hasWokenTask(false), queueType(t), manager(m) { }
+    isLock(false), name(nm), queueType(t), manager(m) { }
 
     ~TaskQueue(void) {
         LOG(EXTENSION_LOG_INFO, "Task Queue killing %s", name.c_str());
@@ -105,11 +112,22 @@ public:
 
     struct timeval reschedule(ExTask &task);
 
-    bool fetchNextTask(ExTask &task, struct timeval &tv, int &taskIdx,
-                       struct timeval now);
+    /**
+     * Hand the next ready task to the given thread, if the thread may take
+     * up work of this queue's type. With batch set, up to MAX_TASK_BATCH
+     * further ready tasks go to the thread's own ready deque, unless the
+     * thread's last task overran its time slice.
+     */
+    bool fetchNextTask(ExecutorThread &thread, struct timeval now, bool batch);
 
     void wake(ExTask &task);
 
+    /**
+     * Put the task to sleep for the given number of seconds, moving it in
+     * the timer wheel if it is waiting there.
+     */
+    void snooze(ExTask &task, double secs);
+
     static const std::string taskType2Str(task_type_t type);
 
     const std::string getName() const {
@@ -125,13 +143,14 @@ private:
 
     ExTask popReadyTask(void);
 
+    void returnReadyTask(ExTask &task);
+
     SyncObject mutex;
 
     Atomic<bool> isLock;
 
     const std::string name;
 
-    bool hasWokenTask;
     task_type_t queueType;
 
     ExecutorPool *manager;
@@ -139,19 +158,19 @@ private:
     // sorted by task priority then waketime ..
     std::priority_queue<ExTask, std::deque<ExTask >,
                         CompareByPriority> readyQueue;
-    std::priority_queue<ExTask, std::deque<ExTask >,
-                        CompareByDueDate> futureQueue;
+    TimerWheel futureQueue;
 };
 
 class ExecutorThread {
     friend class ExecutorPool;
+    friend class TaskQueue;
 public:
 
     ExecutorThread(ExecutorPool *m, size_t startingQueue, const std::string nm)
         : manager(m), startIndex(startingQueue), name(nm),
           state(EXECUTOR_CREATING), taskStart(0),
           tasklog(TASK_LOG_SIZE), slowjobs(TASK_LOG_SIZE), currentTask(NULL),
-          curTaskType(-1) { set_max_tv(waketime); }
+          curTaskType(-1), overran(false) { set_max_tv(waketime); }
 
     ~ExecutorThread() {
         LOG(EXTENSION_LOG_INFO, "Executor killing %s", name.c_str());
@@ -205,10 +224,17 @@ private:
 
     ExTask currentTask;
     int curTaskType;
+    //! The last task ran longer than TASK_BATCH_SLICE.
+    bool overran;
+
+    //! Ready tasks claimed in one batch from a TaskQueue, all of the
+    //! curTaskType this thread holds. The owner runs them from the front,
+    //! idle threads steal them from the back.
+    std::deque<TaskQpair> readyQ;
+    Mutex readyMutex;
 };
 
 typedef std::vector<ExecutorThread *> ThreadQ;
-typedef std::pair<ExTask, TaskQueue *> TaskQpair;
 typedef std::pair<RingBuffer<TaskLogEntry>*, RingBuffer<TaskLogEntry> *>
                                                                 TaskLog;
 typedef std::vector<TaskQueue *> TaskQ;
@@ -228,6 +254,14 @@ public:
 
     TaskQueue *nextTask(ExecutorThread &t, uint8_t tick);
 
+    TaskQueue *popLocalTask(ExecutorThread &t);
+
+    TaskQueue *stealTask(ExecutorThread &t);
+
+    void returnLocalTasks(ExecutorThread &t);
+
+    void recordSchedulingLatency(TaskQueue *q, ExTask &task);
+
     bool cancel(size_t taskId, bool eraseTask=false);
 
     bool stopTaskGroup(EventuallyPersistentEngine *e, task_type_t qidx);
@@ -276,13 +310,15 @@ private:
     size_t maxGlobalThreads;
     size_t numTaskSets; // safe to read lock-less not altered after creation
 
-    size_t     numReadyTasks;
-    size_t     highWaterMark; // High Water Mark for num Ready Tasks
+    Atomic<size_t> numReadyTasks; // includes tasks in thread ready deques
+    Atomic<size_t> highWaterMark; // High Water Mark for num Ready Tasks
+    Atomic<size_t> numSleepers;   // threads that may be waiting on mutex
     SyncObject mutex; // Thread management condition var + mutex
-    // sync: numReadyTasks, highWaterMark, defaultQ
 
-    //! A mapping of task ids to Task, TaskQ in the thread pool
-    std::map<size_t, TaskQpair> taskLocator;
+    //! A mapping of task ids to Task, TaskQ in the thread pool, split by
+    //! task id so waking and snoozing unrelated tasks don't contend.
+    std::map<size_t, TaskQpair> taskLocator[TASK_LOCATOR_SHARDS];
+    Mutex locatorMutex[TASK_LOCATOR_SHARDS];
 
     //A list of threads
     ThreadQ threadQ;
@@ -296,11 +332,14 @@ private:
 
     size_t numBuckets;
 
-    SyncObject tMutex; // to serialize taskLocator, threadQ, numBuckets access
+    SyncObject tMutex; // to serialize schedule, threadQ, numBuckets access
 
-    uint16_t *curWorkers; // for every TaskSet track its no. of worker threads
+    Atomic<size_t> *curWorkers; // for every TaskSet track its no. of workers
     uint16_t *maxWorkers; // and limit it to the value set here
 
+    //! Time from a task's waketime to its start, per TaskSet (in usec).
+    Histogram<hrtime_t> *schedLatency;
+
     // Singleton creation
     static Mutex initGuard;
     static ExecutorPool *instance;
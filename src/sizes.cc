@@ -85,6 +85,17 @@ int main(int, char **) {
     display("HistogramBin<hrtime_t>", sizeof(HistogramBin<hrtime_t>));
     display("HistogramBin<int>", sizeof(HistogramBin<int>));
 
+    std::cout << std::endl << "Stored Value Metadata" << std::endl << std::endl;
+
+    display("Inline key bytes", StoredValue::INLINE_KEY_BYTES);
+    size_t keylens[] = { 8, 16, 32, 64, 128, 250 };
+    for (size_t i = 0; i < sizeof(keylens) / sizeof(keylens[0]); ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "Key of %lu bytes",
+                 static_cast<unsigned long>(keylens[i]));
+        display(name, StoredValue::requiredStorage(keylens[i]));
+    }
+
     std::cout << std::endl << "Histogram Ranges" << std::endl << std::endl;
 
     EPStats stats;
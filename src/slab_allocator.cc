@@ -0,0 +1,388 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "locks.h"
+#include "slab_allocator.h"
+#include "stats.h"
+
+const size_t SlabAllocator::SLAB_SHIFT;
+const size_t SlabAllocator::SLAB_SIZE;
+const size_t SlabAllocator::MAX_CHUNK_SIZE;
+
+/**
+ * A block of SLAB_SIZE bytes carved into equally sized chunks.
+ */
+class Slab {
+public:
+    Slab(SlabClass *c, char *b, size_t n) :
+        cls(c), base(b), freeList(NULL), capacity(n), carved(0), used(0),
+        listed(false), draining(false) {}
+
+    bool isFull() const { return used == capacity; }
+
+    //! The owning size class, NULL once the allocator is gone.
+    SlabClass *cls;
+    char      *base;
+    void      *freeList;
+    size_t     capacity;
+    //! Chunks handed out at least once; the rest were never touched.
+    size_t     carved;
+    size_t     used;
+    //! True while this slab is in its class' list of available slabs.
+    bool       listed;
+    //! True while the defragmenter is moving objects out of this slab.
+    //! Written under the class lock, read without it by isDraining().
+    Atomic<bool> draining;
+};
+
+/**
+ * The slabs of one chunk size.
+ */
+class SlabClass {
+public:
+    SlabClass(SlabAllocator &a, size_t sz) : allocator(a), chunkSize(sz) {}
+
+    void *allocate();
+    void release(Slab *s, void *p);
+    size_t startDefragment(double maxUsage);
+    size_t finishDefragment();
+    size_t orphanSlabs();
+
+private:
+    Slab *newSlab();
+    void freeSlab(Slab *s);
+    void rebuildAvailable();
+
+    SlabAllocator      &allocator;
+    const size_t        chunkSize;
+    Mutex               mutex;
+    std::vector<Slab*>  slabs;
+    //! Slabs that may have free chunks; full and draining ones are
+    //! dropped lazily.
+    std::vector<Slab*>  available;
+};
+
+// Slab numbers are mapped in two levels of 2^14 entries, which covers
+// 48 bits of address space. Lookups don't take any lock, so both the
+// leaves and their entries are published atomically.
+static const size_t MAP_BITS = 14;
+static const size_t MAP_SIZE = static_cast<size_t>(1) << MAP_BITS;
+typedef Atomic<Slab*> SlabMapEntry;
+static Atomic<SlabMapEntry*> slabMap[MAP_SIZE];
+static Mutex slabMapMutex;
+
+static inline size_t slabNumber(const void *p) {
+    return reinterpret_cast<uintptr_t>(p) >> SlabAllocator::SLAB_SHIFT;
+}
+
+static Slab *lookupSlab(const void *p) {
+    size_t n = slabNumber(p);
+    if ((n >> MAP_BITS) >= MAP_SIZE) {
+        return NULL;
+    }
+    SlabMapEntry *leaf = slabMap[n >> MAP_BITS].load();
+    return leaf ? leaf[n & (MAP_SIZE - 1)].load() : NULL;
+}
+
+static bool mapSlab(const void *p, Slab *s) {
+    size_t n = slabNumber(p);
+    if ((n >> MAP_BITS) >= MAP_SIZE) {
+        return false;
+    }
+    if (slabMap[n >> MAP_BITS].load() == NULL) {
+        LockHolder lh(slabMapMutex);
+        if (slabMap[n >> MAP_BITS].load() == NULL) {
+            SlabMapEntry *leaf = new (std::nothrow) SlabMapEntry[MAP_SIZE];
+            if (leaf == NULL) {
+                return false;
+            }
+            slabMap[n >> MAP_BITS].store(leaf);
+        }
+    }
+    slabMap[n >> MAP_BITS].load()[n & (MAP_SIZE - 1)].store(s);
+    return true;
+}
+
+static void *allocSlabMemory() {
+    void *p;
+#ifdef WIN32
+    p = _aligned_malloc(SlabAllocator::SLAB_SIZE, SlabAllocator::SLAB_SIZE);
+#else
+    if (posix_memalign(&p, SlabAllocator::SLAB_SIZE,
+                       SlabAllocator::SLAB_SIZE) != 0) {
+        p = NULL;
+    }
+#endif
+    return p;
+}
+
+static void freeSlabMemory(void *p) {
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+Slab *SlabClass::newSlab() {
+    char *mem = static_cast<char*>(allocSlabMemory());
+    if (mem == NULL) {
+        return NULL;
+    }
+    Slab *s = new Slab(this, mem, SlabAllocator::SLAB_SIZE / chunkSize);
+    if (!mapSlab(mem, s)) {
+        freeSlabMemory(mem);
+        delete s;
+        return NULL;
+    }
+    slabs.push_back(s);
+    allocator.stats.slabMemory.fetch_add(SlabAllocator::SLAB_SIZE);
+    return s;
+}
+
+void SlabClass::freeSlab(Slab *s) {
+    assert(s->used == 0);
+    mapSlab(s->base, NULL);
+    freeSlabMemory(s->base);
+    delete s;
+    allocator.stats.slabMemory.fetch_sub(SlabAllocator::SLAB_SIZE);
+}
+
+void *SlabClass::allocate() {
+    LockHolder lh(mutex);
+    Slab *s = NULL;
+    while (!available.empty()) {
+        Slab *candidate = available.back();
+        if (!candidate->draining && !candidate->isFull()) {
+            s = candidate;
+            break;
+        }
+        candidate->listed = false;
+        available.pop_back();
+    }
+
+    if (s == NULL) {
+        s = newSlab();
+        if (s == NULL) {
+            return NULL;
+        }
+        s->listed = true;
+        available.push_back(s);
+    }
+
+    void *p;
+    if (s->freeList) {
+        p = s->freeList;
+        s->freeList = *static_cast<void**>(p);
+    } else {
+        p = s->base + (s->carved++ * chunkSize);
+    }
+    ++s->used;
+    allocator.stats.slabUsedMemory.fetch_add(chunkSize);
+    return p;
+}
+
+void SlabClass::release(Slab *s, void *p) {
+    LockHolder lh(mutex);
+    *static_cast<void**>(p) = s->freeList;
+    s->freeList = p;
+    --s->used;
+    allocator.stats.slabUsedMemory.fetch_sub(chunkSize);
+    if (!s->listed && !s->draining) {
+        s->listed = true;
+        available.push_back(s);
+    }
+}
+
+static bool lessUsed(const Slab *a, const Slab *b) {
+    return a->used < b->used;
+}
+
+size_t SlabClass::startDefragment(double maxUsage) {
+    LockHolder lh(mutex);
+    std::vector<Slab*> sorted(slabs);
+    std::sort(sorted.begin(), sorted.end(), lessUsed);
+
+    size_t room = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        room += sorted[i]->capacity - sorted[i]->used;
+    }
+
+    // Drain the emptiest slabs first, for as long as the slabs we keep
+    // have room for everything that has to move.
+    size_t moving = 0;
+    size_t marked = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        Slab *s = sorted[i];
+        if (s->used >= maxUsage * s->capacity) {
+            break;
+        }
+        size_t remaining = room - (s->capacity - s->used);
+        if (moving + s->used > remaining) {
+            break;
+        }
+        room = remaining;
+        moving += s->used;
+        s->draining = true;
+        ++marked;
+    }
+    return marked;
+}
+
+void SlabClass::rebuildAvailable() {
+    available.clear();
+    for (size_t i = 0; i < slabs.size(); ++i) {
+        slabs[i]->listed = !slabs[i]->draining && !slabs[i]->isFull();
+        if (slabs[i]->listed) {
+            available.push_back(slabs[i]);
+        }
+    }
+}
+
+size_t SlabClass::finishDefragment() {
+    LockHolder lh(mutex);
+    std::vector<Slab*> kept;
+    size_t freed = 0;
+    for (size_t i = 0; i < slabs.size(); ++i) {
+        Slab *s = slabs[i];
+        s->draining = false;
+        if (s->used == 0) {
+            freeSlab(s);
+            ++freed;
+        } else {
+            kept.push_back(s);
+        }
+    }
+    slabs.swap(kept);
+    rebuildAvailable();
+    return freed;
+}
+
+size_t SlabClass::orphanSlabs() {
+    LockHolder lh(mutex);
+    size_t orphaned = 0;
+    for (size_t i = 0; i < slabs.size(); ++i) {
+        if (slabs[i]->used == 0) {
+            freeSlab(slabs[i]);
+        } else {
+            slabs[i]->cls = NULL;
+            ++orphaned;
+        }
+    }
+    slabs.clear();
+    available.clear();
+    return orphaned;
+}
+
+SlabAllocator::SlabAllocator(EPStats &st) : stats(st) {
+    // Chunk sizes grow by a quarter, in multiples of 16 bytes.
+    std::vector<size_t> sizes;
+    size_t size = 16;
+    while (size < MAX_CHUNK_SIZE) {
+        sizes.push_back(size);
+        size_t next = (size + size / 4 + 15) & ~static_cast<size_t>(15);
+        size = std::min(std::max(size + 16, next), MAX_CHUNK_SIZE);
+    }
+    sizes.push_back(MAX_CHUNK_SIZE);
+
+    size_t c = 0;
+    for (size_t units = 0; units <= MAX_CHUNK_SIZE / 16; ++units) {
+        while (units * 16 > sizes[c]) {
+            ++c;
+        }
+        classIndex.push_back(static_cast<uint8_t>(c));
+    }
+
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        classes.push_back(new SlabClass(*this, sizes[i]));
+    }
+}
+
+SlabAllocator::~SlabAllocator() {
+    size_t orphaned = 0;
+    std::vector<SlabClass*>::iterator it;
+    for (it = classes.begin(); it != classes.end(); ++it) {
+        orphaned += (*it)->orphanSlabs();
+        delete *it;
+    }
+    if (orphaned > 0) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Leaking %lu slabs that still hold objects at shutdown",
+            static_cast<unsigned long>(orphaned));
+    }
+}
+
+SlabClass *SlabAllocator::classFor(size_t len) {
+    if (len > MAX_CHUNK_SIZE) {
+        return NULL;
+    }
+    return classes[classIndex[(len + 15) >> 4]];
+}
+
+void *SlabAllocator::allocate(size_t len) {
+    SlabClass *c = classFor(len);
+    return c ? c->allocate() : NULL;
+}
+
+bool SlabAllocator::release(void *p) {
+    Slab *s = lookupSlab(p);
+    if (s == NULL) {
+        return false;
+    }
+    // Objects outliving their allocator stay where they are.
+    if (s->cls != NULL) {
+        s->cls->release(s, p);
+    }
+    return true;
+}
+
+bool SlabAllocator::isDraining(const void *p) {
+    Slab *s = lookupSlab(p);
+    return s != NULL && s->draining.load();
+}
+
+size_t SlabAllocator::startDefragment(double maxUsage) {
+    size_t marked = 0;
+    std::vector<SlabClass*>::iterator it;
+    for (it = classes.begin(); it != classes.end(); ++it) {
+        marked += (*it)->startDefragment(maxUsage);
+    }
+    return marked;
+}
+
+size_t SlabAllocator::finishDefragment() {
+    size_t freed = 0;
+    std::vector<SlabClass*>::iterator it;
+    for (it = classes.begin(); it != classes.end(); ++it) {
+        freed += (*it)->finishDefragment();
+    }
+    return freed;
+}
+
+size_t SlabAllocator::getSlabMemory() const {
+    return stats.slabMemory.load();
+}
+
+size_t SlabAllocator::getUsedMemory() const {
+    return stats.slabUsedMemory.load();
+}
@@ -0,0 +1,118 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SLAB_ALLOCATOR_H_
+#define SRC_SLAB_ALLOCATOR_H_ 1
+
+#include "config.h"
+
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+#include "mutex.h"
+
+class EPStats;
+class SlabClass;
+
+/**
+ * Size-class slab allocator for StoredValue and Blob memory.
+ *
+ * Each size class owns a set of SLAB_SIZE blocks and hands out chunks
+ * from them, so objects of similar sizes share slabs instead of
+ * spreading holes over the whole heap. Slabs only go back to the system
+ * allocator from the defragmenter (or at destruction), which runs with
+ * the owning engine as the current engine so allocator hooks charge the
+ * right bucket.
+ *
+ * Any slab chunk can be released from any thread: a process-wide page
+ * map finds the slab (and so the owning allocator) from the address.
+ */
+class SlabAllocator {
+public:
+
+    static const size_t SLAB_SHIFT = 20;
+    static const size_t SLAB_SIZE = static_cast<size_t>(1) << SLAB_SHIFT;
+    //! Objects larger than this come from the system allocator.
+    static const size_t MAX_CHUNK_SIZE = 16384;
+
+    SlabAllocator(EPStats &st);
+
+    ~SlabAllocator();
+
+    /**
+     * Allocate memory for an object of the given size.
+     *
+     * @return the memory, or NULL if the object is too large for a slab
+     *         or no slab could be allocated
+     */
+    void *allocate(size_t len);
+
+    /**
+     * Give back memory handed out by any SlabAllocator.
+     *
+     * @return false if p does not belong to a slab
+     */
+    static bool release(void *p);
+
+    /**
+     * True if p lives in a slab the defragmenter is emptying.
+     */
+    static bool isDraining(const void *p);
+
+    /**
+     * Mark slabs filled below the given ratio as draining, as long as
+     * the rest of their size class has room for what they hold. Draining
+     * slabs are not used for new allocations.
+     *
+     * @return the number of slabs marked
+     */
+    size_t startDefragment(double maxUsage);
+
+    /**
+     * Release all empty slabs and make the remaining draining slabs
+     * available again.
+     *
+     * @return the number of slabs released
+     */
+    size_t finishDefragment();
+
+    /**
+     * Get the number of bytes of slab memory held.
+     */
+    size_t getSlabMemory() const;
+
+    /**
+     * Get the number of bytes of slab memory handed out in chunks.
+     */
+    size_t getUsedMemory() const;
+
+private:
+
+    friend class SlabClass;
+
+    SlabClass *classFor(size_t len);
+
+    EPStats                 &stats;
+    std::vector<SlabClass*>  classes;
+    //! Index into classes by the size in 16 byte units.
+    std::vector<uint8_t>     classIndex;
+
+    DISALLOW_COPY_AND_ASSIGN(SlabAllocator);
+};
+
+#endif  // SRC_SLAB_ALLOCATOR_H_
@@ -29,6 +29,7 @@
 #include "histo.h"
 #include "memory_tracker.h"
 #include "mutex.h"
+#include "striped_counter.h"
 
 #ifndef DEFAULT_MAX_DATA_SIZE
 /* Something something something ought to be enough for anybody */
@@ -121,7 +122,7 @@ public:
     //! Number of items persisted.
     Atomic<size_t> totalPersisted;
     //! Cumulative number of items added to the queue.
-    Atomic<size_t> totalEnqueued;
+    StripedCounter totalEnqueued;
     //! Number of times an item flush failed.
     Atomic<size_t> flushFailed;
     //! Number of times an item is not flushed due to the item's expiry
@@ -162,7 +163,7 @@ public:
     //! Number of times a value could not be ejected
     Atomic<size_t> numFailedEjects;
     //! Number of times "Not my bucket" happened
-    Atomic<size_t> numNotMyVBuckets;
+    StripedCounter numNotMyVBuckets;
     //! Total size of stored objects.
     Atomic<size_t> currentSize;
     //! Total memory overhead to store values for resident keys.
@@ -173,6 +174,14 @@ public:
     Atomic<size_t> totalMemory;
     //! True if the memory usage tracker is enabled.
     Atomic<bool> memoryTrackerEnabled;
+    //! Memory held in slabs by the slab allocator.
+    Atomic<size_t> slabMemory;
+    //! Slab memory handed out to stored values and blobs.
+    Atomic<size_t> slabUsedMemory;
+    //! Number of objects the defragmenter moved out of sparse slabs.
+    Atomic<size_t> defragNumMoved;
+    //! Number of slabs the defragmenter gave back.
+    Atomic<size_t> defragNumSlabsFreed;
     //! Whether or not to force engine shutdown.
     Atomic<bool> forceShutdown;
 
@@ -206,9 +215,9 @@ public:
     Atomic<size_t> pendingCompactions;
 
     //! Number of times background fetches occurred.
-    Atomic<size_t> bg_fetched;
+    StripedCounter bg_fetched;
     //! Number of times meta background fetches occurred.
-    Atomic<size_t> bg_meta_fetched;
+    StripedCounter bg_meta_fetched;
     //! Number of remaining bg fetch jobs.
     Atomic<size_t> numRemainingBgJobs;
     //! The number of samples the bgWaitDelta and bgLoadDelta contains of
@@ -250,11 +259,15 @@ public:
 
     /* TAP related stats */
     //! The total number of tap events sent (not including noops)
-    Atomic<size_t> numTapFetched;
+    StripedCounter numTapFetched;
     //! Number of background fetched tap items
     Atomic<size_t> numTapBGFetched;
     //! Number of times a tap background fetch task is requeued
     Atomic<size_t> numTapBGFetchRequeued;
+    //! Number of items handed to producers by disk backfills
+    Atomic<size_t> numBackfillItems;
+    //! Number of connection map lookups made by disk backfills
+    Atomic<size_t> numBackfillConnMapLookups;
     //! Number of foreground fetched tap items
     Atomic<size_t> numTapFGFetched;
     //! Number of tap deletes.
@@ -313,6 +326,8 @@ public:
     Atomic<size_t> alogRuns;
     //! The number of items that last access scanner task swept to log
     Atomic<size_t> alogNumItems;
+    //! The number of unchanged vbuckets that last access scanner task copied
+    Atomic<size_t> alogSkippedVBuckets;
     //! The next access scanner task schedule time (GMT)
     Atomic<hrtime_t> alogTime;
     //! The number of seconds that the last access scanner task took
@@ -435,6 +450,7 @@ public:
 
         mlogCompactorRuns.store(0);
         alogRuns.store(0);
+        alogSkippedVBuckets.store(0);
 
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
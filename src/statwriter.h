@@ -52,6 +52,11 @@ void add_casted_stat(const char *k, const Atomic<T> &v,
     add_casted_stat(k, v.load(), add_stat, cookie);
 }
 
+inline void add_casted_stat(const char *k, const StripedCounter &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    add_casted_stat(k, v.load(), add_stat, cookie);
+}
+
 /// @cond DETAILS
 /**
  * Convert a histogram into a bunch of calls to add stats.
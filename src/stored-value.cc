@@ -18,9 +18,12 @@
 #include "config.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <string>
 
+#include "slab_allocator.h"
 #include "stored-value.h"
 
 #ifndef DEFAULT_HT_SIZE
@@ -29,10 +32,12 @@
 
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+ht_index_type_t HashTable::defaultIndexType = HT_INDEX_CHAINED;
 double StoredValue::mutation_mem_threshold = 0.9;
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
 const int64_t StoredValue::state_temp_init = -5;
+const size_t StoredValue::INLINE_KEY_BYTES;
 
 static ssize_t prime_size_table[] = {
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3079, 6143, 12289, 24571, 49157,
@@ -91,8 +96,8 @@ bool StoredValue::unlocked_restoreValue(Item *itm, HashTable &ht) {
         cas = itm->getCas();
         flags = itm->getFlags();
         exptime = itm->getExptime();
-        revSeqno = itm->getRevSeqno();
-        bySeqno = itm->getBySeqno();
+        setRevSeqno(itm->getRevSeqno());
+        storeBySeqno(itm->getBySeqno());
         nru = INITIAL_NRU_VALUE;
     }
     deleted = false;
@@ -112,14 +117,14 @@ bool StoredValue::unlocked_restoreMeta(Item *itm, ENGINE_ERROR_CODE status,
         cas = itm->getCas();
         flags = itm->getFlags();
         exptime = itm->getExptime();
-        revSeqno = itm->getRevSeqno();
+        setRevSeqno(itm->getRevSeqno());
         if (itm->isDeleted()) {
             setStoredValueState(state_deleted_key);
         } else { // Regular item with the full eviction
             --ht.numTempItems;
             ++ht.numItems;
             ++ht.numNonResidentItems;
-            bySeqno = itm->getBySeqno();
+            storeBySeqno(itm->getBySeqno());
         }
         if (nru == MAX_NRU_VALUE) {
             nru = INITIAL_NRU_VALUE;
@@ -155,26 +160,13 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
             StoredValue::reduceMetaDataSize(*this, stats, vptr->metaDataSize());
             StoredValue::reduceCacheSize(*this, vptr->size());
 
-            int bucket_num = getBucketForHash(hash(vptr->getKey()));
-            StoredValue *v = values[bucket_num];
             // Remove the item from the hash table.
-            if (v == vptr) {
-                values[bucket_num] = v->next;
-            } else {
-                while (v->next) {
-                    if (v->next == vptr) {
-                        v->next = v->next->next;
-                        break;
-                    } else {
-                        v = v->next;
-                    }
-                }
-            }
+            unlinkValue(getBucketForHash(vptr->getKeyHash()), vptr);
 
             if (vptr->isResident()) {
                 ++stats.numValueEjects;
             }
-            if (!vptr->isResident() && !v->isTempItem()) {
+            if (!vptr->isResident() && !vptr->isTempItem()) {
                 --numNonResidentItems; // Decrement because the item is fully evicted.
             }
             --numItems; // Decrement because the item is fully evicted.
@@ -207,17 +199,18 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
     }
 
     int bucket_num(0);
-    LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
+    uint64_t h = hash(itm.getKey());
+    LockHolder lh = getLockedBucket(h, &bucket_num);
+    StoredValue *v = unlocked_find(itm.getKey(), h, bucket_num, true, false);
 
     if (v == NULL) {
-        v = valFact(itm, values[bucket_num], *this);
+        v = valFact(itm, bucketHead(bucket_num), *this);
         v->markClean();
         if (partial) {
             v->markNotResident();
             ++numNonResidentItems;
         }
-        values[bucket_num] = v;
+        linkValue(bucket_num, v);
         ++numItems;
     } else {
         if (partial) {
@@ -231,7 +224,7 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
                 v->cas = itm.getCas();
                 v->flags = itm.getFlags();
                 v->exptime = itm.getExptime();
-                v->revSeqno = itm.getRevSeqno();
+                v->setRevSeqno(itm.getRevSeqno());
             } else {
                 return INVALID_CAS;
             }
@@ -282,6 +275,84 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+/**
+ * Set the default layout of the hashtable bucket index.
+ */
+void HashTable::setDefaultIndexType(ht_index_type_t to) {
+    defaultIndexType = to;
+}
+
+HashIndexLine *HashTable::allocIndexLines(size_t n) {
+    void *p;
+    size_t len = n * sizeof(HashIndexLine);
+#ifdef WIN32
+    p = _aligned_malloc(len, 64);
+#else
+    if (posix_memalign(&p, 64, len) != 0) {
+        p = NULL;
+    }
+#endif
+    if (p) {
+        memset(p, 0, len);
+    }
+    return static_cast<HashIndexLine*>(p);
+}
+
+void HashTable::freeIndexLines(HashIndexLine *l) {
+#ifdef WIN32
+    _aligned_free(l);
+#else
+    free(l);
+#endif
+}
+
+StoredValue *HashTable::findUnindexed(const HashIndexLine &line,
+                                      StoredValue *v) {
+    for (; v; v = v->next) {
+        size_t i = 0;
+        while (i < HashIndexLine::SLOTS && line.items[i] != v) {
+            ++i;
+        }
+        if (i == HashIndexLine::SLOTS) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+void HashTable::unlinkValue(int bucket_num, StoredValue *v) {
+    StoredValue **p = &bucketHead(bucket_num);
+    while (*p != v) {
+        assert(*p);
+        p = &(*p)->next;
+    }
+    *p = v->next;
+
+    if (indexType != HT_INDEX_BUCKETED) {
+        return;
+    }
+
+    HashIndexLine &line = indexLine(bucket_num);
+    for (size_t i = 0; i < HashIndexLine::SLOTS; ++i) {
+        if (line.items[i] == v) {
+            line.items[i] = NULL;
+            line.tags[i] = 0;
+            if (line.overflow > 0) {
+                // Give the slot to an item that only lives in the chain,
+                // so misses can skip the chain again sooner.
+                StoredValue *o = findUnindexed(line, bucketHead(bucket_num));
+                assert(o);
+                line.items[i] = o;
+                line.tags[i] = indexTag(o);
+                --line.overflow;
+            }
+            return;
+        }
+    }
+    assert(line.overflow > 0);
+    --line.overflow;
+}
+
 HashTableStatVisitor HashTable::clear(bool deactivate) {
     HashTableStatVisitor rv;
 
@@ -293,12 +364,18 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
     if (deactivate) {
         setActiveState(false);
     }
-    for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            rv.visit(v);
-            values[i] = v->next;
-            delete v;
+    for (size_t l = 0; l < n_locks; ++l) {
+        StoredValue **table = values[stripeTable[l]];
+        for (size_t i = l; i < tableSize[stripeTable[l]]; i += n_locks) {
+            while (table[i]) {
+                StoredValue *v = table[i];
+                rv.visit(v);
+                table[i] = v->next;
+                delete v;
+            }
+            if (indexType == HT_INDEX_BUCKETED) {
+                memset(&lines[stripeTable[l]][i], 0, sizeof(HashIndexLine));
+            }
         }
     }
 
@@ -315,62 +392,125 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
 }
 
 void HashTable::resize(size_t newSize) {
+    if (startResize(newSize)) {
+        while (resizeStep(1) > 0) {
+            // Each step releases the stripe lock, letting waiters in.
+        }
+    }
+}
+
+bool HashTable::startResize(size_t newSize) {
     assert(isActive());
 
-    // Due to the way hashing works, we can't fit anything larger than
-    // an int.
+    // Bucket numbers are ints, so we can't fit anything larger than
+    // that.
     if (newSize > static_cast<size_t>(std::numeric_limits<int>::max())) {
-        return;
+        return false;
+    }
+
+    // Every lock needs at least one bucket of its own.
+    if (newSize < n_locks) {
+        return false;
+    }
+
+    LockHolder lh(resizeLock);
+    // Only one resize may be migrating stripes at a time.
+    if (stripesPending.load() > 0) {
+        return false;
     }
 
     // Don't resize to the same size, either.
     if (newSize == size) {
-        return;
+        return false;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
-    if (visitors.load() > 0) {
-        // Do not allow a resize while any visitors are actually
-        // processing.  The next attempt will have to pick it up.  New
-        // visitors cannot start doing meaningful work (we own all
-        // locks at this point).
-        return;
-    }
+    // All stripes live in the same array between resizes.
+    uint8_t from = stripeTable[0];
+    uint8_t to = 1 - from;
+    assert(values[to] == NULL);
 
     // Get a place for the new items.
     StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
                                                                 sizeof(StoredValue*)));
+    HashIndexLine *newLines = NULL;
+    if (newValues && indexType == HT_INDEX_BUCKETED) {
+        newLines = allocIndexLines(newSize);
+        if (!newLines) {
+            free(newValues);
+            newValues = NULL;
+        }
+    }
     // If we can't allocate memory, don't move stuff around.
     if (!newValues) {
-        return;
+        return false;
     }
 
-    stats.memOverhead.fetch_sub(memorySize());
-    ++numResizes;
+    // Readers only look at the new array once they see their stripe
+    // moved, which happens under the stripe lock after this point.
+    values[to] = newValues;
+    lines[to] = newLines;
+    tableSize[to] = newSize;
+    stats.memOverhead.fetch_add(newSize * bucketMemorySize());
+    assert(stats.memOverhead.load() < GIGANTOR);
 
-    // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
+    ++numResizes;
     size = newSize;
-    ep_sync_synchronize();
+    resizeCursor = 0;
+    stripesPending.store(n_locks);
+    return true;
+}
+
+size_t HashTable::resizeStep(size_t maxStripes) {
+    LockHolder lh(resizeLock);
+    for (size_t n = 0; n < maxStripes && stripesPending.load() > 0; ++n) {
+        migrateStripe(resizeCursor++);
+        stripesPending.fetch_sub(1);
+    }
+
+    if (stripesPending.load() == 0 && resizeCursor > 0) {
+        // Every stripe has been moved, so nobody can reach the old
+        // array anymore.
+        uint8_t from = 1 - stripeTable[0];
+        stats.memOverhead.fetch_sub(tableSize[from] * bucketMemorySize());
+        assert(stats.memOverhead.load() < GIGANTOR);
+        free(values[from]);
+        freeIndexLines(lines[from]);
+        values[from] = NULL;
+        lines[from] = NULL;
+        tableSize[from] = 0;
+        resizeCursor = 0;
+    }
+    return stripesPending.load();
+}
+
+void HashTable::migrateStripe(size_t lock) {
+    LockHolder lh(mutexes[lock]);
+    hrtime_t start = gethrtime();
+
+    uint8_t from = stripeTable[lock];
+    uint8_t to = 1 - from;
+    StoredValue **oldValues = values[from];
+    StoredValue **newValues = values[to];
 
     // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            values[i] = v->next;
+    for (size_t i = lock; i < tableSize[from]; i += n_locks) {
+        while (oldValues[i]) {
+            StoredValue *v = oldValues[i];
+            oldValues[i] = v->next;
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(), v->getKeyLen()));
+            int newBucket = bucketForHash(v->getKeyHash(), tableSize[to]);
+            assert(mutexForBucket(newBucket) == static_cast<int>(lock));
             v->next = newValues[newBucket];
             newValues[newBucket] = v;
+            if (indexType == HT_INDEX_BUCKETED) {
+                indexInsert(lines[to][newBucket], v);
+            }
         }
     }
 
-    // values still points to the old (now empty) table.
-    free(values);
-    values = newValues;
-
-    stats.memOverhead.fetch_add(memorySize());
-    assert(stats.memOverhead.load() < GIGANTOR);
+    stripeTable[lock] = to;
+    ++stripesMoved;
+    atomic_setIfBigger(maxResizePause, (gethrtime() - start) / 1000);
 }
 
 static size_t distance(size_t a, size_t b) {
@@ -391,8 +531,12 @@ void HashTable::resize() {
     int i(0);
     size_t new_size(0);
 
-    // Figure out where in the prime table we are.
+    // Figure out where in the prime table we are. A line of the
+    // bucketed index holds several items, so it needs fewer buckets.
     ssize_t target(static_cast<ssize_t>(ni));
+    if (indexType == HT_INDEX_BUCKETED) {
+        target /= HashIndexLine::SLOTS / 2;
+    }
     for (i = 0; prime_size_table[i] > 0 && prime_size_table[i] < target; ++i) {
         // Just looking...
     }
@@ -409,7 +553,7 @@ void HashTable::resize() {
         new_size = size;
     } else {
         // Somewhere in the middle, use the one we're closer to.
-        new_size = nearest(ni, prime_size_table[i-1], prime_size_table[i]);
+        new_size = nearest(static_cast<size_t>(target), prime_size_table[i-1], prime_size_table[i]);
     }
 
     resize(new_size);
@@ -424,22 +568,73 @@ void HashTable::visit(HashTableVisitor &visitor) {
     size_t visited = 0;
     for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        StoredValue **table = values[stripeTable[l]];
+        int tblSize = static_cast<int>(tableSize[stripeTable[l]]);
+        for (int i = l; i < tblSize; i+= n_locks) {
             assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            assert(v == NULL || i == getBucketForHash(hash(v->getKeyBytes(),
-                                                           v->getKeyLen())));
+            StoredValue *v = table[i];
+            assert(v == NULL || i == getBucketForHash(v->getKeyHash()));
             while (v) {
                 StoredValue *tmp = v->next;
                 visitor.visit(v);
                 v = tmp;
             }
-            ++visited;
         }
+        ++visited;
         lh.unlock();
         aborted = !visitor.shouldContinue();
     }
-    assert(aborted || visited == size);
+    assert(aborted || visited == n_locks);
+}
+
+StoredValue *HashTable::relocate(int bucket_num, StoredValue *v) {
+    // A StoredValue holds no pointers into itself, so a byte copy moves
+    // it, taking over the reference to its value.
+    size_t len = StoredValue::requiredStorage(v->getKeyLen());
+    StoredValue *nv = static_cast<StoredValue*>(ObjectRegistry::allocate(len));
+    std::memcpy(static_cast<void*>(nv), v, len);
+
+    if (indexType == HT_INDEX_BUCKETED) {
+        HashIndexLine &line = indexLine(bucket_num);
+        for (size_t i = 0; i < HashIndexLine::SLOTS; ++i) {
+            if (line.items[i] == v) {
+                line.items[i] = nv;
+            }
+        }
+    }
+    ObjectRegistry::deallocate(v);
+    return nv;
+}
+
+size_t HashTable::defragment() {
+    if (!isActive()) {
+        return 0;
+    }
+    VisitorTracker vt(&visitors);
+    size_t moved = 0;
+
+    for (size_t l = 0; l < n_locks; ++l) {
+        LockHolder lh(mutexes[l]);
+        StoredValue **table = values[stripeTable[l]];
+        for (size_t i = l; i < tableSize[stripeTable[l]]; i += n_locks) {
+            for (StoredValue **p = &table[i]; *p; p = &(*p)->next) {
+                StoredValue *v = *p;
+                // Nobody can take a new reference to the value while we
+                // hold the bucket lock.
+                if (v->value.isUnique() &&
+                    SlabAllocator::isDraining(v->value.get())) {
+                    v->value.reset(Blob::New(v->value->getData(),
+                                             v->value->length()));
+                    ++moved;
+                }
+                if (SlabAllocator::isDraining(v)) {
+                    *p = relocate(static_cast<int>(i), v);
+                    ++moved;
+                }
+            }
+        }
+    }
+    return moved;
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
@@ -451,11 +646,12 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        StoredValue **table = values[stripeTable[l]];
+        int tblSize = static_cast<int>(tableSize[stripeTable[l]]);
+        for (int i = l; i < tblSize; i+= n_locks) {
             size_t depth = 0;
-            StoredValue *p = values[i];
-            assert(p == NULL || i == getBucketForHash(hash(p->getKeyBytes(),
-                                                           p->getKeyLen())));
+            StoredValue *p = table[i];
+            assert(p == NULL || i == getBucketForHash(p->getKeyHash()));
             size_t mem(0);
             while (p) {
                 depth++;
@@ -463,11 +659,28 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
                 p = p->next;
             }
             visitor.visit(i, depth, mem);
-            ++visited;
         }
+        ++visited;
     }
 
-    assert(visited == size);
+    assert(visited == n_locks);
+}
+
+void HashTable::prefetchBucket(uint64_t h) {
+    // Without the stripe lock the stripe may be moving to the other array
+    // right now, so this only computes an address to hint the CPU with and
+    // never dereferences anything.
+    int t = stripeTable[mutexForHash(h)];
+    size_t tblSize = tableSize[t];
+    if (tblSize == 0) {
+        return;
+    }
+    int bucket_num = bucketForHash(h, tblSize);
+    if (indexType == HT_INDEX_BUCKETED) {
+        ep_prefetch(&lines[t][bucket_num]);
+    } else {
+        ep_prefetch(&values[t][bucket_num]);
+    }
 }
 
 add_type_t HashTable::unlocked_add(int &bucket_num,
@@ -511,8 +724,8 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                 }
                 itm.setCas();
             }
-            v = valFact(itm, values[bucket_num], *this, isDirty);
-            values[bucket_num] = v;
+            v = valFact(itm, bucketHead(bucket_num), *this, isDirty);
+            linkValue(bucket_num, v);
 
             if (v->isTempItem()) {
                 ++numTempItems;
@@ -601,21 +814,32 @@ void StoredValue::reduceMetaDataSize(HashTable &ht, EPStats &st, size_t by) {
  */
 bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm) {
     double newSize = static_cast<double>(st.getTotalMemoryUsed() +
-                                         sizeof(StoredValue) + itm.getNKey());
+                                         requiredStorage(itm.getNKey()));
     double maxSize=  static_cast<double>(st.getMaxDataSize()) * mutation_mem_threshold;
     return newSize <= maxSize;
 }
 
-Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
+Item* StoredValue::toItem(bool lck, uint16_t vbucket, Item *reuse) const {
+    if (reuse) {
+        reuse->reset(getKey(), getFlags(), getExptime(), value,
+                     lck ? static_cast<uint64_t>(-1) : getCas(),
+                     getBySeqno(), vbucket, getRevSeqno());
+        return reuse;
+    }
     return new Item(getKey(), getFlags(), getExptime(),
                     value,
                     lck ? static_cast<uint64_t>(-1) : getCas(),
-                    bySeqno, vbucket, getRevSeqno());
+                    getBySeqno(), vbucket, getRevSeqno());
 }
 
 Item *HashTable::getRandomKeyFromSlot(int slot) {
     LockHolder lh = getLockedBucket(slot);
-    StoredValue *v = values[slot];
+    // The slot may not exist in the array its stripe lives in while
+    // a resize is in progress.
+    if (static_cast<size_t>(slot) >= tableSize[stripeTable[mutexForBucket(slot)]]) {
+        return NULL;
+    }
+    StoredValue *v = bucketHead(slot);
 
     while (v) {
         if (!v->isTempItem() && !v->isDeleted() && v->isResident()) {
@@ -30,6 +30,7 @@
 #include "histo.h"
 #include "item.h"
 #include "item_pager.h"
+#include "keyhash.h"
 #include "locks.h"
 #include "queueditem.h"
 #include "stats.h"
@@ -52,8 +53,8 @@ class StoredValue {
 public:
 
     void operator delete(void* p) {
-        ::operator delete(p);
-     }
+        ObjectRegistry::deallocate(p);
+    }
 
     uint8_t getNRUValue();
 
@@ -153,6 +154,41 @@ public:
             && (std::memcmp(k.data(), getKeyBytes(), getKeyLen()) == 0);
     }
 
+    /**
+     * True of this item is for the given key, checking the cached key
+     * hash before comparing any key bytes.
+     *
+     * @param k the key we're checking
+     * @param h the hash of k
+     * @return true if this item's key is equal to k
+     */
+    bool hasKey(const std::string &k, uint64_t h) const {
+        // A locked item keeps its lock expiry where the hash would be.
+        return (locked || shortKeyHash == shortHash(h)) && hasKey(k);
+    }
+
+    /**
+     * Compute the hash of this item's key from the key bytes.
+     */
+    uint64_t getKeyHash() const {
+        return keyhash(getKeyBytes(), getKeyLen());
+    }
+
+    /**
+     * Get the high 32 bits of the hash of this item's key, which are
+     * cached while the item isn't locked.
+     */
+    uint32_t getShortKeyHash() const {
+        return locked ? shortHash(getKeyHash()) : shortKeyHash;
+    }
+
+    /**
+     * The part of a key hash cached in a StoredValue.
+     */
+    static uint32_t shortHash(uint64_t h) {
+        return static_cast<uint32_t>(h >> 32);
+    }
+
     /**
      * Get this item's key.
      */
@@ -210,15 +246,15 @@ public:
         value = itm.getValue();
         deleted = false;
         flags = itm.getFlags();
-        bySeqno = itm.getBySeqno();
+        storeBySeqno(itm.getBySeqno());
 
         cas = itm.getCas();
         exptime = itm.getExptime();
         if (preserveSeqno) {
-            revSeqno = itm.getRevSeqno();
+            setRevSeqno(itm.getRevSeqno());
         } else {
-            ++revSeqno;
-            itm.setRevSeqno(revSeqno);
+            setRevSeqno(getRevSeqno() + 1);
+            itm.setRevSeqno(getRevSeqno());
         }
 
         markDirty();
@@ -280,18 +316,20 @@ public:
 
     /**
      * Lock this item until the given time.
-     *
-     * This is a NOOP for small item types.
      */
     void lock(rel_time_t expiry) {
         lock_expiry = expiry;
+        locked = true;
     }
 
     /**
      * Unlock this item.
      */
     void unlock() {
-        lock_expiry = 0;
+        if (locked) {
+            locked = false;
+            shortKeyHash = shortHash(getKeyHash());
+        }
     }
 
     /**
@@ -300,7 +338,7 @@ public:
      * An item always has an ID after it's been persisted.
      */
     bool hasBySeqno() {
-        return bySeqno > 0;
+        return getBySeqno() > 0;
     }
 
     /**
@@ -308,8 +346,10 @@ public:
      *
      * @return the ID for the item; 0 if the item has no ID
      */
-    int64_t getBySeqno() {
-        return bySeqno;
+    int64_t getBySeqno() const {
+        // The high half is signed, so the negative states survive.
+        return static_cast<int64_t>(bySeqnoHigh) * (static_cast<int64_t>(1) << 32) +
+               bySeqnoLow;
     }
 
     /**
@@ -320,7 +360,7 @@ public:
      * It is an error to set an ID on an item that already has one.
      */
     void setBySeqno(int64_t to) {
-        bySeqno = to;
+        storeBySeqno(to);
         assert(hasBySeqno());
     }
 
@@ -329,7 +369,7 @@ public:
      */
     void setStoredValueState(const int64_t to) {
         assert(to == state_deleted_key || to == state_non_existent_key);
-        bySeqno = to;
+        storeBySeqno(to);
     }
 
     /**
@@ -344,14 +384,14 @@ public:
      * Is this an initial temporary item?
      */
     bool isTempInitialItem() {
-        return bySeqno == state_temp_init;
+        return getBySeqno() == state_temp_init;
     }
 
     /**
      * Is this a temporary item created for a non-existent key?
      */
      bool isTempNonExistentItem() {
-         return bySeqno == state_non_existent_key;
+         return getBySeqno() == state_non_existent_key;
 
      }
 
@@ -359,7 +399,7 @@ public:
      * Is this a temporary item created for a deleted key?
      */
      bool isTempDeletedItem() {
-         return bySeqno == state_deleted_key;
+         return getBySeqno() == state_deleted_key;
 
      }
 
@@ -376,11 +416,21 @@ public:
      * @return the amount of memory used by this item.
      */
     size_t size() {
-        return sizeof(StoredValue) + getKeyLen() + valuelen();
+        return metaDataSize() + valuelen();
     }
 
     size_t metaDataSize() {
-        return sizeof(StoredValue) + getKeyLen();
+        return requiredStorage(getKeyLen());
+    }
+
+    /**
+     * Get the number of bytes a StoredValue with a key of the given
+     * length takes. The first INLINE_KEY_BYTES of the key live in what
+     * would otherwise be padding at the end of the header.
+     */
+    static size_t requiredStorage(size_t keylen) {
+        return sizeof(StoredValue) +
+            (keylen > INLINE_KEY_BYTES ? keylen - INLINE_KEY_BYTES : 0);
     }
 
     /**
@@ -390,11 +440,10 @@ public:
      * @return true if the item is locked
      */
     bool isLocked(rel_time_t curtime) {
-        if (lock_expiry == 0 || (curtime > lock_expiry)) {
-            lock_expiry = 0;
-            return false;
+        if (locked && curtime > lock_expiry) {
+            unlock();
         }
-        return true;
+        return locked;
     }
 
     /**
@@ -449,8 +498,10 @@ public:
      *
      * @param lck if true, the new item will return a locked CAS ID.
      * @param vbucket the vbucket containing this item.
+     * @param reuse if not NULL, the item to reset and return instead of
+     *              a new one.
      */
-    Item *toItem(bool lck, uint16_t vbucket) const;
+    Item *toItem(bool lck, uint16_t vbucket, Item *reuse = NULL) const;
 
     /**
      * Set the memory threshold on the current bucket quota for accepting a new mutation
@@ -468,19 +519,22 @@ public:
     static const int64_t state_non_existent_key;
     static const int64_t state_temp_init;
 
+    //! Number of key bytes kept inside sizeof(StoredValue).
+    static const size_t INLINE_KEY_BYTES = 4;
+
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
                 bool setDirty = true) :
-        value(itm.getValue()), next(n), bySeqno(itm.getBySeqno()),
-        flags(itm.getFlags()) {
+        value(itm.getValue()), next(n), flags(itm.getFlags()) {
         cas = itm.getCas();
         exptime = itm.getExptime();
         deleted = false;
+        locked = false;
         nru = INITIAL_NRU_VALUE;
-        lock_expiry = 0;
         keylen = itm.getKey().length();
-        revSeqno = itm.getRevSeqno();
+        storeBySeqno(itm.getBySeqno());
+        setRevSeqno(itm.getRevSeqno());
 
         if (setDirty) {
             markDirty();
@@ -495,19 +549,35 @@ private:
     friend class HashTable;
     friend class StoredValueFactory;
 
+    void storeBySeqno(int64_t to) {
+        assert(to >= -(static_cast<int64_t>(1) << 47) &&
+               to < (static_cast<int64_t>(1) << 47));
+        bySeqnoLow = static_cast<uint32_t>(to);
+        bySeqnoHigh = static_cast<int16_t>(to >> 32);
+    }
+
     value_t            value;          // 8 bytes
     StoredValue        *next;          // 8 bytes
     uint64_t           cas;            //!< CAS identifier.
-    uint64_t           revSeqno;       //!< Revision id sequence number
-    int64_t            bySeqno;        //!< By sequence id number
-    rel_time_t         lock_expiry;    //!< getl lock expiration
+    //! Revision id sequence number. Set by remote clusters as well, so
+    //! all 64 bits are kept.
+    uint64_t           revSeqno;
+    // bySeqno is 48 bits, split so that it packs without holes.
+    uint32_t           bySeqnoLow;     //!< By sequence id number
     uint32_t           exptime;        //!< Expiration time of this item.
     uint32_t           flags;          // 4 bytes
+    union {
+        uint32_t       shortKeyHash;   //!< High half of the key hash
+        rel_time_t     lock_expiry;    //!< getl lock expiration, if locked
+    };
+    int16_t            bySeqnoHigh;
     bool               _isDirty  :  1; // 1 bit
     bool               deleted   :  1;
+    //! True while getl holds the item and lock_expiry is valid.
+    bool               locked    :  1;
     uint8_t            nru       :  2; //!< True if referenced since last sweep
     uint8_t            keylen;
-    char               keybytes[1];    //!< The key itself.
+    char               keybytes[INLINE_KEY_BYTES]; //!< The key itself.
 
     static void increaseMetaDataSize(HashTable &ht, EPStats &st, size_t by);
     static void reduceMetaDataSize(HashTable &ht, EPStats &st, size_t by);
@@ -697,21 +767,45 @@ private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, HashTable &ht,
                                 bool setDirty) {
-        size_t base = sizeof(StoredValue);
-
         const std::string &key = itm.getKey();
         assert(key.length() < 256);
-        size_t len = key.length() + base;
+        size_t len = StoredValue::requiredStorage(key.length());
 
-        StoredValue *t = new (::operator new(len))
+        StoredValue *t = new (ObjectRegistry::allocate(len))
                          StoredValue(itm, n, *stats, ht, setDirty);
         std::memcpy(t->keybytes, key.data(), key.length());
+        t->shortKeyHash = StoredValue::shortHash(keyhash(key.data(),
+                                                         key.length()));
         return t;
     }
 
     EPStats                *stats;
 };
 
+/**
+ * Layout of the per-bucket index of a HashTable.
+ */
+typedef enum {
+    HT_INDEX_CHAINED, // Walk the chain of StoredValues in each bucket.
+    HT_INDEX_BUCKETED // Look up tagged pointers in a cache line first.
+} ht_index_type_t;
+
+/**
+ * One cache line of the bucketed hash index.
+ *
+ * Holds the addresses of up to SLOTS items of a bucket's chain, each
+ * tagged with the top bits of its key hash, so most hits and misses
+ * touch this line instead of every StoredValue in the chain.
+ */
+struct HashIndexLine {
+    static const size_t SLOTS = 6;
+
+    StoredValue *items[SLOTS];
+    uint16_t     tags[SLOTS];
+    //! Number of items in the chain without a slot in this line.
+    uint32_t     overflow;
+};
+
 /**
  * A container of StoredValue instances.
  */
@@ -727,13 +821,23 @@ public:
      * @param l the number of locks in the hash table
      */
     HashTable(EPStats &st, size_t s = 0, size_t l = 0) :
-        stats(st), valFact(st) {
+        stats(st), valFact(st), indexType(defaultIndexType) {
         size = HashTable::getNumBuckets(s);
-        n_locks = HashTable::getNumLocks(l);
+        // Every lock must own at least one bucket; see getBucketForHash.
+        n_locks = std::min(HashTable::getNumLocks(l), size);
         assert(size > 0);
         assert(n_locks > 0);
         assert(visitors == 0);
-        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        values[0] = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        values[1] = NULL;
+        tableSize[0] = size;
+        tableSize[1] = 0;
+        lines[0] = lines[1] = NULL;
+        if (indexType == HT_INDEX_BUCKETED) {
+            lines[0] = allocIndexLines(size);
+        }
+        stripeTable = static_cast<uint8_t*>(calloc(n_locks, sizeof(uint8_t)));
+        resizeCursor = 0;
         mutexes = new Mutex[n_locks];
         activeState = true;
     }
@@ -749,16 +853,25 @@ public:
 #endif
         }
         delete []mutexes;
-        free(values);
-        values = NULL;
+        free(values[0]);
+        free(values[1]);
+        freeIndexLines(lines[0]);
+        freeIndexLines(lines[1]);
+        free(stripeTable);
+        values[0] = values[1] = NULL;
     }
 
     size_t memorySize() {
         return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + ((tableSize[0] + tableSize[1]) * bucketMemorySize())
+            + (n_locks * (sizeof(Mutex) + sizeof(uint8_t)));
     }
 
+    /**
+     * Get the layout of the bucket index of this hash table.
+     */
+    ht_index_type_t getIndexType(void) { return indexType; }
+
     /**
      * Get the number of hash table buckets this hash table has.
      */
@@ -803,6 +916,28 @@ public:
      */
     size_t getNumResizes() { return numResizes; }
 
+    /**
+     * True while a resize is migrating lock stripes to a new bucket array.
+     */
+    bool isResizing() { return stripesPending.load() > 0; }
+
+    /**
+     * Get the number of lock stripes still waiting to be migrated by the
+     * resize in progress (0 if no resize is running).
+     */
+    size_t getNumResizeStripesPending() { return stripesPending; }
+
+    /**
+     * Get the total number of lock stripes migrated by all resizes.
+     */
+    size_t getNumResizeStripesMoved() { return stripesMoved; }
+
+    /**
+     * Get the longest time (in microseconds) a single stripe lock was
+     * held while its items were migrated during a resize.
+     */
+    hrtime_t getMaxResizePause() { return maxResizePause; }
+
     /**
      * Get the number of temp. items within this hash table.
      */
@@ -815,20 +950,51 @@ public:
 
     /**
      * Resize to the specified size.
+     *
+     * The items are moved over one lock stripe at a time, so front-end
+     * operations only ever wait for the migration of a single stripe.
      */
     void resize(size_t to);
 
+    /**
+     * Start an incremental resize to the specified size without moving
+     * any items yet.
+     *
+     * A second bucket array is allocated next to the current one and
+     * resizeStep() moves the lock stripes over to it. Until a stripe is
+     * moved, all operations on its keys keep using the old array.
+     *
+     * @param to the new number of hash buckets
+     * @return true if a resize was started
+     */
+    bool startResize(size_t to);
+
+    /**
+     * Migrate up to the given number of lock stripes of the resize in
+     * progress to the new bucket array.
+     *
+     * @param maxStripes the maximum number of stripes to move
+     * @return the number of stripes still waiting to be moved
+     */
+    size_t resizeStep(size_t maxStripes);
+
     /**
      * Find the item with the given key.
      *
+     * The bucket lock is released before returning, so the StoredValue
+     * may be freed or relocated by the defragmenter at any time after.
+     * Callers that need its contents must use unlocked_find() under
+     * getLockedBucket() instead.
+     *
      * @param key the key to find
      * @return a pointer to a StoredValue -- NULL if not found
      */
     StoredValue *find(std::string &key, bool trackReference=true) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_find(key, bucket_num, false, trackReference);
+        uint64_t h = hash(key);
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        return unlocked_find(key, h, bucket_num, false, trackReference);
     }
 
     /**
@@ -872,8 +1038,10 @@ public:
                         item_eviction_policy_t policy = VALUE_ONLY,
                         uint8_t nru=0xff) {
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        uint64_t h = hash(val.getKey());
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_find(val.getKey(), h, bucket_num, true,
+                                       false);
         return unlocked_set(v, val, cas, allowExisting, hasMetaData, policy, nru);
     }
 
@@ -957,8 +1125,8 @@ public:
                 itm.setCas();
             }
             int bucket_num = getBucketForHash(hash(itm.getKey()));
-            v = valFact(itm, values[bucket_num], *this);
-            values[bucket_num] = v;
+            v = valFact(itm, bucketHead(bucket_num), *this);
+            linkValue(bucket_num, v);
             ++numItems;
             if (nru <= MAX_NRU_VALUE && !v->isTempItem()) {
                 v->setNRUValue(nru);
@@ -1006,8 +1174,10 @@ public:
                    bool isDirty = true, bool storeVal = true) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        uint64_t h = hash(val.getKey());
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_find(val.getKey(), h, bucket_num, true,
+                                       false);
         return unlocked_add(bucket_num, v, val, policy, isDirty, storeVal);
     }
 
@@ -1056,8 +1226,9 @@ public:
                                item_eviction_policy_t policy = VALUE_ONLY) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        StoredValue *v = unlocked_find(key, bucket_num, false, false);
+        uint64_t h = hash(key);
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_find(key, h, bucket_num, false, false);
         return unlocked_softDelete(v, cas, policy);
     }
 
@@ -1144,19 +1315,33 @@ public:
      */
     StoredValue *unlocked_find(const std::string &key, int bucket_num,
                                bool wantsDeleted=false, bool trackReference=true) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced();
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+        return unlocked_find(key, hash(key), bucket_num, wantsDeleted,
+                             trackReference);
+    }
+
+    /**
+     * Find an item within a specific bucket assuming you already
+     * locked the bucket, using the hash of the key computed when the
+     * bucket was locked.
+     *
+     * @param key the key of the item to find
+     * @param h the hash of the key
+     * @param bucket_num the bucket number
+     * @param wantsDeleted true if soft deleted items should be returned
+     *
+     * @return a pointer to a StoredValue -- NULL if not found
+     */
+    StoredValue *unlocked_find(const std::string &key, uint64_t h,
+                               int bucket_num, bool wantsDeleted,
+                               bool trackReference) {
+        StoredValue *v = findInBucket(key, h, bucket_num);
+        if (v) {
+            if (trackReference && !v->isDeleted()) {
+                v->referenced();
+            }
+            if (wantsDeleted || !v->isDeleted()) {
+                return v;
             }
-            v = v->next;
         }
         return NULL;
     }
@@ -1169,15 +1354,9 @@ public:
      *
      * @return the hash value
      */
-    inline int hash(const char *str, const size_t len) {
+    inline uint64_t hash(const char *str, const size_t len) {
         assert(isActive());
-        int h=5381;
-
-        for(size_t i=0; i < len; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
-
-        return h;
+        return keyhash(str, len);
     }
 
     /**
@@ -1186,7 +1365,7 @@ public:
      * @param s the string
      * @return the hash value
      */
-    inline int hash(const std::string &s) {
+    inline uint64_t hash(const std::string &s) {
         return hash(s.data(), s.length());
     }
 
@@ -1209,15 +1388,13 @@ public:
      * @param bucket output parameter to receive a bucket
      * @return a locked LockHolder
      */
-    inline LockHolder getLockedBucket(int h, int *bucket) {
-        while (true) {
-            assert(isActive());
-            *bucket = getBucketForHash(h);
-            LockHolder rv(mutexes[mutexForBucket(*bucket)]);
-            if (*bucket == getBucketForHash(h)) {
-                return rv;
-            }
-        }
+    inline LockHolder getLockedBucket(uint64_t h, int *bucket) {
+        assert(isActive());
+        // The lock only depends on the hash, so it stays the same while
+        // a resize moves the key between bucket arrays.
+        LockHolder rv(mutexes[mutexForHash(h)]);
+        *bucket = getBucketForHash(h);
+        return rv;
     }
 
     /**
@@ -1242,7 +1419,7 @@ public:
      * @return a locked LockHolder
      */
     inline LockHolder getLockedBucket(const std::string &s, int *bucket) {
-        return getLockedBucket(hash(s.data(), s.size()), bucket);
+        return getLockedBucket(hash(s), bucket);
     }
 
     /**
@@ -1255,55 +1432,35 @@ public:
      * @return true if an object was deleted, false otherwise
      */
     bool unlocked_del(const std::string &key, int bucket_num) {
-        assert(isActive());
-        StoredValue *v = values[bucket_num];
+        return unlocked_del(key, hash(key), bucket_num);
+    }
 
-        // Special case empty bucket.
-        if (!v) {
+    /**
+     * Delete a key from the cache without trying to lock the cache first,
+     * using the hash of the key computed when the bucket was locked.
+     *
+     * @param key the key to delete
+     * @param h the hash of the key
+     * @param bucket_num the bucket to look in (must already be locked)
+     * @return true if an object was deleted, false otherwise
+     */
+    bool unlocked_del(const std::string &key, uint64_t h, int bucket_num) {
+        assert(isActive());
+        StoredValue *v = findInBucket(key, h, bucket_num);
+        if (!v || (!v->isDeleted() && v->isLocked(ep_current_time()))) {
             return false;
         }
 
-        // Special case the first one
-        if (v->hasKey(key)) {
-            if (!v->isDeleted() && v->isLocked(ep_current_time())) {
-                return false;
-            }
-
-            values[bucket_num] = v->next;
-            StoredValue::reduceCacheSize(*this, v->size());
-            StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
-            if (v->isTempItem()) {
-                --numTempItems;
-            } else {
-                --numItems;
-            }
-            delete v;
-            return true;
-        }
-
-        while (v->next) {
-            if (v->next->hasKey(key)) {
-                StoredValue *tmp = v->next;
-                if (!tmp->isDeleted() && tmp->isLocked(ep_current_time())) {
-                    return false;
-                }
-
-                v->next = v->next->next;
-                StoredValue::reduceCacheSize(*this, tmp->size());
-                StoredValue::reduceMetaDataSize(*this, stats, tmp->metaDataSize());
-                if (tmp->isTempItem()) {
-                    --numTempItems;
-                } else {
-                    --numItems;
-                }
-                delete tmp;
-                return true;
-            } else {
-                v = v->next;
-            }
+        unlinkValue(bucket_num, v);
+        StoredValue::reduceCacheSize(*this, v->size());
+        StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
+        if (v->isTempItem()) {
+            --numTempItems;
+        } else {
+            --numItems;
         }
-
-        return false;
+        delete v;
+        return true;
     }
 
     /**
@@ -1315,8 +1472,9 @@ public:
     bool del(const std::string &key) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_del(key, bucket_num);
+        uint64_t h = hash(key);
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        return unlocked_del(key, h, bucket_num);
     }
 
     /**
@@ -1329,6 +1487,24 @@ public:
      */
     void visitDepth(HashTableDepthVisitor &visitor);
 
+    /**
+     * Hint the CPU to load the bucket of the given hash, without taking
+     * its lock. Batched lookups prefetch the buckets of several keys
+     * before searching any of them, so their cache misses overlap.
+     *
+     * @param h the hash of the key
+     */
+    void prefetchBucket(uint64_t h);
+
+    /**
+     * Move items and values out of the slabs the slab allocator is
+     * draining. Values that are also referenced from elsewhere stay
+     * where they are.
+     *
+     * @return the number of objects moved
+     */
+    size_t defragment();
+
     /**
      * Get the number of buckets that should be used for initialization.
      *
@@ -1353,6 +1529,12 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Set the bucket index layout used by hash tables created from now
+     * on.
+     */
+    static void setDefaultIndexType(ht_index_type_t);
+
     /**
      * Get the max deleted revision seqno seen so far.
      */
@@ -1400,23 +1582,162 @@ private:
 
     size_t               size;
     size_t               n_locks;
-    StoredValue        **values;
+    //! The bucket arrays; a resize moves stripes from one to the other.
+    StoredValue        **values[2];
+    size_t               tableSize[2];
+    //! The bucketed index of each bucket array, if in use.
+    HashIndexLine       *lines[2];
+    //! Index into values[] of the array each lock stripe lives in.
+    uint8_t             *stripeTable;
     Mutex               *mutexes;
     EPStats&             stats;
     StoredValueFactory   valFact;
+    ht_index_type_t      indexType;
     Atomic<size_t>       visitors;
     Atomic<size_t>       numItems;
     Atomic<size_t>       numResizes;
     Atomic<size_t>       numTempItems;
+    //! Serializes resizers; never taken by front-end operations.
+    Mutex                resizeLock;
+    size_t               resizeCursor;
+    Atomic<size_t>       stripesPending;
+    Atomic<size_t>       stripesMoved;
+    Atomic<hrtime_t>     maxResizePause;
     bool                 activeState;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static ht_index_type_t        defaultIndexType;
 
-    int getBucketForHash(int h) {
-        return abs(h % static_cast<int>(size));
+    /**
+     * Map a hash to a bucket in an array of the given size.
+     *
+     * Bucket i is always covered by lock i % n_locks, and a key always
+     * uses lock hash % n_locks, so a stripe holds the same set of keys
+     * in any bucket array.
+     */
+    int bucketForHash(uint64_t h, size_t tblSize) {
+        size_t lock = h % n_locks;
+        size_t stripeBuckets = (tblSize - lock + n_locks - 1) / n_locks;
+        return static_cast<int>(lock + n_locks * ((h / n_locks) % stripeBuckets));
     }
 
+    /**
+     * Get the bucket for the given hash in the array its stripe currently
+     * lives in. The caller must hold the stripe lock.
+     */
+    int getBucketForHash(uint64_t h) {
+        return bucketForHash(h, tableSize[stripeTable[h % n_locks]]);
+    }
+
+    /**
+     * Get the head of the chain of the given bucket. The caller must hold
+     * the stripe lock for the bucket.
+     */
+    inline StoredValue *&bucketHead(int bucket_num) {
+        return values[stripeTable[mutexForBucket(bucket_num)]][bucket_num];
+    }
+
+    /**
+     * Get the bucketed index line of the given bucket. The caller must
+     * hold the stripe lock for the bucket.
+     */
+    inline HashIndexLine &indexLine(int bucket_num) {
+        return lines[stripeTable[mutexForBucket(bucket_num)]][bucket_num];
+    }
+
+    static inline uint16_t indexTag(uint64_t h) {
+        return static_cast<uint16_t>(h >> 48);
+    }
+
+    //! The index tag of an item, the same as indexTag() of its key hash.
+    static inline uint16_t indexTag(const StoredValue *v) {
+        return static_cast<uint16_t>(v->getShortKeyHash() >> 16);
+    }
+
+    /**
+     * Find the item for the given key in a locked bucket, whether it is
+     * deleted or not.
+     */
+    StoredValue *findInBucket(const std::string &key, uint64_t h,
+                              int bucket_num) {
+        if (indexType == HT_INDEX_BUCKETED) {
+            HashIndexLine &line = indexLine(bucket_num);
+            uint16_t tag = indexTag(h);
+            for (size_t i = 0; i < HashIndexLine::SLOTS; ++i) {
+                if (line.tags[i] == tag && line.items[i] &&
+                    line.items[i]->hasKey(key, h)) {
+                    return line.items[i];
+                }
+            }
+            if (line.overflow == 0) {
+                return NULL;
+            }
+        }
+
+        for (StoredValue *v = bucketHead(bucket_num); v; v = v->next) {
+            if (v->hasKey(key, h)) {
+                return v;
+            }
+        }
+        return NULL;
+    }
+
+    /**
+     * Make a new StoredValue, whose next pointer already refers to the
+     * current head of the bucket, the head of the bucket.
+     */
+    void linkValue(int bucket_num, StoredValue *v) {
+        bucketHead(bucket_num) = v;
+        if (indexType == HT_INDEX_BUCKETED) {
+            indexInsert(indexLine(bucket_num), v);
+        }
+    }
+
+    /**
+     * Remove the given StoredValue from the chain (and index) of a
+     * locked bucket without freeing it.
+     */
+    void unlinkValue(int bucket_num, StoredValue *v);
+
+    /**
+     * Move a StoredValue of a locked bucket to newly allocated memory.
+     *
+     * @return the StoredValue at its new address
+     */
+    StoredValue *relocate(int bucket_num, StoredValue *v);
+
+    static void indexInsert(HashIndexLine &line, StoredValue *v) {
+        for (size_t i = 0; i < HashIndexLine::SLOTS; ++i) {
+            if (line.items[i] == NULL) {
+                line.items[i] = v;
+                line.tags[i] = indexTag(v);
+                return;
+            }
+        }
+        ++line.overflow;
+    }
+
+    size_t bucketMemorySize() const {
+        return sizeof(StoredValue*) +
+            (indexType == HT_INDEX_BUCKETED ? sizeof(HashIndexLine) : 0);
+    }
+
+    /**
+     * Find an item in the chain that has no slot in the given index line.
+     */
+    static StoredValue *findUnindexed(const HashIndexLine &line,
+                                      StoredValue *v);
+
+    static HashIndexLine *allocIndexLines(size_t n);
+    static void freeIndexLines(HashIndexLine *l);
+
+    inline int mutexForHash(uint64_t h) {
+        return static_cast<int>(h % n_locks);
+    }
+
+    void migrateStripe(size_t lock);
+
     inline int mutexForBucket(int bucket_num) {
         assert(isActive());
         assert(bucket_num >= 0);
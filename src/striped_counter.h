@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_STRIPED_COUNTER_H_
+#define SRC_STRIPED_COUNTER_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "common.h"
+
+/**
+ * A counter for stats updated by many threads at once.
+ *
+ * The count is split over stripes on separate cache lines, and every
+ * thread updates the stripe it was assigned on first use, so threads
+ * don't keep pulling the same cache line away from each other. Reading
+ * the counter adds up all stripes; it is meant for stats that are
+ * updated far more often than they are read.
+ *
+ * The stripes are not read as a snapshot, so a read that overlaps an
+ * increment on one stripe and a decrement on another may see just the
+ * decrement. Only counters that go up (or get reset) should be striped;
+ * gauges that go up and down, like the disk queue size, would briefly
+ * read as having wrapped below zero.
+ */
+class StripedCounter {
+public:
+
+    static const size_t NUM_STRIPES = 16;
+
+    StripedCounter(size_t initial = 0) {
+        store(initial);
+    }
+
+    size_t load() const {
+        size_t rv = 0;
+        for (size_t i = 0; i < NUM_STRIPES; ++i) {
+            rv += stripes[i].value.load();
+        }
+        return rv;
+    }
+
+    /**
+     * Set the counter. Updates made concurrently may get lost, so this
+     * is only for resetting stats.
+     */
+    void store(size_t newValue) {
+        stripes[0].value.store(newValue);
+        for (size_t i = 1; i < NUM_STRIPES; ++i) {
+            stripes[i].value.store(0);
+        }
+    }
+
+    void fetch_add(size_t n) {
+        stripes[stripe()].value.fetch_add(n);
+    }
+
+    void fetch_sub(size_t n) {
+        stripes[stripe()].value.fetch_sub(n);
+    }
+
+    void operator ++() {
+        fetch_add(1);
+    }
+
+    void operator ++(int) {
+        fetch_add(1);
+    }
+
+    void operator --() {
+        fetch_sub(1);
+    }
+
+    void operator --(int) {
+        fetch_sub(1);
+    }
+
+    void operator =(size_t newValue) {
+        store(newValue);
+    }
+
+    operator size_t() const {
+        return load();
+    }
+
+private:
+
+    // The stripe of the calling thread. Threads get the stripes round
+    // robin, so up to NUM_STRIPES threads never share one.
+    static size_t stripe() {
+        static ThreadLocal<void*> index;
+        static Atomic<size_t> nextIndex(0);
+        // Stored off by one, so a thread without a stripe reads 0.
+        size_t rv = reinterpret_cast<size_t>(index.get());
+        if (rv == 0) {
+            rv = (nextIndex++ % NUM_STRIPES) + 1;
+            index = reinterpret_cast<void*>(rv);
+        }
+        return rv - 1;
+    }
+
+    struct Stripe {
+        Atomic<size_t> value;
+        char           pad[64 - sizeof(Atomic<size_t>)];
+    };
+
+    Stripe stripes[NUM_STRIPES];
+
+    DISALLOW_COPY_AND_ASSIGN(StripedCounter);
+};
+
+#endif  // SRC_STRIPED_COUNTER_H_
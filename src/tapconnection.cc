@@ -145,6 +145,8 @@ TapConfig::TapConfig(EventuallyPersistentEngine &e)
     requeueSleepTime = config.getTapRequeueSleepTime();
     backfillBacklogLimit = config.getTapBacklogLimit();
     backfillResidentThreshold = config.getTapBackfillResident();
+    checkpointBatchItems = config.getTapCheckpointBatchItems();
+    checkpointBatchBytes = config.getTapCheckpointBatchBytes();
 }
 
 void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
@@ -215,6 +217,10 @@ TapProducer::TapProducer(EventuallyPersistentEngine &e,
     queueSize(0),
     flags(f),
     recordsFetched(0),
+    checkpointItemsFetched(0),
+    checkpointFetches(0),
+    itemsShipped(0),
+    bytesCopied(0),
     pendingFlush(false),
     backfillAge(0),
     doTakeOver(false),
@@ -923,6 +929,27 @@ void TapProducer::queueBGFetch_UNLOCKED(const std::string &key, uint64_t id, uin
 
 void TapProducer::completeBGFetchJob(Item *itm, uint16_t vbid, bool implicitEnqueue) {
     LockHolder lh(queueLock);
+    completeBGFetchJob_UNLOCKED(itm, vbid, implicitEnqueue);
+}
+
+void TapProducer::completeBGFetchJobs(const std::vector<Item*> &items,
+                                      bool implicitEnqueue) {
+    LockHolder lh(queueLock);
+    std::vector<Item*>::const_iterator it = items.begin();
+    if (isRetired()) {
+        // The queues of a retired producer may already be cleared for good.
+        for (; it != items.end(); ++it) {
+            delete *it;
+        }
+        return;
+    }
+    for (; it != items.end(); ++it) {
+        completeBGFetchJob_UNLOCKED(*it, (*it)->getVBucketId(), implicitEnqueue);
+    }
+}
+
+void TapProducer::completeBGFetchJob_UNLOCKED(Item *itm, uint16_t vbid,
+                                              bool implicitEnqueue) {
     std::map<uint16_t, CheckpointState>::iterator it = checkpointState_.find(vbid);
 
     // implicitEnqueue is used for the optimized disk fetch wherein we
@@ -982,6 +1009,22 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
     addStat("vb_filters", vbucketFilter.size(), add_stat, c);
     addStat("vb_filter", filterText.c_str(), add_stat, c);
     addStat("rec_fetched", recordsFetched, add_stat, c);
+    addStat("chk_items_fetched", checkpointItemsFetched, add_stat, c);
+    addStat("chk_fetches", checkpointFetches, add_stat, c);
+    if (checkpointItemsFetched > 0) {
+        addStat("chk_fetches_per_item",
+                static_cast<double>(checkpointFetches) / checkpointItemsFetched,
+                add_stat, c);
+    }
+    rel_time_t age = ep_current_time() - conn_->created;
+    if (age > 0) {
+        addStat("chk_items_per_sec", checkpointItemsFetched / age, add_stat, c);
+    }
+    addStat("bytes_copied", bytesCopied, add_stat, c);
+    if (itemsShipped > 0) {
+        addStat("bytes_copied_per_item",
+                static_cast<double>(bytesCopied) / itemsShipped, add_stat, c);
+    }
     if (recordsSkipped > 0) {
         addStat("rec_skipped", recordsSkipped, add_stat, c);
     }
@@ -1095,6 +1138,8 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
         uint16_t invalid_count = 0;
         uint16_t open_checkpoint_count = 0;
         uint16_t wait_for_ack_count = 0;
+        const TapConfig &config = engine_.getTapConfig();
+        std::vector<queued_item> items;
 
         std::map<uint16_t, CheckpointState>::iterator it = checkpointState_.begin();
         for (; it != checkpointState_.end(); ++it) {
@@ -1109,53 +1154,65 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
             }
 
             bool isLastItem = false;
-            queued_item qi = vb->checkpointManager.nextItem(conn_->name, isLastItem);
-            switch(qi->getOperation()) {
-            case queue_op_set:
-            case queue_op_del:
-                if (supportCheckpointSync_ && isLastItem) {
-                    it->second.lastItem = true;
-                } else {
-                    it->second.lastItem = false;
-                }
-                addEvent_UNLOCKED(qi);
-                break;
-            case queue_op_checkpoint_start:
-                {
-                    it->second.currentCheckpointId = qi->getRevSeqno();
-                    if (supportCheckpointSync_) {
-                        it->second.state = checkpoint_start;
-                        addCheckpointMessage_UNLOCKED(qi);
-                    }
-                }
-                break;
-            case queue_op_checkpoint_end:
-                if (supportCheckpointSync_) {
-                    it->second.state = checkpoint_end;
-                    uint32_t seqno_acked;
-                    if (seqnoReceived == 0) {
-                        seqno_acked = 0;
+            items.clear();
+            vb->checkpointManager.nextItems(conn_->name, it->second.cursor, items,
+                                            config.getCheckpointBatchItems(),
+                                            config.getCheckpointBatchBytes(),
+                                            isLastItem);
+            ++checkpointFetches;
+            checkpointItemsFetched += items.size();
+            if (items.empty()) {
+                ++open_checkpoint_count;
+                continue;
+            }
+
+            std::vector<queued_item>::iterator qit = items.begin();
+            for (; qit != items.end(); ++qit) {
+                queued_item &qi = *qit;
+                switch(qi->getOperation()) {
+                case queue_op_set:
+                case queue_op_del:
+                    // Only a batch of its own can hold the last item.
+                    if (supportCheckpointSync_ && isLastItem) {
+                        it->second.lastItem = true;
                     } else {
-                        seqno_acked = isLastAckSucceed ? seqnoReceived : seqnoReceived - 1;
+                        it->second.lastItem = false;
                     }
-                    if (it->second.lastSeqNum <= seqno_acked &&
-                        it->second.isBgFetchCompleted()) {
-                        // All resident and non-resident items in a checkpoint are sent
-                        // and acked. CHEKCPOINT_END message is going to be sent.
-                        addCheckpointMessage_UNLOCKED(qi);
-                    } else {
-                        vb->checkpointManager.decrTapCursorFromCheckpointEnd(conn_->name);
-                        ++wait_for_ack_count;
+                    addEvent_UNLOCKED(qi);
+                    break;
+                case queue_op_checkpoint_start:
+                    {
+                        it->second.currentCheckpointId = qi->getRevSeqno();
+                        if (supportCheckpointSync_) {
+                            it->second.state = checkpoint_start;
+                            addCheckpointMessage_UNLOCKED(qi);
+                        }
                     }
+                    break;
+                case queue_op_checkpoint_end:
+                    if (supportCheckpointSync_) {
+                        it->second.state = checkpoint_end;
+                        uint32_t seqno_acked;
+                        if (seqnoReceived == 0) {
+                            seqno_acked = 0;
+                        } else {
+                            seqno_acked = isLastAckSucceed ? seqnoReceived : seqnoReceived - 1;
+                        }
+                        if (it->second.lastSeqNum <= seqno_acked &&
+                            it->second.isBgFetchCompleted()) {
+                            // All resident and non-resident items in a checkpoint are sent
+                            // and acked. CHEKCPOINT_END message is going to be sent.
+                            addCheckpointMessage_UNLOCKED(qi);
+                        } else {
+                            vb->checkpointManager.decrTapCursorFromCheckpointEnd(conn_->name,
+                                                                             it->second.cursor);
+                            ++wait_for_ack_count;
+                        }
+                    }
+                    break;
+                default:
+                    break;
                 }
-                break;
-            case queue_op_empty:
-                {
-                    ++open_checkpoint_count;
-                }
-                break;
-            default:
-                break;
             }
         }
 
@@ -1203,7 +1260,8 @@ size_t TapProducer::getRemainingOnCheckpoints_UNLOCKED() {
         if (!vb || (vb->getState() == vbucket_state_dead && !doTakeOver)) {
             continue;
         }
-        numItems += vb->checkpointManager.getNumItemsForTAPConnection(conn_->name);
+        numItems += vb->checkpointManager.getNumItemsForTAPConnection(conn_->name,
+                                                                      it->second.cursor);
     }
     return numItems;
 }
@@ -1218,7 +1276,7 @@ bool TapProducer::hasNextFromCheckpoints_UNLOCKED() {
         if (!vb || (vb->getState() == vbucket_state_dead && !doTakeOver)) {
             continue;
         }
-        hasNext = vb->checkpointManager.hasNext(conn_->name);
+        hasNext = vb->checkpointManager.hasNext(conn_->name, it->second.cursor);
         if (hasNext) {
             break;
         }
@@ -1656,6 +1714,9 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
                             uint8_t &nru) {
     LockHolder lh(queueLock);
     Item *itm = NULL;
+    // Items go out as views of the stored values; only keys and control
+    // message bodies are copied.
+    ItemPool &pool = engine_.getTapConnMap().getItemPool();
 
     // Check if there are any checkpoint start / end messages to be sent to the TAP client.
     queued_item checkpoint_msg = nextCheckpointMessage_UNLOCKED();
@@ -1677,8 +1738,11 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
         *vbucket = checkpoint_msg->getVBucketId();
         uint64_t cid = htonll(checkpoint_msg->getRevSeqno());
         value_t vblob(Blob::New((const char*)&cid, sizeof(cid)));
-        itm = new Item(checkpoint_msg->getKey(), 0, 0, vblob,
-                       0, -1, checkpoint_msg->getVBucketId());
+        itm = pool.acquire();
+        itm->reset(checkpoint_msg->getKey(), 0, 0, vblob,
+                   0, -1, checkpoint_msg->getVBucketId());
+        ++itemsShipped;
+        bytesCopied += checkpoint_msg->getKey().length() + sizeof(cid);
         return itm;
     }
 
@@ -1703,14 +1767,19 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
 
         // If there's a better version in memory, grab it,
         // else go with what we pulled from disk.
+        Item *reuse = pool.acquire();
         GetValue gv(engine_.getEpStore()->get(itm->getKey(), itm->getVBucketId(),
-                                              c, false, false, false));
+                                              c, false, false, false, reuse));
         if (gv.getStatus() == ENGINE_SUCCESS) {
             delete itm;
             itm = gv.getValue();
-        } else if (gv.getStatus() == ENGINE_KEY_ENOENT ||
-                   itm->isExpired(ep_real_time()) || itm->isDeleted()) {
-            ret = TAP_DELETION;
+            bytesCopied += itm->getNKey();
+        } else {
+            pool.release(reuse);
+            if (gv.getStatus() == ENGINE_KEY_ENOENT ||
+                itm->isExpired(ep_real_time()) || itm->isDeleted()) {
+                ret = TAP_DELETION;
+            }
         }
 
         nru = gv.getNRUValue();
@@ -1740,21 +1809,26 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
         }
 
         if (qi->getOperation() == queue_op_set) {
+            Item *reuse = pool.acquire();
             GetValue gv(engine_.getEpStore()->get(qi->getKey(), qi->getVBucketId(),
-                                                  c, false, false, false));
+                                                  c, false, false, false, reuse));
             ENGINE_ERROR_CODE r = gv.getStatus();
             if (r == ENGINE_SUCCESS) {
                 itm = gv.getValue();
                 assert(itm);
                 nru = gv.getNRUValue();
+                bytesCopied += itm->getNKey();
                 ret = TAP_MUTATION;
             } else if (r == ENGINE_KEY_ENOENT) {
                 // Item was deleted and set a message type to tap_deletion.
-                itm = new Item(qi->getKey().c_str(), qi->getKey().length(), 0,
-                               0, 0, 0, -1, qi->getVBucketId());
+                itm = reuse;
+                itm->reset(qi->getKey(), 0, 0, value_t(), 0, -1,
+                           qi->getVBucketId());
                 itm->setRevSeqno(qi->getRevSeqno());
+                bytesCopied += itm->getNKey();
                 ret = TAP_DELETION;
             } else if (r == ENGINE_EWOULDBLOCK) {
+                pool.release(reuse);
                 queueBGFetch_UNLOCKED(qi->getKey(), gv.getId(), *vbucket);
                 // If there's an item ready, return NOOP so we'll come
                 // back immediately, otherwise pause the connection
@@ -1766,6 +1840,7 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
                 }
                 return NULL;
             } else {
+                pool.release(reuse);
                 if (r == ENGINE_NOT_MY_VBUCKET) {
                     LOG(EXTENSION_LOG_WARNING, "%s Trying to fetch an item for "
                         "vbucket %d that doesn't exist on this server",
@@ -1780,15 +1855,17 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
             }
             ++stats.numTapFGFetched;
         } else if (qi->getOperation() == queue_op_del) {
-            itm = new Item(qi->getKey().c_str(), qi->getKey().length(), 0,
-                           0, 0, 0, -1, qi->getVBucketId());
+            itm = pool.acquire();
+            itm->reset(qi->getKey(), 0, 0, value_t(), 0, -1, qi->getVBucketId());
             itm->setRevSeqno(qi->getRevSeqno());
+            bytesCopied += itm->getNKey();
             ret = TAP_DELETION;
             ++stats.numTapDeletes;
         }
     }
 
     if (ret == TAP_MUTATION || ret == TAP_DELETION) {
+        ++itemsShipped;
         ++queueDrain;
         addLogElement_UNLOCKED(qi);
         if (!isBackfillCompleted_UNLOCKED() && totalBackfillBacklogs > 0) {
@@ -1804,6 +1881,39 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, uint16_t &ret,
 
 /***************************** UprProducer **************************************/
 
+/**
+ * Free a message that was never sent, along with the item it holds.
+ */
+static void discardResponse(UprResponse *resp) {
+    switch (resp->getEvent()) {
+        case UPR_MUTATION:
+        case UPR_DELETION:
+            delete dynamic_cast<MutationResponse*>(resp)->getItem();
+            break;
+        default:
+            break;
+    }
+    delete resp;
+}
+
+void Stream::clear() {
+    while (!readyQ.empty()) {
+        discardResponse(readyQ.front());
+        readyQ.pop();
+    }
+    readyQBytes = 0;
+}
+
+UprProducer::UprProducer(EventuallyPersistentEngine &e,
+                         const void *cookie,
+                         const std::string &n) :
+    Producer(e, cookie, n), nextStream(0), peeked(NULL), peekedVBucket(0),
+    streamBufferBytes(e.getConfiguration().getUprStreamBufferBytes()),
+    bufferSize(0), unackedBytes(0), ackedBytes(0), itemsSent(0) {
+    conn_ = new Connection(this, cookie, n);
+    setReserved(false);
+}
+
 ENGINE_ERROR_CODE UprProducer::addStream(uint16_t vbucket,
                                          uint32_t opaque,
                                          uint32_t stream_flags,
@@ -1817,11 +1927,15 @@ ENGINE_ERROR_CODE UprProducer::addStream(uint16_t vbucket,
         return ENGINE_NOT_MY_VBUCKET;
     }
 
+    LockHolder lh(queueLock);
     std::map<uint16_t, Stream*>::iterator itr = streams.find(vbucket);
     if (itr != streams.end()) {
         if (itr->second->getState() != STREAM_DEAD) {
             return ENGINE_KEY_EEXISTS;
         } else {
+            if (peeked && peekedVBucket == vbucket) {
+                peeked = NULL;
+            }
             delete itr->second;
             streams.erase(vbucket);
         }
@@ -1838,22 +1952,28 @@ ENGINE_ERROR_CODE UprProducer::addStream(uint16_t vbucket,
     if (start_seqno >= end_seqno) {
         readyQ.push(new StreamEndResponse(opaque, 0, vbucket));
     } else {
-        streams[vbucket] = new Stream(stream_flags, opaque, vbucket,
-                                      start_seqno, end_seqno, vb_uuid,
-                                      high_seqno, STREAM_ACTIVE);
-        scheduleBackfill(vb, start_seqno, end_seqno);
+        Stream *s = new Stream(stream_flags, opaque, vbucket, start_seqno,
+                               end_seqno, vb_uuid, high_seqno, STREAM_ACTIVE);
+        streams[vbucket] = s;
+        lh.unlock();
+        size_t taskId = scheduleBackfill(vb, start_seqno, end_seqno);
+        lh.lock();
+        itr = streams.find(vbucket);
+        if (itr != streams.end() && itr->second == s) {
+            s->setBackfillTask(taskId);
+        }
     }
 
     return ENGINE_SUCCESS;
 }
 
-void UprProducer::scheduleBackfill(RCPtr<VBucket> &vb, uint64_t start_seqno,
-                                   uint64_t end_seqno) {
+size_t UprProducer::scheduleBackfill(RCPtr<VBucket> &vb, uint64_t start_seqno,
+                                     uint64_t end_seqno) {
     item_eviction_policy_t policy = engine_.getEpStore()->getItemEvictionPolicy();
     double num_items = static_cast<double>(vb->getNumItems(policy));
 
     if (num_items == 0) {
-        return;
+        return 0;
     }
 
     KVStore *underlying(engine_.getEpStore()->getAuxUnderlying());
@@ -1862,16 +1982,22 @@ void UprProducer::scheduleBackfill(RCPtr<VBucket> &vb, uint64_t start_seqno,
     ExTask task = new BackfillDiskLoad(conn_->name, &engine_,
                                        engine_.getUprConnMap(),
                                        underlying, vb->getId(), start_seqno,
-                                       end_seqno, conn_->getConnectionToken(),
+                                       end_seqno, connection_t(this),
                                        Priority::TapBgFetcherPriority,
                                        0, false);
-    ExecutorPool::get()->schedule(task, AUXIO_TASK_IDX);
+    return ExecutorPool::get()->schedule(task, AUXIO_TASK_IDX);
 }
 
 void UprProducer::addStats(ADD_STAT add_stat, const void *c) {
     ConnHandler::addStats(add_stat, c);
 
     LockHolder lh(queueLock);
+    addStat("buffer_size", bufferSize, add_stat, c);
+    addStat("unacked_bytes", unackedBytes, add_stat, c);
+    addStat("acked_bytes", ackedBytes, add_stat, c);
+    addStat("items_sent", itemsSent, add_stat, c);
+    addStat("window_full", windowIsFull_UNLOCKED(), add_stat, c);
+
     std::map<uint16_t, Stream*>::iterator itr;
     for (itr = streams.begin(); itr != streams.end(); ++itr) {
         const int bsize = 32;
@@ -1889,6 +2015,12 @@ void UprProducer::addStats(ADD_STAT add_stat, const void *c) {
         addStat(buffer, s->getVBucketUUID(), add_stat, c);
         snprintf(buffer, bsize, "stream_%d_high_seqno", s->getVBucket());
         addStat(buffer, s->getHighSeqno(), add_stat, c);
+        snprintf(buffer, bsize, "stream_%d_backlog_items", s->getVBucket());
+        addStat(buffer, s->getBacklogItems(), add_stat, c);
+        snprintf(buffer, bsize, "stream_%d_backlog_bytes", s->getVBucket());
+        addStat(buffer, s->getBacklogBytes(), add_stat, c);
+        snprintf(buffer, bsize, "stream_%d_backfill_blocked", s->getVBucket());
+        addStat(buffer, s->isBackfillBlocked(), add_stat, c);
     }
 }
 
@@ -1904,41 +2036,110 @@ void UprProducer::aggregateQueueStats(ConnCounter* aggregator) {
 }
 
 UprResponse* UprProducer::peekNextItem() {
-    LockHolder lh(queueLock);
-    while (!readyQ.empty()) {
-        bool skip = false;
-        UprResponse* op = readyQ.front();
-        switch (op->getEvent()) {
-            case UPR_MUTATION:
-            case UPR_DELETION:
-            {
-                MutationResponse *m = dynamic_cast<MutationResponse*>(op);
-                skip = shouldSkipMutation(m->getBySeqno(), m->getVBucket());
-                break;
+    size_t wakeTask = 0;
+    UprResponse* op = NULL;
+    {
+        LockHolder lh(queueLock);
+        if (windowIsFull_UNLOCKED()) {
+            return NULL;
+        }
+        while ((op = nextResponse_UNLOCKED()) != NULL) {
+            bool skip = false;
+            switch (op->getEvent()) {
+                case UPR_MUTATION:
+                case UPR_DELETION:
+                {
+                    MutationResponse *m = dynamic_cast<MutationResponse*>(op);
+                    skip = shouldSkipMutation(m->getBySeqno(), m->getVBucket());
+                    break;
+                }
+                case UPR_STREAM_END:
+                    break;
+                default:
+                    LOG(EXTENSION_LOG_WARNING, "Producer is attempting to write an "
+                        "unexpected event %d", op->getEvent());
+                    abort();
             }
-            case UPR_STREAM_END:
+            if (!skip) {
                 break;
-            default:
-                LOG(EXTENSION_LOG_WARNING, "Producer is attempting to write an "
-                    "unexpected event %d", op->getEvent());
-                abort();
-        }
-        if (!skip) {
-            return op;
+            }
+            size_t taskId = removeResponse_UNLOCKED(op, false);
+            if (taskId != 0) {
+                wakeTask = taskId;
+            }
         }
-        delete op;
-        readyQ.pop();
     }
-    return NULL;
+    if (wakeTask != 0) {
+        ExecutorPool::get()->wake(wakeTask);
+    }
+    return op;
 }
 
 void UprProducer::popNextItem() {
-    LockHolder lh(queueLock);
+    size_t wakeTask = 0;
+    {
+        LockHolder lh(queueLock);
+        if (peeked) {
+            wakeTask = removeResponse_UNLOCKED(peeked, true);
+        }
+    }
+    if (wakeTask != 0) {
+        ExecutorPool::get()->wake(wakeTask);
+    }
+}
+
+UprResponse* UprProducer::nextResponse_UNLOCKED() {
+    peeked = NULL;
     if (!readyQ.empty()) {
-        UprResponse* op = readyQ.front();
-        delete op;
+        peeked = readyQ.front();
+        return peeked;
+    }
+
+    std::map<uint16_t, Stream*>::iterator itr = streams.lower_bound(nextStream);
+    for (size_t i = 0; i < streams.size(); ++i, ++itr) {
+        if (itr == streams.end()) {
+            itr = streams.begin();
+        }
+        UprResponse *resp = itr->second->front();
+        if (resp) {
+            peeked = resp;
+            peekedVBucket = itr->first;
+            return peeked;
+        }
+    }
+    return NULL;
+}
+
+size_t UprProducer::removeResponse_UNLOCKED(UprResponse *resp, bool sent) {
+    size_t wakeTask = 0;
+    peeked = NULL;
+    if (!readyQ.empty() && readyQ.front() == resp) {
         readyQ.pop();
+    } else {
+        std::map<uint16_t, Stream*>::iterator itr = streams.find(peekedVBucket);
+        if (itr == streams.end() || itr->second->front() != resp) {
+            // The stream was cleared in the meantime.
+            return 0;
+        }
+        Stream *s = itr->second;
+        s->pop();
+        // Let the next stream have its turn.
+        nextStream = peekedVBucket + 1;
+        if (s->isBackfillBlocked() &&
+            s->getBacklogBytes() <= streamBufferBytes / 2) {
+            s->setBackfillBlocked(false);
+            wakeTask = s->getBackfillTask();
+        }
+    }
+
+    if (sent) {
+        unackedBytes += resp->getMessageSize();
+        ++itemsSent;
+        delete resp;
+    } else {
+        discardResponse(resp);
     }
+    return wakeTask;
 }
 
 bool UprProducer::shouldSkipMutation(uint64_t byseqno, uint16_t vbucket) {
@@ -1969,10 +2170,14 @@ void UprProducer::setTimeForNoop() {
 void UprProducer::clearQueues() {
     LockHolder lh(queueLock);
     while (!readyQ.empty()) {
-        UprResponse* resp = readyQ.front();
+        discardResponse(readyQ.front());
         readyQ.pop();
-        delete resp;
     }
+    std::map<uint16_t, Stream*>::iterator itr = streams.begin();
+    for (; itr != streams.end(); ++itr) {
+        itr->second->clear();
+    }
+    peeked = NULL;
 }
 
 void UprProducer::appendQueue(std::list<queued_item> *q) {
@@ -2013,17 +2218,54 @@ void UprProducer::completeBGFetchJob(Item *item, uint16_t vbid,
 
     // TODO: This is the wrong way to assign an opaque
     std::map<uint16_t, Stream*>::iterator itr = streams.find(vbid);
-    if (itr == streams.end()) {
+    if (itr == streams.end() || itr->second->getState() != STREAM_ACTIVE) {
+        delete item;
         return;
     }
 
     stats.memOverhead.fetch_add(sizeof(Item *));
     assert(stats.memOverhead.load() < GIGANTOR);
-    readyQ.push(new MutationResponse(item, itr->second->getOpaque()));
+    itr->second->push(new MutationResponse(item, itr->second->getOpaque()));
+}
+
+void UprProducer::completeBGFetchJobs(const std::vector<Item*> &items,
+                                      bool implicitEnqueue) {
+    // Backfills of different vbuckets may hand over batches concurrently.
+    LockHolder lh(queueLock);
+    Producer::completeBGFetchJobs(items, implicitEnqueue);
+}
+
+bool UprProducer::isBackfillBlocked(uint16_t vbucket) {
+    LockHolder lh(queueLock);
+    std::map<uint16_t, Stream*>::iterator itr = streams.find(vbucket);
+    if (itr == streams.end() ||
+        itr->second->getBacklogBytes() < streamBufferBytes) {
+        return false;
+    }
+    itr->second->setBackfillBlocked(true);
+    return true;
 }
 
 bool UprProducer::windowIsFull() {
-    abort(); // Not Implemented
+    LockHolder lh(queueLock);
+    return windowIsFull_UNLOCKED();
+}
+
+void UprProducer::setBufferSize(uint32_t bytes) {
+    LockHolder lh(queueLock);
+    bufferSize = bytes;
+}
+
+void UprProducer::bufferAcknowledgement(uint32_t bytes) {
+    LockHolder lh(queueLock);
+    if (bytes > unackedBytes) {
+        LOG(EXTENSION_LOG_WARNING, "%s Consumer acknowledged %u bytes, but "
+            "only %llu were unacknowledged", logHeader(), bytes,
+            static_cast<unsigned long long>(unackedBytes));
+        bytes = unackedBytes;
+    }
+    unackedBytes -= bytes;
+    ackedBytes += bytes;
 }
 
 void UprProducer::flush() {
@@ -28,6 +28,7 @@
 #include <vector>
 
 #include "atomic.h"
+#include "checkpoint.h"
 #include "common.h"
 #include "locks.h"
 #include "mutex.h"
@@ -561,6 +562,8 @@ public:
     // True if the TAP cursor reaches to the last item at its current checkpoint.
     bool lastItem;
     proto_checkpoint_state state;
+    // Handle to the TAP cursor in the vbucket's checkpoint manager.
+    CursorHandle cursor;
 };
 
 
@@ -606,6 +609,14 @@ public:
         return backfillResidentThreshold;
     }
 
+    size_t getCheckpointBatchItems() const {
+        return checkpointBatchItems;
+    }
+
+    size_t getCheckpointBatchBytes() const {
+        return checkpointBatchBytes;
+    }
+
 protected:
     friend class TapConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -672,6 +683,10 @@ private:
     size_t backfillBacklogLimit;
     double backfillResidentThreshold;
 
+    // Parameters to control the batches taken from checkpoints
+    size_t checkpointBatchItems;
+    size_t checkpointBatchBytes;
+
     EventuallyPersistentEngine &engine;
 };
 
@@ -810,7 +825,8 @@ public:
         paused(false),
         notificationScheduled(false),
         notifySent(false),
-        reconnects(0) {}
+        reconnects(0),
+        retired(false) {}
 
     void addStats(ADD_STAT add_stat, const void *c);
 
@@ -896,8 +912,44 @@ public:
     virtual void completeBGFetchJob(Item *item, uint16_t vbid,
                                     bool implicitEnqueue) = 0;
 
+    /**
+     * Invoked with a batch of items fetched by a disk backfill.
+     */
+    virtual void completeBGFetchJobs(const std::vector<Item*> &items,
+                                     bool implicitEnqueue) {
+        std::vector<Item*>::const_iterator it = items.begin();
+        for (; it != items.end(); ++it) {
+            completeBGFetchJob(*it, (*it)->getVBucketId(), implicitEnqueue);
+        }
+    }
+
+    /**
+     * Mark this producer as no longer reachable through its name in the
+     * connection map. Called with the map's lock held.
+     */
+    void retire() {
+        retired = true;
+    }
+
+    /**
+     * True if the producer was closed for good or replaced by another
+     * producer with the same name.
+     */
+    bool isRetired() const {
+        return retired;
+    }
+
     virtual bool windowIsFull() = 0;
 
+    /**
+     * True if the disk backfill of the given vbucket should wait for the
+     * producer to send what it holds before loading more items.
+     */
+    virtual bool isBackfillBlocked(uint16_t vbucket) {
+        (void) vbucket;
+        return false;
+    }
+
     const VBucketFilter &getVBucketFilter() {
         LockHolder lh(queueLock);
         return vbucketFilter;
@@ -930,6 +982,8 @@ private:
     Atomic<bool> notifySent;
     //! Number of times this client reconnected
     uint32_t reconnects;
+    //! No longer reachable through the connection map?
+    Atomic<bool> retired;
 };
 
 /**
@@ -987,6 +1041,9 @@ public:
      */
     void completeBGFetchJob(Item *item, uint16_t vbid, bool implicitEnqueue);
 
+    void completeBGFetchJobs(const std::vector<Item*> &items,
+                             bool implicitEnqueue);
+
     /**
      * Get the next item (e.g., checkpoint_start, checkpoint_end, tap_mutation, or
      * tap_deletion) to be transmitted.
@@ -1076,6 +1133,9 @@ protected:
      *
      * @return true if the the queue was empty
      */
+    void completeBGFetchJob_UNLOCKED(Item *item, uint16_t vbid,
+                                     bool implicitEnqueue);
+
     bool addEvent_UNLOCKED(const queued_item &it);
 
     /**
@@ -1445,6 +1505,14 @@ protected:
     uint32_t flags;
     //! Number of records fetched from this stream since the
     size_t recordsFetched;
+    //! Number of items taken from the checkpoints
+    size_t checkpointItemsFetched;
+    //! Number of batches taken from the checkpoints
+    size_t checkpointFetches;
+    //! Number of items handed to memcached
+    size_t itemsShipped;
+    //! Number of bytes copied into the items handed to memcached
+    size_t bytesCopied;
     //! Number of records skipped due to changing the filter on the connection
     Atomic<size_t> recordsSkipped;
     //! Do we have a pending flush command?
@@ -1529,9 +1597,11 @@ public:
            stream_state_t st) :
         flags(f), opaque(op), vbucket(vb), start_seqno(s_seqno),
         end_seqno(e_seqno), vbucket_uuid(vb_uuid), high_seqno(h_seqno),
-        state(st) {}
+        state(st), readyQBytes(0), backfillTask(0), backfillBlocked(false) {}
 
-    ~Stream() {}
+    ~Stream() {
+        clear();
+    }
 
     uint32_t getFlags() { return flags; }
 
@@ -1551,6 +1621,47 @@ public:
 
     void setState(stream_state_t newState) { state = newState; }
 
+    /**
+     * Queue a message for the producer to send on this stream.
+     */
+    void push(UprResponse *resp) {
+        readyQ.push(resp);
+        readyQBytes += resp->getMessageSize();
+    }
+
+    /**
+     * Return the next message to send on this stream, or NULL if there
+     * is none.
+     */
+    UprResponse *front() {
+        return readyQ.empty() ? NULL : readyQ.front();
+    }
+
+    /**
+     * Remove the next message from the queue without freeing it.
+     */
+    void pop() {
+        readyQBytes -= readyQ.front()->getMessageSize();
+        readyQ.pop();
+    }
+
+    /**
+     * Free all queued messages along with the items they hold.
+     */
+    void clear();
+
+    size_t getBacklogItems() { return readyQ.size(); }
+
+    size_t getBacklogBytes() { return readyQBytes; }
+
+    void setBackfillTask(size_t taskId) { backfillTask = taskId; }
+
+    size_t getBackfillTask() { return backfillTask; }
+
+    bool isBackfillBlocked() { return backfillBlocked; }
+
+    void setBackfillBlocked(bool blocked) { backfillBlocked = blocked; }
+
 private:
     uint32_t flags;
     uint32_t opaque;
@@ -1560,6 +1671,16 @@ private:
     uint64_t vbucket_uuid;
     uint64_t high_seqno;
     stream_state_t state;
+
+    //! Messages waiting to be sent on this stream.
+    std::queue<UprResponse*> readyQ;
+    size_t readyQBytes;
+    //! The disk backfill feeding the stream, and whether it waits for
+    //! the stream to drain.
+    size_t backfillTask;
+    bool backfillBlocked;
+
+    DISALLOW_COPY_AND_ASSIGN(Stream);
 };
 
 class UprConsumer : public Consumer {
@@ -1601,13 +1722,15 @@ public:
 
     UprProducer(EventuallyPersistentEngine &e,
                 const void *cookie,
-                const std::string &n) :
-        Producer(e, cookie, n) {
-        conn_ = new Connection(this, cookie, n);
-        setReserved(false);
-    }
+                const std::string &n);
 
-    ~UprProducer() {}
+    ~UprProducer() {
+        clearQueues();
+        std::map<uint16_t, Stream*>::iterator itr = streams.begin();
+        for (; itr != streams.end(); ++itr) {
+            delete itr->second;
+        }
+    }
 
     void addStats(ADD_STAT add_stat, const void *c);
 
@@ -1622,8 +1745,11 @@ public:
                                 uint64_t high_seqno,
                                 uint64_t *rollback_seqno);
 
-    void scheduleBackfill(RCPtr<VBucket> &vb, uint64_t start_seqno,
-                          uint64_t end_seqno);
+    /**
+     * @return the id of the disk backfill task, or 0 if none was needed
+     */
+    size_t scheduleBackfill(RCPtr<VBucket> &vb, uint64_t start_seqno,
+                            uint64_t end_seqno);
 
     bool isTimeForNoop();
 
@@ -1645,16 +1771,57 @@ public:
 
     void completeBGFetchJob(Item *item, uint16_t vbid, bool implicitEnqueue);
 
+    void completeBGFetchJobs(const std::vector<Item*> &items,
+                             bool implicitEnqueue);
+
+    bool isBackfillBlocked(uint16_t vbucket);
+
+    /**
+     * True if the consumer's buffer holds as many bytes as it advertised,
+     * so nothing more is sent until it acknowledges some of them.
+     */
     bool windowIsFull();
 
+    /**
+     * Set the number of bytes of messages the consumer is able to buffer,
+     * 0 to turn flow control off.
+     */
+    void setBufferSize(uint32_t bytes);
+
+    /**
+     * Give back the credit for messages the consumer has processed.
+     */
+    void bufferAcknowledgement(uint32_t bytes);
+
     void flush();
 
+    /**
+     * Return the next message to send, or NULL if there is none or the
+     * consumer's buffer is full. Streams with queued messages take turns.
+     */
     UprResponse* peekNextItem();
 
     void popNextItem();
 
 private:
 
+    bool windowIsFull_UNLOCKED() {
+        return bufferSize > 0 && unackedBytes >= bufferSize;
+    }
+
+    /**
+     * Return the next queued message and remember where it came from.
+     */
+    UprResponse* nextResponse_UNLOCKED();
+
+    /**
+     * Remove the message returned by nextResponse_UNLOCKED() from its
+     * queue. Messages not sent are freed along with their item.
+     *
+     * @return the id of a backfill task to wake up, or 0
+     */
+    size_t removeResponse_UNLOCKED(UprResponse *resp, bool sent);
+
     /**
      * This function determines if the mutation that is ready to be put on the
      * wire is still part of an active stream. It also checks to see if that
@@ -1663,8 +1830,23 @@ private:
      */
     bool shouldSkipMutation(uint64_t byseqno, uint16_t vbucket);
 
+    //! Messages that don't belong to an open stream.
     std::queue<UprResponse*> readyQ;
     std::map<uint16_t, Stream*> streams;
+    //! The vbucket of the stream whose turn it is to send.
+    uint16_t nextStream;
+    //! The last message handed out by peekNextItem() and its stream.
+    UprResponse *peeked;
+    uint16_t peekedVBucket;
+
+    //! Backlog of a stream above which its disk backfill waits.
+    size_t streamBufferBytes;
+    //! Bytes the consumer is able to buffer, 0 if flow control is off.
+    uint32_t bufferSize;
+    //! Bytes sent that the consumer has not acknowledged yet.
+    size_t unackedBytes;
+    size_t ackedBytes;
+    size_t itemsSent;
 };
 
 #endif  // SRC_TAPCONNECTION_H_
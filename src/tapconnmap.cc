@@ -247,6 +247,7 @@ void ConnMap::getExpiredConnections_UNLOCKED(std::list<connection_t> &deadClient
                 if (!tp->isSuspended()) {
                     deadClients.push_back(tc);
                     removeTapCursors_UNLOCKED(tp);
+                    tp->retire();
                     iter = all.erase(iter);
                     is_dead = true;
                 }
@@ -314,6 +315,13 @@ void ConnMap::notifyVBConnections(uint16_t vbid)
     lh.unlock();
 }
 
+void ConnMap::retire(connection_t &conn) {
+    Producer *tp = dynamic_cast<Producer*>(conn.get());
+    if (tp) {
+        tp->retire();
+    }
+}
+
 bool ConnMap::mapped(connection_t &tc) {
     bool rv = false;
     std::map<const void*, connection_t>::iterator it;
@@ -386,6 +394,7 @@ void ConnMap::shutdownAllTapConnections() {
         (*ii)->releaseReference();
         Producer *tp = dynamic_cast<Producer*>((*ii).get());
         if (tp) {
+            tp->retire();
             tp->clearQueues();
         }
     }
@@ -557,6 +566,7 @@ bool ConnMap::closeConnectionByName_UNLOCKED(const std::string &name) {
 
             tp->setExpiryTime(ep_current_time() - 1);
             tp->setName(ConnHandler::getAnonName());
+            tp->retire();
             tp->setDisconnect(true);
             tp->setPaused(true);
             rv = true;
@@ -654,6 +664,7 @@ TapProducer *TapConnMap::newProducer(const void* cookie,
             LOG(EXTENSION_LOG_INFO,
                 "%s keep alive timed out, should be nuked", producer->logHeader());
             producer->setName(ConnHandler::getAnonName());
+            producer->retire();
             producer->setDisconnect(true);
             producer->setConnected(false);
             producer->setPaused(true);
@@ -894,6 +905,7 @@ UprConsumer *UprConnMap::newConsumer(const void* cookie,
 
     connection_t conn = findByName_UNLOCKED(name);
     if (conn.get()) {
+        retire(conn);
         all.remove(conn);
         map_.erase(conn->getCookie());
     }
@@ -917,6 +929,7 @@ UprProducer *UprConnMap::newProducer(const void* cookie,
 
     connection_t conn = findByName_UNLOCKED(name);
     if (conn.get()) {
+        retire(conn);
         all.remove(conn);
         map_.erase(conn->getCookie());
     }
@@ -937,6 +950,7 @@ void UprConnMap::disconnect(const void *cookie) {
     if (itr != map_.end()) {
         connection_t conn = itr->second;
         if (conn.get()) {
+            retire(conn);
             all.remove(conn);
             map_.erase(itr);
         }
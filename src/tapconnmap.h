@@ -28,6 +28,7 @@
 #include <vector>
 
 #include "common.h"
+#include "item.h"
 #include "locks.h"
 #include "queueditem.h"
 #include "syncobject.h"
@@ -316,6 +317,12 @@ protected:
 
     bool mapped(connection_t &tc);
 
+    /**
+     * Mark a connection that is taken out of the map as retired, if it is
+     * a producer.
+     */
+    static void retire(connection_t &conn);
+
     /**
      * Clear all the session stats for a given TAP producer
      *
@@ -392,6 +399,17 @@ public:
                              const std::map<uint16_t, uint64_t> &checkpoints);
 
     bool checkConnectivity(const std::string &name);
+
+    /**
+     * Get the pool of the items TAP producers hand to memcached.
+     */
+    ItemPool &getItemPool() {
+        return itemPool;
+    }
+
+private:
+
+    ItemPool itemPool;
 };
 
 
@@ -83,8 +83,18 @@ bool VBSnapshotTask::run() {
 }
 
 bool VBDeleteTask::run() {
-    return !engine->getEpStore()->completeVBucketDeletion(vbucket, cookie,
-                                                          recreate);
+    EventuallyPersistentStore *store = engine->getEpStore();
+    if (!diskDeleted) {
+        if (!store->completeVBucketDeletion(vbucket, cookie, recreate)) {
+            return true;
+        }
+        diskDeleted = true;
+    }
+    if (store->getVBuckets().getShard(vbucket)->reclaimBuckets()) {
+        return false;
+    }
+    ExecutorPool::get()->snooze(taskId, 0.1);
+    return true;
 }
 
 bool CompactVBucketTask::run() {
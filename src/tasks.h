@@ -57,18 +57,23 @@ typedef struct {
     std::list<expiredItemCtx> expiredItems;
 } compaction_ctx;
 
+class GlobalTask;
+
+typedef SingleThreadedRCPtr<GlobalTask> ExTask;
+
 class GlobalTask : public RCValue {
-friend class CompareByDueDate;
 friend class CompareByPriority;
 friend class ExecutorPool;
 friend class ExecutorThread;
 friend class TaskQueue;
+friend class TimerWheel;
 public:
     GlobalTask(EventuallyPersistentEngine *e, const Priority &p,
                double sleeptime = 0, bool completeBeforeShutdown = true) :
           RCValue(), priority(p), starttime(0),
           blockShutdown(completeBeforeShutdown),
-          state(TASK_RUNNING), taskId(nextTaskId()), engine(e) {
+          state(TASK_RUNNING), taskId(nextTaskId()), engine(e),
+          wheelSlot(-1) {
         snooze(sleeptime, true);
     }
 
@@ -144,12 +149,15 @@ protected:
     EventuallyPersistentEngine *engine;
     Mutex mutex;
 
+    // Where the task waits in its TaskQueue's timer wheel, guarded by the
+    // queue's lock. wheelSlot is -1 while the task is not in the wheel.
+    int wheelSlot;
+    std::list<ExTask>::iterator wheelPos;
+
     static Atomic<size_t> task_id_counter;
     static size_t nextTaskId() { return task_id_counter.fetch_add(1); }
 };
 
-typedef SingleThreadedRCPtr<GlobalTask> ExTask;
-
 /**
  * A task for persisting items to disk.
  */
@@ -206,8 +214,12 @@ public:
                  const Priority &p, uint16_t sid, bool rc = false,
                  bool completeBeforeShutdown = true) :
         GlobalTask(e, p, 0, completeBeforeShutdown), vbucket(vb),
-        shardID(sid), recreate(rc), cookie(c) {}
+        shardID(sid), recreate(rc), diskDeleted(false), cookie(c) {}
 
+    /**
+     * Delete the vbucket's file, then wait until lookups running when
+     * the vbucket got unmapped are done with it, so it is released.
+     */
     bool run();
 
     std::string getDescription() {
@@ -220,6 +232,7 @@ private:
     uint16_t vbucket;
     uint16_t shardID;
     bool recreate;
+    bool diskDeleted;
     const void* cookie;
 };
 
@@ -353,14 +366,4 @@ public:
     }
 };
 
-/**
- * Order tasks by their ready date.
- */
-class CompareByDueDate {
-public:
-    bool operator()(ExTask &t1, ExTask &t2) {
-        return less_tv(t2->waketime, t1->waketime);
-    }
-};
-
 #endif  // SRC_TASKS_H_
@@ -0,0 +1,202 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+
+#include "timer_wheel.h"
+
+// Number of ticks covered by one slot of the given level.
+#define LEVEL_SPAN(level) (static_cast<uint64_t>(1) << \
+                           (TimerWheel::SLOT_BITS * (level)))
+
+const int TimerWheel::SLOT_BITS;
+const int TimerWheel::SLOTS;
+const int TimerWheel::LEVELS;
+const int TimerWheel::DUE_SLOT;
+const int TimerWheel::PARKED_SLOT;
+
+TimerWheel::TimerWheel() : slots(PARKED_SLOT + 1), current(0), numTasks(0) {
+    for (int i = 0; i < LEVELS; ++i) {
+        levelCount[i] = 0;
+    }
+}
+
+uint64_t TimerWheel::toTick(const struct timeval &tv) {
+    // Round up, so a task never comes out of the wheel before its time.
+    return static_cast<uint64_t>(tv.tv_sec) * 1000 +
+           (static_cast<uint64_t>(tv.tv_usec) + 999) / 1000;
+}
+
+void TimerWheel::insert(ExTask &task) {
+    assert(task->wheelSlot == -1);
+    if (task->waketime.tv_sec == INT_MAX &&
+        task->waketime.tv_usec == INT_MAX) {
+        std::list<ExTask> &parked = slots[PARKED_SLOT];
+        task->wheelPos = parked.insert(parked.end(), task);
+        task->wheelSlot = PARKED_SLOT;
+        ++numTasks;
+        return;
+    }
+
+    size_t timed = 0;
+    for (int i = 0; i < LEVELS; ++i) {
+        timed += levelCount[i];
+    }
+    if (timed == 0) {
+        // Nothing to cascade, so catch up with the clock and keep the
+        // new task in the lowest level it fits.
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        uint64_t tick = static_cast<uint64_t>(now.tv_sec) * 1000 +
+                        now.tv_usec / 1000;
+        if (tick > current) {
+            current = tick;
+        }
+    }
+    place(task, toTick(task->waketime));
+    ++numTasks;
+}
+
+void TimerWheel::place(ExTask &task, uint64_t due) {
+    int slot;
+    if (due <= current) {
+        slot = DUE_SLOT;
+    } else {
+        uint64_t delta = due - current;
+        if (delta >= LEVEL_SPAN(LEVELS)) {
+            // Further out than the wheel reaches; park it in the top
+            // level, it gets placed again once it comes down.
+            delta = LEVEL_SPAN(LEVELS) - 1;
+            due = current + delta;
+        }
+        int level = 0;
+        while (delta >= LEVEL_SPAN(level + 1)) {
+            ++level;
+        }
+        slot = level * SLOTS + static_cast<int>((due >> (SLOT_BITS * level)) &
+                                                (SLOTS - 1));
+        ++levelCount[level];
+    }
+    std::list<ExTask> &l = slots[slot];
+    task->wheelPos = l.insert(l.end(), task);
+    task->wheelSlot = slot;
+}
+
+bool TimerWheel::remove(ExTask &task) {
+    int slot = task->wheelSlot;
+    if (slot == -1) {
+        return false;
+    }
+    slots[slot].erase(task->wheelPos);
+    if (slot < DUE_SLOT) {
+        --levelCount[slot / SLOTS];
+    }
+    task->wheelSlot = -1;
+    --numTasks;
+    return true;
+}
+
+void TimerWheel::cascade(int level) {
+    int idx = static_cast<int>((current >> (SLOT_BITS * level)) & (SLOTS - 1));
+    std::list<ExTask> l;
+    l.swap(slots[level * SLOTS + idx]);
+    levelCount[level] -= l.size();
+    for (std::list<ExTask>::iterator it = l.begin(); it != l.end(); ++it) {
+        place(*it, toTick((*it)->waketime));
+    }
+}
+
+void TimerWheel::expire(const struct timeval &now, std::vector<ExTask> &out) {
+    uint64_t target = static_cast<uint64_t>(now.tv_sec) * 1000 +
+                      now.tv_usec / 1000;
+
+    while (current < target) {
+        int lowest = 0;
+        while (lowest < LEVELS && levelCount[lowest] == 0) {
+            ++lowest;
+        }
+        if (lowest == LEVELS) {
+            current = target;
+            break;
+        }
+        if (lowest > 0) {
+            // Nothing in the levels below, skip to the tick just before
+            // the next slot of the lowest used level comes up.
+            uint64_t skip = current | (LEVEL_SPAN(lowest) - 1);
+            if (skip > current) {
+                current = std::min(skip, target);
+                continue;
+            }
+        }
+
+        ++current;
+        for (int level = LEVELS - 1; level > 0; --level) {
+            if ((current & (LEVEL_SPAN(level) - 1)) == 0) {
+                cascade(level);
+            }
+        }
+        std::list<ExTask> &l = slots[current & (SLOTS - 1)];
+        levelCount[0] -= l.size();
+        slots[DUE_SLOT].splice(slots[DUE_SLOT].end(), l);
+    }
+
+    // The waketime may have moved since the task was placed.
+    std::list<ExTask> due;
+    due.swap(slots[DUE_SLOT]);
+    for (std::list<ExTask>::iterator it = due.begin(); it != due.end(); ++it) {
+        uint64_t tick = toTick((*it)->waketime);
+        if (tick > target) {
+            place(*it, tick);
+        } else {
+            (*it)->wheelSlot = -1;
+            --numTasks;
+            out.push_back(*it);
+        }
+    }
+}
+
+struct timeval TimerWheel::nextDue() const {
+    struct timeval tv;
+    uint64_t tick = 0;
+    if (!slots[DUE_SLOT].empty()) {
+        tick = current;
+    } else {
+        for (int level = 0; level < LEVELS && tick == 0; ++level) {
+            if (levelCount[level] == 0) {
+                continue;
+            }
+            uint64_t base = current >> (SLOT_BITS * level);
+            for (uint64_t k = 1; k <= static_cast<uint64_t>(SLOTS); ++k) {
+                int idx = static_cast<int>((base + k) & (SLOTS - 1));
+                if (!slots[level * SLOTS + idx].empty()) {
+                    tick = (base + k) << (SLOT_BITS * level);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (tick == 0) {
+        set_max_tv(tv);
+    } else {
+        tv.tv_sec = tick / 1000;
+        tv.tv_usec = (tick % 1000) * 1000;
+    }
+    return tv;
+}
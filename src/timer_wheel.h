@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_TIMER_WHEEL_H_
+#define SRC_TIMER_WHEEL_H_ 1
+
+#include "config.h"
+
+#include <list>
+#include <vector>
+
+#include "common.h"
+#include "tasks.h"
+
+/**
+ * Hierarchical timing wheel holding the tasks of a TaskQueue until their
+ * waketime.
+ *
+ * Level 0 has one slot per millisecond, each higher level one slot per
+ * full turn of the level below; tasks move down a level when their slot
+ * comes up. Inserting and removing a task is O(1). Tasks snoozed for
+ * ever are parked outside the wheel until they get a new waketime.
+ *
+ * Not thread safe: the owning TaskQueue serializes access.
+ */
+class TimerWheel {
+public:
+
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 4;
+
+    TimerWheel();
+
+    /**
+     * Add a task, due at its waketime.
+     */
+    void insert(ExTask &task);
+
+    /**
+     * Take a task out of the wheel.
+     *
+     * @return false if the task was not in the wheel
+     */
+    bool remove(ExTask &task);
+
+    /**
+     * Move all tasks due as of the given time to out.
+     */
+    void expire(const struct timeval &now, std::vector<ExTask> &out);
+
+    /**
+     * Get the earliest time a task may be due. Tasks in the upper levels
+     * are reported at the time they move down, which may be early.
+     */
+    struct timeval nextDue() const;
+
+    bool empty() const { return numTasks == 0; }
+
+    size_t size() const { return numTasks; }
+
+private:
+
+    // Slot lists after the levels: tasks that are already due and tasks
+    // without a waketime.
+    static const int DUE_SLOT = LEVELS * SLOTS;
+    static const int PARKED_SLOT = DUE_SLOT + 1;
+
+    static uint64_t toTick(const struct timeval &tv);
+
+    void place(ExTask &task, uint64_t due);
+    void cascade(int level);
+
+    std::vector<std::list<ExTask> > slots;
+    size_t levelCount[LEVELS];
+    //! The last tick expired.
+    uint64_t current;
+    size_t numTasks;
+};
+
+#endif  // SRC_TIMER_WHEEL_H_
@@ -47,6 +47,18 @@ public:
         return event_;
     }
 
+    /**
+     * Return the number of bytes the message takes on the wire, which is
+     * what it costs of the consumer's flow control buffer.
+     */
+    virtual uint32_t getMessageSize() {
+        return headerBytes;
+    }
+
+protected:
+    //! Size of the binary protocol header every message starts with.
+    static const uint32_t headerBytes = 24;
+
 private:
     uint32_t opaque_;
     upr_event_t event_;
@@ -131,6 +143,11 @@ public:
         return vbucket_;
     }
 
+    uint32_t getMessageSize() {
+        // The flags are the only extras.
+        return headerBytes + sizeof(uint32_t);
+    }
+
 private:
     uint32_t flags_;
     uint16_t vbucket_;
@@ -140,7 +157,14 @@ class MutationResponse : public UprResponse {
 public:
     MutationResponse(Item* item, uint32_t opaque)
         : UprResponse(item->isDeleted() ? UPR_DELETION : UPR_MUTATION, opaque),
-          item_(item) {}
+          item_(item) {
+        size_ = headerBytes + item->getNKey();
+        if (item->isDeleted()) {
+            size_ += deletionExtrasBytes;
+        } else {
+            size_ += mutationExtrasBytes + item->getNBytes();
+        }
+    }
 
     Item* getItem() {
         return item_;
@@ -158,8 +182,19 @@ public:
         return item_->getRevSeqno();
     }
 
+    uint32_t getMessageSize() {
+        return size_;
+    }
+
 private:
+    //! By seqno, rev seqno, flags, expiration, lock time, nmeta and nru.
+    static const uint32_t mutationExtrasBytes = 31;
+    //! By seqno, rev seqno and nmeta.
+    static const uint32_t deletionExtrasBytes = 18;
+
     Item* item_;
+    // Kept, as memcached may release the item once it is sent.
+    uint32_t size_;
 };
 
 #endif  // SRC_UPR_RESPONSE_H_
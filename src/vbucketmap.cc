@@ -32,7 +32,7 @@ VBucketMap::VBucketMap(Configuration &config, EventuallyPersistentStore &store)
     WorkLoadPolicy &workload = store.getEPEngine().getWorkLoadPolicy();
     numShards = workload.getNumShards();
     for (size_t shardId = 0; shardId < numShards; shardId++) {
-        KVShard *shard = new KVShard(shardId, store);
+        KVShard *shard = new KVShard(shardId, store, epochs);
         shards.push_back(shard);
     }
 
@@ -62,6 +62,13 @@ RCPtr<VBucket> VBucketMap::getBucket(uint16_t id) const {
     }
 }
 
+VBucket *VBucketMap::peekBucket(uint16_t id) const {
+    if (static_cast<size_t>(id) < size) {
+        return getShard(id)->peekBucket(id);
+    }
+    return NULL;
+}
+
 ENGINE_ERROR_CODE VBucketMap::addBucket(const RCPtr<VBucket> &b) {
     if (static_cast<size_t>(b->getId()) < size) {
         getShard(b->getId())->setBucket(b);
@@ -23,6 +23,7 @@
 #include <vector>
 
 #include "configuration.h"
+#include "epoch.h"
 #include "kvshard.h"
 #include "vbucket.h"
 
@@ -41,6 +42,11 @@ public:
     void removeBucket(uint16_t id);
     void addBuckets(const std::vector<VBucket*> &newBuckets);
     RCPtr<VBucket> getBucket(uint16_t id) const;
+    /**
+     * Get a vbucket without taking a reference. Only valid inside an
+     * epoch of getEpochs(); see KVShard::peekBucket().
+     */
+    VBucket *peekBucket(uint16_t id) const;
     size_t getSize() const;
     std::vector<int> getBuckets(void) const;
     std::vector<int> getBucketsSortedByState(void) const;
@@ -53,8 +59,14 @@ public:
     KVShard* getShard(uint16_t id) const;
     size_t getNumShards() const;
 
+    EpochManager &getEpochs() {
+        return epochs;
+    }
+
 private:
 
+    // Declared first, so it outlives the shards using it.
+    EpochManager epochs;
     std::vector<KVShard*> shards;
     Atomic<bool> *bucketDeletion;
     Atomic<bool> *bucketCreation;
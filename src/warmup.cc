@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <limits>
 #include <list>
 #include <map>
@@ -107,6 +108,28 @@ static void warmupCallback(void *arg, uint16_t vb,
     }
 }
 
+static void collectAccessLogFetches(uint16_t vbId,
+                                    std::vector<std::pair<std::string, uint64_t> > &fetches,
+                                    void *arg)
+{
+    std::map<uint16_t, std::vector<std::pair<std::string, uint64_t> > > *keys =
+        static_cast<std::map<uint16_t,
+                    std::vector<std::pair<std::string, uint64_t> > > *>(arg);
+    if (!fetches.empty()) {
+        std::vector<std::pair<std::string, uint64_t> > &vbKeys = (*keys)[vbId];
+        vbKeys.insert(vbKeys.end(), fetches.begin(), fetches.end());
+    }
+}
+
+static void collectAccessLogKey(void *arg, uint16_t vb,
+                                const std::string &key, uint64_t rowid)
+{
+    std::map<uint16_t, std::vector<std::pair<std::string, uint64_t> > > *keys =
+        static_cast<std::map<uint16_t,
+                    std::vector<std::pair<std::string, uint64_t> > > *>(arg);
+    (*keys)[vb].push_back(std::make_pair(key, rowid));
+}
+
 const int WarmupState::Initialize = 0;
 const int WarmupState::EstimateDatabaseItemCount = 2;
 const int WarmupState::KeyDump = 3;
@@ -221,7 +244,8 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
             switch (vb->ht.insert(*i, policy, shouldEject(), val.isPartial())) {
             case NOMEM:
                 if (retry == 2) {
-                    if (hasPurged) {
+                    bool purged = false;
+                    if (!hasPurged.compare_exchange_strong(purged, true)) {
                         if (++stats.warmOOM == 1) {
                             LOG(EXTENSION_LOG_WARNING,
                                 "Warmup dataload failure: max_size too low.");
@@ -258,10 +282,14 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
             }
         } while (!succeeded && retry-- > 0);
 
+        if (phaseStats) {
+            phaseStats->loaded(i->getNKey() + i->getNBytes());
+        }
+
         bool expired = i->isExpired(startTime);
         if (succeeded && expired) {
             ++stats.warmupExpired;
-            epstore->incExpirationStat(vb, false);
+            epstore->incExpirationStat(*vb, false);
             LOG(EXTENSION_LOG_WARNING, "Item was expired at load:  %s",
                 i->getKey().c_str());
             uint64_t cas = 0;
@@ -331,7 +359,6 @@ void LoadStorageKVPairCallback::purge() {
             vb->ht.visit(epv);
         }
     }
-    hasPurged = true;
 }
 
 void LoadValueCallback::callback(CacheLookup &lookup)
@@ -343,9 +370,11 @@ void LoadValueCallback::callback(CacheLookup &lookup)
         }
 
         int bucket_num(0);
-        LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
+        uint64_t h = vb->ht.hash(lookup.getKey());
+        LockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
 
-        StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), h, bucket_num,
+                                              false, true);
         if (v && v->isResident()) {
             setStatus(ENGINE_KEY_EEXISTS);
             return;
@@ -363,22 +392,18 @@ void LoadValueCallback::callback(CacheLookup &lookup)
 
 Warmup::Warmup(EventuallyPersistentStore *st) :
     state(), store(st), startTime(0), metadata(0), warmup(0),
+    nextPhaseVb(0), phaseTasks(0), phaseCancelled(false), phasePurged(false),
     estimateTime(0), estimatedItemCount(std::numeric_limits<size_t>::max()),
     corruptAccessLog(false), warmupComplete(false),
     estimatedWarmupCount(std::numeric_limits<size_t>::max())
 {
     shardVbStates = new std::map<uint16_t, vbucket_state>[store->vbMap.numShards];
     shardVbIds = new std::vector<uint16_t>[store->vbMap.numShards];
-    shardKeyDumpStatus = new bool[store->vbMap.numShards];
-    for (size_t i = 0; i < store->vbMap.numShards; i++) {
-        shardKeyDumpStatus[i] = false;
-    }
 }
 
 Warmup::~Warmup() {
     delete [] shardVbStates;
     delete [] shardVbIds;
-    delete [] shardKeyDumpStatus;
 }
 
 void Warmup::setEstimatedItemCount(size_t to)
@@ -454,46 +479,31 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
 
 void Warmup::scheduleKeyDump()
 {
-    threadtask_count = 0;
-    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupKeyDump(*store, this,
-                                        i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+    initVBuckets();
+    keyDumpStats.start();
+    std::vector<uint16_t> vbs;
+    if (store->getAuxUnderlying()->isKeyDumpSupported()) {
+        vbs = loadOrder;
     }
-
+    schedulePhaseTasks(vbs);
 }
 
-void Warmup::keyDumpforShard(uint16_t shardId)
+bool Warmup::keyDumpNextVBucket()
 {
-    if (store->getAuxUnderlying()->isKeyDumpSupported()) {
-        shared_ptr<Callback<GetValue> > cb(createLKVPCB(
-                    shardVbStates[shardId],
-                    false, state.getState()));
-        store->getAuxUnderlying()->dumpKeys(shardVbIds[shardId], cb);
-        shardKeyDumpStatus[shardId] = true;
+    uint16_t vbid;
+    if (nextPhaseVBucket(vbid)) {
+        dumpVBucket(vbid, true, false, keyDumpStats);
+        return true;
     }
 
-    if (++threadtask_count == store->vbMap.numShards) {
-        bool success = false;
-        for (size_t i = 0; i < store->vbMap.numShards; i++) {
-            if (shardKeyDumpStatus[i]) {
-                success = true;
-            } else {
-                success = false;
-                break;
-            }
-        }
-
-        if (success) {
+    if (finishPhaseTask(keyDumpStats)) {
+        if (store->getAuxUnderlying()->isKeyDumpSupported()) {
             transition(WarmupState::CheckForAccessLog);
         } else {
-            if (store->getAuxUnderlying()->isKeyDumpSupported()) {
-                LOG(EXTENSION_LOG_WARNING,
-                        "Failed to dump keys, falling back to full dump");
-            }
             transition(WarmupState::LoadingKVPairs);
         }
     }
+    return false;
 }
 
 void Warmup::scheduleCheckForAccessLog()
@@ -532,6 +542,8 @@ void Warmup::checkForAccessLog()
 
 void Warmup::scheduleLoadingAccessLog()
 {
+    initVBuckets();
+    accessLogStats.start();
     threadtask_count = 0;
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
         ExTask task = new WarmupLoadAccessLog(*store, this, i,
@@ -542,16 +554,13 @@ void Warmup::scheduleLoadingAccessLog()
 
 void Warmup::loadingAccessLog(uint16_t shardId)
 {
-
-    LoadStorageKVPairCallback *load_cb = createLKVPCB(shardVbStates[shardId], true,
-                                                      state.getState());
     bool success = false;
     hrtime_t stTime = gethrtime();
     if (store->accessLog[shardId]->exists()) {
         try {
             store->accessLog[shardId]->open();
-            if (doWarmup(*(store->accessLog[shardId]),
-                         shardVbStates[shardId], *load_cb) != (size_t)-1) {
+            if (readAccessLog(*(store->accessLog[shardId]),
+                              shardVbStates[shardId]) != (size_t)-1) {
                 success = true;
             }
         } catch (MutationLog::ReadException &e) {
@@ -569,8 +578,7 @@ void Warmup::loadingAccessLog(uint16_t shardId)
         if (old.exists()) {
             try {
                 old.open();
-                if (doWarmup(old, shardVbStates[shardId],
-                             *load_cb) != (size_t)-1) {
+                if (readAccessLog(old, shardVbStates[shardId]) != (size_t)-1) {
                     success = true;
                 }
             } catch (MutationLog::ReadException &e) {
@@ -581,30 +589,90 @@ void Warmup::loadingAccessLog(uint16_t shardId)
         }
     }
 
-    size_t numItems = store->getEPEngine().getEpStats().warmedUpValues;
-    if (success && numItems) {
-        LOG(EXTENSION_LOG_WARNING,
-            "%d items loaded from access log, completed in %s", numItems,
+    if (success) {
+        LOG(EXTENSION_LOG_INFO, "Read access log of shard %d in %s", shardId,
             hrtime2text((gethrtime() - stTime) / 1000).c_str());
-    } else {
-        size_t estimatedCount= store->getEPEngine().getEpStats().warmedUpKeys;
-        setEstimatedWarmupCount(estimatedCount);
     }
 
-    delete load_cb;
     if (++threadtask_count == store->vbMap.numShards) {
+        // Load the values of all the shards' logs, a vbucket at a time.
+        std::vector<uint16_t> vbs;
+        size_t numKeys = 0;
+        std::vector<uint16_t>::iterator it = loadOrder.begin();
+        for (; it != loadOrder.end(); ++it) {
+            std::map<uint16_t,
+                     std::vector<std::pair<std::string, uint64_t> > >::iterator
+                keys = accessLogKeys.find(*it);
+            if (keys != accessLogKeys.end()) {
+                vbs.push_back(*it);
+                numKeys += keys->second.size();
+            }
+        }
+        if (numKeys > 0) {
+            setEstimatedWarmupCount(numKeys);
+        } else {
+            setEstimatedWarmupCount(store->getEPEngine().getEpStats().warmedUpKeys);
+        }
+        schedulePhaseTasks(vbs);
+    }
+}
+
+bool Warmup::loadAccessLogNextVBucket()
+{
+    uint16_t vbid;
+    if (nextPhaseVBucket(vbid)) {
+        // The map itself doesn't change while its values are loaded.
+        std::vector<std::pair<std::string, uint64_t> > keys;
+        keys.swap(accessLogKeys.find(vbid)->second);
+
+        LoadStorageKVPairCallback cb(store, true, state.getState(),
+                                     phasePurged, &accessLogStats);
+        WarmupCookie cookie(store, cb);
+        if (store->multiBGFetchEnabled()) {
+            size_t pos = 0;
+            while (pos < keys.size() && cookie.skipped == 0) {
+                size_t n = std::min(getAccessLogBatchSize(),
+                                    keys.size() - pos);
+                std::vector<std::pair<std::string, uint64_t> >
+                    fetches(keys.begin() + pos, keys.begin() + pos + n);
+                batchWarmupCallback(vbid, fetches, &cookie);
+                pos += n;
+            }
+        } else {
+            std::vector<std::pair<std::string, uint64_t> >::iterator it;
+            for (it = keys.begin();
+                 it != keys.end() && cookie.skipped == 0; ++it) {
+                warmupCallback(&cookie, vbid, it->first, it->second);
+            }
+        }
+        if (cookie.skipped > 0) {
+            phaseCancelled = true;
+        }
+        LOG(EXTENSION_LOG_DEBUG, "Populated vbucket %d from access log "
+            "(l: %ld, s: %ld, e: %ld)", vbid, cookie.loaded, cookie.skipped,
+            cookie.error);
+        return true;
+    }
+
+    if (finishPhaseTask(accessLogStats)) {
+        accessLogKeys.clear();
+        size_t numItems = store->getEPEngine().getEpStats().warmedUpValues;
+        if (numItems) {
+            LOG(EXTENSION_LOG_WARNING,
+                "%d items loaded from access log, completed in %s", numItems,
+                hrtime2text(accessLogStats.getElapsed() / 1000).c_str());
+        }
         if (!store->maybeEnableTraffic()) {
             transition(WarmupState::LoadingData);
-        }
-        else {
+        } else {
             transition(WarmupState::Done);
         }
-
     }
+    return false;
 }
 
-size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
-                        vbucket_state> &vbmap, Callback<GetValue> &cb)
+size_t Warmup::readAccessLog(MutationLog &lf, const std::map<uint16_t,
+                             vbucket_state> &vbmap)
 {
     MutationLogHarvester harvester(lf, &store->getEPEngine());
     std::map<uint16_t, vbucket_state>::const_iterator it;
@@ -619,50 +687,64 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
     hrtime_t end = gethrtime();
 
     size_t total = harvester.total();
-    setEstimatedWarmupCount(total);
     LOG(EXTENSION_LOG_DEBUG, "Completed log read in %s with %ld entries",
         hrtime2text(end - st).c_str(), total);
 
-    st = gethrtime();
-    WarmupCookie cookie(store, cb);
+    std::map<uint16_t, std::vector<std::pair<std::string, uint64_t> > > keys;
     if (store->multiBGFetchEnabled()) {
-        harvester.apply(&cookie, &batchWarmupCallback);
+        harvester.apply(&keys, &collectAccessLogFetches);
     } else {
-        harvester.apply(&cookie, &warmupCallback);
+        harvester.apply(&keys, &collectAccessLogKey);
+    }
+
+    // Each vbucket belongs to a single shard's log.
+    LockHolder lh(accessLogMutex);
+    std::map<uint16_t,
+             std::vector<std::pair<std::string, uint64_t> > >::iterator kit;
+    for (kit = keys.begin(); kit != keys.end(); ++kit) {
+        accessLogKeys[kit->first].swap(kit->second);
     }
-    end = gethrtime();
-    LOG(EXTENSION_LOG_DEBUG, "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
-        hrtime2text(end - st).c_str(), cookie.loaded, cookie.skipped,
-        cookie.error);
-    return cookie.loaded;
+    return total;
 }
 
-void Warmup::scheduleLoadingKVPairs()
+size_t Warmup::getAccessLogBatchSize() const
 {
-    threadtask_count = 0;
-    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingKVPairs(*store, this,
-                                               i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+    Configuration &config = store->getEPEngine().getConfiguration();
+    size_t batchSize = config.getWarmupBatchSize();
+    size_t items = accessLogStats.getItems();
+    if (items > 0) {
+        // Keep the values fetched by all the tasks together in budget.
+        size_t itemSize = accessLogStats.getBytes() / items + 1;
+        size_t budget = config.getWarmupInflightBytes() / phaseTasks;
+        batchSize = std::max(static_cast<size_t>(1),
+                             std::min(batchSize, budget / itemSize));
     }
+    return batchSize;
+}
 
+void Warmup::scheduleLoadingKVPairs()
+{
+    initVBuckets();
+    kvPairsStats.start();
+    schedulePhaseTasks(loadOrder);
 }
 
-void Warmup::loadKVPairsforShard(uint16_t shardId)
+bool Warmup::loadKVPairsNextVBucket()
 {
-    bool maybe_enable_traffic = false;
-    if (store->getItemEvictionPolicy() == FULL_EVICTION) {
-        maybe_enable_traffic = true;
+    uint16_t vbid;
+    if (nextPhaseVBucket(vbid)) {
+        bool maybe_enable_traffic = false;
+        if (store->getItemEvictionPolicy() == FULL_EVICTION) {
+            maybe_enable_traffic = true;
+        }
+        dumpVBucket(vbid, false, maybe_enable_traffic, kvPairsStats);
+        return true;
     }
-    shared_ptr<Callback<GetValue> >
-        cb(createLKVPCB(shardVbStates[shardId],
-                        maybe_enable_traffic, state.getState()));
-    shared_ptr<Callback<CacheLookup> >
-        cl(new LoadValueCallback(store->vbMap, state.getState()));
-    store->getAuxUnderlying()->dump(shardVbIds[shardId], cb, cl);
-    if (++threadtask_count == store->vbMap.numShards) {
+
+    if (finishPhaseTask(kvPairsStats)) {
         transition(WarmupState::Done);
     }
+    return false;
 }
 
 void Warmup::scheduleLoadingData()
@@ -670,25 +752,120 @@ void Warmup::scheduleLoadingData()
     size_t estimatedCount = store->getEPEngine().getEpStats().warmedUpKeys;
     setEstimatedWarmupCount(estimatedCount);
 
+    initVBuckets();
+    dataStats.start();
+    schedulePhaseTasks(loadOrder);
+}
+
+bool Warmup::loadDataNextVBucket()
+{
+    uint16_t vbid;
+    if (nextPhaseVBucket(vbid)) {
+        dumpVBucket(vbid, false, true, dataStats);
+        return true;
+    }
+
+    if (finishPhaseTask(dataStats)) {
+        transition(WarmupState::Done);
+    }
+    return false;
+}
+
+void Warmup::initVBuckets()
+{
+    LoadStorageKVPairCallback load_cb(store, false, state.getState(),
+                                      phasePurged);
+    std::map<uint16_t, vbucket_state>::const_iterator it;
+    for (it = allVbStates.begin(); it != allVbStates.end(); ++it) {
+        uint16_t vbid = it->first;
+        vbucket_state vbs = it->second;
+        vbs.checkpointId++;
+        load_cb.initVBucket(vbid, vbs);
+    }
+}
+
+void Warmup::schedulePhaseTasks(const std::vector<uint16_t> &vbs)
+{
+    phaseVbs = vbs;
+    nextPhaseVb = 0;
+    phaseCancelled = false;
+    phasePurged = false;
     threadtask_count = 0;
-    for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingData(*store, this,
-                                            i, Priority::WarmupPriority);
+    // One task per reader thread, but no idle ones. A phase without
+    // vbuckets still gets a task to move on to the next phase.
+    phaseTasks = std::min(ExecutorPool::get()->getNumReaders(), vbs.size());
+    phaseTasks = std::max(phaseTasks, static_cast<size_t>(1));
+
+    for (size_t i = 0; i < phaseTasks; i++) {
+        ExTask task;
+        switch (state.getState()) {
+        case WarmupState::KeyDump:
+            task = new WarmupKeyDump(*store, this, Priority::WarmupPriority);
+            break;
+        case WarmupState::LoadingAccessLog:
+            task = new WarmupLoadAccessLogData(*store, this,
+                                               Priority::WarmupPriority);
+            break;
+        case WarmupState::LoadingKVPairs:
+            task = new WarmupLoadingKVPairs(*store, this,
+                                            Priority::WarmupPriority);
+            break;
+        case WarmupState::LoadingData:
+            task = new WarmupLoadingData(*store, this,
+                                         Priority::WarmupPriority);
+            break;
+        default:
+            LOG(EXTENSION_LOG_WARNING,
+                "Internal error.. No loading tasks for warmup state %d",
+                state.getState());
+            abort();
+        }
         ExecutorPool::get()->schedule(task, READER_TASK_IDX);
     }
 }
 
-void Warmup::loadDataforShard(uint16_t shardId)
+bool Warmup::nextPhaseVBucket(uint16_t &vbid)
 {
-    shared_ptr<Callback<GetValue> > cb(createLKVPCB(
-                shardVbStates[shardId],
-                true, state.getState()));
-    shared_ptr<Callback<CacheLookup> >
-        cl(new LoadValueCallback(store->vbMap, state.getState()));
-    store->getAuxUnderlying()->dump(shardVbIds[shardId], cb, cl);
+    if (phaseCancelled) {
+        return false;
+    }
+    size_t idx = nextPhaseVb.fetch_add(1);
+    if (idx >= phaseVbs.size()) {
+        return false;
+    }
+    vbid = phaseVbs[idx];
+    return true;
+}
 
-    if (++threadtask_count == store->vbMap.numShards) {
-        transition(WarmupState::Done);
+bool Warmup::finishPhaseTask(WarmupPhaseStats &phaseStats)
+{
+    if (++threadtask_count == phaseTasks) {
+        phaseStats.stop();
+        return true;
+    }
+    return false;
+}
+
+void Warmup::dumpVBucket(uint16_t vbid, bool keysOnly, bool maybeEnable,
+                         WarmupPhaseStats &phaseStats)
+{
+    shared_ptr<LoadStorageKVPairCallback>
+        load_cb(new LoadStorageKVPairCallback(store, maybeEnable,
+                                              state.getState(), phasePurged,
+                                              &phaseStats));
+    shared_ptr<Callback<GetValue> > cb(load_cb);
+    std::vector<uint16_t> vbs(1, vbid);
+    if (keysOnly) {
+        store->getAuxUnderlying()->dumpKeys(vbs, cb);
+    } else {
+        shared_ptr<Callback<CacheLookup> >
+            cl(new LoadValueCallback(store->vbMap, state.getState()));
+        store->getAuxUnderlying()->dump(vbs, cb, cl);
+    }
+
+    if (load_cb->getStatus() == ENGINE_ENOMEM) {
+        // Enough is loaded to enable traffic, leave the rest on disk.
+        phaseCancelled = true;
     }
 }
 
@@ -841,25 +1018,39 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
         } else {
             addStat("estimated_value_count", estimatedWarmupCount, add_stat, c);
         }
+
+        addStat("tasks", phaseTasks, add_stat, c);
+        addPhaseStats("key_dump", keyDumpStats, add_stat, c);
+        addPhaseStats("access_log", accessLogStats, add_stat, c);
+        addPhaseStats("kv_pairs", kvPairsStats, add_stat, c);
+        addPhaseStats("data", dataStats, add_stat, c);
    } else {
         addStat(NULL, "disabled", add_stat, c);
     }
 }
 
-LoadStorageKVPairCallback *Warmup::createLKVPCB(const std::map<uint16_t, vbucket_state> &st,
-                                                bool maybeEnable, int warmupState)
+void Warmup::addPhaseStats(const char *phase,
+                           const WarmupPhaseStats &phaseStats,
+                           ADD_STAT add_stat, const void *c) const
 {
-    LoadStorageKVPairCallback *load_cb;
-    load_cb = new LoadStorageKVPairCallback(store, maybeEnable, warmupState);
-    std::map<uint16_t, vbucket_state>::const_iterator it;
-    for (it = st.begin(); it != st.end(); ++it) {
-        uint16_t vbid = it->first;
-        vbucket_state vbs = it->second;
-        vbs.checkpointId++;
-        load_cb->initVBucket(vbid, vbs);
+    if (!phaseStats.isStarted()) {
+        return;
     }
 
-    return load_cb;
+    std::string nm(phase);
+    size_t items = phaseStats.getItems();
+    size_t bytes = phaseStats.getBytes();
+    hrtime_t elapsed = phaseStats.getElapsed();
+    addStat((nm + "_items").c_str(), items, add_stat, c);
+    addStat((nm + "_bytes").c_str(), bytes, add_stat, c);
+    addStat((nm + "_time").c_str(), elapsed / 1000, add_stat, c);
+    if (elapsed > 0) {
+        double secs = static_cast<double>(elapsed) / 1000000000;
+        addStat((nm + "_items_per_sec").c_str(),
+                static_cast<uint64_t>(items / secs), add_stat, c);
+        addStat((nm + "_mb_per_sec").c_str(),
+                bytes / secs / (1024 * 1024), add_stat, c);
+    }
 }
 
 void Warmup::populateShardVbStates()
@@ -882,4 +1073,27 @@ void Warmup::populateShardVbStates()
             }
         }
     }
+
+    // Load the active vbuckets first, and take turns between the shards so
+    // that the loading tasks spread over all of them.
+    loadOrder.clear();
+    for (int pass = 0; pass < 2; ++pass) {
+        vbucket_state_t wanted = pass == 0 ? vbucket_state_active :
+                                             vbucket_state_replica;
+        std::vector<size_t> pos(store->vbMap.shards.size(), 0);
+        bool more = true;
+        while (more) {
+            more = false;
+            for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
+                while (pos[i] < shardVbIds[i].size()) {
+                    uint16_t vbid = shardVbIds[i][pos[i]++];
+                    if (shardVbStates[i][vbid].state == wanted) {
+                        loadOrder.push_back(vbid);
+                        more = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
 }
@@ -23,6 +23,7 @@
 #include <map>
 #include <ostream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "ep_engine.h"
@@ -61,6 +62,55 @@ public:
 };
 
 
+/**
+ * Throughput of a warmup phase, updated by all the tasks loading it.
+ */
+class WarmupPhaseStats {
+public:
+    WarmupPhaseStats() : startTime(0), endTime(0), items(0), bytes(0) { }
+
+    void start() {
+        startTime.store(gethrtime());
+    }
+
+    void stop() {
+        endTime.store(gethrtime());
+    }
+
+    void loaded(size_t nbytes) {
+        ++items;
+        bytes.fetch_add(nbytes);
+    }
+
+    bool isStarted() const {
+        return startTime.load() != 0;
+    }
+
+    /**
+     * Get the time spent in the phase so far (ns).
+     */
+    hrtime_t getElapsed() const {
+        hrtime_t end = endTime.load();
+        return (end != 0 ? end : gethrtime()) - startTime.load();
+    }
+
+    size_t getItems() const {
+        return items.load();
+    }
+
+    size_t getBytes() const {
+        return bytes.load();
+    }
+
+private:
+    Atomic<hrtime_t> startTime;
+    Atomic<hrtime_t> endTime;
+    Atomic<size_t>   items;
+    Atomic<size_t>   bytes;
+
+    DISALLOW_COPY_AND_ASSIGN(WarmupPhaseStats);
+};
+
 //////////////////////////////////////////////////////////////////////////////
 //                                                                          //
 //    Helper class used to insert data into the epstore                     //
@@ -74,11 +124,13 @@ public:
 class LoadStorageKVPairCallback : public Callback<GetValue> {
 public:
     LoadStorageKVPairCallback(EventuallyPersistentStore *ep,
-                              bool _maybeEnableTraffic, int _warmupState)
+                              bool _maybeEnableTraffic, int _warmupState,
+                              Atomic<bool> &purged,
+                              WarmupPhaseStats *ps = NULL)
         : vbuckets(ep->vbMap), stats(ep->getEPEngine().getEpStats()),
           epstore(ep), startTime(ep_real_time()),
-          hasPurged(false), maybeEnableTraffic(_maybeEnableTraffic),
-          warmupState(_warmupState)
+          hasPurged(purged), maybeEnableTraffic(_maybeEnableTraffic),
+          warmupState(_warmupState), phaseStats(ps)
     {
         assert(epstore);
     }
@@ -100,9 +152,12 @@ private:
     EPStats    &stats;
     EventuallyPersistentStore *epstore;
     time_t      startTime;
-    bool        hasPurged;
+    // Shared by all the callbacks of a warmup phase, so the emergency
+    // purge runs once per phase rather than once per vbucket.
+    Atomic<bool> &hasPurged;
     bool        maybeEnableTraffic;
     int         warmupState;
+    WarmupPhaseStats *phaseStats;
 };
 
 class LoadValueCallback : public Callback<CacheLookup> {
@@ -141,18 +196,19 @@ public:
 
     hrtime_t getTime(void) { return warmup; }
 
-    size_t doWarmup(MutationLog &lf, const std::map<uint16_t,
-                    vbucket_state> &vbmap, Callback<GetValue> &cb);
+    size_t readAccessLog(MutationLog &lf, const std::map<uint16_t,
+                         vbucket_state> &vbmap);
 
     bool isComplete() { return warmupComplete.load(); }
 
     void initialize();
     void estimateDatabaseItemCount(uint16_t shardId);
-    void keyDumpforShard(uint16_t shardId);
+    bool keyDumpNextVBucket();
     void checkForAccessLog();
     void loadingAccessLog(uint16_t shardId);
-    void loadKVPairsforShard(uint16_t shardId);
-    void loadDataforShard(uint16_t shardId);
+    bool loadAccessLogNextVBucket();
+    bool loadKVPairsNextVBucket();
+    bool loadDataNextVBucket();
     void done();
 
 private:
@@ -174,9 +230,16 @@ private:
 
     void transition(int to, bool force=false);
 
+    void initVBuckets();
+    void schedulePhaseTasks(const std::vector<uint16_t> &vbs);
+    bool nextPhaseVBucket(uint16_t &vbid);
+    bool finishPhaseTask(WarmupPhaseStats &phaseStats);
+    void dumpVBucket(uint16_t vbid, bool keysOnly, bool maybeEnable,
+                     WarmupPhaseStats &phaseStats);
+    size_t getAccessLogBatchSize() const;
 
-    LoadStorageKVPairCallback *createLKVPCB(const std::map<uint16_t, vbucket_state> &st,
-                                            bool maybeEnable, int warmupState);
+    void addPhaseStats(const char *phase, const WarmupPhaseStats &phaseStats,
+                       ADD_STAT add_stat, const void *c) const;
 
     WarmupState state;
     EventuallyPersistentStore *store;
@@ -188,8 +251,27 @@ private:
     std::map<uint16_t, vbucket_state> allVbStates;
     std::map<uint16_t, vbucket_state> *shardVbStates;
     Atomic<size_t> threadtask_count;
-    bool *shardKeyDumpStatus;
     std::vector<uint16_t> *shardVbIds;
+    //! The vbuckets to load, in the order to load them.
+    std::vector<uint16_t> loadOrder;
+
+    // The vbuckets of the running phase. Its tasks take them one at a time
+    // until none is left (or loading was cancelled).
+    std::vector<uint16_t> phaseVbs;
+    Atomic<size_t> nextPhaseVb;
+    size_t phaseTasks;
+    Atomic<bool> phaseCancelled;
+    //! Set once the running phase ran out of memory and purged.
+    Atomic<bool> phasePurged;
+
+    //! Keys (and seqnos or rowids) read from the access logs, by vbucket.
+    std::map<uint16_t, std::vector<std::pair<std::string, uint64_t> > > accessLogKeys;
+    Mutex accessLogMutex;
+
+    WarmupPhaseStats keyDumpStats;
+    WarmupPhaseStats accessLogStats;
+    WarmupPhaseStats kvPairsStats;
+    WarmupPhaseStats dataStats;
 
     hrtime_t estimateTime;
     size_t estimatedItemCount;
@@ -249,21 +331,18 @@ private:
 class WarmupKeyDump : public GlobalTask {
 public:
     WarmupKeyDump(EventuallyPersistentStore &st, Warmup* w,
-                  uint16_t sh, const Priority &p) :
-        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh), _warmup(w) {}
+                  const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _warmup(w) {}
 
     std::string getDescription() {
-        return std::string("Warmup - key dump: shard %d", _shardId);
+        return std::string("Warmup - key dump");
     }
 
     bool run() {
-
-        _warmup->keyDumpforShard(_shardId);
-        return false;
+        return _warmup->keyDumpNextVBucket();
     }
 
 private:
-    uint16_t _shardId;
     Warmup* _warmup;
 };
 
@@ -308,45 +387,57 @@ private:
     uint16_t shardID;
 };
 
+class WarmupLoadAccessLogData : public GlobalTask {
+public:
+    WarmupLoadAccessLogData(EventuallyPersistentStore &st, Warmup *w,
+                            const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _warmup(w) { }
+
+    std::string getDescription() {
+        return std::string("Warmup - loading access log data");
+    }
+
+    bool run() {
+        return _warmup->loadAccessLogNextVBucket();
+    }
+
+private:
+    Warmup* _warmup;
+};
+
 class WarmupLoadingKVPairs : public GlobalTask {
 public:
     WarmupLoadingKVPairs(EventuallyPersistentStore &st, Warmup* w,
-                         uint16_t sh, const Priority &p) :
-        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh), _warmup(w) { }
+                         const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _warmup(w) { }
 
     std::string getDescription() {
-        return std::string("Warmup - loading KV Pairs: shard %d", _shardId);
+        return std::string("Warmup - loading KV Pairs");
     }
 
     bool run() {
-
-        _warmup->loadKVPairsforShard(_shardId);
-        return false;
+        return _warmup->loadKVPairsNextVBucket();
     }
 
 private:
-    uint16_t _shardId;
     Warmup* _warmup;
 };
 
 class WarmupLoadingData : public GlobalTask {
 public:
     WarmupLoadingData(EventuallyPersistentStore &st, Warmup* w,
-                      uint16_t sh, const Priority &p) :
-        GlobalTask(&st.getEPEngine(), p, 0, false), _shardId(sh), _warmup(w) {}
+                      const Priority &p) :
+        GlobalTask(&st.getEPEngine(), p, 0, false), _warmup(w) {}
 
     std::string getDescription() {
-        return std::string("Warmup - loading data: shard %d", _shardId);
+        return std::string("Warmup - loading data");
     }
 
     bool run() {
-
-        _warmup->loadDataforShard(_shardId);
-        return false;
+        return _warmup->loadDataNextVBucket();
     }
 
 private:
-    uint16_t _shardId;
     Warmup* _warmup;
 };
 
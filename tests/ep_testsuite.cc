@@ -112,6 +112,7 @@ extern uint64_t upr_last_high_seqno;
 extern uint64_t upr_last_byseqno;
 extern uint64_t upr_last_revseqno;
 extern std::string upr_last_key;
+extern uint64_t upr_bytes_received;
 
 struct test_harness testHarness;
 
@@ -2720,6 +2721,99 @@ static enum test_result test_upr_producer_stream_req(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static void upr_flow_control(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             const void *cookie, uint8_t opcode,
+                             uint32_t bytes) {
+    uint32_t ext = htonl(bytes);
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(opcode, 0, 0, reinterpret_cast<char*>(&ext),
+                       sizeof(ext));
+    check(h1->unknown_command(h, cookie, pkt, add_response) == ENGINE_SUCCESS,
+          "Failed to send a UPR flow control message");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected success for a UPR flow control message");
+    free(pkt);
+}
+
+static enum test_result test_upr_producer_flow_control(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = testHarness.create_cookie();
+    const char *name = "unittest";
+    uint16_t nname = strlen(name);
+
+    int num_items = 10;
+    for (int j = 0; j < num_items; ++j) {
+        item *i = NULL;
+        std::stringstream ss;
+        ss << "key" << j;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "data", &i)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    check(h1->upr.open(h, cookie, 0, 0, UPR_OPEN_PRODUCER, (void*)name, nname)
+          == ENGINE_SUCCESS,
+          "Failed upr producer open connection.");
+
+    // Each mutation takes 24 + 31 + 4 + 4 bytes, so three of them fill
+    // a buffer of 150 bytes.
+    upr_flow_control(h, h1, cookie, CMD_UPR_SET_BUFFER_SIZE, 150);
+    check(get_int_stat(h, h1, "eq_uprq:unittest:buffer_size", "upr") == 150,
+          "Buffer size didn't match");
+
+    uint64_t rollback = 0;
+    check(h1->upr.stream_req(h, cookie, 0, 0, 0, 0, num_items, 0, 0,
+                             &rollback, mock_upr_add_failover_log)
+                == ENGINE_SUCCESS,
+          "Failed to initiate stream request");
+
+    struct upr_message_producers* producers = get_upr_producers();
+    upr_bytes_received = 0;
+    int num_mutations = 0;
+    bool stream_end = false;
+    useconds_t sleepTime = 128;
+    for (int acks = 0; !stream_end && acks < num_items; ++acks) {
+        // Drain the stream until the window is full.
+        while (get_str_stat(h, h1, "eq_uprq:unittest:window_full",
+                            "upr") == "false" && !stream_end) {
+            upr_last_op = 0;
+            h1->upr.step(h, cookie, producers);
+            if (upr_last_op == PROTOCOL_BINARY_CMD_UPR_MUTATION) {
+                ++num_mutations;
+            } else if (upr_last_op == PROTOCOL_BINARY_CMD_UPR_STREAM_END) {
+                stream_end = true;
+            } else {
+                // The backfill hasn't queued the next items yet.
+                decayingSleep(&sleepTime);
+            }
+        }
+
+        if (!stream_end) {
+            // Nothing is sent while the consumer's buffer is full.
+            upr_last_op = 0;
+            h1->upr.step(h, cookie, producers);
+            check(upr_last_op == 0, "Expected no message with a full window");
+            check(get_int_stat(h, h1, "eq_uprq:unittest:unacked_bytes", "upr")
+                  == static_cast<int>(upr_bytes_received),
+                  "Unacked bytes didn't match the bytes received");
+        }
+
+        upr_flow_control(h, h1, cookie, CMD_UPR_BUFFER_ACK,
+                         static_cast<uint32_t>(upr_bytes_received));
+        upr_bytes_received = 0;
+    }
+
+    check(stream_end, "Expected the stream to end");
+    check(num_mutations == num_items, "Invalid number of mutations");
+    check(get_int_stat(h, h1, "eq_uprq:unittest:unacked_bytes", "upr") == 0,
+          "Expected all bytes to be acknowledged");
+
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
 static test_result test_upr_producer_stream_req_nmvb(ENGINE_HANDLE *h,
                                                      ENGINE_HANDLE_V1 *h1) {
     const void *cookie1 = testHarness.create_cookie();
@@ -4318,6 +4412,45 @@ static enum test_result test_key_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_hash_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v1", &i, 0, 0) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    h1->release(h, NULL, i);
+
+    const void *cookie = testHarness.create_cookie();
+
+    // The first request waits for the walk over the hash tables.
+    vals.clear();
+    check(h1->get_stats(h, cookie, "hash", 4, add_stats) == ENGINE_SUCCESS,
+          "Failed to get hash stats.");
+    check(vals.find("hash_stats_age") != vals.end(), "Found no hash_stats_age");
+    check(vals["vb_0:state"] == "active", "Wrong vb_0:state");
+    check(vals.find("vb_0:size") != vals.end(), "Found no vb_0:size");
+    check(vals.find("vb_0:max_depth") != vals.end(), "Found no vb_0:max_depth");
+    check(vals["vb_0:reported"] == "1", "Wrong vb_0:reported");
+    check(vals["vb_0:counted"] == "1", "Wrong vb_0:counted");
+
+    check(store(h, h1, NULL, OPERATION_SET, "k2", "v2", &i, 0, 0) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    h1->release(h, NULL, i);
+
+    int maxAge = get_int_stat(h, h1, "ep_hash_stats_max_age", "config");
+
+    // The second is answered from the last walk, which predates k2.
+    vals.clear();
+    check(h1->get_stats(h, cookie, "hash", 4, add_stats) == ENGINE_SUCCESS,
+          "Failed to get hash stats.");
+    check(vals.find("hash_stats_age") != vals.end(), "Found no hash_stats_age");
+    check(atoi(vals["hash_stats_age"].c_str()) < maxAge,
+          "Hash stats older than hash_stats_max_age");
+    check(vals["vb_0:state"] == "active", "Wrong vb_0:state");
+    check(vals["vb_0:counted"] == "1", "Hash stats weren't served from the cache");
+
+    testHarness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
 static enum test_result test_vkey_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     check(set_vbucket_state(h, h1, 1, vbucket_state_active), "Failed set vbucket 1 state.");
     check(set_vbucket_state(h, h1, 2, vbucket_state_active), "Failed set vbucket 2 state.");
@@ -4449,6 +4582,11 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     check(vals.find("ep_warmup_time") != vals.end(), "Found no ep_warmup_time");
     std::string warmup_time = vals["ep_warmup_time"];
     assert(atoi(warmup_time.c_str()) > 0);
+    check(vals.find("ep_warmup_tasks") != vals.end(), "Found no ep_warmup_tasks");
+    check(atoi(vals["ep_warmup_key_dump_items"].c_str()) == 5000,
+          "Expected all keys to be dumped");
+    check(vals.find("ep_warmup_key_dump_items_per_sec") != vals.end(),
+          "Found no ep_warmup_key_dump_items_per_sec");
 
     vals.clear();
     check(h1->get_stats(h, NULL, "prev-vbucket", 12, add_stats) == ENGINE_SUCCESS,
@@ -8385,6 +8523,8 @@ engine_test_t* get_tests(void) {
                  "chk_remover_stime=1;chk_period=60", prepare, cleanup),
         TestCase("stats key", test_key_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("stats hash", test_hash_stats, test_setup, teardown,
+                 NULL, prepare, cleanup),
         TestCase("stats vkey", test_vkey_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("stats vkey callback tests", test_stats_vkey_valid_field,
@@ -8776,6 +8916,8 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test producer stream request", test_upr_producer_stream_req,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("test producer flow control", test_upr_producer_flow_control,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test producer stream request nmvb",
                  test_upr_producer_stream_req_nmvb, test_setup, teardown, NULL,
                  prepare, cleanup),
@@ -39,6 +39,8 @@ uint64_t upr_last_revseqno;
 const void *upr_last_meta;
 uint16_t upr_last_nmeta;
 std::string upr_last_key;
+// Bytes of the messages received, as counted against a flow control buffer
+uint64_t upr_bytes_received;
 
 extern "C" {
 
@@ -101,6 +103,7 @@ static ENGINE_ERROR_CODE mock_stream_end(const void *cookie,
     upr_last_opaque = opaque;
     upr_last_vbucket = vbucket;
     upr_last_flags = flags;
+    upr_bytes_received += 24 + sizeof(uint32_t);
     return ENGINE_ENOTSUP;
 }
 
@@ -123,9 +126,11 @@ static ENGINE_ERROR_CODE mock_mutation(const void* cookie,
                                        const void *meta,
                                        uint16_t nmeta) {
     (void) cookie;
+    Item *it = reinterpret_cast<Item*>(itm);
     upr_last_op = PROTOCOL_BINARY_CMD_UPR_MUTATION;
     upr_last_opaque = opaque;
-    upr_last_key.assign(reinterpret_cast<Item*>(itm)->getKey().c_str());
+    upr_last_key.assign(it->getKey().c_str());
+    upr_bytes_received += 24 + 31 + it->getNKey() + it->getNBytes();
     upr_last_vbucket = vbucket;
     upr_last_byseqno = by_seqno;
     upr_last_revseqno = rev_seqno;
@@ -149,6 +154,7 @@ static ENGINE_ERROR_CODE mock_deletion(const void* cookie,
     upr_last_op = PROTOCOL_BINARY_CMD_UPR_DELETION;
     upr_last_opaque = opaque;
     upr_last_key.assign(static_cast<const char*>(key), nkey);
+    upr_bytes_received += 24 + 18 + nkey;
     upr_last_cas = cas;
     upr_last_vbucket = vbucket;
     upr_last_byseqno = by_seqno;
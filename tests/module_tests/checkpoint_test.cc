@@ -33,6 +33,9 @@
 #define NUM_TAP_THREADS 3
 #define NUM_SET_THREADS 4
 #define NUM_ITEMS 50000
+#define NUM_CURSORS 24
+#define NUM_CURSOR_ROUNDS 20
+#define NUM_CURSOR_KEYS 1000
 
 EPStats global_stats;
 CheckpointConfig checkpoint_config;
@@ -228,12 +231,18 @@ void basic_chk_test() {
         gate->wait();
     }
     sleep(1);
+    hrtime_t start = gethrtime();
     mutex->notify();
 
     for (i = 0; i < NUM_SET_THREADS; ++i) {
         rc = pthread_join(set_threads[i], NULL);
         assert(rc == 0);
     }
+    hrtime_t elapsed = gethrtime() - start;
+    // The set threads compete with the persistence and TAP cursors.
+    printf("%d sets with %d TAP cursors: %.0f sets/sec\n",
+           NUM_SET_THREADS * NUM_ITEMS, NUM_TAP_THREADS,
+           NUM_SET_THREADS * NUM_ITEMS * 1e9 / elapsed);
 
     // Push the flush command into the queue so that all other threads can be terminated.
     int64_t bySeqno = 0;
@@ -303,9 +312,357 @@ void test_reset_checkpoint_id() {
     assert(items.size() == 0);
 }
 
+void test_checkpoint_queue() {
+    CheckpointQueue queue;
+    CheckpointIndex index;
+    assert(queue.begin() == queue.end());
+
+    std::vector<queued_item> items;
+    for (int i = 0; i < 1000; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        items.push_back(queued_item(new QueuedItem(key.str(), 0, queue_op_set,
+                                                   0, i)));
+    }
+
+    queue.push_back(items[0]);
+    queue.push_back(items[1]);
+    queue.closeChunk();
+    std::vector<CheckpointQueue::iterator> positions;
+    for (int i = 2; i < 1000; ++i) {
+        positions.push_back(queue.push_back(items[i]));
+        index.set(positions.back(), i);
+    }
+    assert(queue.size() == 1000);
+
+    // Tombstones are skipped in both directions and by the index.
+    for (int i = 2; i < 1000; i += 2) {
+        index.erase(items[i]->getKey());
+        queue.erase(positions[i - 2]);
+    }
+    assert(queue.size() == 501);
+    assert(queue.tombstones() == 499);
+    int n = 0;
+    CheckpointQueue::iterator it = queue.begin();
+    for (; it != queue.end(); ++it, ++n) {
+        assert(n < 2 || (*it)->getBySeqno() % 2 == 1);
+    }
+    assert(n == 501);
+    it = queue.end();
+    for (n = 0; it != queue.begin(); ++n) {
+        --it;
+    }
+    assert(n == 501);
+    for (int i = 2; i < 1000; ++i) {
+        CheckpointIndex::Entry *entry = index.find(items[i]->getKey());
+        if (i % 2 == 0) {
+            assert(entry == NULL);
+        } else {
+            assert(entry && entry->mutation_id == i && *(entry->position) == items[i]);
+        }
+    }
+
+    // Inserting behind the head doesn't move any other item.
+    std::vector<queued_item> older(items.begin() + 500, items.begin() + 510);
+    CheckpointQueue::iterator second = ++queue.begin();
+    CheckpointQueue::iterator third = positions[1];
+    queue.insertAfterHead(older);
+    assert(queue.size() == 511);
+    assert(*second == items[1] && *third == items[3]);
+    it = second;
+    for (int i = 500; i < 510; ++i) {
+        assert(*(++it) == items[i]);
+    }
+    assert(++it == third);
+
+    // Popping the last item also drops the tombstone in front of it.
+    queue.pop_back();
+    assert(queue.back() == items[997]);
+    assert(queue.tombstones() == 498);
+}
+
+struct queue_reader_args {
+    CheckpointQueue *queue;
+    Atomic<bool> *done;
+};
+
+static void *launch_queue_reader(void *arg) {
+    struct queue_reader_args *args = static_cast<queue_reader_args*>(arg);
+    size_t seen = 0;
+    while (!args->done->load() || seen < args->queue->size()) {
+        // Walking up to a snapshot of the end never runs into a slot the
+        // appender has yet to publish.
+        size_t n = 0;
+        CheckpointQueue::iterator end = args->queue->end();
+        CheckpointQueue::iterator it = args->queue->begin();
+        for (; it != end; ++it, ++n) {
+            assert(it->get() && (*it)->getBySeqno() == static_cast<int64_t>(n));
+        }
+        assert(n >= seen);
+        seen = n;
+    }
+    return NULL;
+}
+
+void test_checkpoint_queue_append() {
+    CheckpointQueue queue;
+
+    // The end of a queue whose last chunk just got full is where an
+    // iterator moving past its last item ends up.
+    CheckpointQueue::iterator last;
+    for (size_t i = 0; i < CheckpointQueue::MIN_CHUNK_ITEMS; ++i) {
+        last = queue.push_back(queued_item(new QueuedItem("key", 0,
+                                                          queue_op_set, 0, i)));
+    }
+    assert(++last == queue.end());
+
+    CheckpointQueue shared;
+    Atomic<bool> done(false);
+    struct queue_reader_args args = { &shared, &done };
+    pthread_t reader;
+    assert(pthread_create(&reader, NULL, launch_queue_reader, &args) == 0);
+    for (int i = 0; i < 20000; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        shared.push_back(queued_item(new QueuedItem(key.str(), 0,
+                                                    queue_op_set, 0, i)));
+    }
+    done = true;
+    assert(pthread_join(reader, NULL) == 0);
+}
+
+/*
+ * A slow cursor keeps the closed checkpoints around, which get collapsed
+ * into the latest closed one. The cursor must then see every key once.
+ */
+void test_collapse_checkpoints() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+    manager->registerTAPCursor("slow");
+
+    for (int chk = 0; chk < 4; ++chk) {
+        for (int k = 0; k < 10; ++k) {
+            std::stringstream key;
+            key << "key-" << k;
+            int64_t bySeqno = 0;
+            manager->queueDirty(vbucket, key.str(), queue_op_set, 0, &bySeqno);
+        }
+        std::stringstream key;
+        key << "unique-" << chk;
+        int64_t bySeqno = 0;
+        manager->queueDirty(vbucket, key.str(), queue_op_set, 0, &bySeqno);
+        manager->createNewCheckpoint();
+    }
+    assert(manager->getNumCheckpoints() == 5);
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForPersistence(items);
+    manager->itemsPersisted();
+    bool newCheckpointCreated;
+    manager->removeClosedUnrefCheckpoints(vbucket, newCheckpointCreated);
+    assert(manager->getNumCheckpoints() == 2);
+
+    std::set<std::string> keys;
+    size_t numMutations = 0;
+    bool isLastItem = false;
+    for (;;) {
+        queued_item qi = manager->nextItem("slow", isLastItem);
+        if (qi->getOperation() == queue_op_empty) {
+            break;
+        }
+        if (qi->getOperation() == queue_op_set) {
+            keys.insert(qi->getKey());
+            ++numMutations;
+        }
+    }
+    assert(keys.size() == 14 && numMutations == 14);
+
+    delete manager;
+}
+
+/*
+ * Drive a vbucket with many TAP cursors: every round dirties the same keys
+ * (so queueDirty has to adjust the cursors sitting in the open checkpoint),
+ * drains all cursors through their handles and closes the checkpoint.
+ */
+void test_many_cursors() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+
+    std::vector<std::string> names;
+    std::vector<CursorHandle> handles(NUM_CURSORS);
+    for (int i = 0; i < NUM_CURSORS; ++i) {
+        std::stringstream name;
+        name << "eq_tapq:replication_ns_" << i << "@127.0.0.1";
+        names.push_back(name.str());
+        manager->registerTAPCursor(name.str());
+    }
+    assert(manager->getNumOfTAPCursors() == NUM_CURSORS);
+
+    hrtime_t queueTime = 0;
+    hrtime_t nextTime = 0;
+    size_t numFetched = 0;
+    for (int round = 0; round < NUM_CURSOR_ROUNDS; ++round) {
+        hrtime_t start = gethrtime();
+        for (int k = 0; k < NUM_CURSOR_KEYS; ++k) {
+            std::stringstream key;
+            key << "key-" << (k * 7 + round) % NUM_CURSOR_KEYS;
+            int64_t bySeqno = 0;
+            manager->queueDirty(vbucket, key.str(), queue_op_set, 0, &bySeqno);
+            // Let half of the cursors trail the writer within the checkpoint.
+            if (k % 100 == 0) {
+                for (int i = 0; i < NUM_CURSORS; i += 2) {
+                    bool isLastItem = false;
+                    manager->nextItem(names[i], handles[i], isLastItem);
+                }
+            }
+        }
+        queueTime += gethrtime() - start;
+        manager->createNewCheckpoint();
+
+        start = gethrtime();
+        for (int i = 0; i < NUM_CURSORS; ++i) {
+            bool isLastItem = false;
+            while (manager->nextItem(names[i], handles[i], isLastItem)->getOperation()
+                   != queue_op_empty) {
+                ++numFetched;
+            }
+            assert(!manager->hasNext(names[i], handles[i]));
+        }
+        nextTime += gethrtime() - start;
+
+        std::vector<queued_item> items;
+        manager->getAllItemsForPersistence(items);
+        manager->itemsPersisted();
+        bool newCheckpointCreated;
+        manager->removeClosedUnrefCheckpoints(vbucket, newCheckpointCreated);
+    }
+    // All cursors caught up, so only the open checkpoint remains.
+    assert(manager->getNumCheckpoints() == 1);
+
+    printf("%d cursors: %.1f ns/queueDirty, %.1f ns/nextItem\n", NUM_CURSORS,
+           static_cast<double>(queueTime) / (NUM_CURSOR_ROUNDS * NUM_CURSOR_KEYS),
+           static_cast<double>(nextTime) / numFetched);
+
+    // A handle to a removed cursor must not reach any other cursor, and
+    // resolves to a cursor registered again under the same name.
+    assert(manager->removeTAPCursor(names[0]));
+    bool isLastItem = false;
+    queued_item qi = manager->nextItem(names[0], handles[0], isLastItem);
+    assert(qi->getOperation() == queue_op_empty && qi->getVBucketId() == 0xffff);
+    manager->registerTAPCursor(names[1] + "-new");
+    assert(!manager->hasNext(names[0], handles[0]));
+    manager->registerTAPCursor(names[0], manager->getOpenCheckpointId(), true);
+    qi = manager->nextItem(names[0], handles[0], isLastItem);
+    assert(qi->getOperation() == queue_op_checkpoint_start);
+
+    delete manager;
+}
+
+/*
+ * Updates to the same key leave tombstones behind, which close the open
+ * checkpoint once they reach the item limit along with the items.
+ */
+void test_hot_key_closes_checkpoint() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+
+    size_t maxItems = checkpoint_config.getCheckpointMaxItems();
+    for (size_t i = 0; i < maxItems; ++i) {
+        int64_t bySeqno = 0;
+        manager->queueDirty(vbucket, "hot", queue_op_set, 0, &bySeqno);
+    }
+    assert(manager->getOpenCheckpointId() == 1);
+    assert(manager->getNumOpenChkItems() == 2);
+
+    int64_t bySeqno = 0;
+    manager->queueDirty(vbucket, "hot", queue_op_set, 0, &bySeqno);
+    assert(manager->getOpenCheckpointId() == 2);
+
+    delete manager;
+}
+
+/*
+ * Batches taken from a cursor stop at the size limits, and the last
+ * mutation and the end of a checkpoint always come in a batch of their own.
+ */
+void test_next_items() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1);
+    std::string name("eq_tapq:batch");
+    manager->registerTAPCursor(name);
+    CursorHandle handle;
+
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        int64_t bySeqno = 0;
+        manager->queueDirty(vbucket, key.str(), queue_op_set, 0, &bySeqno);
+    }
+    manager->createNewCheckpoint();
+    for (int i = 0; i < 3; ++i) {
+        std::stringstream key;
+        key << "new-" << i;
+        int64_t bySeqno = 0;
+        manager->queueDirty(vbucket, key.str(), queue_op_set, 0, &bySeqno);
+    }
+
+    std::vector<queued_item> items;
+    bool isLastItem = false;
+    assert(manager->nextItems(name, handle, items, 4, 1 << 20, isLastItem) == 4);
+    assert(items[0]->getOperation() == queue_op_checkpoint_start);
+    assert(items[3]->getKey() == "key-2" && !isLastItem);
+
+    // A byte limit smaller than any item still lets one item through.
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 4, 1, isLastItem) == 1);
+    assert(items[0]->getKey() == "key-3" && !isLastItem);
+
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 100, 1 << 20, isLastItem) == 5);
+    assert(items.back()->getKey() == "key-8" && !isLastItem);
+
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 100, 1 << 20, isLastItem) == 1);
+    assert(items[0]->getKey() == "key-9" && isLastItem);
+
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 100, 1 << 20, isLastItem) == 1);
+    assert(items[0]->getOperation() == queue_op_checkpoint_end && !isLastItem);
+
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 100, 1 << 20, isLastItem) == 3);
+    assert(items[0]->getOperation() == queue_op_checkpoint_start);
+    assert(items.back()->getKey() == "new-1" && !isLastItem);
+
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 100, 1 << 20, isLastItem) == 1);
+    assert(items[0]->getKey() == "new-2" && isLastItem);
+
+    items.clear();
+    assert(manager->nextItems(name, handle, items, 100, 1 << 20, isLastItem) == 0);
+    assert(!manager->hasNext(name, handle));
+
+    delete manager;
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     basic_chk_test();
     test_reset_checkpoint_id();
+    test_many_cursors();
+    test_checkpoint_queue();
+    test_checkpoint_queue_append();
+    test_collapse_checkpoints();
+    test_hot_key_closes_checkpoint();
+    test_next_items();
 }
@@ -0,0 +1,211 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "epoch.h"
+#include "threadtests.h"
+
+#define NUM_SLOTS 16
+#define NUM_READERS 8
+#define NUM_TIMES 100000
+
+static const int LIVE = 0x1a7e;
+
+class Widget : public RCValue {
+public:
+    Widget() : state(LIVE) {
+        numInstances++;
+    }
+
+    ~Widget() {
+        state = 0;
+        numInstances--;
+    }
+
+    bool isLive() const {
+        return state == LIVE;
+    }
+
+    static int getNumInstances() {
+        return numInstances;
+    }
+
+private:
+    volatile int state;
+    static Atomic<int> numInstances;
+};
+
+Atomic<int> Widget::numInstances(0);
+
+static void releaseWidget(void *arg) {
+    delete static_cast<RCPtr<Widget>*>(arg);
+}
+
+// Replace a slot the way KVShard::setBucket does.
+static void replace(EpochManager &em, RCPtr<Widget> &slot, Widget *w) {
+    if (slot) {
+        em.retire(releaseWidget, new RCPtr<Widget>(slot));
+    }
+    slot.reset(w);
+    em.reclaim();
+}
+
+static void testGuardDefersReclaim() {
+    EpochManager em;
+    RCPtr<Widget> slot(new Widget);
+
+    {
+        EpochGuard outer(em);
+        Widget *w = slot.get();
+        {
+            EpochGuard inner(em);
+        }
+        replace(em, slot, new Widget);
+        assert(!em.reclaim());
+        assert(em.getNumRetired() == 1);
+        assert(w->isLive());
+        assert(Widget::getNumInstances() == 2);
+    }
+
+    assert(em.reclaim());
+    assert(em.getNumRetired() == 0);
+    assert(Widget::getNumInstances() == 1);
+
+    // A guard entered after the retirement doesn't hold it back.
+    {
+        EpochGuard guard(em);
+        replace(em, slot, NULL);
+    }
+    em.enter();
+    assert(em.reclaim());
+    em.exit();
+    assert(Widget::getNumInstances() == 0);
+}
+
+static void testDestroyRetired() {
+    {
+        EpochManager em;
+        RCPtr<Widget> slot(new Widget);
+        EpochGuard *guard = new EpochGuard(em);
+        replace(em, slot, NULL);
+        delete guard;
+        assert(Widget::getNumInstances() == 1);
+    }
+    assert(Widget::getNumInstances() == 0);
+}
+
+class Reader : public Generator<bool> {
+public:
+    Reader(EpochManager &m, RCPtr<Widget> *s, Atomic<bool> &d) :
+        em(m), slots(s), done(d) { }
+
+    bool operator()() {
+        size_t i = 0;
+        while (!done) {
+            RCPtr<Widget> w;
+            {
+                EpochGuard guard(em);
+                w.reset(slots[i++ % NUM_SLOTS].get());
+            }
+            assert(!w || w->isLive());
+        }
+        return true;
+    }
+
+private:
+    EpochManager  &em;
+    RCPtr<Widget> *slots;
+    Atomic<bool>  &done;
+};
+
+class ReplaceTest : public Generator<bool> {
+public:
+    ReplaceTest(EpochManager &m, RCPtr<Widget> *s, Atomic<bool> &d) :
+        em(m), slots(s), done(d), reader(m, s, d), hasWriter(false) { }
+
+    bool operator()() {
+        // One thread replaces the widgets (like the holder of vbsetMutex
+        // does), all others read them.
+        bool expected = false;
+        if (!hasWriter.compare_exchange_strong(expected, true)) {
+            return reader();
+        }
+        for (int i = 0; i < NUM_TIMES; ++i) {
+            replace(em, slots[rand() % NUM_SLOTS],
+                    i % 5 == 0 ? NULL : new Widget);
+        }
+        done = true;
+        return true;
+    }
+
+private:
+    EpochManager  &em;
+    RCPtr<Widget> *slots;
+    Atomic<bool>  &done;
+    Reader         reader;
+    Atomic<bool>   hasWriter;
+};
+
+static void testConcurrentReplace() {
+    EpochManager em;
+    RCPtr<Widget> slots[NUM_SLOTS];
+    Atomic<bool> done(false);
+    ReplaceTest gen(em, slots, done);
+
+    getCompletedThreads<bool>(NUM_READERS + 1, &gen);
+
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        replace(em, slots[i], NULL);
+    }
+    assert(em.reclaim());
+    assert(Widget::getNumInstances() == 0);
+}
+
+class Visitor : public Generator<bool> {
+public:
+    Visitor(EpochManager &m) : em(m) { }
+
+    bool operator()() {
+        EpochGuard guard(em);
+        return true;
+    }
+
+private:
+    EpochManager &em;
+};
+
+static void testSlotsReleasedOnExit() {
+    EpochManager em;
+    Visitor gen(em);
+    // More threads than slots over time, but never at once.
+    for (size_t i = 0; i < 3; ++i) {
+        getCompletedThreads<bool>(EpochManager::MAX_READERS / 2, &gen);
+    }
+}
+
+int main() {
+    alarm(120);
+    testGuardDefersReclaim();
+    testDestroyRetired();
+    testConcurrentReplace();
+    testSlotsReleasedOnExit();
+}
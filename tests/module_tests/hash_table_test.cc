@@ -24,6 +24,8 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <iostream>
 #include <limits>
 
 #include "threadtests.h"
@@ -262,6 +264,114 @@ static void testAddExpiry() {
     assert(v->isExpired(ep_real_time() + 6));
 }
 
+static void testPackedSeqnos() {
+    HashTable h(global_stats, 5, 1);
+    std::string k("seqnos");
+    const int64_t bySeqno = (static_cast<int64_t>(1) << 46) + 7;
+    const uint64_t revSeqno = (static_cast<uint64_t>(1) << 47) + 3;
+
+    Item i(k, 0, 0, "v", 1, 0, bySeqno);
+    assert(h.set(i) == WAS_CLEAN);
+
+    StoredValue *v = h.find(k);
+    assert(v);
+    assert(v->getBySeqno() == bySeqno);
+    v->setRevSeqno(revSeqno);
+    assert(v->getRevSeqno() == revSeqno);
+
+    v->setRevSeqno(v->getRevSeqno() + 1);
+    assert(v->getRevSeqno() == revSeqno + 1);
+    v->setStoredValueState(StoredValue::state_deleted_key);
+    assert(v->getBySeqno() == StoredValue::state_deleted_key);
+    assert(v->isTempDeletedItem());
+    v->setStoredValueState(StoredValue::state_non_existent_key);
+    assert(v->isTempNonExistentItem());
+}
+
+static void testLocking() {
+    HashTable h(global_stats, 5, 1);
+    std::string k("locked");
+    Item i(k, 0, 0, "v", 1);
+    assert(h.set(i) == WAS_CLEAN);
+
+    StoredValue *v = h.find(k);
+    assert(v);
+    assert(!v->isLocked(0));
+    v->lock(10);
+    assert(v->isLocked(10));
+    assert(!v->isLocked(11));
+    // Expiry cleared the lock.
+    assert(!v->isLocked(0));
+
+    // The lock expiry takes the place of the cached key hash, so the
+    // item must still be found while locked, and get its hash back.
+    v->lock(10);
+    assert(h.find(k) == v);
+    assert(v->getShortKeyHash() == StoredValue::shortHash(h.hash(k)));
+    v->unlock();
+    assert(!v->isLocked(0));
+    assert(v->getShortKeyHash() == StoredValue::shortHash(h.hash(k)));
+    assert(h.find(k) == v);
+
+    // A locked item can't be deleted, but dropping it must not leave
+    // its lock behind.
+    v->lock(10);
+    assert(!h.del(k));
+    h.clear();
+    Item again(k, 0, 0, "v", 1);
+    assert(h.set(again) == WAS_CLEAN);
+    assert(!h.find(k)->isLocked(0));
+}
+
+/**
+ * The StoredValue header before it was packed and started caching the
+ * key hash. Its allocation was the header plus the whole key.
+ */
+struct UnpackedStoredValue {
+    void       *value;
+    void       *next;
+    uint64_t    cas;
+    uint64_t    revSeqno;
+    int64_t     bySeqno;
+    rel_time_t  lock_expiry;
+    uint32_t    exptime;
+    uint32_t    flags;
+    uint8_t     bits;
+    uint8_t     keylen;
+    char        keybytes[1];
+};
+
+/**
+ * Report the memory held per item once the values are ejected, next to
+ * what the unpacked header took. The packed header caches half of the
+ * key hash in the word the getl lock expiry used, and saves 4 bytes per
+ * item.
+ */
+static void testMetaDataBytesPerItem() {
+    HashTable h(global_stats, 3079, 1);
+    const size_t numItems = 10000;
+    const size_t keylen = 16;
+
+    for (size_t n = 0; n < numItems; ++n) {
+        char key[keylen + 1];
+        snprintf(key, sizeof(key), "key::%011lu", static_cast<unsigned long>(n));
+        std::string k(key);
+        Item i(k, 0, 0, "value", 5);
+        assert(h.set(i) == WAS_CLEAN);
+        StoredValue *v = h.find(k);
+        v->markClean();
+        assert(h.unlocked_ejectItem(v, VALUE_ONLY));
+    }
+
+    double after = static_cast<double>(h.metaDataMemory.load()) / numItems;
+    double before = sizeof(UnpackedStoredValue) + keylen;
+    std::cout << "Metadata bytes per item with " << keylen << " byte keys: "
+              << before << " before, " << after << " after" << std::endl;
+    assert(after == StoredValue::requiredStorage(keylen));
+    assert(after < before);
+    assert(before - after == 4);
+}
+
 static void testResize() {
     HashTable h(global_stats, 5, 3);
 
@@ -331,6 +441,178 @@ static void testConcurrentAccessResize() {
     getCompletedThreads(16, &gen);
 }
 
+static void testIncrementalResize() {
+    alarm(60);
+    HashTable h(global_stats, 47, 7);
+
+    std::vector<std::string> keys = generateKeys(2000);
+    storeMany(h, keys);
+
+    assert(h.startResize(3079));
+    assert(h.isResizing());
+    assert(!h.startResize(769));
+    assert(h.getSize() == 3079);
+    assert(h.getNumResizeStripesPending() == 7);
+
+    // Move some of the stripes, leaving the table split across both
+    // arrays, and make sure everything is still reachable.
+    assert(h.resizeStep(3) == 4);
+    verifyFound(h, keys);
+
+    std::vector<std::string> more = generateKeys(5000, 2000);
+    storeMany(h, more);
+    for (size_t i = 0; i < 500; ++i) {
+        assert(h.del(keys[i]));
+    }
+    assert(count(h) == 4500);
+
+    assert(h.resizeStep(100) == 0);
+    assert(!h.isResizing());
+    assert(h.getNumResizeStripesMoved() == 7);
+    assert(h.resizeStep(1) == 0);
+
+    std::vector<std::string> remaining(keys.begin() + 500, keys.end());
+    verifyFound(h, remaining);
+    verifyFound(h, more);
+    assert(count(h) == 4500);
+}
+
+static void prefetchAll(HashTable &h, const std::vector<std::string> &keys) {
+    std::vector<std::string>::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        h.prefetchBucket(h.hash(*it));
+    }
+}
+
+static void testPrefetchBucket() {
+    HashTable h(global_stats, 47, 7);
+
+    std::vector<std::string> keys = generateKeys(1000);
+    std::vector<std::string> missing = generateKeys(1100, 1000);
+    prefetchAll(h, keys);
+    storeMany(h, keys);
+
+    // Prefetching is only a hint, also while stripes are migrating.
+    prefetchAll(h, keys);
+    prefetchAll(h, missing);
+    assert(h.startResize(3079));
+    assert(h.resizeStep(3) == 4);
+    prefetchAll(h, keys);
+    prefetchAll(h, missing);
+    assert(h.resizeStep(100) == 0);
+    prefetchAll(h, keys);
+
+    verifyFound(h, keys);
+    assert(count(h) == 1000);
+}
+
+/**
+ * Drives incremental resizes from one thread while all the other
+ * threads keep reading and rewriting items, which must stay
+ * reachable throughout the migration.
+ */
+class ResizeStressGenerator : public Generator<bool> {
+public:
+
+    ResizeStressGenerator(const std::vector<std::string> &k,
+                          HashTable &h) : keys(k), ht(h), threads(0),
+                                          done(false) {}
+
+    bool operator()() {
+        if (threads.fetch_add(1) == 0) {
+            resizer();
+        } else {
+            accessor();
+        }
+        return true;
+    }
+
+private:
+
+    void resizer() {
+        size_t sizes[] = { 3079, 97, 12289, 769 };
+        for (int i = 0; i < 12; ++i) {
+            assert(ht.startResize(sizes[i % 4]));
+            while (ht.resizeStep(1) != 0) {
+                sched_yield();
+            }
+        }
+        done = true;
+    }
+
+    void accessor() {
+        size_t i = 0;
+        while (!done) {
+            std::string &key = keys[i++ % keys.size()];
+            assert(ht.find(key));
+            Item itm(key, 0, 0, key.c_str(), key.length());
+            assert(ht.set(itm) != NOT_FOUND);
+        }
+    }
+
+    std::vector<std::string>  keys;
+    HashTable                &ht;
+    Atomic<int>               threads;
+    Atomic<bool>              done;
+};
+
+static void testConcurrentIncrementalResize() {
+    alarm(60);
+    HashTable h(global_stats, 769, 47);
+
+    std::vector<std::string> keys = generateKeys(20000);
+    storeMany(h, keys);
+
+    ResizeStressGenerator gen(keys, h);
+    getCompletedThreads(8, &gen);
+
+    assert(!h.isResizing());
+    assert(h.getSize() == 769);
+    assert(h.getNumResizeStripesMoved() == 12 * 47);
+    verifyFound(h, keys);
+    assert(count(h) == 20000);
+}
+
+static void testBucketedIndex() {
+    alarm(60);
+    // Few buckets, so most chains overflow their index line.
+    HashTable h(global_stats, 5, 3);
+    assert(h.getIndexType() == HT_INDEX_BUCKETED);
+
+    std::vector<std::string> keys = generateKeys(3000);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+
+    std::vector<std::string> gone;
+    std::vector<std::string> kept;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i % 3 == 0) {
+            assert(h.del(keys[i]));
+            gone.push_back(keys[i]);
+        } else {
+            kept.push_back(keys[i]);
+        }
+    }
+    verifyFound(h, kept);
+    for (size_t i = 0; i < gone.size(); ++i) {
+        assert(!h.find(gone[i]));
+        assert(!h.del(gone[i]));
+    }
+    assert(count(h) == static_cast<int>(kept.size()));
+
+    h.resize();
+    verifyFound(h, kept);
+    assert(count(h) == static_cast<int>(kept.size()));
+
+    // Empty the table completely and fill it again.
+    for (size_t i = 0; i < kept.size(); ++i) {
+        assert(h.del(kept[i]));
+    }
+    assert(count(h) == 0);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+}
+
 static void testAutoResize() {
     HashTable h(global_stats, 5, 3);
 
@@ -566,6 +848,28 @@ static void testSizeStatsEjectFlush() {
     free(someval);
 }
 
+static void testItemPool() {
+    HashTable ht(global_stats, 5, 1);
+    std::string key("somekey");
+    Item i(key, 0, 0, "someval", 7);
+    assert(ht.set(i) == WAS_CLEAN);
+    StoredValue *v(ht.find(key));
+    assert(v);
+
+    // A pooled item shares the stored value instead of copying it.
+    ItemPool pool;
+    Item *itm = v->toItem(false, 0, pool.acquire());
+    assert(itm->isPooled());
+    assert(itm->getKey() == key);
+    assert(itm->getValue().get() == v->getValue().get());
+
+    // Released items drop their value and come back for the next message.
+    pool.release(itm);
+    assert(itm->getValue().get() == NULL);
+    assert(pool.acquire() == itm);
+    pool.release(itm);
+}
+
 int main() {
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     global_stats.setMaxDataSize(64*1024*1024);
@@ -575,19 +879,37 @@ int main() {
     testHashSizeTwo();
     testReverseDeletions();
     testForwardDeletions();
+    // The deletion tests armed a short alarm of their own.
+    alarm(60);
     testFind();
     testAdd();
     testAddExpiry();
+    testPackedSeqnos();
+    testLocking();
     testDepthCounting();
     testPoisonKey();
     testResize();
     testConcurrentAccessResize();
     testAutoResize();
+    testIncrementalResize();
+    testConcurrentIncrementalResize();
+    testPrefetchBucket();
+    HashTable::setDefaultIndexType(HT_INDEX_BUCKETED);
+    testBucketedIndex();
+    testFind();
+    testAdd();
+    testResize();
+    testIncrementalResize();
+    testConcurrentIncrementalResize();
+    testPrefetchBucket();
+    HashTable::setDefaultIndexType(HT_INDEX_CHAINED);
     testSizeStats();
     testSizeStatsFlush();
     testSizeStatsSoftDel();
     testSizeStatsSoftDelFlush();
     testSizeStatsEject();
     testSizeStatsEjectFlush();
+    testMetaDataBytesPerItem();
+    testItemPool();
     exit(0);
 }
@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Compare the key hash used by the HashTable against the byte-at-a-time
+ * DJB hash it replaced: hashing throughput over document-id sized keys
+ * and how evenly the keys spread over the hash buckets.
+ */
+
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "keyhash.h"
+
+static uint64_t djbhash(const char *str, size_t len) {
+    int h = 5381;
+    for (size_t i = 0; i < len; i++) {
+        h = ((h << 5) + h) ^ str[i];
+    }
+    return static_cast<unsigned int>(h);
+}
+
+typedef uint64_t (*hash_func_t)(const char *, size_t);
+
+static std::vector<std::string> generateKeys(size_t num, size_t len) {
+    std::vector<std::string> rv;
+    for (size_t i = 0; i < num; ++i) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lu", static_cast<unsigned long>(i));
+        std::string key("doc::");
+        key.append(len - key.length() - strlen(buf), 'x');
+        key.append(buf);
+        rv.push_back(key);
+    }
+    return rv;
+}
+
+static void throughput(const char *name, hash_func_t fn,
+                       const std::vector<std::string> &keys, int rounds) {
+    uint64_t sink = 0;
+    hrtime_t start = gethrtime();
+    for (int r = 0; r < rounds; ++r) {
+        std::vector<std::string>::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); ++it) {
+            sink += fn(it->data(), it->length());
+        }
+    }
+    hrtime_t elapsed = gethrtime() - start;
+    double per = static_cast<double>(elapsed) / (rounds * keys.size());
+    printf("  %-8s %8.1f ns/key (%llx)\n", name, per,
+           static_cast<unsigned long long>(sink & 0xff));
+}
+
+static void distribution(const char *name, hash_func_t fn,
+                         const std::vector<std::string> &keys,
+                         size_t nbuckets) {
+    std::vector<size_t> depth(nbuckets);
+    std::vector<std::string>::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        ++depth[fn(it->data(), it->length()) % nbuckets];
+    }
+
+    double expected = static_cast<double>(keys.size()) / nbuckets;
+    double chi = 0;
+    size_t maxDepth = 0;
+    size_t empty = 0;
+    for (size_t i = 0; i < nbuckets; ++i) {
+        double d = depth[i] - expected;
+        chi += d * d / expected;
+        maxDepth = std::max(maxDepth, depth[i]);
+        empty += depth[i] == 0 ? 1 : 0;
+    }
+    // A uniform hash keeps chi^2 / (buckets - 1) close to 1.
+    printf("  %-8s chi2/df %6.3f  max depth %3lu  empty %5.2f%%\n",
+           name, chi / (nbuckets - 1), static_cast<unsigned long>(maxDepth),
+           100.0 * empty / nbuckets);
+}
+
+int main(int argc, char **argv) {
+    size_t nkeys = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t lens[] = { 16, 40, 80, 120 };
+
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+        std::vector<std::string> keys = generateKeys(nkeys, lens[i]);
+        printf("%lu keys of %lu bytes\n", static_cast<unsigned long>(nkeys),
+               static_cast<unsigned long>(lens[i]));
+        throughput("djb", djbhash, keys, 20);
+        throughput("keyhash", keyhash, keys, 20);
+        distribution("djb", djbhash, keys, 3079);
+        distribution("keyhash", keyhash, keys, 3079);
+        distribution("djb", djbhash, keys, 196613);
+        distribution("keyhash", keyhash, keys, 196613);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Compare the memory accounting done for a stored mutation (an item, its
+ * blob and the allocations behind them, then freeing half of them again)
+ * when every allocation updates the engine's stats, as the allocator
+ * hooks used to, against accounting in per thread batches, over an
+ * increasing number of threads.
+ */
+
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "memory_batch.h"
+#include "stats.h"
+#include "threadtests.h"
+
+class AccountingBench : public Generator<hrtime_t> {
+public:
+    AccountingBench(EPStats &s, bool b, size_t n) :
+        stats(s), batched(b), mutations(n) { }
+
+    hrtime_t operator()() {
+        MemoryBatch batch;
+        hrtime_t start = gethrtime();
+        for (size_t i = 0; i < mutations; ++i) {
+            int64_t sign = (i % 2) ? -1 : 1;
+            if (batched) {
+                batch.addTotalMemory(stats, sign * 96);
+                batch.addTotalMemory(stats, sign * 320);
+                batch.addValueSize(stats, sign * 256);
+                batch.addOverhead(stats, sign * 64);
+            } else {
+                stats.totalMemory.fetch_add(static_cast<size_t>(sign * 96));
+                stats.totalMemory.fetch_add(static_cast<size_t>(sign * 320));
+                stats.currentSize.fetch_add(static_cast<size_t>(sign * 256));
+                stats.totalValueSize.fetch_add(static_cast<size_t>(sign * 256));
+                stats.memOverhead.fetch_add(static_cast<size_t>(sign * 64));
+            }
+        }
+        batch.flush(stats);
+        return gethrtime() - start;
+    }
+
+private:
+    EPStats &stats;
+    bool     batched;
+    size_t   mutations;
+};
+
+static void run(const char *name, bool batched, size_t nthreads,
+                size_t mutations) {
+    EPStats stats;
+    AccountingBench gen(stats, batched, mutations);
+    std::vector<hrtime_t> times = getCompletedThreads<hrtime_t>(nthreads,
+                                                                &gen);
+    hrtime_t slowest = *std::max_element(times.begin(), times.end());
+    double mops = static_cast<double>(nthreads * mutations) * 1000 / slowest;
+    printf("  %-7s %3lu threads %8.2f Mmutations/s\n", name,
+           static_cast<unsigned long>(nthreads), mops);
+}
+
+int main(int argc, char **argv) {
+    size_t maxThreads = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    size_t mutations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    printf("%lu mutations per thread\n", static_cast<unsigned long>(mutations));
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        run("direct", false, n, mutations);
+        run("batched", true, n, mutations);
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+
+#include "memory_batch.h"
+#include "stats.h"
+#include "threadtests.h"
+
+#define NUM_THREADS 16
+#define NUM_TIMES 100000
+
+static void testThreshold() {
+    EPStats stats;
+    stats.totalMemory.store(1 << 20);
+    MemoryBatch batch;
+
+    batch.addTotalMemory(stats, MemoryBatch::BATCH_SIZE);
+    assert(stats.totalMemory.load() == 1 << 20);
+    batch.addTotalMemory(stats, 1);
+    assert(stats.totalMemory.load() == (1 << 20) + MemoryBatch::BATCH_SIZE + 1);
+
+    batch.addTotalMemory(stats, -MemoryBatch::BATCH_SIZE);
+    assert(stats.totalMemory.load() == (1 << 20) + MemoryBatch::BATCH_SIZE + 1);
+    batch.addTotalMemory(stats, -2);
+    assert(stats.totalMemory.load() == (1 << 20) - 1);
+
+    batch.addValueSize(stats, 100);
+    batch.addOverhead(stats, 40);
+    assert(stats.currentSize.load() == 0);
+    batch.flush(stats);
+    assert(stats.currentSize.load() == 100);
+    assert(stats.totalValueSize.load() == 100);
+    assert(stats.memOverhead.load() == 40);
+}
+
+static void testDiscard() {
+    EPStats stats;
+    MemoryBatch batch;
+
+    // What an engine's thread batched before the engine gets deleted is
+    // dropped, and nothing freed during the delete reaches any stats.
+    batch.addTotalMemory(stats, 100);
+    batch.addOverhead(stats, 10);
+    batch.setDiscard(true);
+    batch.addTotalMemory(stats, -10 * MemoryBatch::BATCH_SIZE);
+    batch.addValueSize(stats, -10 * MemoryBatch::BATCH_SIZE);
+    batch.addOverhead(stats, -10 * MemoryBatch::BATCH_SIZE);
+    batch.flush(stats);
+    assert(stats.totalMemory.load() == 0);
+    assert(stats.currentSize.load() == 0);
+    assert(stats.totalValueSize.load() == 0);
+    assert(stats.memOverhead.load() == 0);
+
+    // The thread accounts normally once it runs for the next engine.
+    batch.setDiscard(false);
+    batch.addTotalMemory(stats, 42);
+    batch.flush(stats);
+    assert(stats.totalMemory.load() == 42);
+}
+
+class Allocator : public Generator<bool> {
+public:
+    Allocator(EPStats &s) : stats(s) { }
+
+    bool operator()() {
+        MemoryBatch batch;
+        for (int i = 0; i < NUM_TIMES; ++i) {
+            batch.addTotalMemory(stats, 96);
+            batch.addValueSize(stats, 64);
+            if (i % 2) {
+                batch.addTotalMemory(stats, -96);
+                batch.addValueSize(stats, -64);
+            }
+        }
+        batch.flush(stats);
+        return true;
+    }
+
+private:
+    EPStats &stats;
+};
+
+static void testConcurrentBatches() {
+    EPStats stats;
+    Allocator gen(stats);
+
+    getCompletedThreads<bool>(NUM_THREADS, &gen);
+
+    assert(stats.totalMemory.load() == NUM_THREADS * NUM_TIMES / 2 * 96);
+    assert(stats.currentSize.load() == NUM_THREADS * NUM_TIMES / 2 * 64);
+    assert(stats.totalValueSize.load() == stats.currentSize.load());
+}
+
+int main() {
+    alarm(60);
+    testThreshold();
+    testDiscard();
+    testConcurrentBatches();
+}
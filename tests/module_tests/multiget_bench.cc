@@ -0,0 +1,171 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Compare the latency per key of looking up the keys of a multi-get one
+ * at a time (hashing, locking and searching every key before the next,
+ * like a get does) against the windowed lookup of
+ * EventuallyPersistentStore::getMulti, which prefetches the buckets of
+ * a few keys before searching any of them. Keys are drawn at random
+ * from a table much larger than the caches.
+ */
+
+#include "config.h"
+
+#include <platform/platform.h>
+#include <stats.h>
+#include <stored-value.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "threadtests.h"
+
+time_t time_offset;
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL) + time_offset;
+    }
+}
+
+EPStats global_stats;
+
+//! Same as MULTI_GET_WINDOW in ep.cc.
+static const size_t WINDOW = 16;
+
+static bool find(HashTable &ht, const std::string &key, uint64_t h) {
+    int bucket_num(0);
+    LockHolder lh = ht.getLockedBucket(h, &bucket_num);
+    return ht.unlocked_find(key, h, bucket_num, false, false) != NULL;
+}
+
+class MultiGetBench : public Generator<hrtime_t> {
+public:
+    MultiGetBench(HashTable &h, const std::vector<std::string> &k,
+                  size_t b, size_t n, bool batch) :
+        ht(h), keys(k), batchSize(b), numBatches(n), batched(batch),
+        seed(0) { }
+
+    hrtime_t operator()() {
+        unsigned int mySeed = static_cast<unsigned int>(seed++);
+        std::vector<const std::string*> batch(batchSize);
+        size_t found = 0;
+        hrtime_t spent = 0;
+        for (size_t n = 0; n < numBatches; ++n) {
+            for (size_t i = 0; i < batchSize; ++i) {
+                batch[i] = &keys[rand_r(&mySeed) % keys.size()];
+            }
+            hrtime_t start = gethrtime();
+            if (batched) {
+                for (size_t w = 0; w < batchSize; w += WINDOW) {
+                    size_t end = std::min(batchSize, w + WINDOW);
+                    uint64_t hashes[WINDOW];
+                    for (size_t i = w; i < end; ++i) {
+                        hashes[i - w] = ht.hash(*batch[i]);
+                        ht.prefetchBucket(hashes[i - w]);
+                    }
+                    for (size_t i = w; i < end; ++i) {
+                        if (find(ht, *batch[i], hashes[i - w])) {
+                            ++found;
+                        }
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < batchSize; ++i) {
+                    if (find(ht, *batch[i], ht.hash(*batch[i]))) {
+                        ++found;
+                    }
+                }
+            }
+            spent += gethrtime() - start;
+        }
+        assert(found == batchSize * numBatches);
+        return spent;
+    }
+
+private:
+    HashTable                      &ht;
+    const std::vector<std::string> &keys;
+    size_t                          batchSize;
+    size_t                          numBatches;
+    bool                            batched;
+    Atomic<size_t>                  seed;
+};
+
+static void run(const char *name, HashTable &h,
+                const std::vector<std::string> &keys, size_t nthreads,
+                size_t batchSize, size_t numBatches, bool batched) {
+    MultiGetBench gen(h, keys, batchSize, numBatches, batched);
+    std::vector<hrtime_t> times = getCompletedThreads<hrtime_t>(nthreads,
+                                                                &gen);
+    hrtime_t total = 0;
+    std::vector<hrtime_t>::iterator it;
+    for (it = times.begin(); it != times.end(); ++it) {
+        total += *it;
+    }
+    double perKey = static_cast<double>(total) /
+        (nthreads * batchSize * numBatches);
+    printf("  %-8s %3lu keys %3lu threads %8.1f ns/key\n", name,
+           static_cast<unsigned long>(batchSize),
+           static_cast<unsigned long>(nthreads), perKey);
+}
+
+int main(int argc, char **argv) {
+    size_t numItems = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t maxThreads = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    size_t numBatches = argc > 3 ? strtoul(argv[3], NULL, 10) : 2000;
+
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    global_stats.setMaxDataSize(static_cast<size_t>(-1) / 2);
+    HashTable h(global_stats, HashTable::getNumBuckets(numItems),
+                HashTable::getNumLocks(0));
+
+    std::vector<std::string> keys;
+    keys.reserve(numItems);
+    for (size_t i = 0; i < numItems; ++i) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "multiget_bench_key_%lu",
+                 static_cast<unsigned long>(i));
+        keys.push_back(buf);
+        Item itm(keys.back(), 0, 0, buf, 8);
+        h.set(itm);
+    }
+
+    printf("%lu items, %lu buckets, %lu locks\n",
+           static_cast<unsigned long>(numItems),
+           static_cast<unsigned long>(h.getSize()),
+           static_cast<unsigned long>(h.getNumLocks()));
+    size_t batchSizes[] = { 100, 250, 500 };
+    for (size_t b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); ++b) {
+        for (size_t n = 1; n <= maxThreads; n *= 2) {
+            run("per key", h, keys, n, batchSizes[b], numBatches, false);
+            run("batched", h, keys, n, batchSizes[b], numBatches, true);
+        }
+    }
+    return 0;
+}
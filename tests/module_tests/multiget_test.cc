@@ -0,0 +1,571 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bgfetcher.h"
+#include "ep.h"
+#include "ep_engine.h"
+#include "kvstore.h"
+#include "objectregistry.h"
+#include "syncobject.h"
+
+/*
+ * The "disk" all mock kvstores read from. Keys in unreadable fail to be
+ * read, and reads wait while the gate is closed.
+ */
+static Mutex diskMutex;
+static std::map<std::string, std::string> disk;
+static std::set<std::string> unreadable;
+static size_t multiReads;
+static size_t singleReads;
+static bool efficientGet = true;
+
+static SyncObject gate;
+static bool gateClosed = false;
+
+static void setGate(bool closed) {
+    LockHolder lh(gate);
+    gateClosed = closed;
+    gate.notify();
+}
+
+static void passGate() {
+    LockHolder lh(gate);
+    while (gateClosed) {
+        gate.wait();
+    }
+}
+
+static GetValue readDisk(const std::string &key, uint16_t vb) {
+    LockHolder lh(diskMutex);
+    if (unreadable.find(key) != unreadable.end()) {
+        return GetValue(NULL, ENGINE_FAILED);
+    }
+    std::map<std::string, std::string>::iterator it = disk.find(key);
+    if (it == disk.end()) {
+        return GetValue(NULL, ENGINE_KEY_ENOENT);
+    }
+    return GetValue(new Item(key, 0, 0, it->second.data(), it->second.size(),
+                             1, 1, vb));
+}
+
+/**
+ * A kvstore that persists nothing and reads from the shared mock disk.
+ */
+class MockKVStore : public KVStore {
+public:
+    MockKVStore(bool read_only) : KVStore(read_only) { }
+
+    void reset() { }
+    bool begin() { return true; }
+    bool commit() { return true; }
+    void rollback() { }
+
+    StorageProperties getStorageProperties() {
+        return StorageProperties(true, true, true, efficientGet);
+    }
+
+    void set(const Item &item, Callback<mutation_result> &cb) {
+        mutation_result p(1, item.getBySeqno());
+        cb.callback(p);
+    }
+
+    void get(const std::string &key, uint64_t, uint16_t vb,
+             Callback<GetValue> &cb) {
+        passGate();
+        GetValue gv = readDisk(key, vb);
+        {
+            LockHolder lh(diskMutex);
+            ++singleReads;
+        }
+        cb.callback(gv);
+    }
+
+    void getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
+        passGate();
+        vb_bgfetch_queue_t::iterator it;
+        for (it = itms.begin(); it != itms.end(); ++it) {
+            // All fetches of a key share its value, as with couchstore.
+            GetValue gv = readDisk(it->first, vb);
+            std::list<VBucketBGFetchItem *>::iterator fit;
+            for (fit = it->second.begin(); fit != it->second.end(); ++fit) {
+                (*fit)->value = gv;
+            }
+            LockHolder lh(diskMutex);
+            ++multiReads;
+        }
+    }
+
+    void del(const Item &, uint64_t, Callback<int> &cb) {
+        int rv = 1;
+        cb.callback(rv);
+    }
+
+    bool delVBucket(uint16_t, bool) { return true; }
+
+    vbucket_map_t listPersistedVbuckets() {
+        return vbucket_map_t();
+    }
+
+    bool snapshotStats(const std::map<std::string, std::string> &) {
+        return true;
+    }
+
+    bool snapshotVBuckets(const vbucket_map_t &) { return true; }
+
+    bool compactVBucket(const uint16_t, compaction_ctx *,
+                        Callback<compaction_ctx> &) {
+        return true;
+    }
+
+    void dump(std::vector<uint16_t> &, shared_ptr<Callback<GetValue> >,
+              shared_ptr<Callback<CacheLookup> >) { }
+
+    void dump(uint16_t, uint64_t, uint64_t, shared_ptr<Callback<GetValue> >,
+              shared_ptr<Callback<CacheLookup> >) { }
+};
+
+// Stands in for the one in kvstore.cc, which would pull in couchstore.
+KVStore *KVStoreFactory::create(EPStats &, Configuration &, bool read_only) {
+    return new MockKVStore(read_only);
+}
+
+size_t KVStore::getEstimatedItemCount(std::vector<uint16_t> &) {
+    return 0;
+}
+
+/*
+ * The parts of the server API the engine uses.
+ */
+static SyncObject notified;
+static std::map<const void *, std::vector<ENGINE_ERROR_CODE> > notifications;
+static std::map<const void *, void *> engineSpecific;
+static time_t processStarted;
+
+extern "C" {
+    static void mock_notify_io_complete(const void *cookie,
+                                        ENGINE_ERROR_CODE status) {
+        LockHolder lh(notified);
+        notifications[cookie].push_back(status);
+        notified.notify();
+    }
+
+    static void mock_store_engine_specific(const void *cookie, void *data) {
+        LockHolder lh(notified);
+        engineSpecific[cookie] = data;
+    }
+
+    static void *mock_get_engine_specific(const void *cookie) {
+        LockHolder lh(notified);
+        return engineSpecific[cookie];
+    }
+
+    static ENGINE_ERROR_CODE mock_cookie_reserve(const void *) {
+        return ENGINE_SUCCESS;
+    }
+
+    static ENGINE_ERROR_CODE mock_cookie_release(const void *) {
+        return ENGINE_SUCCESS;
+    }
+
+    static void mock_register_callback(ENGINE_HANDLE *, ENGINE_EVENT_TYPE,
+                                       EVENT_CALLBACK, const void *) {
+    }
+
+    static rel_time_t mock_get_current_time(void) {
+        return static_cast<rel_time_t>(time(NULL) - processStarted);
+    }
+
+    static rel_time_t mock_realtime(const time_t exptime) {
+        if (exptime == 0) {
+            return 0;
+        }
+        return static_cast<rel_time_t>(exptime - processStarted);
+    }
+
+    static time_t mock_abstime(const rel_time_t exptime) {
+        return processStarted + exptime;
+    }
+
+    static const char *mock_get_logger_name(void) {
+        return "multiget_test";
+    }
+
+    static void mock_log(EXTENSION_LOG_LEVEL, const void *, const char *,
+                         ...) {
+    }
+
+    static void *mock_get_logger(void) {
+        static EXTENSION_LOGGER_DESCRIPTOR descriptor;
+        descriptor.get_name = mock_get_logger_name;
+        descriptor.log = mock_log;
+        return &descriptor;
+    }
+
+    static EXTENSION_LOG_LEVEL mock_get_log_level(void) {
+        return EXTENSION_LOG_WARNING;
+    }
+
+    static bool mock_add_hook(void (*)(const void *, size_t)) {
+        return false;
+    }
+
+    static bool mock_remove_hook(void (*)(const void *, size_t)) {
+        return false;
+    }
+
+    static bool mock_add_delete_hook(void (*)(const void *)) {
+        return false;
+    }
+
+    static bool mock_remove_delete_hook(void (*)(const void *)) {
+        return false;
+    }
+
+    static int mock_get_extra_stats_size(void) {
+        return 0;
+    }
+
+    static void mock_get_allocator_stats(allocator_stats *) {
+    }
+
+    static size_t mock_get_allocation_size(void *) {
+        return 0;
+    }
+
+    static SERVER_HANDLE_V1 *mock_get_server_api(void) {
+        static SERVER_CORE_API core;
+        static SERVER_CALLBACK_API callback;
+        static SERVER_LOG_API log;
+        static SERVER_COOKIE_API cookie;
+        static ALLOCATOR_HOOKS_API hooks;
+        static SERVER_HANDLE_V1 api;
+
+        core.get_current_time = mock_get_current_time;
+        core.realtime = mock_realtime;
+        core.abstime = mock_abstime;
+        callback.register_callback = mock_register_callback;
+        log.get_logger = mock_get_logger;
+        log.get_level = mock_get_log_level;
+        cookie.store_engine_specific = mock_store_engine_specific;
+        cookie.get_engine_specific = mock_get_engine_specific;
+        cookie.notify_io_complete = mock_notify_io_complete;
+        cookie.reserve = mock_cookie_reserve;
+        cookie.release = mock_cookie_release;
+        hooks.add_new_hook = mock_add_hook;
+        hooks.remove_new_hook = mock_remove_hook;
+        hooks.add_delete_hook = mock_add_delete_hook;
+        hooks.remove_delete_hook = mock_remove_delete_hook;
+        hooks.get_extra_stats_size = mock_get_extra_stats_size;
+        hooks.get_allocator_stats = mock_get_allocator_stats;
+        hooks.get_allocation_size = mock_get_allocation_size;
+
+        api.interface = 1;
+        api.core = &core;
+        api.callback = &callback;
+        api.log = &log;
+        api.cookie = &cookie;
+        api.alloc_hooks = &hooks;
+        return &api;
+    }
+}
+
+/**
+ * Wait for the cookie to be notified, give a second notification the
+ * chance to show up, and return (and forget) all of them.
+ */
+static std::vector<ENGINE_ERROR_CODE> waitForNotifications(const void *c) {
+    LockHolder lh(notified);
+    while (notifications[c].empty()) {
+        notified.wait();
+    }
+    lh.unlock();
+    usleep(200000);
+    lh.lock();
+    std::vector<ENGINE_ERROR_CODE> rv;
+    rv.swap(notifications[c]);
+    return rv;
+}
+
+static size_t numNotifications(const void *c) {
+    LockHolder lh(notified);
+    return notifications[c].size();
+}
+
+static void assertNotifiedOnce(const void *c, ENGINE_ERROR_CODE status) {
+    std::vector<ENGINE_ERROR_CODE> n = waitForNotifications(c);
+    assert(n.size() == 1);
+    assert(n[0] == status);
+}
+
+static EventuallyPersistentEngine *createEngine() {
+    ENGINE_HANDLE *handle = NULL;
+    assert(create_instance(1, mock_get_server_api, &handle) == ENGINE_SUCCESS);
+    EventuallyPersistentEngine *engine =
+        reinterpret_cast<EventuallyPersistentEngine *>(handle);
+    ObjectRegistry::onSwitchThread(engine);
+
+    Configuration &config = engine->getConfiguration();
+    config.setItemEvictionPolicy("full_eviction");
+    config.setMaxVbuckets(4);
+    config.setMaxNumShards(2);
+    // The pool sizes itself from the cpu count otherwise.
+    config.setMaxThreads(8);
+    assert(engine->initialize(NULL) == ENGINE_SUCCESS);
+    // Warmup sets up the vbuckets it found on disk behind our back.
+    while (engine->getEpStore()->isWarmingUp()) {
+        usleep(10000);
+    }
+    return engine;
+}
+
+static void destroyEngine(EventuallyPersistentEngine *engine) {
+    ENGINE_HANDLE *handle = reinterpret_cast<ENGINE_HANDLE *>(engine);
+    reinterpret_cast<ENGINE_HANDLE_V1 *>(handle)->destroy(handle, false);
+}
+
+static void store(EventuallyPersistentEngine *engine, const std::string &key,
+                  const std::string &body) {
+    Item itm(key, 0, 0, body.data(), body.size());
+    assert(engine->getEpStore()->set(itm, NULL) == ENGINE_SUCCESS);
+}
+
+static void storeOnDisk(const std::string &key, const std::string &body) {
+    LockHolder lh(diskMutex);
+    disk[key] = body;
+}
+
+static std::string bodyOf(MultiGetItem &item) {
+    Item *itm = item.value.getValue();
+    assert(itm != NULL);
+    return std::string(itm->getData(), itm->getNBytes());
+}
+
+static void releaseValues(std::vector<MultiGetItem> &items) {
+    std::vector<MultiGetItem>::iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        delete it->value.getValue();
+        it->value.setValue(NULL);
+    }
+}
+
+static size_t tempItems(EventuallyPersistentEngine *engine, uint16_t vbid) {
+    RCPtr<VBucket> vb = engine->getEpStore()->getVBucket(vbid);
+    assert(vb);
+    return vb->ht.getNumTempItems();
+}
+
+static void testFetchGroup() {
+    RCPtr<BGFetchGroup> group(new BGFetchGroup(3));
+    ENGINE_ERROR_CODE status = ENGINE_SUCCESS;
+    assert(!group->complete(status));
+    status = ENGINE_ENOMEM;
+    assert(!group->complete(status));
+    status = ENGINE_TMPFAIL;
+    assert(group->complete(status));
+    // The cookie hears about the first failure.
+    assert(status == ENGINE_ENOMEM);
+
+    group.reset(new BGFetchGroup(2));
+    status = ENGINE_SUCCESS;
+    assert(!group->complete(status));
+    assert(group->complete(status));
+    assert(status == ENGINE_SUCCESS);
+}
+
+static void testResidentAndNotMyVBucket(EventuallyPersistentEngine *engine) {
+    alarm(60);
+    static int cookie;
+    assert(engine->getEpStore()->setVBucketState(2, vbucket_state_replica) ==
+           ENGINE_SUCCESS);
+    store(engine, "resident", "value");
+
+    std::vector<MultiGetItem> items;
+    items.push_back(MultiGetItem("resident", 0));
+    items.push_back(MultiGetItem("replica", 2));
+    items.push_back(MultiGetItem("missing vbucket", 3));
+    items.push_back(MultiGetItem("resident", 0));
+    assert(engine->getMulti(&cookie, items) == ENGINE_SUCCESS);
+
+    assert(items[0].value.getStatus() == ENGINE_SUCCESS);
+    assert(bodyOf(items[0]) == "value");
+    assert(items[1].value.getStatus() == ENGINE_NOT_MY_VBUCKET);
+    assert(items[2].value.getStatus() == ENGINE_NOT_MY_VBUCKET);
+    assert(items[3].value.getStatus() == ENGINE_SUCCESS);
+    assert(bodyOf(items[3]) == "value");
+    releaseValues(items);
+
+    // Nothing went to disk, so there is nothing to notify.
+    usleep(200000);
+    assert(numNotifications(&cookie) == 0);
+    assert(multiReads == 0 && singleReads == 0);
+}
+
+static void testFetchedTogether(EventuallyPersistentEngine *engine) {
+    alarm(60);
+    static int cookie;
+    storeOnDisk("one", "1");
+    storeOnDisk("two", "2");
+    storeOnDisk("bad", "3");
+    unreadable.insert("bad");
+    size_t temps = tempItems(engine, 0);
+
+    std::vector<MultiGetItem> items;
+    items.push_back(MultiGetItem("one", 0));
+    items.push_back(MultiGetItem("two", 0));
+    items.push_back(MultiGetItem("bad", 0));
+    items.push_back(MultiGetItem("gone", 0));
+
+    // Full eviction adds a temp item for every key not in memory, until
+    // its fetch completes.
+    setGate(true);
+    assert(engine->getMulti(&cookie, items) == ENGINE_EWOULDBLOCK);
+    for (size_t i = 0; i < items.size(); ++i) {
+        assert(items[i].value.getStatus() == ENGINE_EWOULDBLOCK);
+    }
+    assert(tempItems(engine, 0) == temps + 4);
+    assert(numNotifications(&cookie) == 0);
+    setGate(false);
+
+    // All four fetches notify the cookie once, with the failed one.
+    assertNotifiedOnce(&cookie, ENGINE_TMPFAIL);
+    assert(multiReads == 4);
+    assert(singleReads == 0);
+
+    {
+        LockHolder lh(diskMutex);
+        unreadable.clear();
+    }
+    assert(engine->getMulti(&cookie, items) == ENGINE_EWOULDBLOCK);
+    assert(items[0].value.getStatus() == ENGINE_SUCCESS);
+    assert(bodyOf(items[0]) == "1");
+    assert(items[1].value.getStatus() == ENGINE_SUCCESS);
+    assert(bodyOf(items[1]) == "2");
+    assert(items[2].value.getStatus() == ENGINE_EWOULDBLOCK);
+    assert(items[3].value.getStatus() == ENGINE_KEY_ENOENT);
+    releaseValues(items);
+    assertNotifiedOnce(&cookie, ENGINE_SUCCESS);
+
+    assert(engine->getMulti(&cookie, items) == ENGINE_SUCCESS);
+    assert(items[2].value.getStatus() == ENGINE_SUCCESS);
+    assert(bodyOf(items[2]) == "3");
+    releaseValues(items);
+    assert(multiReads == 5);
+}
+
+static void testPendingVBucket(EventuallyPersistentEngine *engine) {
+    alarm(60);
+    static int cookie;
+    EventuallyPersistentStore *epstore = engine->getEpStore();
+    assert(epstore->setVBucketState(1, vbucket_state_pending) ==
+           ENGINE_SUCCESS);
+    size_t temps = tempItems(engine, 0);
+    size_t reads = multiReads;
+
+    // The key of the active vbucket comes first, so it is looked up
+    // before the pending vbucket is seen.
+    std::vector<MultiGetItem> items;
+    items.push_back(MultiGetItem("active", 0));
+    items.push_back(MultiGetItem("pending", 1));
+    assert(engine->getMulti(&cookie, items) == ENGINE_EWOULDBLOCK);
+    assert(items[0].value.getStatus() == ENGINE_EWOULDBLOCK);
+    assert(items[1].value.getStatus() == ENGINE_EWOULDBLOCK);
+
+    // The pending vbucket holds on to the cookie, so nothing was queued
+    // for the active key, and no temp item was left behind for it.
+    assert(tempItems(engine, 0) == temps);
+    usleep(200000);
+    assert(numNotifications(&cookie) == 0);
+    assert(multiReads == reads);
+
+    assert(epstore->setVBucketState(1, vbucket_state_active) ==
+           ENGINE_SUCCESS);
+    epstore->getVBucket(1)->fireAllOps(*engine);
+    assertNotifiedOnce(&cookie, ENGINE_SUCCESS);
+
+    assert(engine->getMulti(&cookie, items) == ENGINE_EWOULDBLOCK);
+    assert(tempItems(engine, 0) == temps + 1);
+    assertNotifiedOnce(&cookie, ENGINE_SUCCESS);
+    assert(multiReads == reads + 2);
+
+    assert(engine->getMulti(&cookie, items) == ENGINE_SUCCESS);
+    assert(items[0].value.getStatus() == ENGINE_KEY_ENOENT);
+    assert(items[1].value.getStatus() == ENGINE_KEY_ENOENT);
+}
+
+static void testSingleFetches(EventuallyPersistentEngine *engine) {
+    alarm(60);
+    static int cookie;
+    assert(!engine->getEpStore()->multiBGFetchEnabled());
+    storeOnDisk("first", "1");
+    storeOnDisk("second", "2");
+
+    std::vector<MultiGetItem> items;
+    items.push_back(MultiGetItem("first", 0));
+    items.push_back(MultiGetItem("second", 0));
+
+    // Without batched reads each fetch notifies the cookie on its own,
+    // so only one is queued at a time.
+    assert(engine->getMulti(&cookie, items) == ENGINE_EWOULDBLOCK);
+    assertNotifiedOnce(&cookie, ENGINE_SUCCESS);
+    assert(singleReads == 1);
+
+    assert(engine->getMulti(&cookie, items) == ENGINE_EWOULDBLOCK);
+    assert(items[0].value.getStatus() == ENGINE_SUCCESS);
+    assert(bodyOf(items[0]) == "1");
+    assert(items[1].value.getStatus() == ENGINE_EWOULDBLOCK);
+    releaseValues(items);
+    assertNotifiedOnce(&cookie, ENGINE_SUCCESS);
+    assert(singleReads == 2);
+
+    assert(engine->getMulti(&cookie, items) == ENGINE_SUCCESS);
+    assert(bodyOf(items[1]) == "2");
+    releaseValues(items);
+    assert(multiReads == 0);
+}
+
+int main() {
+    processStarted = time(NULL) - 2;
+    testFetchGroup();
+
+    EventuallyPersistentEngine *engine = createEngine();
+    assert(engine->getEpStore()->multiBGFetchEnabled());
+    testResidentAndNotMyVBucket(engine);
+    testFetchedTogether(engine);
+    testPendingVBucket(engine);
+    destroyEngine(engine);
+
+    {
+        LockHolder lh(diskMutex);
+        disk.clear();
+        multiReads = singleReads = 0;
+        efficientGet = false;
+    }
+    engine = createEngine();
+    testSingleFetches(engine);
+    destroyEngine(engine);
+}
@@ -19,6 +19,8 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 #include <map>
@@ -244,6 +246,93 @@ static void testDelAll() {
     remove(TMP_LOG_FILE);
 }
 
+static void writeKeys(MutationLog &ml, uint16_t vb, int n) {
+    for (int i = 0; i < n; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "user::%08d", i);
+        // Large enough rowids to need more than one varint byte.
+        ml.newItem(vb, key, (static_cast<uint64_t>(vb) << 40) + i);
+    }
+}
+
+static off_t fileSize(const char *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+static void testCompactLogging() {
+    const int numKeys = 2000;
+    remove(TMP_LOG_FILE);
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        for (uint16_t vb = 1; vb < 4; ++vb) {
+            writeKeys(ml, vb, numKeys);
+        }
+        ml.commit1();
+        ml.commit2();
+    }
+    off_t plainSize = fileSize(TMP_LOG_FILE);
+    remove(TMP_LOG_FILE);
+
+    {
+        MutationLog ml(TMP_LOG_FILE, 4096, LOG_VERSION_COMPACT);
+        ml.open();
+        for (uint16_t vb = 1; vb < 4; ++vb) {
+            writeKeys(ml, vb, numKeys);
+        }
+        ml.commit1();
+        ml.commit2();
+    }
+    assert(fileSize(TMP_LOG_FILE) * 2 < plainSize);
+
+    {
+        // An existing log keeps the version it was created with.
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        ml.delItem(1, "user::00000007");
+        ml.deleteAll(2);
+        ml.newItem(2, "user::00000001", 42);
+        ml.commit1();
+        ml.commit2();
+    }
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        assert(ml.header().version() == LOG_VERSION_COMPACT);
+        MutationLogHarvester h(ml);
+        h.setVBucket(1);
+        h.setVBucket(2);
+        h.setVBucket(3);
+
+        assert(h.load());
+
+        assert(h.getItemsSeen()[ML_NEW] == 3 * numKeys + 1);
+        assert(h.getItemsSeen()[ML_DEL] == 1);
+        assert(h.getItemsSeen()[ML_DEL_ALL] == 1);
+        assert(h.getItemsSeen()[ML_COMMIT1] == 2);
+        assert(h.getItemsSeen()[ML_COMMIT2] == 2);
+
+        std::map<std::string, uint64_t> maps[4];
+        h.apply(&maps, loaderFun);
+
+        assert(maps[0].size() == 0);
+        assert(maps[1].size() == numKeys - 1);
+        assert(maps[2].size() == 1);
+        assert(maps[3].size() == numKeys);
+
+        assert(maps[1].find("user::00000007") == maps[1].end());
+        assert(maps[1]["user::00001999"] == (1ULL << 40) + 1999);
+        assert(maps[2]["user::00000001"] == 42);
+        assert(maps[3]["user::00000000"] == (3ULL << 40));
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
 static bool leftover_compare(mutation_log_uncommitted_t a,
                              mutation_log_uncommitted_t b) {
     if (a.vbucket != b.vbucket) {
@@ -525,6 +614,7 @@ int main(int, char **) {
     testSyncSet();
     testLogging();
     testDelAll();
+    testCompactLogging();
     testLoggingDirty();
     testLoggingBadCRC();
     testLoggingShortRead();
@@ -0,0 +1,134 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "slab_allocator.h"
+#include "stats.h"
+
+static void testAllocateRelease() {
+    EPStats stats;
+    SlabAllocator allocator(stats);
+
+    void *a = allocator.allocate(40);
+    void *b = allocator.allocate(40);
+    assert(a != NULL && b != NULL && a != b);
+    memset(a, 'a', 40);
+    memset(b, 'b', 40);
+    assert(static_cast<char*>(a)[39] == 'a');
+    assert(allocator.getSlabMemory() == SlabAllocator::SLAB_SIZE);
+    assert(allocator.getUsedMemory() == 96);
+
+    assert(SlabAllocator::release(a));
+    assert(allocator.getUsedMemory() == 48);
+    // The freed chunk is handed out again first.
+    assert(allocator.allocate(33) == a);
+
+    assert(SlabAllocator::release(a));
+    assert(SlabAllocator::release(b));
+    assert(allocator.getUsedMemory() == 0);
+    // Empty slabs stay until the defragmenter runs.
+    assert(allocator.getSlabMemory() == SlabAllocator::SLAB_SIZE);
+    assert(allocator.finishDefragment() == 1);
+    assert(allocator.getSlabMemory() == 0);
+}
+
+static void testSizes() {
+    EPStats stats;
+    SlabAllocator allocator(stats);
+
+    // Every request fits in its chunk without wasting much more than a
+    // quarter of it.
+    for (size_t len = 1; len <= SlabAllocator::MAX_CHUNK_SIZE; len += 7) {
+        size_t before = allocator.getUsedMemory();
+        void *p = allocator.allocate(len);
+        assert(p != NULL);
+        size_t chunk = allocator.getUsedMemory() - before;
+        assert(chunk >= len);
+        assert(chunk - len < chunk / 4 + 16);
+        assert(SlabAllocator::release(p));
+    }
+    assert(allocator.allocate(SlabAllocator::MAX_CHUNK_SIZE + 1) == NULL);
+
+    int onStack;
+    void *onHeap = malloc(16);
+    assert(!SlabAllocator::release(&onStack));
+    assert(!SlabAllocator::release(onHeap));
+    free(onHeap);
+    allocator.finishDefragment();
+}
+
+static void testDefragment() {
+    EPStats stats;
+    SlabAllocator allocator(stats);
+
+    std::vector<void*> chunks;
+    chunks.push_back(allocator.allocate(1000));
+    const size_t chunk = allocator.getUsedMemory();
+    const size_t perSlab = SlabAllocator::SLAB_SIZE / chunk;
+    while (chunks.size() < 4 * perSlab) {
+        chunks.push_back(allocator.allocate(1000));
+    }
+    assert(allocator.getSlabMemory() == 4 * SlabAllocator::SLAB_SIZE);
+
+    // Leave every slab a fifth full.
+    std::vector<void*> live;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i % 5 == 0) {
+            live.push_back(chunks[i]);
+        } else {
+            assert(SlabAllocator::release(chunks[i]));
+        }
+    }
+
+    // Three slabs can move into the fourth.
+    assert(allocator.startDefragment(0.5) == 3);
+    std::vector<void*> moved;
+    for (size_t i = 0; i < live.size(); ++i) {
+        if (SlabAllocator::isDraining(live[i])) {
+            void *p = allocator.allocate(1000);
+            assert(!SlabAllocator::isDraining(p));
+            assert(SlabAllocator::release(live[i]));
+            moved.push_back(p);
+        } else {
+            moved.push_back(live[i]);
+        }
+    }
+    assert(allocator.finishDefragment() == 3);
+    assert(allocator.getSlabMemory() == SlabAllocator::SLAB_SIZE);
+    assert(allocator.getUsedMemory() == live.size() * chunk);
+
+    // Nothing left to gain.
+    assert(allocator.startDefragment(0.5) == 0);
+    assert(allocator.finishDefragment() == 0);
+
+    for (size_t i = 0; i < moved.size(); ++i) {
+        assert(SlabAllocator::release(moved[i]));
+    }
+    assert(allocator.finishDefragment() == 1);
+}
+
+int main() {
+    testAllocateRelease();
+    testSizes();
+    testDefragment();
+    return 0;
+}
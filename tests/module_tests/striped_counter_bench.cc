@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Compare the update throughput of two stats counters bumped together on
+ * a hot path (like totalEnqueued, and the diskQueueSize gauge next to it)
+ * as adjacent atomics, the way EPStats keeps the gauges, against striped
+ * counters, over an increasing number of threads.
+ */
+
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "atomic.h"
+#include "striped_counter.h"
+#include "threadtests.h"
+
+template <typename T>
+class UpdateBench : public Generator<hrtime_t> {
+public:
+    UpdateBench(T &e, T &q, size_t n) : enqueued(e), queued(q), updates(n) { }
+
+    hrtime_t operator()() {
+        hrtime_t start = gethrtime();
+        for (size_t i = 0; i < updates; ++i) {
+            ++enqueued;
+            ++queued;
+        }
+        return gethrtime() - start;
+    }
+
+private:
+    T      &enqueued;
+    T      &queued;
+    size_t  updates;
+};
+
+template <typename T>
+static void run(const char *name, T &enqueued, T &queued, size_t nthreads,
+                size_t updates) {
+    UpdateBench<T> gen(enqueued, queued, updates);
+    std::vector<hrtime_t> times = getCompletedThreads<hrtime_t>(nthreads,
+                                                                &gen);
+    hrtime_t slowest = *std::max_element(times.begin(), times.end());
+    double mops = static_cast<double>(nthreads * updates) * 1000 / slowest;
+    printf("  %-7s %3lu threads %8.2f Mupdates/s\n", name,
+           static_cast<unsigned long>(nthreads), mops);
+}
+
+struct AdjacentCounters {
+    Atomic<size_t> enqueued;
+    Atomic<size_t> queued;
+};
+
+int main(int argc, char **argv) {
+    size_t maxThreads = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    size_t updates = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    AdjacentCounters atomics;
+    StripedCounter enqueued, queued;
+
+    printf("%lu updates per thread\n", static_cast<unsigned long>(updates));
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        run("atomic", atomics.enqueued, atomics.queued, n, updates);
+        run("striped", enqueued, queued, n, updates);
+    }
+    return 0;
+}
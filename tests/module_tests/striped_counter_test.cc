@@ -0,0 +1,72 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+
+#include "striped_counter.h"
+#include "threadtests.h"
+
+#define NUM_THREADS 40
+#define NUM_TIMES 100000
+
+class Counter : public Generator<bool> {
+public:
+    Counter(StripedCounter &a, StripedCounter &b) : added(a), moved(b) { }
+
+    bool operator()() {
+        for (int i = 0; i < NUM_TIMES; ++i) {
+            ++added;
+            moved.fetch_add(3);
+            moved--;
+        }
+        return true;
+    }
+
+private:
+    StripedCounter &added;
+    StripedCounter &moved;
+};
+
+static void testConcurrentUpdates() {
+    StripedCounter added, moved;
+    Counter gen(added, moved);
+
+    getCompletedThreads<bool>(NUM_THREADS, &gen);
+
+    assert(added.load() == NUM_THREADS * NUM_TIMES);
+    assert(moved.load() == 2 * NUM_THREADS * NUM_TIMES);
+}
+
+static void testStore() {
+    StripedCounter c(5);
+    assert(c == 5);
+    c.fetch_sub(7);
+    ++c;
+    c.fetch_add(2);
+    assert(c.load() == 1);
+    c = 0;
+    assert(c.load() == 0);
+}
+
+int main() {
+    alarm(60);
+    testStore();
+    testConcurrentUpdates();
+}
@@ -171,6 +171,43 @@ static size_t env_int(const char *k, size_t rv) {
     return rv;
 }
 
+/**
+ * Print the 50th and 99th percentile of a histogram reported as
+ * <prefix>_<start>,<end> stats.
+ */
+static void print_percentiles(const std::string &prefix) {
+    std::map<uint64_t, std::pair<uint64_t, uint64_t> > bins;
+    uint64_t total = 0;
+    std::map<std::string, std::string>::iterator it;
+    for (it = vals.begin(); it != vals.end(); ++it) {
+        if (it->first.compare(0, prefix.length() + 1, prefix + "_") != 0) {
+            continue;
+        }
+        unsigned long long start, end;
+        if (sscanf(it->first.c_str() + prefix.length() + 1, "%llu,%llu",
+                   &start, &end) != 2) {
+            continue;
+        }
+        uint64_t count = strtoull(it->second.c_str(), NULL, 10);
+        bins[start] = std::make_pair(static_cast<uint64_t>(end), count);
+        total += count;
+    }
+
+    uint64_t p50 = 0, p99 = 0, seen = 0;
+    std::map<uint64_t, std::pair<uint64_t, uint64_t> >::iterator b;
+    for (b = bins.begin(); b != bins.end(); ++b) {
+        seen += b->second.second;
+        if (p50 == 0 && seen * 100 >= total * 50) {
+            p50 = b->second.first;
+        }
+        if (p99 == 0 && seen * 100 >= total * 99) {
+            p99 = b->second.first;
+        }
+    }
+    std::cout << prefix << ": " << total << " runs, p50 <= " << p50
+              << "us, p99 <= " << p99 << "us" << std::endl;
+}
+
 extern "C" {
 static test_result test_persistence(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     size_t total = env_int("TEST_TOTAL_KEYS", 100000);
@@ -204,6 +241,41 @@ static test_result test_persistence(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 
     return SUCCESS;
 }
+
+/**
+ * Keep the flusher and the other periodic tasks snoozing and waking, and
+ * report how late the executor threads started them.
+ */
+static test_result test_wakeup_jitter(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    size_t rounds = env_int("TEST_JITTER_ROUNDS", 200);
+    size_t batch = env_int("TEST_JITTER_BATCH", 50);
+    char key[24];
+
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < batch; ++i) {
+            item *it = NULL;
+            snprintf(key, sizeof(key), "k%d", static_cast<int>(i));
+            check(storeCasVb11(h, h1, NULL, OPERATION_SET, key, "v", 1,
+                               9713, &it, 0, 0) == ENGINE_SUCCESS,
+                  "store failure");
+            h1->release(h, NULL, it);
+        }
+        // Let the flusher go idle between bursts, so each one wakes it.
+        wait_for_flusher_to_settle(h, h1);
+        usleep(1000 + (rand() % 5000));
+    }
+
+    vals.clear();
+    check(h1->get_stats(h, NULL, "dispatcher", strlen("dispatcher"),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get stats.");
+    const char *types[] = { "Writer", "Reader", "AuxIO", "NonIO" };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        print_percentiles(std::string("sched_latency:") + types[i]);
+    }
+
+    return SUCCESS;
+}
 }
 
 extern "C" MEMCACHED_PUBLIC_API
@@ -218,6 +290,8 @@ engine_test_t* get_tests(void) {
     static engine_test_t tests[]  = {
         {"test persistence", test_persistence, NULL, teardown, NULL,
          NULL, NULL},
+        {"test wakeup jitter", test_wakeup_jitter, NULL, teardown, NULL,
+         NULL, NULL},
         {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
     };
     return tests;
@@ -0,0 +1,107 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Compare the throughput of vbucket lookups over an increasing number of
+ * threads: copying the RCPtr out of the slot (which takes the slot's spin
+ * lock and the vbucket's refcount) the way KVShard::getBucket does,
+ * against using the vbucket inside an epoch without a reference, as the
+ * front end get and set do through peekBucket. All threads hit the same
+ * few slots, like front end operations on hot vbuckets.
+ */
+
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "atomic.h"
+#include "epoch.h"
+#include "threadtests.h"
+
+#define NUM_SLOTS 4
+
+class FakeVBucket : public RCValue {
+public:
+    FakeVBucket() : ops(0) { }
+
+    size_t ops;
+};
+
+class LookupBench : public Generator<hrtime_t> {
+public:
+    LookupBench(RCPtr<FakeVBucket> *s, EpochManager *m, size_t n) :
+        slots(s), em(m), lookups(n) { }
+
+    hrtime_t operator()() {
+        size_t sink = 0;
+        hrtime_t start = gethrtime();
+        for (size_t i = 0; i < lookups; ++i) {
+            if (em) {
+                EpochGuard guard(*em);
+                sink += slots[i % NUM_SLOTS].get()->ops;
+            } else {
+                RCPtr<FakeVBucket> vb(slots[i % NUM_SLOTS]);
+                sink += vb->ops;
+            }
+        }
+        hrtime_t elapsed = gethrtime() - start;
+        return sink == 0 ? elapsed : elapsed + 1;
+    }
+
+private:
+    RCPtr<FakeVBucket> *slots;
+    EpochManager       *em;
+    size_t              lookups;
+};
+
+static void run(const char *name, RCPtr<FakeVBucket> *slots,
+                EpochManager *em, size_t nthreads, size_t lookups) {
+    LookupBench gen(slots, em, lookups);
+    std::vector<hrtime_t> times = getCompletedThreads<hrtime_t>(nthreads,
+                                                                &gen);
+    hrtime_t slowest = 0;
+    std::vector<hrtime_t>::iterator it;
+    for (it = times.begin(); it != times.end(); ++it) {
+        slowest = std::max(slowest, *it);
+    }
+    double mops = static_cast<double>(nthreads * lookups) * 1000 / slowest;
+    printf("  %-6s %3lu threads %8.2f Mlookups/s\n", name,
+           static_cast<unsigned long>(nthreads), mops);
+}
+
+int main(int argc, char **argv) {
+    size_t maxThreads = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+    size_t lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    RCPtr<FakeVBucket> slots[NUM_SLOTS];
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        slots[i].reset(new FakeVBucket);
+    }
+    EpochManager em;
+
+    printf("%lu lookups per thread\n", static_cast<unsigned long>(lookups));
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        run("rcptr", slots, NULL, n, lookups);
+        run("peek", slots, &em, n, lookups);
+    }
+    return 0;
+}